@@ -33,6 +33,70 @@ typedef Eigen::SparseMatrix<double> SparMat;
 /** @brief triplet, for adding element to sparse matrix efficiently */
 typedef Eigen::Triplet<double> Triplet;
 
+/**
+ * @brief coefficients of the derivative of each row of a polynomial matrix,
+ * coefficients in ascending order
+ */
+template <int N_COEFFS>
+inline Eigen::Matrix<double, DIM, N_COEFFS - 1> derivative(
+    const Eigen::Matrix<double, DIM, N_COEFFS> &coeff) {
+  Eigen::Matrix<double, DIM, N_COEFFS - 1> der;
+  for (int j = 0; j < N_COEFFS - 1; j++) {
+    der.col(j) = coeff.col(j + 1) * (j + 1);
+  }
+  return der;
+}
+
+/**
+ * @brief value of each row of a polynomial matrix at t (Horner's scheme),
+ * coefficients in ascending order
+ */
+template <int N_COEFFS>
+inline Eigen::Vector3d evaluatePolynomial(const Eigen::Matrix<double, DIM, N_COEFFS> &coeff,
+                                          double t) {
+  Eigen::Vector3d value = coeff.col(N_COEFFS - 1);
+  for (int j = N_COEFFS - 2; j >= 0; j--) {
+    value = value * t + coeff.col(j);
+  }
+  return value;
+}
+
+/**
+ * @brief coefficients of each row of a polynomial matrix in the Bernstein basis
+ * of [0, 1]. On [0, 1] a polynomial lies between the minimum and the maximum of
+ * its Bernstein coefficients (convex hull property).
+ */
+template <int N_COEFFS>
+inline Eigen::Matrix<double, DIM, N_COEFFS> bernsteinCoefficients(
+    const Eigen::Matrix<double, DIM, N_COEFFS> &coeff) {
+  /* b_j = sum_{i <= j} C(j, i) / C(n, i) * a_i */
+  static const Eigen::Matrix<double, N_COEFFS, N_COEFFS> basis_change = [] {
+    Eigen::Matrix<double, N_COEFFS, N_COEFFS> M = Eigen::Matrix<double, N_COEFFS, N_COEFFS>::Zero();
+    auto binomial = [](int n, int k) {
+      double c = 1;
+      for (int l = 1; l <= k; l++) {
+        c = c * (n - k + l) / l;
+      }
+      return c;
+    };
+    for (int j = 0; j < N_COEFFS; j++) {
+      for (int i = 0; i <= j; i++) {
+        M(i, j) = binomial(j, i) / binomial(N_COEFFS - 1, i);
+      }
+    }
+    return M;
+  }();
+  return coeff * basis_change;
+}
+
+/** @brief position and its derivatives at one time stamp */
+struct PolyState {
+  Eigen::Vector3d pos;
+  Eigen::Vector3d vel;
+  Eigen::Vector3d acc;
+  Eigen::Vector3d jrk;
+};
+
 /**
  * @brief A piece of polynomial trajectory
  * use relative time t_ = t / T
@@ -41,21 +105,58 @@ class PolyPiece {
  private:
   double _duration;
   Eigen::Matrix<double, DIM, N_ORDER + 1> _coeffs;
+  /* derivatives in absolute time, updated by setup() */
+  Eigen::Matrix<double, DIM, N_ORDER>     _vel_coeffs;
+  Eigen::Matrix<double, DIM, N_ORDER - 1> _acc_coeffs;
+  Eigen::Matrix<double, DIM, N_ORDER - 2> _jrk_coeffs;
+
+  void updateDerivatives();
 
  public:
-  PolyPiece() {}
+  PolyPiece() : _duration(1.0) {
+    _coeffs.setZero();
+    _vel_coeffs.setZero();
+    _acc_coeffs.setZero();
+    _jrk_coeffs.setZero();
+  }
   ~PolyPiece() {}
   void setup(const double t);
   void setup(const Eigen::MatrixXd coeffs);
   void setup(const double t, const Eigen::MatrixXd coeffs);
-  Eigen::Vector3d getPos(double t) const;
-  Eigen::Vector3d getVel(double t) const;
-  Eigen::Vector3d getAcc(double t) const;
-  Eigen::Vector3d getJrk(double t) const;
+  Eigen::Vector3d getPos(double t) const { return evaluatePolynomial(_coeffs, t); }
+  Eigen::Vector3d getVel(double t) const { return evaluatePolynomial(_vel_coeffs, t); }
+  Eigen::Vector3d getAcc(double t) const { return evaluatePolynomial(_acc_coeffs, t); }
+  Eigen::Vector3d getJrk(double t) const { return evaluatePolynomial(_jrk_coeffs, t); }
+  PolyState getState(double t) const;
   double getDuration() const;
   Eigen::Matrix<double, DIM, N_ORDER + 1> getCoefficient() const;
 };
 
+/**
+ * @brief samples of a trajectory, one array per quantity. The arrays only grow,
+ * so a buffer kept by the caller does not allocate once it is large enough.
+ */
+struct TrajectorySamples {
+  int                 num = 0;  // valid columns
+  std::vector<double> t;        // absolute time stamps
+  Eigen::Matrix3Xd    pos;
+  Eigen::Matrix3Xd    vel;
+  Eigen::Matrix3Xd    acc;
+  Eigen::Matrix3Xd    jrk;
+
+  void resize(int count) {
+    num = count;
+    if (pos.cols() < count) {
+      t.resize(count);
+      pos.resize(3, count);
+      vel.resize(3, count);
+      acc.resize(3, count);
+      jrk.resize(3, count);
+    }
+  }
+  int size() const { return num; }
+};
+
 class Trajectory {
  private:
   typedef std::vector<PolyPiece> Pieces;
@@ -73,8 +174,11 @@ class Trajectory {
   Eigen::Vector3d getVel(double t) const;
   Eigen::Vector3d getAcc(double t) const;
   Eigen::Vector3d getJrk(double t) const;
+  PolyState getState(double t) const;
+  void sample(double t0, double dt, int count, TrajectorySamples &samples) const;
   double getMaxVelRate() const;
   double getMaxAccRate() const;
+  double getCost(const std::vector<double> &factors) const;
   double getDuration() const;
   int getPieceNum() const;
   const PolyPiece &operator[](int i) const { return _pieces[i]; }
@@ -155,17 +259,46 @@ class CorridorMiniSnap {
   int n_hyperplanes;
   Eigen::Matrix3d _headPVA;  // head's pos, vel, acc
   Eigen::Matrix3d _tailPVA;  // tail's pos, vel, acc
-  Eigen::MatrixXd _Q;
-  Eigen::MatrixXd _A;
+  SparMat _Q;                        // upper triangle of the cost matrix
+  SparMat _A;                        // built from _A_triplets before each solve
+  std::vector<Triplet> _A_triplets;  // nonzeros of the constraints, rows as in _lb and _ub
   Eigen::VectorXd _x;  // solutions
   Eigen::VectorXd _ub;
   Eigen::VectorXd _lb;
   std::vector<double> _timeAlloc;
   std::vector<Eigen::Matrix<double, 6, -1>> _Polygons;
 
+  bool             _persistent_solver;
+  int              _slack_rows_per_piece;
+  int              _slack_rows_reserved;  // of each piece in the problem of the last reset()
+  int              _slack_row_begin;      // first row reserved for isCorridorSatisfied()
+  std::vector<int> _slack_rows_used;      // of each piece
+  IOSQP            _solver;           // kept between solves in persistent mode
+  int              _qp_iterations;    // of the last solve
+  int              _root_searches;    // of the last isCorridorSatisfied()
+  double           _time_limit;       // seconds of each QP solve. 0: no limit
+
  public:
-  CorridorMiniSnap() {}
+  CorridorMiniSnap()
+      : _persistent_solver(false), _slack_rows_per_piece(0), _slack_rows_reserved(0), _slack_row_begin(0),
+        _qp_iterations(0), _root_searches(0), _time_limit(0.0) {}
   ~CorridorMiniSnap() {}
+
+  /**
+   * @brief keep the OSQP workspace between solves. reOptimize() and the next
+   * optimize() with the same pieces and corridor sizes update the values and
+   * bounds of the workspace and start from the last solution, instead of a new
+   * setup and factorization.
+   * @param slack_rows rows reserved in each piece for the constraints added by
+   * isCorridorSatisfied(). Further constraints change the pattern, so the next
+   * solve sets up the workspace again.
+   */
+  void setPersistentSolver(bool enable, int slack_rows = 4);
+  /**
+   * @brief seconds the QP solves of the next optimize() and reOptimize() may
+   * take. A solve that reaches it fails. 0: no limit
+   */
+  void setTimeLimit(double seconds) { _time_limit = seconds; }
   void reset(const Eigen::Matrix3d &head, const Eigen::Matrix3d &tail,
              const std::vector<double> &timeAlloc,
              const std::vector<Eigen::Matrix<double, 6, -1>> &corridors);
@@ -184,7 +317,17 @@ class CorridorMiniSnap {
   bool isCorridorSatisfied(Trajectory &traj, double max_vel, double max_acc, double delta);
   void getTrajectory(Trajectory *traj);
   double getMinimumCost() const;
+  /** @brief OSQP iterations of the last optimize() or reOptimize() */
+  int getIterations() const { return _qp_iterations; }
+  /** @brief root finder calls of the last isCorridorSatisfied(), for the
+   * bounds that the Bernstein coefficients did not prove */
+  int getRootSearches() const { return _root_searches; }
 
+ private:
+  inline void addConstraintCoeff(int row, int col, double value);
+  inline void addConstraintCoeffs(int row, int col, const Eigen::Matrix<double, 1, N_ORDER + 1> &coeffs);
+  inline void addRefinementConstraint(int piece, const Eigen::Matrix<double, 1, DIM * (N_ORDER + 1)> &coeffs,
+                                      double ub, int &row, std::vector<double> &constraint_ub);
 };
 
 };  // namespace traj_opt
@@ -0,0 +1,114 @@
+/**
+ * @file corridor_optimizer.h
+ * @brief minimum snap in the corridors of a path, refined until the
+ * constraints hold, for the allocation of the corridors or several candidate
+ * time allocations. Used by planning_node and planning_benchmark.
+ *
+ */
+
+#ifndef CORRIDOR_OPTIMIZER_H_
+#define CORRIDOR_OPTIMIZER_H_
+#include <CorridorMiniSnap/corridor_minisnap.h>
+#include <thread_pool.h>
+
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace traj_opt {
+
+/** @brief time window of a corridor, from the start of the trajectory */
+typedef std::pair<double, double> TimeWindow;
+
+/** @brief parameters of CorridorOptimizer, with the defaults of planning_node */
+struct CorridorOptimizerConfig {
+  std::vector<double> factors = {0, 0.5, 0.5, 0, 0};
+  double delta_corridor       = 0.3;
+  double max_vel              = 3.0;  // max_vel_optimization
+  double max_acc              = 4.0;  // max_acc_optimization
+  int    max_refinements      = 10;
+  bool   persistent_solver    = false;
+  int    slack_rows_per_piece = 8;
+  /* threads that solve candidate time allocations, including the calling
+   * thread. 0: only the allocation of the corridors */
+  int                 candidate_threads        = 0;
+  std::vector<double> time_scales              = {0.8, 1.25, 1.6};
+  double              heuristic_velocity_ratio = 0.7;  // 0: no heuristic candidate
+  double              time_weight              = 1.0;  // cost of one second of flight
+  double              deadline                 = 0.05; // seconds, for the candidates other than the allocation of the corridors
+};
+
+/** @brief work of the last CorridorOptimizer::solve(), over all candidates */
+struct CorridorOptimizationStats {
+  int qp_solves         = 0;
+  int qp_iterations     = 0;
+  int root_finder_calls = 0;
+  int candidate         = -1;  // of the result. -1: no result
+};
+
+class CorridorOptimizer {
+ private:
+  CorridorOptimizerConfig                        _config;
+  CorridorMiniSnap                               _solver;             // without candidates
+  std::vector<std::unique_ptr<CorridorMiniSnap>> _candidate_solvers;  // one per candidate, so each keeps its OSQP workspace
+  std::unique_ptr<ThreadPool>                    _candidate_thread_pool;
+  CorridorOptimizationStats                      _stats;
+
+ public:
+  CorridorOptimizer() {}
+  ~CorridorOptimizer() {}
+
+  /** @brief set up the solvers and the candidate threads. Not during solve() */
+  void setConfig(const CorridorOptimizerConfig &config);
+  const CorridorOptimizerConfig &getConfig() const { return _config; }
+
+  /** @brief whether solve() tries candidate time allocations, which need the
+   * time windows of the corridors */
+  bool usesCandidates() const { return !_candidate_solvers.empty(); }
+
+  /**
+   * @brief solve the corridors with the allocation of the corridors, or with
+   * the candidate time allocations if there are candidate threads
+   * @param corridor_time_windows in which each corridor is safe. Only used by
+   * the candidates other than the allocation of the corridors
+   * @param corridor_satisfied whether the constraints hold on the result
+   * @return whether traj is a solution
+   */
+  bool solve(const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state,
+             const std::vector<double>                     &time_alloc,
+             const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+             const std::vector<TimeWindow> &corridor_time_windows, Trajectory &traj,
+             bool &corridor_satisfied);
+  const CorridorOptimizationStats &getLastStats() const { return _stats; }
+
+  /**
+   * @brief time allocations to solve: the one of the corridors first, then the
+   * one of the corridors scaled by each of time_scales, then durations from the
+   * length of the path through the corridors
+   */
+  std::vector<std::vector<double>> timeAllocationCandidates(
+      const std::vector<double> &time_alloc, const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+      const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state) const;
+
+  /** @brief whether every piece of a time allocation is flown in the time
+   * window in which its corridor is safe */
+  static bool timeAllocationInSafeWindows(const std::vector<double>     &time_alloc,
+                                          const std::vector<TimeWindow> &corridor_time_windows);
+
+ private:
+  bool solveInCorridors(CorridorMiniSnap &solver, const Eigen::Matrix3d &init_state,
+                        const Eigen::Matrix3d &finl_state, const std::vector<double> &time_alloc,
+                        const std::vector<Eigen::Matrix<double, 6, -1>> &corridors, Trajectory &traj,
+                        bool &corridor_satisfied, CorridorOptimizationStats &stats,
+                        std::chrono::steady_clock::time_point deadline) const;
+  bool solveTimeAllocationCandidates(const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state,
+                                     const std::vector<double>                     &time_alloc,
+                                     const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+                                     const std::vector<TimeWindow> &corridor_time_windows,
+                                     Trajectory &traj, bool &corridor_satisfied);
+};
+
+};  // namespace traj_opt
+
+#endif  // CORRIDOR_OPTIMIZER_H_
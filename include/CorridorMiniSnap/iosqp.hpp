@@ -17,7 +17,9 @@ public:
     IOSQP() : UNBOUNDED_VAL(OSQP_INFTY),
               pWork(nullptr),
               pSettings(nullptr),
-              pData(nullptr)
+              pData(nullptr),
+              setupValid(false),
+              patternReused(false)
     {
         pSettings = (OSQPSettings *)c_malloc(sizeof(OSQPSettings));
         pData = (OSQPData *)c_malloc(sizeof(OSQPData));
@@ -25,6 +27,9 @@ public:
             osqp_set_default_settings(pSettings);
     }
 
+    IOSQP(const IOSQP &) = delete;
+    IOSQP &operator=(const IOSQP &) = delete;
+
     ~IOSQP()
     {
         if (pWork)
@@ -57,8 +62,8 @@ public:
 
         Eigen::Map<const Eigen::VectorXi> iIdxP(P.innerIndexPtr(), P.nonZeros());
         Eigen::Map<const Eigen::VectorXi> oIdxP(P.outerIndexPtr(), P.cols() + 1);
-        Eigen::Matrix<c_int, -1, 1> innerIdxP = iIdxP.cast<c_int>();
-        Eigen::Matrix<c_int, -1, 1> outerIdxP = oIdxP.cast<c_int>();
+        innerIdxP = iIdxP.cast<c_int>();
+        outerIdxP = oIdxP.cast<c_int>();
         pData->P = csc_matrix(pData->n,
                               pData->n,
                               P.nonZeros(),
@@ -68,8 +73,8 @@ public:
 
         Eigen::Map<const Eigen::VectorXi> iIdxA(A.innerIndexPtr(), A.nonZeros());
         Eigen::Map<const Eigen::VectorXi> oIdxA(A.outerIndexPtr(), A.cols() + 1);
-        Eigen::Matrix<c_int, -1, 1> innerIdxA = iIdxA.cast<c_int>();
-        Eigen::Matrix<c_int, -1, 1> outerIdxA = oIdxA.cast<c_int>();
+        innerIdxA = iIdxA.cast<c_int>();
+        outerIdxA = oIdxA.cast<c_int>();
         pData->A = csc_matrix(pData->m,
                               pData->n,
                               A.nonZeros(),
@@ -95,9 +100,89 @@ public:
         if (pData->P)
             c_free(pData->P);
 
+        /* the index arrays are kept as the pattern of the workspace */
+        setupValid = exitflag == 0;
+
+        return exitflag;
+    }
+
+    /**
+     * Same problem as setMats(), for a solver that is kept between solves.
+     * When P (upper triangular) and A have the sparsity pattern of the last
+     * setup, the workspace is kept: its values and bounds are updated and the
+     * solve starts from the last primal and dual solution (OSQP warm start).
+     * Otherwise the workspace is set up again, starting from the last primal
+     * solution if the number of variables did not change.
+     **/
+    inline c_int updateMats(const Eigen::SparseMatrix<double> &P,
+                            const Eigen::VectorXd &q,
+                            const Eigen::SparseMatrix<double> &A,
+                            const Eigen::VectorXd &l,
+                            const Eigen::VectorXd &u,
+                            const double &eps_abs,
+                            const double &eps_rel)
+    {
+        patternReused = false;
+        if (setupValid && samePattern(P, innerIdxP, outerIdxP) && samePattern(A, innerIdxA, outerIdxA))
+        {
+            Eigen::Matrix<c_float, -1, 1> PxVec = Eigen::Map<const Eigen::VectorXd>(P.valuePtr(), P.nonZeros()).cast<c_float>();
+            Eigen::Matrix<c_float, -1, 1> AxVec = Eigen::Map<const Eigen::VectorXd>(A.valuePtr(), A.nonZeros()).cast<c_float>();
+            Eigen::Matrix<c_float, -1, 1> qVec = q.cast<c_float>();
+            Eigen::Matrix<c_float, -1, 1> lVec = l.cast<c_float>();
+            Eigen::Matrix<c_float, -1, 1> uVec = u.cast<c_float>();
+
+            c_int exitflag = osqp_update_P_A(pWork, PxVec.data(), OSQP_NULL, PxVec.size(),
+                                             AxVec.data(), OSQP_NULL, AxVec.size());
+            if (exitflag == 0)
+                exitflag = osqp_update_lin_cost(pWork, qVec.data());
+            if (exitflag == 0)
+                exitflag = osqp_update_bounds(pWork, lVec.data(), uVec.data());
+            if (exitflag == 0)
+                exitflag = osqp_update_eps_abs(pWork, eps_abs);
+            if (exitflag == 0)
+                exitflag = osqp_update_eps_rel(pWork, eps_rel);
+
+            setupValid = exitflag == 0;
+            patternReused = setupValid;
+            return exitflag;
+        }
+
+        Eigen::Matrix<c_float, -1, 1> xPrev;
+        if (setupValid && pWork->data->n == P.rows())
+            xPrev = Eigen::Map<const Eigen::Matrix<c_float, -1, 1>>(pWork->solution->x, pWork->data->n);
+
+        Eigen::SparseMatrix<double> PCopy = P;
+        Eigen::SparseMatrix<double> ACopy = A;
+        Eigen::VectorXd qCopy = q;
+        Eigen::VectorXd lCopy = l;
+        Eigen::VectorXd uCopy = u;
+        c_int exitflag = setMats(PCopy, qCopy, ACopy, lCopy, uCopy, eps_abs, eps_rel);
+        if (exitflag == 0 && xPrev.size() > 0)
+            osqp_warm_start_x(pWork, xPrev.data());
         return exitflag;
     }
 
+    /**
+     * Seconds the next solves may take, 0 for no limit. The solver stops with
+     * OSQP_TIME_LIMIT_REACHED. OSQP only has the limit when it is built with
+     * profiling, which is its default. Otherwise there is no limit.
+     **/
+    inline void setTimeLimit(const double &seconds)
+    {
+#ifdef PROFILING
+        if (pSettings)
+            pSettings->time_limit = seconds;
+        if (pWork)
+            osqp_update_time_limit(pWork, seconds);
+#endif
+    }
+
+    /* whether the last updateMats() kept the workspace */
+    inline bool getPatternReused() const
+    {
+        return patternReused;
+    }
+
     inline c_int solve() const
     {
         return osqp_solve(pWork);
@@ -108,6 +193,11 @@ public:
         return pWork->info->status_val;
     }
 
+    inline c_int getIter() const
+    {
+        return pWork->info->iter;
+    }
+
     inline Eigen::VectorXd getPrimalSol() const
     {
         return Eigen::Map<const Eigen::VectorXd>(pWork->solution->x,
@@ -115,9 +205,29 @@ public:
     }
 
 private:
+    static bool samePattern(const Eigen::SparseMatrix<double> &M,
+                            const Eigen::Matrix<c_int, -1, 1> &innerIdx,
+                            const Eigen::Matrix<c_int, -1, 1> &outerIdx)
+    {
+        if (!M.isCompressed() || outerIdx.size() != M.cols() + 1 || innerIdx.size() != M.nonZeros())
+            return false;
+        for (int i = 0; i <= M.cols(); i++)
+            if (outerIdx(i) != M.outerIndexPtr()[i])
+                return false;
+        for (int i = 0; i < M.nonZeros(); i++)
+            if (innerIdx(i) != M.innerIndexPtr()[i])
+                return false;
+        return true;
+    }
+
     OSQPWorkspace *pWork;
     OSQPSettings *pSettings;
     OSQPData *pData;
+
+    /* sparsity pattern of the last setup */
+    Eigen::Matrix<c_int, -1, 1> innerIdxP, outerIdxP, innerIdxA, outerIdxA;
+    bool setupValid;
+    bool patternReused;
 };
 
 #endif
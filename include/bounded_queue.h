@@ -0,0 +1,80 @@
+//
+// Bounded queue between the stages of the planning pipeline.
+//
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/// A blocking queue that keeps at most capacity items. A full queue drops its oldest item when a new one is pushed,
+/// so a slow consumer always gets the newest work instead of a backlog.
+template<typename T>
+class BoundedQueue{
+public:
+    explicit BoundedQueue(size_t capacity_in = 1) : capacity(capacity_in > 0 ? capacity_in : 1), closed(false) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    void setCapacity(size_t capacity_in)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = capacity_in > 0 ? capacity_in : 1;
+        while(items.size() > capacity){
+            items.pop_front();
+        }
+    }
+
+    /// Returns the number of old items dropped to make room
+    size_t push(T item)
+    {
+        size_t dropped_num = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while(items.size() >= capacity){
+                items.pop_front();
+                ++ dropped_num;
+            }
+            items.push_back(std::move(item));
+        }
+        not_empty_cv.notify_one();
+        return dropped_num;
+    }
+
+    /// Wait for the oldest item. Returns false when the queue is closed and empty.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty_cv.wait(lock, [this]{ return closed || !items.empty(); });
+        if(items.empty()){
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        return true;
+    }
+
+    /// Wake up the consumer. Items already in the queue are still popped.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty_cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable not_empty_cv;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+};
+
+#endif //BOUNDED_QUEUE_H
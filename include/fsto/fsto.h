@@ -16,7 +16,7 @@
 #include "decomp_ros_utils/data_ros_utils.h"
 #include "decomp_util/ellipsoid_decomp.h"
 #include "fsto/config.h"
-#include "fsto/root_finder.hpp"
+#include "root_finder.hpp"
 #include "quadrotor_msgs/PolynomialTrajectory.h"
 #include "sfc_gen.hpp"
 
@@ -0,0 +1,98 @@
+//
+// Size and resolution of the local map, as compile-time parameters of the planner.
+//
+
+#ifndef MAP_GEOMETRY_H
+#define MAP_GEOMETRY_H
+
+#include "dsp_map/map_parameters.h"
+#include <string>
+
+/// Voxel numbers of a map centered at the UAV, the number of risk map layers (prediction steps) and the voxel size.
+/// Everything derived from them is constexpr, so each geometry gets its own index math. RESOLUTION is a type with a
+/// static constexpr double value, since a floating point number cannot be a template argument.
+template<int LENGTH_VOXEL_NUM, int WIDTH_VOXEL_NUM, int HEIGHT_VOXEL_NUM, int RISK_MAP_NUM, typename RESOLUTION>
+struct MapGeometryT
+{
+    static constexpr int length_voxel_num = LENGTH_VOXEL_NUM;
+    static constexpr int width_voxel_num = WIDTH_VOXEL_NUM;
+    static constexpr int height_voxel_num = HEIGHT_VOXEL_NUM;
+    static constexpr int risk_map_number = RISK_MAP_NUM;
+    static constexpr int voxel_num = LENGTH_VOXEL_NUM * WIDTH_VOXEL_NUM * HEIGHT_VOXEL_NUM;
+
+    /// A double like VOXEL_RESOLUTION, so the index math of DspMapGeometry is the one of the macros
+    static constexpr double resolution = RESOLUTION::value;
+    static constexpr float length_half = LENGTH_VOXEL_NUM * RESOLUTION::value / 2.f;
+    static constexpr float width_half = WIDTH_VOXEL_NUM * RESOLUTION::value / 2.f;
+    static constexpr float height_half = HEIGHT_VOXEL_NUM * RESOLUTION::value / 2.f;
+
+    static bool matches(int length_voxel_num_in, int width_voxel_num_in, int height_voxel_num_in, int risk_map_number_in, double resolution_in)
+    {
+        return length_voxel_num_in == length_voxel_num && width_voxel_num_in == width_voxel_num && height_voxel_num_in == height_voxel_num
+               && risk_map_number_in == risk_map_number && resolution_in > resolution * 0.999 && resolution_in < resolution * 1.001;
+    }
+};
+
+template<int MILLIMETERS>
+struct MillimeterResolution
+{
+    static constexpr double value = MILLIMETERS * 0.001;
+};
+
+struct DspMapResolution
+{
+    static constexpr double value = VOXEL_RESOLUTION;
+};
+
+/// The map of the mapping node, set by the macros of dsp_map/map_parameters.h. The risk map topic and the shared
+/// memory ring carry this geometry.
+struct DspMapGeometry : MapGeometryT<MAP_LENGTH_VOXEL_NUM, MAP_WIDTH_VOXEL_NUM, MAP_HEIGHT_VOXEL_NUM, RISK_MAP_NUMBER, DspMapResolution>
+{
+    static const char* name() { return "dsp_map"; }
+};
+
+/// Twice the voxel size over twice the range, for long-range planning next to a DspMapGeometry map
+struct CoarseMapGeometry : MapGeometryT<MAP_LENGTH_VOXEL_NUM, MAP_WIDTH_VOXEL_NUM, MAP_HEIGHT_VOXEL_NUM, RISK_MAP_NUMBER,
+                                        MillimeterResolution<(int)(VOXEL_RESOLUTION * 2000.0 + 0.5)>>
+{
+    static const char* name() { return "coarse"; }
+};
+
+
+template<typename... GEOMETRIES>
+struct MapGeometryList {};
+
+/// Geometries that planners are compiled for. Add a geometry here to make it selectable by name.
+typedef MapGeometryList<DspMapGeometry, CoarseMapGeometry> PrebuiltMapGeometries;
+
+/// Call function(GEOMETRY()) for the geometry of the list with the given name. Returns false if there is none.
+template<typename FUNCTION, typename... GEOMETRIES>
+bool dispatchMapGeometry(MapGeometryList<GEOMETRIES...>, const std::string &name, FUNCTION &&function)
+{
+    bool found = false;
+    auto try_geometry = [&](auto geometry){
+        if(!found && name == decltype(geometry)::name()){
+            found = true;
+            function(geometry);
+        }
+    };
+    (try_geometry(GEOMETRIES()), ...);
+    return found;
+}
+
+/// Name of the geometry of the list with these sizes, or an empty string
+template<typename... GEOMETRIES>
+std::string findMapGeometryName(MapGeometryList<GEOMETRIES...>, int length_voxel_num, int width_voxel_num, int height_voxel_num,
+                                int risk_map_number, double resolution)
+{
+    std::string name;
+    auto try_geometry = [&](auto geometry){
+        if(name.empty() && decltype(geometry)::matches(length_voxel_num, width_voxel_num, height_voxel_num, risk_map_number, resolution)){
+            name = decltype(geometry)::name();
+        }
+    };
+    (try_geometry(GEOMETRIES()), ...);
+    return name;
+}
+
+#endif //MAP_GEOMETRY_H
@@ -0,0 +1,196 @@
+//
+// Latency histograms, counters and scoped timers for the planning stages.
+//
+
+#ifndef PLANNING_INSTRUMENTATION_H
+#define PLANNING_INSTRUMENTATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+/// 0: timers and counters compile to nothing
+#ifndef PLANNING_INSTRUMENTATION
+#define PLANNING_INSTRUMENTATION 1
+#endif
+
+/// Switched at run time. A disabled timer does not read the clock.
+inline std::atomic<bool>& planningInstrumentationEnabled()
+{
+    static std::atomic<bool> enabled(true);
+    return enabled;
+}
+
+
+/// Latencies in fixed buckets, four per octave from 10 us, so recording is a log and an atomic increment and the
+/// threads of the pipeline can share a histogram without a lock. Percentiles are the upper bounds of their buckets,
+/// which are at most 19 % above the true values.
+class LatencyHistogram{
+public:
+    static constexpr int bucket_num = 64; // the last one also takes everything above its lower bound (about 0.5 s)
+    static constexpr double first_upper_bound = 10e-6; // seconds
+
+    LatencyHistogram()
+    {
+        for(auto &b : buckets){
+            b.store(0, std::memory_order_relaxed);
+        }
+        count.store(0, std::memory_order_relaxed);
+        sum_ns.store(0, std::memory_order_relaxed);
+        max_ns.store(0, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    static double bucketUpperBound(int bucket)
+    {
+        return first_upper_bound * std::exp2(0.25 * bucket);
+    }
+
+    void record(double seconds)
+    {
+        int bucket = 0;
+        if(seconds > first_upper_bound){
+            bucket = std::min(bucket_num - 1, (int)std::ceil(4.0 * std::log2(seconds / first_upper_bound)));
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+
+        const uint64_t ns = seconds > 0.0 ? (uint64_t)(seconds * 1e9) : 0;
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t current_max = max_ns.load(std::memory_order_relaxed);
+        while(ns > current_max && !max_ns.compare_exchange_weak(current_max, ns, std::memory_order_relaxed)){}
+    }
+
+    /// Counts of a period, see takeSnapshot()
+    typedef struct Snapshot
+    {
+        uint64_t buckets[bucket_num];
+        uint64_t count;
+        double sum; // seconds
+        double max;
+
+        double mean() const { return count > 0 ? sum / (double)count : 0.0; }
+
+        /// Upper bound of the bucket of the q quantile, 0 < q <= 1. 0 without samples.
+        double quantile(double q) const
+        {
+            if(count == 0){
+                return 0.0;
+            }
+            const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * (double)count));
+            uint64_t cumulative = 0;
+            for(int i=0; i<bucket_num; ++i){
+                cumulative += buckets[i];
+                if(cumulative >= rank){
+                    return i == bucket_num - 1 ? max : std::min(bucketUpperBound(i), max);
+                }
+            }
+            return max;
+        }
+    }Snapshot;
+
+    /// Take the counts since the last call and start a new period. Samples recorded meanwhile go to one of the two.
+    Snapshot takeSnapshot()
+    {
+        Snapshot snapshot;
+        for(int i=0; i<bucket_num; ++i){
+            snapshot.buckets[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+        }
+        snapshot.count = count.exchange(0, std::memory_order_relaxed);
+        snapshot.sum = (double)sum_ns.exchange(0, std::memory_order_relaxed) * 1e-9;
+        snapshot.max = (double)max_ns.exchange(0, std::memory_order_relaxed) * 1e-9;
+        return snapshot;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[bucket_num];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+
+class InstrumentationCounter{
+public:
+    InstrumentationCounter() : value(0) {}
+
+    InstrumentationCounter(const InstrumentationCounter &) = delete;
+    InstrumentationCounter &operator=(const InstrumentationCounter &) = delete;
+
+    void add(uint64_t n)
+    {
+        if(planningInstrumentationEnabled().load(std::memory_order_relaxed)){
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    /// Take the count since the last call
+    uint64_t take()
+    {
+        return value.exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+
+/// Records the time from construction to destruction, or to stop()
+class ScopedLatencyTimer{
+public:
+    explicit ScopedLatencyTimer(LatencyHistogram &histogram_in)
+        : histogram(planningInstrumentationEnabled().load(std::memory_order_relaxed) ? &histogram_in : nullptr)
+    {
+        if(histogram){
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ScopedLatencyTimer(const ScopedLatencyTimer &) = delete;
+    ScopedLatencyTimer &operator=(const ScopedLatencyTimer &) = delete;
+
+    ~ScopedLatencyTimer()
+    {
+        stop();
+    }
+
+    void stop()
+    {
+        if(histogram){
+            histogram->record(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            histogram = nullptr;
+        }
+    }
+
+private:
+    LatencyHistogram *histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+
+#define PLANNING_INSTRUMENTATION_CONCAT_(a, b) a##b
+#define PLANNING_INSTRUMENTATION_CONCAT(a, b) PLANNING_INSTRUMENTATION_CONCAT_(a, b)
+
+#if PLANNING_INSTRUMENTATION
+/// Time the rest of the enclosing scope
+#define PLANNING_SCOPED_TIMER(histogram) ScopedLatencyTimer PLANNING_INSTRUMENTATION_CONCAT(planning_scoped_timer_, __LINE__)(histogram)
+/// Time until PLANNING_TIMER_STOP(name) or the end of the scope
+#define PLANNING_TIMER(name, histogram) ScopedLatencyTimer name(histogram)
+#define PLANNING_TIMER_STOP(name) name.stop()
+#define PLANNING_COUNT(counter, n) (counter).add(n)
+/// A latency measured by other means, in seconds
+#define PLANNING_RECORD(histogram, seconds) \
+    do{ if(planningInstrumentationEnabled().load(std::memory_order_relaxed)) (histogram).record(seconds); }while(0)
+#else
+#define PLANNING_SCOPED_TIMER(histogram) do{}while(0)
+#define PLANNING_TIMER(name, histogram) do{}while(0)
+#define PLANNING_TIMER_STOP(name) do{}while(0)
+#define PLANNING_COUNT(counter, n) do{}while(0)
+#define PLANNING_RECORD(histogram, seconds) do{}while(0)
+#endif
+
+#endif //PLANNING_INSTRUMENTATION_H
@@ -0,0 +1,215 @@
+//
+// Voxel grid filter that reads a depth camera point cloud buffer in place.
+//
+
+#ifndef POINT_CLOUD_VOXEL_FILTER_H
+#define POINT_CLOUD_VOXEL_FILTER_H
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/// Does what pcl::VoxelGrid followed by the axis swap and the crop in map_sim_example did, in one pass over the raw
+/// buffer: points are moved from the camera optical frame (z forward, x right, y down) to the map frame (x forward,
+/// y left, z up), points of voxels outside the crop box are skipped, and the centroid of each voxel is kept if it is
+/// inside the box. The voxels of the box are a dense grid that is reused between frames, and only the voxels touched
+/// by a frame are cleared.
+class PointCloudVoxelFilter{
+public:
+    PointCloudVoxelFilter() : leaf_size(0.15f), leaf_size_inv(1.f / 0.15f), box_min{0.f, 0.f, 0.f}, box_max{0.f, 0.f, 0.f},
+                              voxel_min{0, 0, 0}, voxel_num{0, 0, 0} {}
+
+    /// Leaf size and the open crop box in the map frame
+    void setGrid(float leaf_size_in, float x_min, float x_max, float y_min, float y_max, float z_min, float z_max)
+    {
+        leaf_size = leaf_size_in;
+        leaf_size_inv = 1.f / leaf_size_in;
+        box_min[0] = x_min; box_min[1] = y_min; box_min[2] = z_min;
+        box_max[0] = x_max; box_max[1] = y_max; box_max[2] = z_max;
+
+        for(int i=0; i<3; ++i){
+            voxel_min[i] = (int)std::floor(box_min[i] * leaf_size_inv);
+            voxel_num[i] = (int)std::floor(box_max[i] * leaf_size_inv) - voxel_min[i] + 1;
+        }
+        voxels.assign((size_t)voxel_num[0] * voxel_num[1] * voxel_num[2], VoxelAccumulator());
+    }
+
+    /// thread_num: threads to transform the points, including the calling thread
+    void setThreadNum(int thread_num)
+    {
+        thread_pool.reset(thread_num > 1 ? new ThreadPool(thread_num - 1) : nullptr);
+    }
+
+    /// data: height rows of row_step bytes, each with width points of point_step bytes. x_offset, y_offset and z_offset
+    /// are the byte offsets of the float coordinates in a point. Writes at most max_point_num points (x, y, z) to output
+    /// and returns their number.
+    int filter(const uint8_t *data, int width, int height, int row_step, int point_step, int x_offset, int y_offset,
+               int z_offset, float *output, int max_point_num)
+    {
+        const int point_num = width * height;
+        if(point_num <= 0 || voxels.empty()){
+            return 0;
+        }
+        if((int)points.size() < point_num){
+            points.resize(point_num);
+        }
+
+        /// Transform and find the voxel of each point. Rows are split between threads.
+        static const int ROWS_PER_JOB = 8;
+        const int job_num = (height + ROWS_PER_JOB - 1) / ROWS_PER_JOB;
+        auto transform_rows = [&](int job){
+            const int row_end = std::min(height, (job + 1) * ROWS_PER_JOB);
+            for(int row=job*ROWS_PER_JOB; row<row_end; ++row){
+                const uint8_t *row_data = data + (size_t)row * row_step;
+                IndexedPoint *row_points = &points[(size_t)row * width];
+                for(int col=0; col<width; ++col){
+                    const uint8_t *point_data = row_data + (size_t)col * point_step;
+                    float camera_x, camera_y, camera_z;
+                    std::memcpy(&camera_x, point_data + x_offset, sizeof(float));
+                    std::memcpy(&camera_y, point_data + y_offset, sizeof(float));
+                    std::memcpy(&camera_z, point_data + z_offset, sizeof(float));
+
+                    IndexedPoint &p = row_points[col];
+                    p.x = camera_z;
+                    p.y = -camera_x;
+                    p.z = -camera_y;
+                    p.voxel = isFinite(camera_x) && isFinite(camera_y) && isFinite(camera_z) ? voxelIndex(p.x, p.y, p.z) : -1;
+                }
+            }
+        };
+
+        if(thread_pool){
+            thread_pool->parallelFor(job_num, transform_rows);
+        }else{
+            for(int job=0; job<job_num; ++job){
+                transform_rows(job);
+            }
+        }
+
+        /// Accumulate. Each thread owns a range of voxels and adds their points in the order of the points, so the
+        /// centroids do not depend on the thread number.
+        const int range_num = thread_pool ? thread_pool->threadNum() : 1;
+        if((int)touched_voxels.size() < range_num){
+            touched_voxels.resize(range_num);
+        }
+        const int voxel_total = (int)voxels.size();
+        auto accumulate_range = [&](int range){
+            const int voxel_begin = (int)((long)voxel_total * range / range_num);
+            const int voxel_end = (int)((long)voxel_total * (range + 1) / range_num);
+            std::vector<int> &touched = touched_voxels[range];
+            touched.clear();
+            for(int i=0; i<point_num; ++i){
+                const IndexedPoint &p = points[i];
+                if(p.voxel < voxel_begin || p.voxel >= voxel_end){
+                    continue;
+                }
+                VoxelAccumulator &v = voxels[p.voxel];
+                if(v.num == 0){
+                    touched.push_back(p.voxel);
+                }
+                v.x += p.x;
+                v.y += p.y;
+                v.z += p.z;
+                ++ v.num;
+            }
+        };
+
+        if(thread_pool){
+            thread_pool->parallelFor(range_num, accumulate_range);
+        }else{
+            accumulate_range(0);
+        }
+
+        /// When not all voxels fit, keep the ones pcl::VoxelGrid would have put first: nearest in depth
+        size_t touched_num = 0;
+        for(int range=0; range<range_num; ++range){
+            touched_num += touched_voxels[range].size();
+        }
+        if(touched_num > (size_t)max_point_num){
+            for(int range=1; range<range_num; ++range){
+                touched_voxels[0].insert(touched_voxels[0].end(), touched_voxels[range].begin(), touched_voxels[range].end());
+                touched_voxels[range].clear();
+            }
+            std::sort(touched_voxels[0].begin(), touched_voxels[0].end());
+        }
+
+        int output_num = 0;
+        for(int range=0; range<range_num; ++range){
+            for(const int voxel : touched_voxels[range]){
+                VoxelAccumulator &v = voxels[voxel];
+                const float num_inv = 1.f / (float)v.num;
+                const float x = v.x * num_inv;
+                const float y = v.y * num_inv;
+                const float z = v.z * num_inv;
+                v = VoxelAccumulator();
+
+                if(output_num < max_point_num && x > box_min[0] && x < box_max[0] && y > box_min[1] && y < box_max[1]
+                   && z > box_min[2] && z < box_max[2]){
+                    output[output_num*3] = x;
+                    output[output_num*3+1] = y;
+                    output[output_num*3+2] = z;
+                    ++ output_num;
+                }
+            }
+        }
+
+        return output_num;
+    }
+
+private:
+    typedef struct VoxelAccumulator
+    {
+        float x = 0.f;
+        float y = 0.f;
+        float z = 0.f;
+        int num = 0;
+    }VoxelAccumulator;
+
+    typedef struct IndexedPoint
+    {
+        float x;
+        float y;
+        float z;
+        int voxel; // -1: not finite or outside the crop box
+    }IndexedPoint;
+
+    /// Checked on the bits, since the package is built with -ffast-math
+    static bool isFinite(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(float));
+        return (bits & 0x7f800000u) != 0x7f800000u;
+    }
+
+    /// Index in the grid ordered like pcl::VoxelGrid: depth (x) slowest, then down (-z), then right (-y).
+    /// Compared as floats, so far points are rejected without an int overflow.
+    int voxelIndex(float x, float y, float z) const
+    {
+        const float ix = std::floor(x * leaf_size_inv) - (float)voxel_min[0];
+        const float iy = std::floor(y * leaf_size_inv) - (float)voxel_min[1];
+        const float iz = std::floor(z * leaf_size_inv) - (float)voxel_min[2];
+        if(!(ix >= 0.f && ix < (float)voxel_num[0] && iy >= 0.f && iy < (float)voxel_num[1] && iz >= 0.f && iz < (float)voxel_num[2])){
+            return -1;
+        }
+        return ((int)ix * voxel_num[2] + (voxel_num[2] - 1 - (int)iz)) * voxel_num[1] + (voxel_num[1] - 1 - (int)iy);
+    }
+
+    float leaf_size;
+    float leaf_size_inv;
+    float box_min[3];
+    float box_max[3];
+    int voxel_min[3];
+    int voxel_num[3];
+
+    std::vector<VoxelAccumulator> voxels;
+    std::vector<std::vector<int>> touched_voxels; // of each voxel range
+    std::vector<IndexedPoint> points;
+
+    std::unique_ptr<ThreadPool> thread_pool;
+};
+
+#endif //POINT_CLOUD_VOXEL_FILTER_H
@@ -2,12 +2,22 @@
 // Created by clarence on 2021/12/16.
 //
 
-#include "dsp_map/map_parameters.h"
+#include "map_geometry.h"
+#include "risk_map_layout.h"
+#include "thread_pool.h"
 #include <iostream>
 #include <queue>
 #include <vector>
 #include <stack>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <array>
+#include <unordered_map>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 using namespace std;
 
@@ -28,10 +38,17 @@ typedef struct RectangleEnvelope
 {
     float time_stamp_start = 0.f;
     float time_stamp_end = 0.f;
-    vector<Plane3D> surfaces; // should have 6 surfaces
-    vector<Point3D> vertexes; // should have 8 vertexes
+    std::array<Plane3D, 6> surfaces;
+    std::array<Point3D, 8> vertexes;
 }RectangleEnvelope;
 
+/// Planes of an envelope in structure-of-arrays form for testing a row of points at once
+typedef struct RectangleEnvelopePlanes
+{
+    float point_x[6], point_y[6], point_z[6];
+    float normal_x[6], normal_y[6], normal_z[6];
+}RectangleEnvelopePlanes;
+
 typedef struct Node
 {
     float x,y,z;
@@ -41,6 +58,8 @@ typedef struct Node
     float h; // cost to goal
     float time_stamp;
     long int coding_index;
+    int heap_index; // position in the open list heap, -1 if not in the open list
+    Node* next_in_voxel; // next node in the same bucket of the node index
 
     Node* father;
     RectangleEnvelope envelope;
@@ -57,9 +76,11 @@ typedef struct Node
         this->f = 0.f;
         this->g = 0.f;
         this->h = 0.f;
+        this->heap_index = -1;
+        this->next_in_voxel = nullptr;
         this->father = nullptr;
     }
-    Node(float time_stamp, float x,float y,float z, float vx,float vy,float vz, Node* father, RectangleEnvelope envelope_init)
+    Node(float time_stamp, float x,float y,float z, float vx,float vy,float vz, Node* father, const RectangleEnvelope &envelope_init)
     {
         this->time_stamp = time_stamp;
         this->x = x;
@@ -71,6 +92,8 @@ typedef struct Node
         this->f = 0.f;
         this->g = 0.f;
         this->h = 0.f;
+        this->heap_index = -1;
+        this->next_in_voxel = nullptr;
         this->father = father;
         envelope = envelope_init;
     }
@@ -111,15 +134,291 @@ typedef struct Corridor
 }Corridor;
 
 
-class Astar{
+/// Fixed size chunks of storage for objects that live for one planning cycle. create() constructs an object in the
+/// next free slot and reset() destroys all of them at once. The chunks are kept, so after the first few cycles no
+/// memory is allocated for the objects themselves.
+template<typename T, size_t CHUNK_SIZE = 1024>
+class ObjectPool{
+public:
+    ObjectPool() : used_num(0) {}
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool()
+    {
+        reset();
+    }
+
+    template<typename... Args>
+    T* create(Args&&... args)
+    {
+        const size_t chunk_seq = used_num / CHUNK_SIZE;
+        if(chunk_seq == chunks.size()){
+            chunks.emplace_back(new Slot[CHUNK_SIZE]);
+        }
+
+        T* object = new (&chunks[chunk_seq][used_num % CHUNK_SIZE]) T(std::forward<Args>(args)...);
+        ++ used_num;
+        return object;
+    }
+
+    /// Destroy all objects. Pointers given by create() are invalid after this.
+    void reset()
+    {
+        for(size_t i=0; i<used_num; ++i){
+            reinterpret_cast<T*>(&chunks[i / CHUNK_SIZE][i % CHUNK_SIZE])->~T();
+        }
+        used_num = 0;
+    }
+
+    size_t size() const { return used_num; }
+
+    size_t capacity() const { return chunks.size() * CHUNK_SIZE; }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    vector<unique_ptr<Slot[]>> chunks;
+    size_t used_num;
+};
+
+
+/// Indexed binary min-heap on Node::f. Each node stores its own position in the heap (heap_index), so a node whose
+/// f has decreased can be moved up in O(log n) without searching or re-sorting the open list.
+class NodeHeap{
 public:
+    bool empty() const { return nodes.empty(); }
+
+    size_t size() const { return nodes.size(); }
+
+    Node* top() const { return nodes.front(); }
+
+    const vector<Node*> &data() const { return nodes; }
+
+    void clear()
+    {
+        for(auto &n : nodes){
+            n->heap_index = -1;
+        }
+        nodes.clear();
+    }
+
+    static bool contains(const Node* node) { return node->heap_index >= 0; }
 
-    explicit Astar()
+    void push(Node* node)
     {
-        map_length_half = MAP_LENGTH_VOXEL_NUM * VOXEL_RESOLUTION / 2.f;
-        map_width_half  = MAP_WIDTH_VOXEL_NUM  * VOXEL_RESOLUTION / 2.f;
-        map_height_half = MAP_HEIGHT_VOXEL_NUM * VOXEL_RESOLUTION / 2.f;
+        node->heap_index = (int)nodes.size();
+        nodes.push_back(node);
+        siftUp(node->heap_index);
+    }
+
+    Node* pop()
+    {
+        Node* top_node = nodes.front();
+        Node* last_node = nodes.back();
+        nodes.pop_back();
+        top_node->heap_index = -1;
+
+        if(!nodes.empty()){
+            nodes[0] = last_node;
+            last_node->heap_index = 0;
+            siftDown(0);
+        }
+        return top_node;
+    }
+
+    /// Restore the heap order after node->f was decreased
+    void decreaseKey(Node* node)
+    {
+        siftUp(node->heap_index);
+    }
+
+private:
+    void siftUp(int index)
+    {
+        Node* node = nodes[index];
+        while(index > 0){
+            int parent = (index - 1) / 2;
+            if(!(node->f < nodes[parent]->f)){
+                break;
+            }
+            nodes[index] = nodes[parent];
+            nodes[index]->heap_index = index;
+            index = parent;
+        }
+        nodes[index] = node;
+        node->heap_index = index;
+    }
+
+    void siftDown(int index)
+    {
+        Node* node = nodes[index];
+        const int size = (int)nodes.size();
+        while(true){
+            int child = 2 * index + 1;
+            if(child >= size){
+                break;
+            }
+            if(child + 1 < size && nodes[child + 1]->f < nodes[child]->f){
+                ++child;
+            }
+            if(!(nodes[child]->f < node->f)){
+                break;
+            }
+            nodes[index] = nodes[child];
+            nodes[index]->heap_index = index;
+            index = child;
+        }
+        nodes[index] = node;
+        node->heap_index = index;
+    }
+
+    vector<Node*> nodes;
+};
+
+
+/// Why the last search stopped
+enum class SearchStopReason
+{
+    GOAL,           // reached the goal
+    BOUNDARY,       // reached the boundary of the map
+    DEADLINE,       // the search time limit was reached. The result is the best partial path.
+    STEP_LIMIT,     // the maximum number of expansions was reached
+    EXHAUSTED,      // the open list is empty. No path.
+    INVALID_START   // the start node is not valid. No path.
+};
+
+inline const char* searchStopReasonName(SearchStopReason reason)
+{
+    switch(reason){
+        case SearchStopReason::GOAL: return "goal";
+        case SearchStopReason::BOUNDARY: return "boundary";
+        case SearchStopReason::DEADLINE: return "deadline";
+        case SearchStopReason::STEP_LIMIT: return "step limit";
+        case SearchStopReason::EXHAUSTED: return "exhausted";
+        case SearchStopReason::INVALID_START: return "invalid start";
+    }
+    return "unknown";
+}
+
+
+/// GEOMETRY: size and resolution of the risk maps, see map_geometry.h. The index math and the map bounds are constexpr
+/// for each geometry.
+///
+/// The planner holds the settings and the tables built from the risk map. The state of a search is in a SearchContext:
+/// search() and findCorridors() use one of the planner, and plan() runs a batch of searches with a context each.
+template<typename GEOMETRY = DspMapGeometry>
+class AstarT{
+public:
+    typedef GEOMETRY Geometry;
+    typedef RiskMapLayoutOf<GEOMETRY> Layout;
+    typedef RiskMapBricksT<GEOMETRY> Bricks;
 
+    /// XY shape of an expanded motion primitive relative to its start point. See buildPrimitiveTable().
+    typedef struct PrimitiveShape
+    {
+        bool valid = false;
+        float vertex_x[4];
+        float vertex_y[4];
+        float normal_x[4];
+        float normal_y[4];
+    }PrimitiveShape;
+
+    /// Result of one acceleration sample in an expansion. See evaluateSuccessor().
+    typedef struct SuccessorCandidate
+    {
+        bool endpoint_computed = false;
+        bool safe = false;
+        bool envelope_checked = false;
+        int envelope_voxel_checks = 0; // voxels read one by one when the risk table was inconclusive
+        float weight = 0.f;
+        TrajPoint endpoint;
+        RectangleEnvelope envelope;
+    }SuccessorCandidate;
+
+    /// State of one search: the query, the nodes, the result and the warm start path. A search only writes its own
+    /// context and reads the planner, so searches with different contexts can run at the same time on one risk map.
+    /// The nodes of the result and the corridors stay valid until the next search with the context. See plan().
+    class SearchContext{
+    public:
+        SearchContext() = default;
+
+        SearchContext(const SearchContext &) = delete;
+        SearchContext &operator=(const SearchContext &) = delete;
+
+        SearchStopReason getLastSearchStopReason() const { return last_stop_reason; }
+        bool getLastSearchWarmStarted() const { return last_search_warm_started; }
+        int getLastSearchSteps() const { return last_search_steps; }
+        long getLastEnvelopeChecks() const { return last_envelope_checks; }
+        long getLastEnvelopeVoxelChecks() const { return last_envelope_voxel_checks; }
+        long getLastCorridorExpansionSteps() const { return last_corridor_expansion_steps; }
+        const vector<TrajPoint> &getSearchedPoints() const { return searched_point_vector; }
+
+    private:
+        friend AstarT;
+
+        /// Path of the last search for the warm start. Positions are in the map frame plus the map center.
+        typedef struct WarmStartNode
+        {
+            float x, y, z;
+            float vx, vy, vz;
+            int sample_seq; // acceleration sample of the step to this node, -1 for the first node
+        }WarmStartNode;
+
+        /// The query
+        float start_time = 0.f;
+        float safety_distance = 0.3f;
+        float reference_direction_angle = 100.f;
+        float map_center_x = 0.f;
+        float map_center_y = 0.f;
+        float map_center_z = 0.f;
+
+        NodeHeap open_list;
+        vector<Node*> close_list;
+        unordered_map<long int, Node*> node_index; // voxel code -> nodes in the open list and close list
+        ObjectPool<Node> node_pool;
+        ObjectPool<Corridor, 64> corridor_pool;
+        Node *start_node = nullptr;
+        Node *end_node = nullptr;
+        vector<SuccessorCandidate> successor_candidates;
+        vector<Node*> result_path;
+        vector<Node*> result_path_reversed;
+        vector<TrajPoint> searched_point_vector;
+        vector<int> corridor_expansion_steps; // of each corridor of a findCorridors()
+        vector<WarmStartNode> warm_start_path;
+
+        SearchStopReason last_stop_reason = SearchStopReason::EXHAUSTED;
+        bool last_search_warm_started = false;
+        int last_search_steps = 0;
+        long last_envelope_checks = 0;
+        long last_envelope_voxel_checks = 0;
+        long last_corridor_expansion_steps = 0;
+    };
+
+    /// One search of plan(). The start, the goal and the map center are the arguments of search() and
+    /// updateMapCenterPosition(). The outputs are written by plan().
+    typedef struct SearchQuery
+    {
+        Node start{0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+        Node goal{0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+        float start_time = 0.f;
+        float safety_distance = 0.3f;
+        float reference_direction_angle = 100.f; // larger than pi: no preferred first direction
+        float map_center_x = 0.f;
+        float map_center_y = 0.f;
+        float map_center_z = 0.f;
+        int corridor_pattern = -1; // find the corridors of the path with this pattern of findCorridors(). -1: none
+        float corridor_expand_step = 0.2f;
+        SearchContext *context = nullptr; // nullptr: a context of the planner, the same one for the same position in the batch
+
+        SearchStopReason stop_reason = SearchStopReason::EXHAUSTED;
+        vector<Node*> result;
+        vector<Corridor*> corridors;
+    }SearchQuery;
+
+    explicit AstarT()
+    {
         time_step_node = 0.4;
         time_step_trajectory = 0.05;
 
@@ -138,31 +437,44 @@ public:
 
         boundary_width = 1.5;
 
+        max_search_steps = 300;
+        max_search_time = 0.f;
+
+        use_warm_start = false;
+        warm_start_position_tolerance = 0.3f;
+        warm_start_velocity_tolerance = 0.5f;
+
+        record_searched_points = true;
+
+        use_hashed_node_index = true;
+        use_velocity_direction_code = false;
+
+        use_incremental_corridor = true;
+        use_galloping_corridor = false;
+        corridor_max_expand_distance = 2.f;
+
+        use_primitive_table = true;
+        primitive_table_dirty = true;
+        primitive_table_velocity_resolution = 0.1f;
+        primitive_table_velocity_half_num = 0;
+        primitive_table_safety_distance = 0.f;
+
         risk_limitation_motion_primitive = 0.15;
         risk_limitation_single_voxel = 0.15;
         risk_limitation_corridor = 2.0;
+        risk_table_dirty = true;
+        risk_table_single_voxel_threshold = 0.f;
+        risk_table_frame_seq = 0;
 
         setSampleVector();
 
-        start_time = 0.f;
-
         height_max_limit = 0.f;
         height_min_limit = 0.f;
         use_height_limit = false;
         sample_z_acc = true;
-
-        map_center_x = 0.f;
-        map_center_y = 0.f;
-        map_center_z = 0.f;
-
-        safety_distance = 0.3f;
-
-        reference_direction_angle = 100.f;
-
-        std::cout << "Use Function search to search A* path" << std::endl;
     }
 
-    ~Astar()= default;
+    ~AstarT()= default;
 
     void setSampleVector(){
         a_sample_vector_x.clear();
@@ -198,6 +510,7 @@ public:
     {
         time_step_node = time_step_node_to_set;
         time_step_trajectory = time_step_trajectory_to_set;
+        primitive_table_dirty = true;
     }
 
     void setIfSampleZDirection(bool if_sample_z_acc)
@@ -205,14 +518,12 @@ public:
         sample_z_acc = if_sample_z_acc;
     }
 
+    /// The limits are global heights, so updateMapCenterPosition() must be called before every search
     void setHeightLimit(bool if_use_height_limit, float limit_max, float limit_min)
     {
         use_height_limit = if_use_height_limit;
         height_max_limit = limit_max;
         height_min_limit = limit_min;
-        if(if_use_height_limit){
-            cout << " \033[1;33m Kinodynamic A*: To use height limit. updateMapCenterPosition() must be operated every time. \033[0m" << endl;
-        }
     }
 
     void setMaximumVelAccAndStep(float v_max_xy_set, float v_max_z_set, float a_max_xy_set, float a_max_z_set, float a_step_set)
@@ -229,6 +540,73 @@ public:
         a_sample_step_z = a_step_set;
 
         setSampleVector();
+        primitive_table_dirty = true;
+    }
+
+
+    /// Use precomputed primitive shapes with the start velocity rounded to velocity_resolution. The table is rebuilt at
+    /// the next search after the velocity, acceleration, time step or safety distance is changed.
+    void setPrimitiveTable(bool if_use_primitive_table, float velocity_resolution = 0.1f)
+    {
+        use_primitive_table = if_use_primitive_table;
+        primitive_table_velocity_resolution = velocity_resolution;
+        primitive_table_dirty = true;
+    }
+
+
+    /// if_use_incremental: keep the risk of the corridor and only check the voxels added by each expanding step.
+    /// if_use_galloping: double the step of a direction after each safe step and halve it after an unsafe one, down to a
+    /// quarter of expand_step. The expanding distance of a direction is limited to max_expand_distance in this mode.
+    void setCorridorExpansion(bool if_use_incremental, bool if_use_galloping, float max_expand_distance = 2.f)
+    {
+        use_incremental_corridor = if_use_incremental;
+        use_galloping_corridor = if_use_galloping;
+        corridor_max_expand_distance = max_expand_distance;
+    }
+
+
+    /// Check the successors of a node on thread_num threads, including the search thread. 1 or less is serial.
+    void setExpansionThreads(int thread_num)
+    {
+        if(thread_num > 1){
+            expansion_thread_pool.reset(new ThreadPool(thread_num - 1));
+        }else{
+            expansion_thread_pool.reset();
+        }
+    }
+
+
+    /// Run the queries of plan() on thread_num threads, including the calling thread. 1 or less is serial. The
+    /// successors of a query are checked on its own thread then, since the queries already keep the threads busy.
+    void setQueryThreads(int thread_num)
+    {
+        if(thread_num > 1){
+            query_thread_pool.reset(new ThreadPool(thread_num - 1));
+        }else{
+            query_thread_pool.reset();
+        }
+    }
+
+
+    /// use_hashed_node_index: two nodes are the same if they are in the same voxel (and have the same velocity direction
+    /// when use_velocity_direction_code is true). Otherwise the old same_node_threshold comparison is used.
+    void setNodeIndexMode(bool if_use_hashed_node_index, bool if_use_velocity_direction_code)
+    {
+        use_hashed_node_index = if_use_hashed_node_index;
+        use_velocity_direction_code = if_use_velocity_direction_code;
+    }
+
+
+    void setMaximumSearchSteps(int max_search_steps_set)
+    {
+        max_search_steps = max_search_steps_set;
+    }
+
+
+    /// Stop the search after max_search_time_set seconds and return the best partial path. 0 or less: no time limit.
+    void setMaximumSearchTime(float max_search_time_set)
+    {
+        max_search_time = max_search_time_set;
     }
 
 
@@ -237,115 +615,229 @@ public:
         risk_limitation_motion_primitive = risk_motion_primitive;
         risk_limitation_single_voxel = risk_single_voxel;
         risk_limitation_corridor = risk_corridor;
+        risk_table_dirty = true;
+    }
+
+
+    /// Build the summed-volume tables of a new risk map, stored in RiskMapLayout order. Must be called when the content of the risk map changes. search()
+    /// only rebuilds the tables by itself when it gets a different risk map pointer or the thresholds were changed.
+    void updateRiskMap(float *risk_map_in)
+    {
+        static const int table_layer_size = (Geometry::length_voxel_num + 1) * (Geometry::width_voxel_num + 1) * (Geometry::height_voxel_num + 1);
+
+        risk_map = risk_map_in;
+        risk_sum_table.assign((size_t)table_layer_size * Geometry::risk_map_number, 0.0);
+        risk_exceed_table.assign((size_t)table_layer_size * Geometry::risk_map_number, 0);
+        risk_table_single_voxel_threshold = risk_limitation_single_voxel;
+
+        for(int t=0; t<Geometry::risk_map_number; ++t){
+            buildRiskTableLayer(t, 0, 0, 0);
+        }
+
+        risk_table_dirty = false;
+        risk_table_frame_seq = 0;
+    }
+
+
+    /// Same as updateRiskMap(risk_map_in) for a frame of a sequence in which brick_change_seq[b] is the last frame that
+    /// changed brick b (RiskMapBricks index). If the tables were built from an earlier frame of the sequence, only the
+    /// layers with changed bricks are rebuilt, and only from the lowest corner of their changed bricks, since a summed
+    /// table entry covers every voxel below it.
+    void updateRiskMap(float *risk_map_in, const uint64_t *brick_change_seq, uint64_t frame_seq)
+    {
+        if(risk_table_dirty || risk_table_frame_seq == 0 || frame_seq < risk_table_frame_seq || risk_sum_table.empty()){
+            updateRiskMap(risk_map_in);
+            risk_table_frame_seq = frame_seq;
+            return;
+        }
+
+        risk_map = risk_map_in;
+        for(int t=0; t<Geometry::risk_map_number; ++t){
+            int x_begin = Geometry::length_voxel_num, y_begin = Geometry::width_voxel_num, z_begin = Geometry::height_voxel_num;
+            for(int b=t*Bricks::layer_num; b<(t+1)*Bricks::layer_num; ++b){
+                if(brick_change_seq[b] > risk_table_frame_seq){
+                    int brick_t, x0, x1, y0, y1, z0, z1;
+                    Bricks::range(b, brick_t, x0, x1, y0, y1, z0, z1);
+                    x_begin = std::min(x_begin, x0);
+                    y_begin = std::min(y_begin, y0);
+                    z_begin = std::min(z_begin, z0);
+                }
+            }
+            if(x_begin < Geometry::length_voxel_num){
+                buildRiskTableLayer(t, x_begin, y_begin, z_begin);
+            }
+        }
+        risk_table_frame_seq = frame_seq;
     }
 
 
     void updateMapCenterPosition(float map_px, float map_py, float map_pz)
     {
-        map_center_x = map_px;
-        map_center_y = map_py;
-        map_center_z = map_pz;
+        default_context.map_center_x = map_px;
+        default_context.map_center_y = map_py;
+        default_context.map_center_z = map_pz;
     }
 
 
-    void getSearchedPoints(vector<TrajPoint> &searched_points)
+    /// Keep the end points of all checked primitives of a search for getSearchedPoints(). For debugging only.
+    void setRecordSearchedPoints(bool if_record_searched_points)
     {
-        searched_points = searched_point_vector;
+        record_searched_points = if_record_searched_points;
     }
 
 
-    void search(Node* start_p_v_set, Node* end_pos_set, float start_time_this, float safety_distance_this, float reference_direction_angle_this, float *risk_map_in, vector<Node*> &result){
-        start_node = start_p_v_set;
-        end_node = end_pos_set;
-        start_node->coding_index = 0;
-        end_node->coding_index = 88888888;
+    void getSearchedPoints(vector<TrajPoint> &searched_points)
+    {
+        searched_points = default_context.searched_point_vector;
+    }
+
 
-        safety_distance = safety_distance_this;
-        reference_direction_angle = reference_direction_angle_this;
+    /// The start and end nodes are copied. All nodes in the result and all corridors from findCorridors() are owned by
+    /// the planner and stay valid until the next search.
+    SearchStopReason search(Node* start_p_v_set, Node* end_pos_set, float start_time_this, float safety_distance_this, float reference_direction_angle_this, float *risk_map_in, vector<Node*> &result){
+        default_context.start_time = start_time_this;
+        default_context.safety_distance = safety_distance_this;
+        default_context.reference_direction_angle = reference_direction_angle_this;
 
-        start_time = start_time_this;
-        risk_map = risk_map_in;
+        prepareSearches(risk_map_in, safety_distance_this);
+        return runQuery(default_context, start_p_v_set, end_pos_set, true, result);
+    }
 
 
-        if(!checkNodeValid(start_node)){
-            std::cout << "Invalid start point index or end point index." << std::endl;
-            std::cout << "start_node px="<< start_node->x <<" py="<<start_node->y <<" pz=" << start_node->z << std::endl;
+    /// Run several searches on one risk map, on the query thread pool if there is one. The risk tables and the
+    /// primitive table are prepared once for the batch, for the safety distance of the first query; queries with
+    /// another safety distance compute their envelopes without the primitive table. Each query must have its own
+    /// context. The planner settings must not change while plan() runs.
+    void plan(vector<SearchQuery> &queries, float *risk_map_in)
+    {
+        if(queries.empty()){
             return;
         }
+        prepareSearches(risk_map_in, queries[0].safety_distance);
+        while(batch_contexts.size() < queries.size()){
+            batch_contexts.emplace_back(new SearchContext());
+        }
 
-        open_list.clear();
-        close_list.clear();
-        result_path.clear();
-        result_path_reversed.clear();
-        searched_point_vector.clear();
-
-        start_node->f = 0.f;
-        start_node->time_stamp = 0.f;
-        open_list.push_back(start_node);
+        auto run_query = [&](int i, bool use_expansion_threads){
+            SearchQuery &query = queries[i];
+            SearchContext &context = query.context ? *query.context : *batch_contexts[i];
+            context.start_time = query.start_time;
+            context.safety_distance = query.safety_distance;
+            context.reference_direction_angle = query.reference_direction_angle;
+            context.map_center_x = query.map_center_x;
+            context.map_center_y = query.map_center_y;
+            context.map_center_z = query.map_center_z;
+
+            query.stop_reason = runQuery(context, &query.start, &query.goal, use_expansion_threads, query.result);
+            query.corridors.clear();
+            if(query.corridor_pattern >= 0){
+                findCorridors(context, query.corridors, query.corridor_pattern, query.corridor_expand_step, use_expansion_threads);
+            }
+        };
 
-        Node* current_node;
-        bool found_path = false;
-        int step_counter = 0;
+        if(query_thread_pool && queries.size() > 1){
+            query_thread_pool->parallelFor((int)queries.size(), [&](int i){ run_query(i, false); });
+        }else{
+            for(int i=0; i<(int)queries.size(); ++i){
+                run_query(i, true);
+            }
+        }
+    }
 
-        while (!open_list.empty()){
-            step_counter += 1;
 
-            current_node = open_list[0];
+    /// Seed the next searches with the last path. A path is reused from its node nearest to the new start if that node
+    /// is within position_tolerance and velocity_tolerance of the start. The motion primitives after that node are
+    /// applied to the new start again and checked against the current risk map, up to the first one that is not safe.
+    void setWarmStart(bool if_use_warm_start, float position_tolerance = 0.3f, float velocity_tolerance = 0.5f)
+    {
+        use_warm_start = if_use_warm_start;
+        warm_start_position_tolerance = position_tolerance;
+        warm_start_velocity_tolerance = velocity_tolerance;
+        default_context.warm_start_path.clear();
+        for(auto &context : batch_contexts){
+            context->warm_start_path.clear();
+        }
+    }
 
-            if(nodeEqual(current_node, end_node) || checkNodeOnBoundary(current_node, boundary_width) || step_counter > 300){
-                if(checkNodeOnBoundary(current_node, boundary_width))
-                {
-                    cout << "Boundary condition reached !!!" <<endl;
-                }
-                // Reached goal or boundary
-                addPath(current_node);
+    /// Whether the last search returned a path that continues the one before
+    bool getLastSearchWarmStarted() const
+    {
+        return default_context.last_search_warm_started;
+    }
 
-                // Reverse and Print
-                for(int i=(int)result_path.size()-1; i>0; --i){
-                    auto p = result_path[i];
-                    result_path_reversed.push_back(p);
-                    found_path = true;
-//                    std::cout << "(" << p->x << ", " << p->y << ", " << p->z << ")" << std::endl;
-                }
 
-                result = result_path_reversed;
-                break;
-            }
+    SearchStopReason getLastSearchStopReason() const
+    {
+        return default_context.last_stop_reason;
+    }
 
-            nextStep(current_node);
+    /// Nodes taken from the open list by the last search, with the ones of a warm start that was not kept
+    int getLastSearchSteps() const
+    {
+        return default_context.last_search_steps;
+    }
 
-            close_list.push_back(current_node);
-            open_list.erase(open_list.begin());
+    /// Risk checks of motion primitive envelopes in the last search
+    long getLastEnvelopeChecks() const
+    {
+        return default_context.last_envelope_checks;
+    }
 
-//            std::cout << "open_list length=" << open_list.size() << endl;
-            sort(open_list.begin(),open_list.end(), compare);
-        }
+    /// Voxels read one by one by the envelope checks of the last search, where the risk table was not conclusive
+    long getLastEnvelopeVoxelChecks() const
+    {
+        return default_context.last_envelope_voxel_checks;
+    }
 
-        if(found_path){
-            cout << "Path found, searched times = "<<step_counter <<", result node size = " << result_path_reversed.size() << endl;
-            cout << "x="<<start_node->x<<", y="<<start_node->y<<", z="<<start_node->z<<endl;
+    /// Expanding steps of all corridors of the last findCorridors()
+    long getLastCorridorExpansionSteps() const
+    {
+        return default_context.last_corridor_expansion_steps;
+    }
 
-//            for(auto &n : result_path_reversed){
-//                cout << "x="<<n->x<<", y="<<n->y<<", z="<<n->z<<endl;
-//            }
+    void findCorridors(vector<Corridor*> &corridors, int pattern = 1, float expand_step = 0.2)
+    {
+        findCorridors(default_context, corridors, pattern, expand_step, true);
+    }
 
-        }else{
-            cout << "Path not found, searched times = "<<step_counter << endl;
+    /// Time window, from the start of the last search, in which a corridor of the last findCorridors() meets the corridor
+    /// risk thresholds. The window is made of the risk map layer of the node interval of the corridor and the layers
+    /// next to it that are safe, so a trajectory piece flown in the corridor at another time is still checked. The last
+    /// layer is used for all later times, so a window that reaches it has no end.
+    void getCorridorSafeTimeWindow(const Corridor &corridor, float &window_start, float &window_end) const
+    {
+        const SearchContext &context = default_context;
+        int first_layer, last_layer;
+        matchTimeToTimeIndex(context, first_layer, corridor.envelope.time_stamp_start);
+        last_layer = first_layer;
+
+        while(first_layer > 0 && checkIfEnvelopeSafeAtTimeIndex(context, corridor.envelope, first_layer - 1, risk_limitation_corridor,
+                                                                 risk_limitation_single_voxel)){
+            -- first_layer;
+        }
+        while(last_layer < Geometry::risk_map_number - 1 && checkIfEnvelopeSafeAtTimeIndex(context, corridor.envelope, last_layer + 1,
+                                                                                            risk_limitation_corridor, risk_limitation_single_voxel)){
+            ++ last_layer;
         }
 
+        window_start = (float)first_layer * time_step_node - context.start_time;
+        window_end = last_layer == Geometry::risk_map_number - 1 ? std::numeric_limits<float>::infinity()
+                                                                 : (float)(last_layer + 1) * time_step_node - context.start_time;
     }
 
-    bool checkIfAllTrueVector(const vector<bool> &vector)
+
+    /// Expand the envelope of a motion primitive until it meets risk. See findCorridors() for the patterns. Returns the
+    /// number of expanding steps.
+    int findCorridorEnvelope(const RectangleEnvelope &envelope_primitive, int pattern, float expand_step, RectangleEnvelope &envelope_expanded) const
     {
-        for(const auto &v : vector){
-            if(!v){
-                return false;
-            }
-        }
-        return true;
+        return findCorridorEnvelope(default_context, envelope_primitive, pattern, expand_step, envelope_expanded);
     }
 
-    void findCorridors(vector<Corridor*> &corridors, int pattern = 1, float expand_step = 0.2)
+
+    /// Corridors of the last path of a context. use_expansion_threads: expand them on the expansion thread pool, which is
+    /// only used by one search at a time.
+    void findCorridors(SearchContext &context, vector<Corridor*> &corridors, int pattern = 1, float expand_step = 0.2,
+                       bool use_expansion_threads = true)
     {
         /// Pattern 0: Expand the corridor to xyz directions at the same until the safety condition is not satisfied
         /// Pattern 1: Use Pattern 0 first. When Pattern 0 fails, close expanding direction z, and then y, and then x;
@@ -353,121 +845,415 @@ public:
         ///            iteration. A direction is banned when it is not safe.
         /// Pattern 3: Expand only to y and z. The rest is the same as Pattern 0.
 
-        for(int node_seq=1; node_seq<result_path_reversed.size(); ++node_seq){
-            auto* corridor_this = new Corridor(result_path_reversed[node_seq-1], result_path_reversed[node_seq]);
-            corridor_this->envelope.time_stamp_start = result_path_reversed[node_seq-1]->time_stamp;
-            corridor_this->envelope.time_stamp_end = result_path_reversed[node_seq]->time_stamp;
-            corridor_this->node_start = result_path_reversed[node_seq-1];
-            corridor_this->node_end = result_path_reversed[node_seq];
-
-            /// Expand envelope of the motion primitive to find the corridor
-            RectangleEnvelope envelope_expanded = result_path_reversed[node_seq]->envelope;
-
-            vector<bool> expanding_direction = {true, true, true, true, true, true};
-            vector<float> expanding_distance = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
-
-
-            vector<vector<bool>> expanding_order;
-            vector<bool> expanding_direction2 = {true, true, true, true, false, false}; //xy
-            vector<bool> expanding_direction3 = {true, true, false, false, false, false}; //x
-            vector<bool> expanding_direction4 = {false, false, true, false, false, false}; //y+
-            vector<bool> expanding_direction5 = {false, false, false, true, false, false}; //y-
-            vector<bool> expanding_direction6 = {false, false, false, false, true, false}; //z+
-            vector<bool> expanding_direction7 = {false, false, false, false, false, true}; //z-
-            expanding_order.push_back(expanding_direction2);
-            expanding_order.push_back(expanding_direction3);
-            expanding_order.push_back(expanding_direction4);
-            expanding_order.push_back(expanding_direction5);
-            expanding_order.push_back(expanding_direction6);
-            expanding_order.push_back(expanding_direction7);
-            int pattern1_seq = 0;
-
-            if(pattern == 3){
-                expanding_direction[0] = expanding_direction[1] = false;
+        /// The corridors are created first because the pool is not thread safe. The segments are independent and are
+        /// expanded on the expansion thread pool if there is one.
+        const vector<Node*> &path = context.result_path_reversed;
+        const size_t corridor_start_seq = corridors.size();
+        for(int node_seq=1; node_seq<path.size(); ++node_seq){
+            auto* corridor_this = context.corridor_pool.create(path[node_seq-1], path[node_seq]);
+            corridor_this->envelope.time_stamp_start = path[node_seq-1]->time_stamp;
+            corridor_this->envelope.time_stamp_end = path[node_seq]->time_stamp;
+            corridor_this->node_start = path[node_seq-1];
+            corridor_this->node_end = path[node_seq];
+            corridors.push_back(corridor_this);
+        }
+
+        const int corridor_num = (int)(corridors.size() - corridor_start_seq);
+        context.corridor_expansion_steps.assign(corridor_num, 0);
+        auto expand_corridor = [&](int i){
+            Corridor *corridor_this = corridors[corridor_start_seq + i];
+            context.corridor_expansion_steps[i] = findCorridorEnvelope(context, corridor_this->node_end->envelope, pattern, expand_step, corridor_this->envelope);
+        };
+
+        if(expansion_thread_pool && use_expansion_threads){
+            expansion_thread_pool->parallelFor(corridor_num, expand_corridor);
+        }else{
+            for(int i=0; i<corridor_num; ++i){
+                expand_corridor(i);
             }
+        }
 
-            vector<bool> forbidden_direction = {false, false, false, false, false, false}; // for pattern 2
-            vector<bool> all_false_vector = {false, false, false, false, false, false};
-            int check_surface_seq = -1; // for pattern 2
+        context.last_corridor_expansion_steps = 0;
+        for(const int steps : context.corridor_expansion_steps){
+            context.last_corridor_expansion_steps += steps;
+        }
+    }
 
-            int step_counter = 0;
-            while(step_counter < 30)
-            {
-                ++step_counter;
 
-                if(pattern == 2){
-                    check_surface_seq += 1;
+    int findCorridorEnvelope(const SearchContext &context, const RectangleEnvelope &envelope_primitive, int pattern, float expand_step,
+                             RectangleEnvelope &envelope_expanded) const
+    {
+        typedef std::array<bool, 6> DirectionFlags;
+
+        /// Expand envelope of the motion primitive to find the corridor
+        envelope_expanded = envelope_primitive;
+
+        DirectionFlags expanding_direction = {true, true, true, true, true, true};
+        std::array<float, 6> expanding_distance = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+        std::array<float, 6> galloping_step = {expand_step, expand_step, expand_step, expand_step, expand_step, expand_step};
+        const float galloping_min_step = expand_step * 0.25f;
+
+        static const DirectionFlags expanding_order[6] = {{true, true, true, true, false, false}, //xy
+                                                           {true, true, false, false, false, false}, //x
+                                                           {false, false, true, false, false, false}, //y+
+                                                           {false, false, false, true, false, false}, //y-
+                                                           {false, false, false, false, true, false}, //z+
+                                                           {false, false, false, false, false, true}}; //z-
+        int pattern1_seq = 0;
+
+        if(pattern == 3){
+            expanding_direction[0] = expanding_direction[1] = false;
+        }
 
-                    for(int j=0; j<6; ++j){
-                        int this_seq = check_surface_seq + j;
-                        if(this_seq >= 6){
-                            this_seq -= 6;
-                        }
-                        if(!forbidden_direction[this_seq]){
-                            check_surface_seq = this_seq;
-                            break;
-                        }
-                    }
+        DirectionFlags forbidden_direction = {false, false, false, false, false, false}; // for pattern 2
+        const DirectionFlags all_false_vector = {false, false, false, false, false, false};
+        const DirectionFlags all_true_vector = {true, true, true, true, true, true};
+        int check_surface_seq = -1; // for pattern 2
 
-                    expanding_direction = all_false_vector;
-                    expanding_direction[check_surface_seq] = true;
-                }
+        /// The box keeps the risk of the voxels inside, so each step only checks the newly covered slab
+        CorridorBox box;
+        bool box_valid = true;
+        if(use_incremental_corridor){
+            box_valid = initCorridorBox(context, envelope_primitive, box);
+        }
+        bool expanded = false;
+
+        int step_counter = 0;
+        while(step_counter < 30)
+        {
+            ++step_counter;
+
+            if(pattern == 2){
+                check_surface_seq += 1;
 
-                // Expand to desired direction by one step
                 for(int j=0; j<6; ++j){
-                    if(expanding_direction[j]){
-                        expanding_distance[j] += expand_step;
+                    int this_seq = check_surface_seq + j;
+                    if(this_seq >= 6){
+                        this_seq -= 6;
+                    }
+                    if(!forbidden_direction[this_seq]){
+                        check_surface_seq = this_seq;
+                        break;
                     }
                 }
 
-                RectangleEnvelope envelope_expanded_this;
-                expandEnvelope(result_path_reversed[node_seq]->envelope, envelope_expanded_this, expanding_distance);
+                expanding_direction = all_false_vector;
+                expanding_direction[check_surface_seq] = true;
+            }
 
-                if(!checkIfEnvelopeSafe(envelope_expanded_this, risk_limitation_corridor, risk_limitation_single_voxel)){
-                    for(int j=0; j<6; ++j){ // return to last step
-                        if(expanding_direction[j]){
-                            expanding_distance[j] -= expand_step;
-                        }
+            // Expand to desired direction by one step
+            std::array<float, 6> expanding_distance_this = expanding_distance;
+            bool step_too_small = false;
+            for(int j=0; j<6; ++j){
+                if(expanding_direction[j]){
+                    if(use_galloping_corridor){
+                        const float step = std::min(galloping_step[j], corridor_max_expand_distance - expanding_distance[j]);
+                        step_too_small |= step < galloping_min_step;
+                        expanding_distance_this[j] += step;
+                    }else{
+                        expanding_distance_this[j] += expand_step;
                     }
+                }
+            }
 
-                    if(pattern == 0){
-                        break;
-                    }else if(pattern == 1){
-                        if(pattern1_seq < expanding_order.size()){
-                            expanding_direction = expanding_order[pattern1_seq];
-                            pattern1_seq ++;
-                        }else{
-                            break;
-                        }
+            bool safe;
+            if(step_too_small){
+                safe = false;
+            }else if(use_incremental_corridor){
+                safe = box_valid && tryExpandCorridorBox(context, box, expanding_distance_this, expanding_direction);
+            }else{
+                RectangleEnvelope envelope_expanded_this;
+                expandEnvelope(envelope_primitive, envelope_expanded_this, expanding_distance_this);
+                safe = checkIfEnvelopeSafe(context, envelope_expanded_this, risk_limitation_corridor, risk_limitation_single_voxel);
+            }
 
-                    }else if(pattern == 2){
-                        forbidden_direction[check_surface_seq] = true;
-                        if(checkIfAllTrueVector(forbidden_direction)){
-                            break;
+            if(!safe){
+                /// Galloping: retry with half of the step until the step is too small
+                if(use_galloping_corridor && !step_too_small){
+                    bool retry = false;
+                    for(int j=0; j<6; ++j){
+                        if(expanding_direction[j] && galloping_step[j] * 0.5f >= galloping_min_step){
+                            galloping_step[j] *= 0.5f;
+                            retry = true;
                         }
+                    }
+                    if(retry){
+                        continue;
+                    }
+                }
+
+                if(pattern == 0){
+                    break;
+                }else if(pattern == 1){
+                    if(pattern1_seq < 6){
+                        expanding_direction = expanding_order[pattern1_seq];
+                        pattern1_seq ++;
                     }else{
                         break;
                     }
 
+                }else if(pattern == 2){
+                    forbidden_direction[check_surface_seq] = true;
+                    if(forbidden_direction == all_true_vector){
+                        break;
+                    }
                 }else{
-                    envelope_expanded = envelope_expanded_this;
+                    break;
+                }
+
+            }else{
+                expanding_distance = expanding_distance_this;
+                expanded = true;
+
+                /// Galloping: double the step of the directions that kept being safe
+                if(use_galloping_corridor){
+                    for(int j=0; j<6; ++j){
+                        if(expanding_direction[j]){
+                            galloping_step[j] *= 2.f;
+                        }
+                    }
                 }
             }
+        }
 
-            corridor_this->envelope = envelope_expanded;
-            corridors.push_back(corridor_this);
+        if(expanded){
+            expandEnvelope(envelope_primitive, envelope_expanded, expanding_distance);
         }
+        return step_counter;
     }
 
 
-    void findNearestPoint2DOnALine(float A_x, float A_y, float B_x, float B_y, float P_x, float P_y, float &P_prime_x, float &P_prime_y)
+    /// An envelope of a primitive in the frame of its own rectangle (u, w, z), expanded by a distance on each face.
+    /// The face order is the same as the expanding distances: {u+, u-, w+, w-, z+, z-}.
+    typedef struct CorridorBox
     {
-        float AB_x = B_x - A_x;
-        float AB_y = B_y - A_y;
-        float AP_x = P_x - A_x;
-        float AP_y = P_y - A_y;
-        float AB_length = sqrt(AB_x*AB_x + AB_y*AB_y);
-        float AP_prime_length = (AP_x*AB_x + AP_y*AB_y) / AB_length;
+        float center_x, center_y;
+        float cos_theta, sin_theta;
+        float lower[3], upper[3]; // u, w, z
+        float lower_primitive[3], upper_primitive[3];
+        int time_index;
+        double risk_summation;
+    }CorridorBox;
+
+
+    /// Set up a corridor box of the primitive envelope and sum the risk inside. Returns false if the envelope itself is
+    /// not safe for a corridor, so it can not be expanded.
+    bool initCorridorBox(const SearchContext &context, const RectangleEnvelope &envelope, CorridorBox &box) const
+    {
+        /// Same frame as expandEnvelope()
+        box.center_x = (envelope.vertexes[0].x + envelope.vertexes[2].x + envelope.vertexes[4].x + envelope.vertexes[6].x) / 4.f;
+        box.center_y = (envelope.vertexes[0].y + envelope.vertexes[2].y + envelope.vertexes[4].y + envelope.vertexes[6].y) / 4.f;
+
+        float theta = M_PI / 2.f;
+        if(envelope.vertexes[0].x-envelope.vertexes[2].x != 0.f)
+        {
+            theta = atan2(envelope.vertexes[0].y-envelope.vertexes[2].y, envelope.vertexes[0].x-envelope.vertexes[2].x);
+        }
+        box.cos_theta = cos(theta);
+        box.sin_theta = sin(theta);
+
+        for(int i=0; i<3; ++i){
+            box.lower_primitive[i] = 1e10f;
+            box.upper_primitive[i] = -1e10f;
+        }
+        for(const auto &v : envelope.vertexes){
+            float u, w;
+            toCorridorBoxFrame(box, v.x, v.y, u, w);
+            setMinAndMax(box.lower_primitive[0], box.upper_primitive[0], u);
+            setMinAndMax(box.lower_primitive[1], box.upper_primitive[1], w);
+            setMinAndMax(box.lower_primitive[2], box.upper_primitive[2], v.z);
+        }
+        for(int i=0; i<3; ++i){
+            box.lower[i] = box.lower_primitive[i];
+            box.upper[i] = box.upper_primitive[i];
+        }
+
+        matchTimeToTimeIndex(context, box.time_index, envelope.time_stamp_start);
+
+        if(!ifCorridorBoxInLimits(context, box)){
+            return false;
+        }
+
+        box.risk_summation = 0.0;
+        const CorridorBox &b = box;
+        bool safe = forEachVoxelInCorridorBoxRegion(box, box.lower, box.upper, [&](float u, float w, float z, float risk){
+            if(u < b.lower[0] || u > b.upper[0] || w < b.lower[1] || w > b.upper[1] || z < b.lower[2] || z > b.upper[2]){
+                return true;
+            }
+            box.risk_summation += risk;
+            return risk <= risk_limitation_single_voxel;
+        });
+
+        return safe && box.risk_summation <= risk_limitation_corridor;
+    }
+
+
+    /// Expand the box to the given distances if the voxels newly covered are safe. Only the slabs between the old and the
+    /// new faces are checked. A voxel in more than one slab is assigned to the first expanded face.
+    bool tryExpandCorridorBox(const SearchContext &context, CorridorBox &box, const std::array<float, 6> &distances, const std::array<bool, 6> &expanded) const
+    {
+        CorridorBox new_box = box;
+        for(int i=0; i<3; ++i){
+            new_box.upper[i] = box.upper_primitive[i] + distances[2*i];
+            new_box.lower[i] = box.lower_primitive[i] - distances[2*i+1];
+        }
+
+        if(!ifCorridorBoxInLimits(context, new_box)){
+            return false;
+        }
+
+        double slab_risk_summation = 0.0;
+        for(int face=0; face<6; ++face){
+            if(!expanded[face]){
+                continue;
+            }
+
+            /// Region of the slab of this face, excluding the slabs of the faces before
+            const int axis = face / 2;
+            float region_lower[3], region_upper[3];
+            for(int i=0; i<3; ++i){
+                region_lower[i] = new_box.lower[i];
+                region_upper[i] = new_box.upper[i];
+            }
+            for(int prior_face=0; prior_face<face; ++prior_face){
+                if(expanded[prior_face]){
+                    if(prior_face % 2 == 0){
+                        region_upper[prior_face / 2] = std::min(region_upper[prior_face / 2], box.upper[prior_face / 2]);
+                    }else{
+                        region_lower[prior_face / 2] = std::max(region_lower[prior_face / 2], box.lower[prior_face / 2]);
+                    }
+                }
+            }
+            if(face % 2 == 0){
+                region_lower[axis] = box.upper[axis];
+            }else{
+                region_upper[axis] = box.lower[axis];
+            }
+
+            bool safe = forEachVoxelInCorridorBoxRegion(new_box, region_lower, region_upper, [&](float u, float w, float z, float risk){
+                const float coordinates[3] = {u, w, z};
+                for(int i=0; i<3; ++i){
+                    if(coordinates[i] < new_box.lower[i] || coordinates[i] > new_box.upper[i]){
+                        return true;
+                    }
+                }
+                if(face % 2 == 0 ? coordinates[axis] <= box.upper[axis] : coordinates[axis] >= box.lower[axis]){
+                    return true; // in the old box
+                }
+                for(int prior_face=0; prior_face<face; ++prior_face){
+                    if(expanded[prior_face]){
+                        const int prior_axis = prior_face / 2;
+                        if(prior_face % 2 == 0 ? coordinates[prior_axis] > box.upper[prior_axis] : coordinates[prior_axis] < box.lower[prior_axis]){
+                            return true; // counted by the slab of a prior face
+                        }
+                    }
+                }
+
+                slab_risk_summation += risk;
+                return risk <= risk_limitation_single_voxel;
+            });
+
+            if(!safe || box.risk_summation + slab_risk_summation > risk_limitation_corridor){
+                return false;
+            }
+        }
+
+        new_box.risk_summation = box.risk_summation + slab_risk_summation;
+        box = new_box;
+        return true;
+    }
+
+
+    void toCorridorBoxFrame(const CorridorBox &box, float x, float y, float &u, float &w) const
+    {
+        const float dx = x - box.center_x;
+        const float dy = y - box.center_y;
+        u = dx*box.cos_theta + dy*box.sin_theta;
+        w = -dx*box.sin_theta + dy*box.cos_theta;
+    }
+
+
+    /// Same conditions as checkIfEnvelopeSafe(): the box is inside of the map and of the height limit
+    bool ifCorridorBoxInLimits(const SearchContext &context, const CorridorBox &box) const
+    {
+        float x_min, x_max, y_min, y_max;
+        getCorridorBoxRegionBounds(box, box.lower, box.upper, x_min, x_max, y_min, y_max);
+
+        if(x_min < -map_length_half || x_max >= map_length_half || y_min < -map_width_half || y_max >= map_width_half
+           || box.lower[2] < -map_height_half || box.upper[2] >= map_height_half){
+            return false;
+        }
+
+        if(use_height_limit){
+            if(box.upper[2] > height_max_limit - context.map_center_z || box.lower[2] < height_min_limit - context.map_center_z){
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    void getCorridorBoxRegionBounds(const CorridorBox &box, const float lower[3], const float upper[3],
+                                    float &x_min, float &x_max, float &y_min, float &y_max) const
+    {
+        x_min = y_min = 1e10f;
+        x_max = y_max = -1e10f;
+        for(int i=0; i<4; ++i){
+            const float u = (i & 1) ? upper[0] : lower[0];
+            const float w = (i & 2) ? upper[1] : lower[1];
+            setMinAndMax(x_min, x_max, box.center_x + u*box.cos_theta - w*box.sin_theta);
+            setMinAndMax(y_min, y_max, box.center_y + u*box.sin_theta + w*box.cos_theta);
+        }
+    }
+
+
+    /// Call f(u, w, z, risk) for the voxels whose centers are in the bounding box of a region of the box frame. Stops and
+    /// returns false when f returns false.
+    template<typename F>
+    bool forEachVoxelInCorridorBoxRegion(const CorridorBox &box, const float lower[3], const float upper[3], F f) const
+    {
+        if(lower[0] > upper[0] || lower[1] > upper[1] || lower[2] > upper[2]){
+            return true;
+        }
+
+
+        float x_min, x_max, y_min, y_max;
+        getCorridorBoxRegionBounds(box, lower, upper, x_min, x_max, y_min, y_max);
+
+        const int x_index_min = std::max(0, (int)ceil((x_min + map_length_half) / Geometry::resolution - 0.5f));
+        const int x_index_max = std::min(Geometry::length_voxel_num - 1, (int)floor((x_max + map_length_half) / Geometry::resolution - 0.5f));
+        const int y_index_min = std::max(0, (int)ceil((y_min + map_width_half) / Geometry::resolution - 0.5f));
+        const int y_index_max = std::min(Geometry::width_voxel_num - 1, (int)floor((y_max + map_width_half) / Geometry::resolution - 0.5f));
+        const int z_index_min = std::max(0, (int)ceil((lower[2] + map_height_half) / Geometry::resolution - 0.5f));
+        const int z_index_max = std::min(Geometry::height_voxel_num - 1, (int)floor((upper[2] + map_height_half) / Geometry::resolution - 0.5f));
+
+        for(int z_index=z_index_min; z_index<=z_index_max; ++z_index){
+            const float grid_center_z = ((float)z_index + 0.5f) * Geometry::resolution - map_height_half;
+            for(int y_index=y_index_min; y_index<=y_index_max; ++y_index){
+                const float grid_center_y = ((float)y_index + 0.5f) * Geometry::resolution - map_width_half;
+                const float *risk_row = risk_map + Layout::index(0, y_index, z_index, box.time_index);
+                for(int x_index=x_index_min; x_index<=x_index_max; ++x_index){
+                    const float grid_center_x = ((float)x_index + 0.5f) * Geometry::resolution - map_length_half;
+                    float u, w;
+                    toCorridorBoxFrame(box, grid_center_x, grid_center_y, u, w);
+                    if(!f(u, w, grid_center_z, risk_row[x_index * Layout::x_stride])){
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+
+    void findNearestPoint2DOnALine(float A_x, float A_y, float B_x, float B_y, float P_x, float P_y, float &P_prime_x, float &P_prime_y) const
+    {
+        float AB_x = B_x - A_x;
+        float AB_y = B_y - A_y;
+        float AP_x = P_x - A_x;
+        float AP_y = P_y - A_y;
+        float AB_length = sqrt(AB_x*AB_x + AB_y*AB_y);
+        float AP_prime_length = (AP_x*AB_x + AP_y*AB_y) / AB_length;
 
         float scale_B = AP_prime_length / AB_length;
         P_prime_x = B_x*scale_B + A_x*(1-scale_B);
@@ -475,19 +1261,19 @@ public:
     }
 
 
-    void rotate2DVector(float v_x, float v_y, float theta, float &v_rotated_x, float &v_rotated_y)
+    void rotate2DVector(float v_x, float v_y, float theta, float &v_rotated_x, float &v_rotated_y) const
     {
         v_rotated_x = v_x*cos(theta) + v_y * sin(theta);
         v_rotated_y = -v_x*sin(theta) + v_y * cos(theta);
     }
 
 
-    float vectorNorm(float x, float y, float z){
+    float vectorNorm(float x, float y, float z) const{
         return sqrt(x*x + y*y + z*z);
     }
 
 
-    float vectorSquareNorm(float x, float y, float z){
+    float vectorSquareNorm(float x, float y, float z) const{
         return x*x + y*y + z*z;
     }
 
@@ -503,7 +1289,7 @@ public:
 //                float angle = acos(dot/vector_xe_length); //vector normal was normalized
 //                float outside_distance = vector_xe_length * sin(angle);
 //
-//                if(outside_distance > VOXEL_RESOLUTION){
+//                if(outside_distance > Geometry::resolution){
 //                    return false;
 //                }
 //            }
@@ -514,7 +1300,41 @@ public:
         return true;
     }
 
-    void expandEnvelope(RectangleEnvelope &envelope, RectangleEnvelope &envelope_expanded, vector<float> &searching_dists)
+    static void getEnvelopePlanes(const RectangleEnvelope &envelope, RectangleEnvelopePlanes &planes)
+    {
+        for(int k=0; k<6; ++k){
+            planes.point_x[k] = envelope.surfaces[k].point.x;
+            planes.point_y[k] = envelope.surfaces[k].point.y;
+            planes.point_z[k] = envelope.surfaces[k].point.z;
+            planes.normal_x[k] = envelope.surfaces[k].normal.x;
+            planes.normal_y[k] = envelope.surfaces[k].normal.y;
+            planes.normal_z[k] = envelope.surfaces[k].normal.z;
+        }
+    }
+
+
+    /// Same test as ifPointInEnvelope() for num points starting from (x_start, y, z) with a step of Geometry::resolution
+    /// along x. inside[i] is set to 1 if the point i is inside. The y and z terms are constant along the row, so the
+    /// loop over the points is branch free and vectorized by the compiler.
+    static void ifRowInEnvelope(const RectangleEnvelopePlanes &planes, float x_start, float y, float z, int num, unsigned char *inside)
+    {
+        float yz_dot[6];
+        for(int k=0; k<6; ++k){
+            yz_dot[k] = (y - planes.point_y[k])*planes.normal_y[k] + (z - planes.point_z[k])*planes.normal_z[k];
+        }
+
+        for(int i=0; i<num; ++i){
+            const float x = x_start + Geometry::resolution * (float)i;
+            bool inside_this = true;
+            for(int k=0; k<6; ++k){
+                inside_this &= (x - planes.point_x[k])*planes.normal_x[k] + yz_dot[k] <= 0.f;
+            }
+            inside[i] = inside_this;
+        }
+    }
+
+
+    void expandEnvelope(const RectangleEnvelope &envelope, RectangleEnvelope &envelope_expanded, const std::array<float, 6> &searching_dists) const
     {
         /// searching_directions[6]: [x_position, x_negative, y_position, y_negative, z_position, z_negative]
 
@@ -528,9 +1348,10 @@ public:
             theta = atan2(envelope.vertexes[0].y-envelope.vertexes[2].y, envelope.vertexes[0].x-envelope.vertexes[2].x);
         }
 
-        for(auto &v : envelope.vertexes)
+        for(int i=0; i<8; ++i)
         {
-            Point3D new_v;
+            const Point3D &v = envelope.vertexes[i];
+            Point3D &new_v = envelope_expanded.vertexes[i];
             float v_rotated_x, v_rotated_y;
             rotate2DVector(v.x-center_x, v.y-center_y, theta, v_rotated_x, v_rotated_y);
 
@@ -555,8 +1376,6 @@ public:
             }else{
                 new_v.z = v.z - searching_dists[5];
             }
-
-            envelope_expanded.vertexes.push_back(new_v);
         }
 
         envelope_expanded.surfaces = envelope.surfaces;
@@ -571,17 +1390,71 @@ public:
         envelope_expanded.time_stamp_end = envelope.time_stamp_end;
     }
 
-    bool findRectangleEnvelope(Node *current_node, float ax, float ay, float az, float t, RectangleEnvelope &envelope)
+    /// Find the lowest and the highest point of the primitive. A and B are the start and end point in XY.
+    void findZMinAndMaxPoints(const Node *current_node, float A_x, float A_y, float B_x, float B_y, float ax, float ay, float az, float t,
+                              Point3D &z_min_point, Point3D &z_max_point) const
+    {
+        float A_z = current_node->z;
+        float B_z = A_z + current_node->vz*t + 0.5f*az*t*t;
+
+        float z_potential_min_max_P_x = A_x;
+        float z_potential_min_max_P_y = A_y;
+        float z_potential_min_max_P_z = A_z;
+        if(fabs(az) > 0.0001f){
+            float t_vz_zero = -current_node->vz / az;
+            if(t_vz_zero > 0.f && t_vz_zero < t)
+            {
+                z_potential_min_max_P_z = A_z + current_node->vz*t_vz_zero + 0.5f*az*t_vz_zero*t_vz_zero;
+                z_potential_min_max_P_x = A_x + current_node->vx*t_vz_zero + 0.5f*ax*t_vz_zero*t_vz_zero;
+                z_potential_min_max_P_y = A_y + current_node->vy*t_vz_zero + 0.5f*ay*t_vz_zero*t_vz_zero;
+            }
+        }
+
+        z_min_point.x = z_potential_min_max_P_x;
+        z_min_point.y = z_potential_min_max_P_y;
+        z_min_point.z = z_potential_min_max_P_z;
+        z_max_point.x = z_potential_min_max_P_x;
+        z_max_point.y = z_potential_min_max_P_y;
+        z_max_point.z = z_potential_min_max_P_z;
+
+        if(A_z < z_min_point.z){
+            z_min_point.x = A_x;
+            z_min_point.y = A_y;
+            z_min_point.z = A_z;
+        }
+        if(B_z < z_min_point.z){
+            z_min_point.x = B_x;
+            z_min_point.y = B_y;
+            z_min_point.z = B_z;
+        }
+
+        if(A_z > z_max_point.z){
+            z_max_point.x = A_x;
+            z_max_point.y = A_y;
+            z_max_point.z = A_z;
+        }
+        if(B_z > z_max_point.z){
+            z_max_point.x = B_x;
+            z_max_point.y = B_y;
+            z_max_point.z = B_z;
+        }
+
+        if(z_max_point.z - z_min_point.z < 0.05f) // fix the bug when z_min_point.z == z_max_point.z
+        {
+            z_max_point.z += 0.05f;
+            z_min_point.z -= 0.05f;
+        }
+    }
+
+    bool findRectangleEnvelope(Node *current_node, float ax, float ay, float az, float t, RectangleEnvelope &envelope) const
     {
-        float A_x, A_y, A_z, B_x, B_y, B_z, P_x, P_y, P_prime_x, P_prime_y;
+        float A_x, A_y, B_x, B_y, P_x, P_y, P_prime_x, P_prime_y;
         float A_prime_x, A_prime_y, B_prime_x, B_prime_y;
 
         A_x = current_node->x;
         A_y = current_node->y;
-        A_z = current_node->z;
         B_x = A_x + current_node->vx*t + 0.5f*ax*t*t;
         B_y = A_y + current_node->vy*t + 0.5f*ay*t*t;
-        B_z = A_z + current_node->vz*t + 0.5f*az*t*t;
 
         float tp = 0.5f*t;
         P_x = A_x + current_node->vx*tp + 0.5f*ax*tp*tp;
@@ -655,166 +1528,445 @@ public:
 
 
         /// Find min z and max z
-        float z_potential_min_max_P_x = A_x;
-        float z_potential_min_max_P_y = A_y;
-        float z_potential_min_max_P_z = A_z;
-        if(fabs(az) > 0.0001f){
-            float t_vz_zero = -current_node->vz / az;
-            if(t_vz_zero > 0.f && t_vz_zero < t)
-            {
-                z_potential_min_max_P_z = A_z + current_node->vz*t_vz_zero + 0.5f*az*t_vz_zero*t_vz_zero;
-                z_potential_min_max_P_x = A_x + current_node->vx*t_vz_zero + 0.5f*ax*t_vz_zero*t_vz_zero;
-                z_potential_min_max_P_y = A_y + current_node->vy*t_vz_zero + 0.5f*ay*t_vz_zero*t_vz_zero;
-            }
+        Point3D z_min_point, z_max_point;
+        findZMinAndMaxPoints(current_node, A_x, A_y, B_x, B_y, ax, ay, az, t, z_min_point, z_max_point);
+
+        // Set surfaces
+        Plane3D p1;
+        p1.point.x = A_x; p1.point.y = A_y; p1.point.z = 0.f;
+        p1.normal.x = P_prime_x - P_x; p1.normal.y = P_prime_y - P_y; p1.normal.z = 0.f;
+        float norm_length1 = vectorNorm(p1.normal.x, p1.normal.y, p1.normal.z);
+        p1.normal.x /= norm_length1;  p1.normal.y /= norm_length1; p1.normal.z /= norm_length1;
+        envelope.surfaces[0] = p1;
+
+        Plane3D p2;
+        p2.point.x = B_x; p2.point.y = B_y; p2.point.z = 0.f;
+        p2.normal.x = B_x - A_x; p2.normal.y = B_y - A_y; p2.normal.z = 0.f;
+        float norm_length2 = vectorNorm(p2.normal.x, p2.normal.y, p2.normal.z);
+        p2.normal.x /= norm_length2;  p2.normal.y /= norm_length2; p2.normal.z /= norm_length2;
+        envelope.surfaces[1] = p2;
+
+        Plane3D p3;
+        p3.point.x = B_prime_x;  p3.point.y = B_prime_y; p3.point.z = 0.f;
+        p3.normal.x = P_x - P_prime_x; p3.normal.y = P_y - P_prime_y; p3.normal.z = 0.f;
+        float norm_length3 = vectorNorm(p3.normal.x, p3.normal.y, p3.normal.z);
+        p3.normal.x /= norm_length3;  p3.normal.y /= norm_length3; p3.normal.z /= norm_length3;
+        envelope.surfaces[2] = p3;
+
+        Plane3D p4;
+        p4.point.x = A_prime_x;  p4.point.y = A_prime_y;  p4.point.z = 0.f;
+        p4.normal.x = A_x - B_x; p4.normal.y = A_y - B_y; p4.normal.z= 0.f;
+        float norm_length4 = vectorNorm(p4.normal.x, p4.normal.y, p4.normal.z);
+        p4.normal.x /= norm_length4;  p4.normal.y /= norm_length4; p4.normal.z /= norm_length4;
+        envelope.surfaces[3] = p4;
+
+        Plane3D p5;
+        p5.point.x = z_min_point.x; p5.point.y = z_min_point.y; p5.point.z = z_min_point.z;
+        p5.normal.x = 0.f; p5.normal.y = 0.f; p5.normal.z = -1.f;
+        float norm_length5 = vectorNorm(p5.normal.x, p5.normal.y, p5.normal.z);
+        p5.normal.x /= norm_length5;  p5.normal.y /= norm_length5; p5.normal.z /= norm_length5;
+        envelope.surfaces[4] = p5;
+
+        Plane3D p6;
+        p6.point.x = z_max_point.x; p6.point.y = z_max_point.y; p6.point.z = z_max_point.z;
+        p6.normal.x = 0.f; p6.normal.y = 0.f; p6.normal.z = 1.f;
+        float norm_length6 = vectorNorm(p6.normal.x, p6.normal.y, p6.normal.z);
+        p6.normal.x /= norm_length6;  p6.normal.y /= norm_length6; p6.normal.z /= norm_length6;
+        envelope.surfaces[5] = p6;
+
+        // Set vertexes
+        Point3D v1, v2;
+        v1.x = v2.x = A_x;  v1.y = v2.y = A_y; v1.z = z_max_point.z; v2.z = z_min_point.z;
+        envelope.vertexes[0] = v1;
+        envelope.vertexes[1] = v2;
+
+        Point3D v3, v4;
+        v3.x = v4.x = B_x;  v3.y = v4.y = B_y; v3.z = z_max_point.z; v4.z = z_min_point.z;
+        envelope.vertexes[2] = v3;
+        envelope.vertexes[3] = v4;
+
+        Point3D v5, v6;
+        v5.x = v6.x = B_prime_x;  v5.y = v6.y = B_prime_y; v5.z = z_max_point.z; v6.z = z_min_point.z;
+        envelope.vertexes[4] = v5;
+        envelope.vertexes[5] = v6;
+
+        Point3D v7, v8;
+        v7.x = v8.x = A_prime_x;  v7.y = v8.y = A_prime_y; v7.z = z_max_point.z; v8.z = z_min_point.z;
+        envelope.vertexes[6] = v7;
+        envelope.vertexes[7] = v8;
+
+        return true;
+    }
+
+
+private:
+    /// Build the tables that the searches share. Runs before the searches, so they only read the tables.
+    void prepareSearches(float *risk_map_in, float safety_distance_this)
+    {
+        if(risk_table_dirty || risk_map_in != risk_map){
+            updateRiskMap(risk_map_in);
         }
 
-        Point3D z_min_point, z_max_point;
-        z_min_point.x = z_potential_min_max_P_x;
-        z_min_point.y = z_potential_min_max_P_y;
-        z_min_point.z = z_potential_min_max_P_z;
-        z_max_point.x = z_potential_min_max_P_x;
-        z_max_point.y = z_potential_min_max_P_y;
-        z_max_point.z = z_potential_min_max_P_z;
+        if(use_primitive_table && (primitive_table_dirty || primitive_table_safety_distance != safety_distance_this)){
+            buildPrimitiveTable(safety_distance_this);
+        }
+    }
 
-        if(A_z < z_min_point.z){
-            z_min_point.x = A_x;
-            z_min_point.y = A_y;
-            z_min_point.z = A_z;
+
+    /// Search with a context whose query is set. Only writes the context.
+    SearchStopReason runQuery(SearchContext &context, Node* start_p_v_set, Node* end_pos_set, bool use_expansion_threads, vector<Node*> &result)
+    {
+        /// Anytime mode: when the deadline is reached, return the path to the node that is closest to the goal or to
+        /// the boundary among the expanded nodes.
+        const bool use_deadline = max_search_time > 0.f;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(max_search_time));
+
+        /// Warm start: continue the surviving part of the last path. If the open list runs empty before the goal or the
+        /// boundary, the seed led into a dead end, so search again from scratch with the steps that are left. Both
+        /// searches share max_search_steps.
+        context.last_search_warm_started = false;
+        context.last_search_steps = 0;
+        context.last_envelope_checks = 0;
+        context.last_envelope_voxel_checks = 0;
+        if(use_warm_start){
+            resetSearch(context, start_p_v_set, end_pos_set);
+            if(!checkNodeValid(context.start_node)){
+                return invalidStart(context);
+            }
+
+            Node *seed_node = seedFromWarmStartPath(context);
+            if(seed_node){
+                runSearch(context, seed_node, max_search_steps, use_deadline, deadline, use_expansion_threads, result);
+                if(context.last_stop_reason != SearchStopReason::EXHAUSTED){
+                    context.last_search_warm_started = true;
+                    storeWarmStartPath(context);
+                    return context.last_stop_reason;
+                }
+                result.clear();
+            }
         }
-        if(B_z < z_min_point.z){
-            z_min_point.x = B_x;
-            z_min_point.y = B_y;
-            z_min_point.z = B_z;
+
+        resetSearch(context, start_p_v_set, end_pos_set);
+        if(!checkNodeValid(context.start_node)){
+            return invalidStart(context);
         }
 
-        if(A_z > z_max_point.z){
-            z_max_point.x = A_x;
-            z_max_point.y = A_y;
-            z_max_point.z = A_z;
+        context.start_node->f = 0.f;
+        context.start_node->time_stamp = 0.f;
+        context.open_list.push(context.start_node);
+        addToNodeIndex(context, context.start_node);
+
+        runSearch(context, context.start_node, max_search_steps - context.last_search_steps, use_deadline, deadline, use_expansion_threads, result);
+        storeWarmStartPath(context);
+        return context.last_stop_reason;
+    }
+
+
+    void resetSearch(SearchContext &context, Node* start_p_v_set, Node* end_pos_set) const
+    {
+        context.open_list.clear();
+        context.close_list.clear();
+        context.node_index.clear();
+        context.result_path.clear();
+        context.result_path_reversed.clear();
+        context.searched_point_vector.clear();
+        context.node_pool.reset();
+        context.corridor_pool.reset();
+
+        Node *start_node = context.start_node = context.node_pool.create(*start_p_v_set);
+        context.end_node = context.node_pool.create(*end_pos_set);
+        start_node->heap_index = -1;
+        start_node->next_in_voxel = nullptr;
+        start_node->father = nullptr;
+        start_node->coding_index = getCodingIndex(start_node->x, start_node->y, start_node->z, start_node->vx, start_node->vy, start_node->vz);
+        context.end_node->coding_index = 88888888;
+    }
+
+
+    /// Reported by the stop reason only, since it can happen every cycle while the start stays outside the map
+    static SearchStopReason invalidStart(SearchContext &context)
+    {
+        context.last_stop_reason = SearchStopReason::INVALID_START;
+        return context.last_stop_reason;
+    }
+
+
+    /// Expand from the open list until the goal, the boundary or a limit is reached. root_node is the deepest node
+    /// already in the open list. max_steps: nodes to expand at most.
+    void runSearch(SearchContext &context, Node* root_node, int max_steps, bool use_deadline, std::chrono::steady_clock::time_point deadline,
+                   bool use_expansion_threads, vector<Node*> &result) const
+    {
+        Node* current_node;
+        int step_counter = 0;
+
+        Node* best_node = root_node;
+        float best_node_progress = getSearchProgress(context, root_node);
+
+        context.last_stop_reason = SearchStopReason::EXHAUSTED;
+        NodeHeap &open_list = context.open_list;
+
+        while (!open_list.empty()){
+            step_counter += 1;
+
+            current_node = open_list.top();
+
+            const bool reached_goal = nodeEqual(current_node, context.end_node);
+            const bool reached_boundary = checkNodeOnBoundary(current_node, boundary_width);
+            const bool reached_deadline = use_deadline && std::chrono::steady_clock::now() > deadline;
+
+            if(reached_goal || reached_boundary || step_counter > max_steps || reached_deadline){
+                Node* path_end_node = current_node;
+                if(reached_goal){
+                    context.last_stop_reason = SearchStopReason::GOAL;
+                }else if(reached_boundary){
+                    context.last_stop_reason = SearchStopReason::BOUNDARY;
+                }else if(step_counter > max_steps){
+                    context.last_stop_reason = SearchStopReason::STEP_LIMIT;
+                }else{
+                    context.last_stop_reason = SearchStopReason::DEADLINE;
+                    if(getSearchProgress(context, current_node) >= best_node_progress){
+                        path_end_node = best_node;
+                    }
+                }
+
+                // Reached goal or boundary
+                addPath(context, path_end_node);
+
+                // Reverse and Print
+                for(int i=(int)context.result_path.size()-1; i>0; --i){
+                    auto p = context.result_path[i];
+                    context.result_path_reversed.push_back(p);
+//                    std::cout << "(" << p->x << ", " << p->y << ", " << p->z << ")" << std::endl;
+                }
+
+                result = context.result_path_reversed;
+                break;
+            }
+
+            // The node is moved to the close list before expanding, so successors that fall on it are discarded.
+            open_list.pop();
+            context.close_list.push_back(current_node);
+
+            if(use_deadline){
+                const float progress = getSearchProgress(context, current_node);
+                if(progress < best_node_progress){
+                    best_node_progress = progress;
+                    best_node = current_node;
+                }
+            }
+
+            nextStep(context, current_node, use_expansion_threads);
         }
-        if(B_z > z_max_point.z){
-            z_max_point.x = B_x;
-            z_max_point.y = B_y;
-            z_max_point.z = B_z;
+        context.last_search_steps += step_counter;
+    }
+
+
+    /// Keep the path of the last search in the map-independent frame, with the acceleration sample of each step
+    void storeWarmStartPath(SearchContext &context) const
+    {
+        context.warm_start_path.clear();
+        if(!use_warm_start || context.result_path.size() < 2){
+            return;
         }
 
-        if(z_max_point.z - z_min_point.z < 0.05f) // fix the bug when z_min_point.z == z_max_point.z
-        {
-            z_max_point.z += 0.05f;
-            z_min_point.z -= 0.05f;
+        const int ny = (int)a_sample_vector_y.size();
+        const int nz = (int)a_sample_vector_z.size();
+        for(int i=(int)context.result_path.size()-1; i>=0; --i){
+            const Node *node = context.result_path[i];
+            typename SearchContext::WarmStartNode w;
+            w.x = node->x + context.map_center_x;
+            w.y = node->y + context.map_center_y;
+            w.z = node->z + context.map_center_z;
+            w.vx = node->vx;
+            w.vy = node->vy;
+            w.vz = node->vz;
+            w.sample_seq = -1;
+            if(node->father){
+                const int ax_seq = nearestSample(a_sample_vector_x, (node->vx - node->father->vx) / time_step_node);
+                const int ay_seq = nearestSample(a_sample_vector_y, (node->vy - node->father->vy) / time_step_node);
+                const int az_seq = nearestSample(a_sample_vector_z, (node->vz - node->father->vz) / time_step_node);
+                w.sample_seq = (ax_seq * ny + ay_seq) * nz + az_seq;
+            }
+            context.warm_start_path.push_back(w);
         }
+    }
 
-        // Set surfaces
-        Plane3D p1;
-        p1.point.x = A_x; p1.point.y = A_y; p1.point.z = 0.f;
-        p1.normal.x = P_prime_x - P_x; p1.normal.y = P_prime_y - P_y; p1.normal.z = 0.f;
-        float norm_length1 = vectorNorm(p1.normal.x, p1.normal.y, p1.normal.z);
-        p1.normal.x /= norm_length1;  p1.normal.y /= norm_length1; p1.normal.z /= norm_length1;
-        envelope.surfaces.push_back(p1);
 
-        Plane3D p2;
-        p2.point.x = B_x; p2.point.y = B_y; p2.point.z = 0.f;
-        p2.normal.x = B_x - A_x; p2.normal.y = B_y - A_y; p2.normal.z = 0.f;
-        float norm_length2 = vectorNorm(p2.normal.x, p2.normal.y, p2.normal.z);
-        p2.normal.x /= norm_length2;  p2.normal.y /= norm_length2; p2.normal.z /= norm_length2;
-        envelope.surfaces.push_back(p2);
+    static int nearestSample(const vector<float> &samples, float value)
+    {
+        int nearest = 0;
+        for(int i=1; i<(int)samples.size(); ++i){
+            if(fabs(samples[i] - value) < fabs(samples[nearest] - value)){
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
 
-        Plane3D p3;
-        p3.point.x = B_prime_x;  p3.point.y = B_prime_y; p3.point.z = 0.f;
-        p3.normal.x = P_x - P_prime_x; p3.normal.y = P_y - P_prime_y; p3.normal.z = 0.f;
-        float norm_length3 = vectorNorm(p3.normal.x, p3.normal.y, p3.normal.z);
-        p3.normal.x /= norm_length3;  p3.normal.y /= norm_length3; p3.normal.z /= norm_length3;
-        envelope.surfaces.push_back(p3);
 
-        Plane3D p4;
-        p4.point.x = A_prime_x;  p4.point.y = A_prime_y;  p4.point.z = 0.f;
-        p4.normal.x = A_x - B_x; p4.normal.y = A_y - B_y; p4.normal.z= 0.f;
-        float norm_length4 = vectorNorm(p4.normal.x, p4.normal.y, p4.normal.z);
-        p4.normal.x /= norm_length4;  p4.normal.y /= norm_length4; p4.normal.z /= norm_length4;
-        envelope.surfaces.push_back(p4);
+    /// Rebuild the rest of the last path from the start node. Returns the deepest rebuilt node, which is put in the
+    /// open list while the nodes before it are closed, or nullptr if no step of the last path can be reused.
+    Node* seedFromWarmStartPath(SearchContext &context) const
+    {
+        const auto &warm_start_path = context.warm_start_path;
+        if(warm_start_path.size() < 2){
+            return nullptr;
+        }
 
-        Plane3D p5;
-        p5.point.x = z_min_point.x; p5.point.y = z_min_point.y; p5.point.z = z_min_point.z;
-        p5.normal.x = 0.f; p5.normal.y = 0.f; p5.normal.z = -1.f;
-        float norm_length5 = vectorNorm(p5.normal.x, p5.normal.y, p5.normal.z);
-        p5.normal.x /= norm_length5;  p5.normal.y /= norm_length5; p5.normal.z /= norm_length5;
-        envelope.surfaces.push_back(p5);
+        Node *start_node = context.start_node;
+        const float start_x = start_node->x + context.map_center_x;
+        const float start_y = start_node->y + context.map_center_y;
+        const float start_z = start_node->z + context.map_center_z;
+
+        int nearest = -1;
+        float nearest_distance = warm_start_position_tolerance;
+        for(int i=0; i+1<(int)warm_start_path.size(); ++i){
+            const auto &w = warm_start_path[i];
+            const float distance = sqrtf((w.x - start_x)*(w.x - start_x) + (w.y - start_y)*(w.y - start_y) + (w.z - start_z)*(w.z - start_z));
+            const float velocity_difference = sqrtf((w.vx - start_node->vx)*(w.vx - start_node->vx) + (w.vy - start_node->vy)*(w.vy - start_node->vy)
+                                                    + (w.vz - start_node->vz)*(w.vz - start_node->vz));
+            if(distance <= nearest_distance && velocity_difference <= warm_start_velocity_tolerance){
+                nearest = i;
+                nearest_distance = distance;
+            }
+        }
+        if(nearest < 0){
+            return nullptr;
+        }
 
-        Plane3D p6;
-        p6.point.x = z_max_point.x; p6.point.y = z_max_point.y; p6.point.z = z_max_point.z;
-        p6.normal.x = 0.f; p6.normal.y = 0.f; p6.normal.z = 1.f;
-        float norm_length6 = vectorNorm(p6.normal.x, p6.normal.y, p6.normal.z);
-        p6.normal.x /= norm_length6;  p6.normal.y /= norm_length6; p6.normal.z /= norm_length6;
-        envelope.surfaces.push_back(p6);
+        start_node->f = 0.f;
+        start_node->time_stamp = 0.f;
+        addToNodeIndex(context, start_node);
 
-        // Set vertexes
-        Point3D v1, v2;
-        v1.x = v2.x = A_x;  v1.y = v2.y = A_y; v1.z = z_max_point.z; v2.z = z_min_point.z;
-        envelope.vertexes.push_back(v1);
-        envelope.vertexes.push_back(v2);
+        Node *father = start_node;
+        for(int i=nearest+1; i<(int)warm_start_path.size(); ++i){
+            SuccessorCandidate candidate;
+            evaluateSuccessor(context, father, warm_start_path[i].sample_seq, candidate);
+            if(!candidate.safe){
+                break;
+            }
 
-        Point3D v3, v4;
-        v3.x = v4.x = B_x;  v3.y = v4.y = B_y; v3.z = z_max_point.z; v4.z = z_min_point.z;
-        envelope.vertexes.push_back(v3);
-        envelope.vertexes.push_back(v4);
+            const TrajPoint &p = candidate.endpoint;
+            const long int coding_index = getCodingIndex(p.x, p.y, p.z, p.vx, p.vy, p.vz);
+            if(use_hashed_node_index && findInNodeIndex(context, coding_index)){
+                break;
+            }
 
-        Point3D v5, v6;
-        v5.x = v6.x = B_prime_x;  v5.y = v6.y = B_prime_y; v5.z = z_max_point.z; v6.z = z_min_point.z;
-        envelope.vertexes.push_back(v5);
-        envelope.vertexes.push_back(v6);
+            Node *node = context.node_pool.create(father->time_stamp + time_step_node, p.x, p.y, p.z, p.vx, p.vy, p.vz, father, candidate.envelope);
+            node->coding_index = coding_index;
+            calculateGHF(node, context.end_node, candidate.weight);
+            addToNodeIndex(context, node);
+            context.close_list.push_back(father);
+            father = node;
+        }
 
-        Point3D v7, v8;
-        v7.x = v8.x = A_prime_x;  v7.y = v8.y = A_prime_y; v7.z = z_max_point.z; v8.z = z_min_point.z;
-        envelope.vertexes.push_back(v7);
-        envelope.vertexes.push_back(v8);
+        if(father == start_node){
+            return nullptr;
+        }
 
-        return true;
+        context.open_list.push(father);
+        return father;
     }
 
 
-private:
-    void nextStep(Node* current_node)
+    void nextStep(SearchContext &context, Node* current_node, bool use_expansion_threads) const
     {
-        // Sample primitives
-        for(auto const &ax : a_sample_vector_x){
-            for(auto const &ay : a_sample_vector_y){
-                for(auto const &az : a_sample_vector_z){
+        // Sample primitives. The risk checks of the samples are independent, so they can run on the thread pool.
+        const int sample_num = (int)(a_sample_vector_x.size() * a_sample_vector_y.size() * a_sample_vector_z.size());
+        vector<SuccessorCandidate> &successor_candidates = context.successor_candidates;
+        successor_candidates.resize(sample_num);
+
+        if(expansion_thread_pool && use_expansion_threads){
+            expansion_thread_pool->parallelFor(sample_num, [&](int sample_seq){
+                evaluateSuccessor(context, current_node, sample_seq, successor_candidates[sample_seq]);
+            });
+        }else{
+            for(int sample_seq=0; sample_seq<sample_num; ++sample_seq){
+                evaluateSuccessor(context, current_node, sample_seq, successor_candidates[sample_seq]);
+            }
+        }
 
-                    if(fabs(ax)+fabs(ay)+fabs(current_node->vx)+fabs(current_node->vy) < 0.01f)
-                    {
-                        // Avoid freezing
-                        continue;
-                    }
+        // Merge in the sample order so the result does not depend on the number of threads
+        for(auto &candidate : successor_candidates){
+            if(candidate.envelope_checked){
+                ++ context.last_envelope_checks;
+                context.last_envelope_voxel_checks += candidate.envelope_voxel_checks;
+            }
+            if(record_searched_points && candidate.endpoint_computed){
+                context.searched_point_vector.push_back(candidate.endpoint);
+            }
+            if(candidate.safe){
+                checkPoint(context, candidate.endpoint.x, candidate.endpoint.y, candidate.endpoint.z,
+                           candidate.endpoint.vx, candidate.endpoint.vy, candidate.endpoint.vz,
+                           current_node, candidate.weight, candidate.envelope);
+            }
+        }
+    }
 
-                    TrajPoint primitive_this_endpoint;
-                    RectangleEnvelope envelope_this;
 
-                    if(!getMotionPrimitive(current_node, ax, ay, az, primitive_this_endpoint, envelope_this))
-                    {
-                        continue;
-                    }
+    /// Generate the primitive of one acceleration sample and check it. Only reads the planner and the context and writes
+    /// the candidate, so it can run on any thread.
+    void evaluateSuccessor(const SearchContext &context, Node* current_node, int sample_seq, SuccessorCandidate &candidate) const
+    {
+        candidate.endpoint_computed = false;
+        candidate.safe = false;
+        candidate.envelope_checked = false;
+        candidate.envelope_voxel_checks = 0;
+
+        const int az_seq = sample_seq % (int)a_sample_vector_z.size();
+        const int ay_seq = (sample_seq / (int)a_sample_vector_z.size()) % (int)a_sample_vector_y.size();
+        const int ax_seq = sample_seq / (int)(a_sample_vector_z.size() * a_sample_vector_y.size());
+        const float ax = a_sample_vector_x[ax_seq];
+        const float ay = a_sample_vector_y[ay_seq];
+        const float az = a_sample_vector_z[az_seq];
+
+        if(fabs(ax)+fabs(ay)+fabs(current_node->vx)+fabs(current_node->vy) < 0.01f)
+        {
+            // Avoid freezing
+            return;
+        }
+
+        TrajPoint &primitive_this_endpoint = candidate.endpoint;
+        const bool primitive_valid = getMotionPrimitive(context, current_node, ax_seq, ay_seq, az, primitive_this_endpoint, candidate.envelope);
+        candidate.endpoint_computed = true;
+        if(!primitive_valid)
+        {
+            return;
+        }
 
 
-                    static const float lambda = 0.01;
-                    float weight = lambda*(ax*ax + ay*ay + az*az) + time_step_node; // To add on g
+        static const float lambda = 0.01;
+        float weight = lambda*(ax*ax + ay*ay + az*az) + time_step_node; // To add on g
 //                    float weight = time_step_node * 1.f;
 
-                    // Consider direction change for the first step
-                    if(current_node->time_stamp < 0.01f && fabs(reference_direction_angle) < M_PIf32){
-                        weight += 0.1f * fabs(reference_direction_angle - atan2(primitive_this_endpoint.y - current_node->y,primitive_this_endpoint.x - current_node->x));
-                    }
-
-                    checkPoint(primitive_this_endpoint.x, primitive_this_endpoint.y, primitive_this_endpoint.z,
-                               primitive_this_endpoint.vx, primitive_this_endpoint.vy, primitive_this_endpoint.vz,
-                               current_node, weight, envelope_this);
-                }
-            }
+        // Consider direction change for the first step
+        if(current_node->time_stamp < 0.01f && fabs(context.reference_direction_angle) < M_PIf32){
+            weight += 0.1f * fabs(context.reference_direction_angle - atan2(primitive_this_endpoint.y - current_node->y,primitive_this_endpoint.x - current_node->x));
         }
+        candidate.weight = weight;
+
+        if (!checkNodeValid(primitive_this_endpoint.x, primitive_this_endpoint.y, primitive_this_endpoint.z,
+                            primitive_this_endpoint.vx, primitive_this_endpoint.vy, primitive_this_endpoint.vz))
+            return;
+
+//        std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
+        candidate.envelope_checked = true;
+        if (!checkIfEnvelopeSafe(context, candidate.envelope, risk_limitation_motion_primitive, risk_limitation_single_voxel, &candidate.envelope_voxel_checks))
+            return;
+//        std::chrono::high_resolution_clock::time_point toc = std::chrono::high_resolution_clock::now();
+//        std::cout << "Check: "
+//                  << 1.0e-3 * std::chrono::duration_cast<std::chrono::microseconds>(toc - tic).count()
+//                  << "ms" << std::endl;
 
+        candidate.safe = true;
     }
 
 
-    bool getMotionPrimitive(Node *current_node, float ax, float ay, float az, TrajPoint &primitive_end_point, RectangleEnvelope &envelope){
+    bool getMotionPrimitive(const SearchContext &context, Node *current_node, int ax_seq, int ay_seq, float az, TrajPoint &primitive_end_point,
+                            RectangleEnvelope &envelope) const
+    {
+        const float ax = a_sample_vector_x[ax_seq];
+        const float ay = a_sample_vector_y[ay_seq];
 
         primitive_end_point.vx = current_node->vx + ax * time_step_node;
         primitive_end_point.vy = current_node->vy + ay * time_step_node;
@@ -823,22 +1975,25 @@ private:
         primitive_end_point.y = current_node->y + current_node->vy*time_step_node + 0.5f*ay*time_step_node*time_step_node;
         primitive_end_point.z = current_node->z + current_node->vz*time_step_node + 0.5f*az*time_step_node*time_step_node;
 
-        searched_point_vector.push_back(primitive_end_point);
-
         if(fabs(primitive_end_point.x - current_node->x) + fabs(primitive_end_point.y - current_node->y) + fabs(primitive_end_point.z - current_node->z)< 0.01){
             return false;
         }
 
-        /// Calculate rectangle envelope
-        RectangleEnvelope envelope_ori;
-        if(!findRectangleEnvelope(current_node, ax, ay, az, time_step_node, envelope_ori)){
-            return false;
-        }
+        if(!use_primitive_table || primitive_table_safety_distance != context.safety_distance
+           || !getEnvelopeFromPrimitiveTable(context, current_node, ax_seq, ay_seq, az, envelope))
+        {
+            /// Calculate rectangle envelope
+            RectangleEnvelope envelope_ori;
+            if(!findRectangleEnvelope(current_node, ax, ay, az, time_step_node, envelope_ori)){
+                return false;
+            }
 
-        /// Expand by a safety distance
-        static const float half_safety_distance_for_z = safety_distance * 0.5f;
-        static vector<float> primitive_envelope_expand_distance = {safety_distance, 0, safety_distance, safety_distance, half_safety_distance_for_z, half_safety_distance_for_z};
-        expandEnvelope(envelope_ori, envelope, primitive_envelope_expand_distance); //VOXEL_RESOLUTION
+            /// Expand by a safety distance
+            const float safety_distance = context.safety_distance;
+            const float half_safety_distance_for_z = safety_distance * 0.5f;
+            std::array<float, 6> primitive_envelope_expand_distance = {safety_distance, 0, safety_distance, safety_distance, half_safety_distance_for_z, half_safety_distance_for_z};
+            expandEnvelope(envelope_ori, envelope, primitive_envelope_expand_distance); //Geometry::resolution
+        }
 
         envelope.time_stamp_start = current_node->time_stamp;
         envelope.time_stamp_end = envelope.time_stamp_start + time_step_node;
@@ -847,6 +2002,115 @@ private:
     }
 
 
+    /// The XY shape of a primitive only depends on the start velocity, the acceleration and time_step_node. The shapes
+    /// of all acceleration samples are precomputed on a grid of XY start velocities. Each shape is expanded by the
+    /// safety distance and the largest offset caused by rounding the velocity to the grid, so it still contains the
+    /// real primitive. The z range is cheap and is computed exactly.
+    void buildPrimitiveTable(float safety_distance)
+    {
+        primitive_table_velocity_half_num = (int)ceil(v_max_xy / primitive_table_velocity_resolution);
+        const int velocity_num = 2 * primitive_table_velocity_half_num + 1;
+        const int ax_num = (int)a_sample_vector_x.size();
+        const int ay_num = (int)a_sample_vector_y.size();
+
+        primitive_table.assign((size_t)velocity_num * velocity_num * ax_num * ay_num, PrimitiveShape());
+
+        const float rounding_margin = 0.5f * primitive_table_velocity_resolution * time_step_node * sqrtf(2.f);
+        std::array<float, 6> expand_distance = {safety_distance + rounding_margin, rounding_margin, safety_distance + rounding_margin,
+                                         safety_distance + rounding_margin, 0.f, 0.f};
+
+        for(int vx_seq=0; vx_seq<velocity_num; ++vx_seq){
+            for(int vy_seq=0; vy_seq<velocity_num; ++vy_seq){
+                Node start(0.f, 0.f, 0.f, 0.f, (float)(vx_seq - primitive_table_velocity_half_num) * primitive_table_velocity_resolution,
+                           (float)(vy_seq - primitive_table_velocity_half_num) * primitive_table_velocity_resolution, 0.f);
+
+                for(int ax_seq=0; ax_seq<ax_num; ++ax_seq){
+                    for(int ay_seq=0; ay_seq<ay_num; ++ay_seq){
+                        RectangleEnvelope envelope_ori, envelope_expanded;
+                        if(!findRectangleEnvelope(&start, a_sample_vector_x[ax_seq], a_sample_vector_y[ay_seq], 0.f, time_step_node, envelope_ori)){
+                            continue;
+                        }
+                        expandEnvelope(envelope_ori, envelope_expanded, expand_distance);
+
+                        PrimitiveShape &shape = primitive_table[primitiveTableIndex(vx_seq, vy_seq, ax_seq, ay_seq)];
+                        for(int i=0; i<4; ++i){
+                            shape.vertex_x[i] = envelope_expanded.vertexes[2*i].x;
+                            shape.vertex_y[i] = envelope_expanded.vertexes[2*i].y;
+                            shape.normal_x[i] = envelope_expanded.surfaces[i].normal.x;
+                            shape.normal_y[i] = envelope_expanded.surfaces[i].normal.y;
+                        }
+                        shape.valid = true;
+                    }
+                }
+            }
+        }
+
+        primitive_table_safety_distance = safety_distance;
+        primitive_table_dirty = false;
+    }
+
+
+    size_t primitiveTableIndex(int vx_seq, int vy_seq, int ax_seq, int ay_seq) const
+    {
+        const int velocity_num = 2 * primitive_table_velocity_half_num + 1;
+        return (((size_t)vx_seq * velocity_num + vy_seq) * a_sample_vector_x.size() + ax_seq) * a_sample_vector_y.size() + ay_seq;
+    }
+
+
+    /// Translate a precomputed shape to the node. Returns false if the shape is not in the table.
+    bool getEnvelopeFromPrimitiveTable(const SearchContext &context, const Node *current_node, int ax_seq, int ay_seq, float az,
+                                       RectangleEnvelope &envelope) const
+    {
+        const int vx_seq = (int)lroundf(current_node->vx / primitive_table_velocity_resolution) + primitive_table_velocity_half_num;
+        const int vy_seq = (int)lroundf(current_node->vy / primitive_table_velocity_resolution) + primitive_table_velocity_half_num;
+        const int velocity_num = 2 * primitive_table_velocity_half_num + 1;
+        if(vx_seq < 0 || vx_seq >= velocity_num || vy_seq < 0 || vy_seq >= velocity_num){
+            return false;
+        }
+
+        const PrimitiveShape &shape = primitive_table[primitiveTableIndex(vx_seq, vy_seq, ax_seq, ay_seq)];
+        if(!shape.valid){
+            return false;
+        }
+
+        const float ax = a_sample_vector_x[ax_seq];
+        const float ay = a_sample_vector_y[ay_seq];
+        const float t = time_step_node;
+        const float A_x = current_node->x;
+        const float A_y = current_node->y;
+        const float B_x = A_x + current_node->vx*t + 0.5f*ax*t*t;
+        const float B_y = A_y + current_node->vy*t + 0.5f*ay*t*t;
+
+        Point3D z_min_point, z_max_point;
+        findZMinAndMaxPoints(current_node, A_x, A_y, B_x, B_y, ax, ay, az, t, z_min_point, z_max_point);
+
+        const float half_safety_distance_for_z = context.safety_distance * 0.5f;
+        z_min_point.z -= half_safety_distance_for_z;
+        z_max_point.z += half_safety_distance_for_z;
+
+        for(int i=0; i<4; ++i){
+            Point3D &v_top = envelope.vertexes[2*i];
+            Point3D &v_bottom = envelope.vertexes[2*i+1];
+            v_top.x = v_bottom.x = A_x + shape.vertex_x[i];
+            v_top.y = v_bottom.y = A_y + shape.vertex_y[i];
+            v_top.z = z_max_point.z;
+            v_bottom.z = z_min_point.z;
+
+            envelope.surfaces[i].point = v_top;
+            envelope.surfaces[i].normal.x = shape.normal_x[i];
+            envelope.surfaces[i].normal.y = shape.normal_y[i];
+            envelope.surfaces[i].normal.z = 0.f;
+        }
+
+        envelope.surfaces[4].point = z_min_point;
+        envelope.surfaces[4].normal.x = 0.f; envelope.surfaces[4].normal.y = 0.f; envelope.surfaces[4].normal.z = -1.f;
+        envelope.surfaces[5].point = z_max_point;
+        envelope.surfaces[5].normal.x = 0.f; envelope.surfaces[5].normal.y = 0.f; envelope.surfaces[5].normal.z = 1.f;
+
+        return true;
+    }
+
+
     static void setMinAndMax(float &min, float &max, float current_value)
     {
         if(min > current_value){
@@ -858,80 +2122,75 @@ private:
     }
 
 
-    void checkPoint(float x, float y, float z, float vx, float vy, float vz, Node* father,float g, RectangleEnvelope &envelope)
+    /// Add a checked successor to the open list, or re-parent the node it duplicates
+    void checkPoint(SearchContext &context, float x, float y, float z, float vx, float vy, float vz, Node* father,float g, const RectangleEnvelope &envelope) const
     {
-        if (!checkNodeValid(x, y, z, vx, vy, vz))
-            return;
-
-
-//        std::chrono::high_resolution_clock::time_point tic = std::chrono::high_resolution_clock::now();
-        if (!checkIfEnvelopeSafe(envelope, risk_limitation_motion_primitive, risk_limitation_single_voxel))
-            return;
-//        std::chrono::high_resolution_clock::time_point toc = std::chrono::high_resolution_clock::now();
-//        std::cout << "Check: "
-//                  << 1.0e-3 * std::chrono::duration_cast<std::chrono::microseconds>(toc - tic).count()
-//                  << "ms" << std::endl;
-
-        /// Coding by voxel index and velocity direction.
-//        static const int x_coding_step = MAP_WIDTH_VOXEL_NUM*MAP_HEIGHT_VOXEL_NUM*8;
-//        static const int y_coding_step = MAP_HEIGHT_VOXEL_NUM*8;
-//        static const int z_coding_step = 8;
-
-        static const int x_coding_step = MAP_WIDTH_VOXEL_NUM*MAP_HEIGHT_VOXEL_NUM;
-        static const int y_coding_step = MAP_HEIGHT_VOXEL_NUM;
-        static const int z_coding_step = 1;
-
-        long int coding_index = (int)((x + map_length_half) / VOXEL_RESOLUTION)* x_coding_step +
-                              (int)((y + map_width_half) / VOXEL_RESOLUTION)* y_coding_step +
-                              (int)((z + map_height_half) / VOXEL_RESOLUTION)* z_coding_step;
-//        int v_direction_index = 0;
-//        if(vx >= 0.f){
-//            v_direction_index += 4;
-//        }
-//        if(vy >= 0.f){
-//            v_direction_index += 2;
-//        }
-//        if(vz >= 0.f){
-//            v_direction_index += 1;
-//        }
-//        coding_index += v_direction_index;
+        long int coding_index = getCodingIndex(x, y, z, vx, vy, vz);
+
+        /// Check if contained in close list or open list
+        Node *point_found = nullptr;
+        bool found_in_close_list = false;
+        if(use_hashed_node_index){
+            point_found = findInNodeIndex(context, coding_index);
+            found_in_close_list = point_found != nullptr && !NodeHeap::contains(point_found);
+        }else{
+            found_in_close_list = findInNodeIndex(context, x, y, z, vx, vy, vz, false) != nullptr;
+            if(!found_in_close_list){
+                point_found = findInNodeIndex(context, x, y, z, vx, vy, vz, true);
+            }
+        }
 
-        /// Check if contained in close list
-        if (ifContainedInVector(&close_list, x, y, z, vx, vy, vz) != -1)
+        if (found_in_close_list)
             return;
 
-        int index;
-        if ((index = ifContainedInVector(&open_list, x, y, z, vx, vy, vz)) != -1)
+        if (point_found != nullptr)
         {
-            Node *point = open_list[index];
+            Node *point = point_found;
             if (point->g > father->f + g)
             {
                 point->father = father;
                 point->g = father->g + g;
                 point->f = point->g + point->h;
+                context.open_list.decreaseKey(point);
             }
         }
         else
         {
-            Node * point = new Node(father->time_stamp + time_step_node, x,y,z,vx,vy,vz, father, envelope);
+            Node * point = context.node_pool.create(father->time_stamp + time_step_node, x,y,z,vx,vy,vz, father, envelope);
             point->coding_index = coding_index;
 
-            calculateGHF(point, end_node, g);
-            open_list.push_back(point);
+            calculateGHF(point, context.end_node, g);
+            context.open_list.push(point);
+            addToNodeIndex(context, point);
         }
     }
 
 
-    void addPath(Node *node){
-        result_path.push_back(node);
+    static void addPath(SearchContext &context, Node *node){
+        context.result_path.push_back(node);
 
         if (node->father != nullptr){
-            addPath(node->father);
+            addPath(context, node->father);
         }
 
     }
 
-    void calculateGHF(Node* sNode, Node* eNode, float g)
+    /// Estimated time to reach the goal or the boundary, whichever is closer. Smaller is better.
+    float getSearchProgress(const SearchContext &context, const Node* node) const
+    {
+        const Node *end_node = context.end_node;
+        float goal_time = sqrt((node->x - end_node->x)*(node->x - end_node->x) + (node->y - end_node->y)*(node->y - end_node->y)
+                               + (node->z - end_node->z)*(node->z - end_node->z)) / v_max_xy;
+
+        float boundary_distance = std::min(std::min(node->x + map_length_half - boundary_width, map_length_half - boundary_width - node->x),
+                                           std::min(node->y + map_width_half - boundary_width, map_width_half - boundary_width - node->y));
+        float boundary_time = std::max(boundary_distance, 0.f) / v_max_xy;
+
+        return std::min(goal_time, boundary_time);
+    }
+
+
+    void calculateGHF(Node* sNode, Node* eNode, float g) const
     {
         // Estimated time
         float h = sqrt((sNode->x - eNode->x)*(sNode->x - eNode->x)  + (sNode->y - eNode->y)*(sNode->y - eNode->y) + (sNode->z - eNode->z)*(sNode->z - eNode->z)) / v_max_xy;
@@ -987,29 +2246,22 @@ private:
     }
 
 
-    bool checkIfEnvelopeSafe(RectangleEnvelope &envelope, float risk_threshold){
-        vector<int> indexes;
-        if(!getEnvelopeRectangleIndexes(envelope, indexes)){
-            return false;
-        }
-
-        float risk_summation = 0.f;
-        for(auto &index : indexes){
-            float single_voxel_risk = *(risk_map + index);
-            risk_summation += single_voxel_risk;
-        }
-        if(risk_summation > risk_threshold){
-            return false;
-        }else{
-            return true;
-        }
+    /// voxel_check_num: if not null, the voxels read one by one are added to it
+    bool checkIfEnvelopeSafe(const SearchContext &context, RectangleEnvelope &envelope, float risk_threshold, float risk_threshold_one_voxel,
+                             int *voxel_check_num = nullptr) const{
+        int time_stamp_index_to_check;
+        matchTimeToTimeIndex(context, time_stamp_index_to_check, envelope.time_stamp_start);
+        return checkIfEnvelopeSafeAtTimeIndex(context, envelope, time_stamp_index_to_check, risk_threshold, risk_threshold_one_voxel,
+                                              voxel_check_num);
     }
 
-    bool checkIfEnvelopeSafe(RectangleEnvelope &envelope, float risk_threshold, float risk_threshold_one_voxel){
+    /// Same check on a given layer of the risk map instead of the one of the time of the envelope
+    bool checkIfEnvelopeSafeAtTimeIndex(const SearchContext &context, const RectangleEnvelope &envelope, int time_stamp_index_to_check,
+                                        float risk_threshold, float risk_threshold_one_voxel, int *voxel_check_num = nullptr) const{
         // height_max_limit
         if(use_height_limit){
-            float height_max_limit_map = height_max_limit - map_center_z;
-            float height_min_limit_map = height_min_limit - map_center_z;
+            float height_max_limit_map = height_max_limit - context.map_center_z;
+            float height_min_limit_map = height_min_limit - context.map_center_z;
 
             for(auto &p : envelope.vertexes){
                 if(p.z > height_max_limit_map || p.z < height_min_limit_map){
@@ -1018,21 +2270,63 @@ private:
             }
         }
 
-        // Get voxel storage indexes in the DSP map
-        vector<int> indexes;
-        if(!getEnvelopeRectangleIndexes(envelope, indexes)){
+        int x_index_min, x_index_max, y_index_min, y_index_max, z_index_min, z_index_max;
+        if(!getEnvelopeVoxelRange(envelope, x_index_min, x_index_max, y_index_min, y_index_max, z_index_min, z_index_max)){
+            return false;
+        }
+        if(x_index_min > x_index_max || y_index_min > y_index_max || z_index_min > z_index_max){
+            return true;
+        }
+
+        /// The voxels in the bounding box are a superset of the voxels in the envelope. If the box is safe, so is the
+        /// envelope. If the envelope is axis-aligned, the box is the envelope and the answer is exact.
+        const bool exceed_count_valid = risk_threshold_one_voxel == risk_table_single_voxel_threshold;
+        double box_risk_summation;
+        int box_exceed_num;
+        getBoxRisk(time_stamp_index_to_check, x_index_min, x_index_max, y_index_min, y_index_max, z_index_min, z_index_max,
+                   box_risk_summation, box_exceed_num);
+
+        if(box_risk_summation <= risk_threshold && exceed_count_valid && box_exceed_num == 0){
+            return true;
+        }
+        if(exceed_count_valid && ifEnvelopeAxisAligned(envelope)){
             return false;
         }
 
+        /// Inconclusive. Check the voxels in the envelope row by row.
+
+        RectangleEnvelopePlanes planes;
+        getEnvelopePlanes(envelope, planes);
+
+        const int row_size = x_index_max - x_index_min + 1;
+        const float row_start_x = ((float)x_index_min + 0.5f) * Geometry::resolution - map_length_half;
+        unsigned char inside[Geometry::length_voxel_num];
+
         float risk_summation = 0.f;
-        for(auto &index : indexes){
-            float single_voxel_risk = *(risk_map + index);
-            if(single_voxel_risk > risk_threshold_one_voxel){
-                return false;
-            }else{
-                risk_summation += single_voxel_risk;
-                if(risk_summation > risk_threshold){
-                    return false;
+        for(int z_index=z_index_min; z_index<=z_index_max; ++z_index){
+            const float grid_center_z = ((float)z_index + 0.5f) * Geometry::resolution - map_height_half;
+            for(int y_index=y_index_min; y_index<=y_index_max; ++y_index){
+                const float grid_center_y = ((float)y_index + 0.5f) * Geometry::resolution - map_width_half;
+                ifRowInEnvelope(planes, row_start_x, grid_center_y, grid_center_z, row_size, inside);
+
+                const float *risk_row = risk_map + Layout::index(x_index_min, y_index, z_index, time_stamp_index_to_check);
+                for(int i=0; i<row_size; ++i){
+                    if(!inside[i]){
+                        continue;
+                    }
+                    if(voxel_check_num){
+                        ++ *voxel_check_num;
+                    }
+
+                    float single_voxel_risk = risk_row[i * Layout::x_stride];
+                    if(single_voxel_risk > risk_threshold_one_voxel){
+                        return false;
+                    }else{
+                        risk_summation += single_voxel_risk;
+                        if(risk_summation > risk_threshold){
+                            return false;
+                        }
+                    }
                 }
             }
         }
@@ -1040,92 +2334,109 @@ private:
         return true;
     }
 
-    void matchTimeToTimeIndex(int &time_stamp_indexes_to_check, float time_stamp_start)
+    void matchTimeToTimeIndex(const SearchContext &context, int &time_stamp_indexes_to_check, float time_stamp_start) const
     {
         /// Correct the time with planning start time
-        time_stamp_start += start_time;
+        time_stamp_start += context.start_time;
         time_stamp_indexes_to_check = floor(time_stamp_start/time_step_node);
-        if(time_stamp_indexes_to_check >= RISK_MAP_NUMBER){
-            time_stamp_indexes_to_check = RISK_MAP_NUMBER - 1;
+        if(time_stamp_indexes_to_check >= Geometry::risk_map_number){
+            time_stamp_indexes_to_check = Geometry::risk_map_number - 1;
         }
     }
 
 
-    bool getEnvelopeRectangleIndexes(RectangleEnvelope &envelope, vector<int> &indexes){ // indexes: dimension 1: position, dimension 2: time
-        /// Match time
-        int time_stamp_index_to_check;
-        matchTimeToTimeIndex(time_stamp_index_to_check, envelope.time_stamp_start);
-
-        /// Check in a large rectangle and get indexes
+    /// Index range of the voxels whose centers are in the bounding box of the envelope. Returns false if the bounding
+    /// box is not completely inside of the map. The range is empty (min > max) if no voxel center is in the box.
+    bool getEnvelopeVoxelRange(const RectangleEnvelope &envelope, int &x_index_min, int &x_index_max, int &y_index_min,
+                               int &y_index_max, int &z_index_min, int &z_index_max) const
+    {
         float x_min, x_max, y_min, y_max, z_min, z_max;
         x_min = x_max = envelope.vertexes[0].x;
         y_min = y_max = envelope.vertexes[0].y;
         z_min = z_max = envelope.vertexes[0].z;
         for(int i=1; i<8; ++i){
-            if(x_min > envelope.vertexes[i].x){
-                x_min = envelope.vertexes[i].x;
-            }
-            if(y_min > envelope.vertexes[i].y){
-                y_min = envelope.vertexes[i].y;
-            }
-            if(z_min > envelope.vertexes[i].z){
-                z_min = envelope.vertexes[i].z;
-            }
+            setMinAndMax(x_min, x_max, envelope.vertexes[i].x);
+            setMinAndMax(y_min, y_max, envelope.vertexes[i].y);
+            setMinAndMax(z_min, z_max, envelope.vertexes[i].z);
+        }
 
-            if(x_max < envelope.vertexes[i].x){
-                x_max = envelope.vertexes[i].x;
-            }
-            if(y_max < envelope.vertexes[i].y){
-                y_max = envelope.vertexes[i].y;
-            }
-            if(z_max < envelope.vertexes[i].z){
-                z_max = envelope.vertexes[i].z;
-            }
+        if(x_min < -map_length_half || x_max >= map_length_half || y_min < -map_width_half || y_max >= map_width_half
+           || z_min < -map_height_half || z_max >= map_height_half){
+            return false;
         }
 
-        int x_voxels_num = ceil((x_max - x_min) / VOXEL_RESOLUTION);
-        int y_voxels_num = ceil((y_max - y_min) / VOXEL_RESOLUTION);
-        int z_voxels_num = ceil((z_max - z_min) / VOXEL_RESOLUTION);
+        x_index_min = (int)ceil((x_min + map_length_half) / Geometry::resolution - 0.5f);
+        x_index_max = (int)floor((x_max + map_length_half) / Geometry::resolution - 0.5f);
+        y_index_min = (int)ceil((y_min + map_width_half) / Geometry::resolution - 0.5f);
+        y_index_max = (int)floor((y_max + map_width_half) / Geometry::resolution - 0.5f);
+        z_index_min = (int)ceil((z_min + map_height_half) / Geometry::resolution - 0.5f);
+        z_index_max = (int)floor((z_max + map_height_half) / Geometry::resolution - 0.5f);
+        return true;
+    }
+
 
-        auto x_index_start = (int)((x_min + map_length_half) / VOXEL_RESOLUTION);
-        auto y_index_start = (int)((y_min + map_width_half) / VOXEL_RESOLUTION);
-        auto z_index_start = (int)((z_min + map_height_half) / VOXEL_RESOLUTION);
+    /// Summed-volume table entries of layer t for the voxels from (x_begin, y_begin, z_begin) to the high corner of the map.
+    /// The entries below the corner must be up to date.
+    void buildRiskTableLayer(int t, int x_begin, int y_begin, int z_begin)
+    {
+        static const int table_x_step = 1;
+        static const int table_y_step = Geometry::length_voxel_num + 1;
+        static const int table_z_step = (Geometry::length_voxel_num + 1) * (Geometry::width_voxel_num + 1);
+        static const int table_layer_size = (Geometry::length_voxel_num + 1) * (Geometry::width_voxel_num + 1) * (Geometry::height_voxel_num + 1);
+
+        double *sum_layer = &risk_sum_table[(size_t)t * table_layer_size];
+        int *exceed_layer = &risk_exceed_table[(size_t)t * table_layer_size];
+
+        for(int z=z_begin; z<Geometry::height_voxel_num; ++z){
+            for(int y=y_begin; y<Geometry::width_voxel_num; ++y){
+                const float *risk_row = risk_map + Layout::index(x_begin, y, z, t);
+                int table_index = (z+1)*table_z_step + (y+1)*table_y_step + (x_begin+1)*table_x_step;
+
+                for(int x=x_begin; x<Geometry::length_voxel_num; ++x, ++table_index){
+                    const float risk = risk_row[(x-x_begin)*Layout::x_stride];
+                    sum_layer[table_index] = risk
+                            + sum_layer[table_index - table_x_step] + sum_layer[table_index - table_y_step] + sum_layer[table_index - table_z_step]
+                            - sum_layer[table_index - table_x_step - table_y_step] - sum_layer[table_index - table_x_step - table_z_step]
+                            - sum_layer[table_index - table_y_step - table_z_step] + sum_layer[table_index - table_x_step - table_y_step - table_z_step];
+                    exceed_layer[table_index] = (risk > risk_table_single_voxel_threshold ? 1 : 0)
+                            + exceed_layer[table_index - table_x_step] + exceed_layer[table_index - table_y_step] + exceed_layer[table_index - table_z_step]
+                            - exceed_layer[table_index - table_x_step - table_y_step] - exceed_layer[table_index - table_x_step - table_z_step]
+                            - exceed_layer[table_index - table_y_step - table_z_step] + exceed_layer[table_index - table_x_step - table_y_step - table_z_step];
+                }
+            }
+        }
+    }
 
-        static const int z_change_storage_taken = MAP_WIDTH_VOXEL_NUM*MAP_LENGTH_VOXEL_NUM*RISK_MAP_NUMBER;  //Order: zyxt
-        static const int y_change_storage_taken = MAP_LENGTH_VOXEL_NUM*RISK_MAP_NUMBER;
-        static const int x_change_storage_taken = RISK_MAP_NUMBER;
 
-//        static const int check_step = 1;
+    /// Risk summation and the number of voxels with risk larger than risk_table_single_voxel_threshold in a voxel box.
+    /// The index ranges are inclusive.
+    void getBoxRisk(int t, int x_index_min, int x_index_max, int y_index_min, int y_index_max, int z_index_min, int z_index_max,
+                    double &risk_summation, int &exceed_num) const
+    {
+        static const int table_y_step = Geometry::length_voxel_num + 1;
+        static const int table_z_step = (Geometry::length_voxel_num + 1) * (Geometry::width_voxel_num + 1);
+        static const int table_layer_size = (Geometry::length_voxel_num + 1) * (Geometry::width_voxel_num + 1) * (Geometry::height_voxel_num + 1);
 
-        for(int i=0; i<=x_voxels_num; ++i){
-            auto x_index_this = x_index_start + i;
-            if(x_index_this < 0 || x_index_this >= MAP_LENGTH_VOXEL_NUM){
-                return false;
-            }
+        const double *sum_layer = &risk_sum_table[(size_t)t * table_layer_size];
+        const int *exceed_layer = &risk_exceed_table[(size_t)t * table_layer_size];
 
-            for(int j=0; j<=y_voxels_num; ++j){
-                auto y_index_this = y_index_start + j;
-                if(y_index_this < 0 || y_index_this >= MAP_WIDTH_VOXEL_NUM){
-                    return false;
-                }
+        const int x0 = x_index_min, x1 = x_index_max + 1;
+        const int y0 = (y_index_min) * table_y_step, y1 = (y_index_max + 1) * table_y_step;
+        const int z0 = (z_index_min) * table_z_step, z1 = (z_index_max + 1) * table_z_step;
 
-                for(int k=0; k<z_voxels_num; ++k){
-                    auto z_index_this = z_index_start + k;
-                    if(z_index_this < 0 || z_index_this >= MAP_HEIGHT_VOXEL_NUM){
-                        return false;
-                    }
+        risk_summation = sum_layer[z1 + y1 + x1] - sum_layer[z0 + y1 + x1] - sum_layer[z1 + y0 + x1] - sum_layer[z1 + y1 + x0]
+                         + sum_layer[z0 + y0 + x1] + sum_layer[z0 + y1 + x0] + sum_layer[z1 + y0 + x0] - sum_layer[z0 + y0 + x0];
+        exceed_num = exceed_layer[z1 + y1 + x1] - exceed_layer[z0 + y1 + x1] - exceed_layer[z1 + y0 + x1] - exceed_layer[z1 + y1 + x0]
+                     + exceed_layer[z0 + y0 + x1] + exceed_layer[z0 + y1 + x0] + exceed_layer[z1 + y0 + x0] - exceed_layer[z0 + y0 + x0];
+    }
 
-                    /// Ignore the grids that are not inside of the envelope
-                    float grid_center_x = x_min + VOXEL_RESOLUTION*i;
-                    float grid_center_y = y_min + VOXEL_RESOLUTION*j;
-                    float grid_center_z = z_min + VOXEL_RESOLUTION*k;
-                    if(!ifPointInEnvelope(grid_center_x, grid_center_y, grid_center_z, envelope)){
-                        continue;
-                    }
 
-                    int index = z_index_this * z_change_storage_taken + y_index_this * y_change_storage_taken + x_index_this*x_change_storage_taken + time_stamp_index_to_check;
-                    indexes.push_back(index);
-                }
+    static bool ifEnvelopeAxisAligned(const RectangleEnvelope &envelope)
+    {
+        static const float aligned_threshold = 1e-5f;
+        for(int i=0; i<4; ++i){
+            if(fabs(envelope.surfaces[i].normal.x) > aligned_threshold && fabs(envelope.surfaces[i].normal.y) > aligned_threshold){
+                return false;
             }
         }
         return true;
@@ -1142,47 +2453,111 @@ private:
 //    }
 
 
-    int ifContainedInVector(vector<Node*>* Nodelist, float &x, float &y, float &z,
-                                   float &vx, float &vy, float &vz) const
+    long int getVoxelCode(int x_index, int y_index, int z_index) const
     {
-        /// This function is hard to tune!!!!
-        for(int i = 0; i < Nodelist->size(); i++)
-        {
-            float same_node_threshold = VOXEL_RESOLUTION * std::min((fabs(vx)+fabs(vy)+fabs(vz)+0.0001f)*time_step_node, 1.f);
+        /// Offset the indexes so voxels slightly outside of the map still get unique codes
+        static const long int code_offset = 1024;
+        static const long int code_step = 4096;
+        return ((x_index + code_offset) * code_step + (y_index + code_offset)) * code_step + (z_index + code_offset);
+    }
 
-            if (fabs(Nodelist->at(i)->x - x) < same_node_threshold &&
-                fabs(Nodelist->at(i)->y - y) < same_node_threshold &&
-                fabs(Nodelist->at(i)->z - z) < same_node_threshold //&&
-                )
-            {
-                return i;
+
+    void getVoxelIndex(float x, float y, float z, int &x_index, int &y_index, int &z_index) const
+    {
+        x_index = (int)floor((x + map_length_half) / Geometry::resolution);
+        y_index = (int)floor((y + map_width_half) / Geometry::resolution);
+        z_index = (int)floor((z + map_height_half) / Geometry::resolution);
+    }
+
+
+    long int getCodingIndex(float x, float y, float z, float vx, float vy, float vz) const
+    {
+        /// Coding by voxel index and velocity direction. The lowest three bits are the velocity direction.
+        int x_index, y_index, z_index;
+        getVoxelIndex(x, y, z, x_index, y_index, z_index);
+
+        int v_direction_index = 0;
+        if(use_velocity_direction_code){
+            if(vx >= 0.f){
+                v_direction_index += 4;
+            }
+            if(vy >= 0.f){
+                v_direction_index += 2;
+            }
+            if(vz >= 0.f){
+                v_direction_index += 1;
+            }
+        }
+
+        return getVoxelCode(x_index, y_index, z_index) * 8 + v_direction_index;
+    }
+
+
+    static void addToNodeIndex(SearchContext &context, Node *node)
+    {
+        Node* &bucket = context.node_index[node->coding_index / 8];
+        node->next_in_voxel = bucket;
+        bucket = node;
+    }
+
+
+    /// Find a node with the same coding index. Works for the open list and the close list.
+    static Node* findInNodeIndex(const SearchContext &context, long int coding_index)
+    {
+        auto bucket = context.node_index.find(coding_index / 8);
+        if(bucket == context.node_index.end()){
+            return nullptr;
+        }
+
+        for(Node *n = bucket->second; n != nullptr; n = n->next_in_voxel){
+            if(n->coding_index == coding_index){
+                return n;
             }
         }
-        return -1;
+        return nullptr;
     }
 
 
-    int ifContainedInVector(vector<Node*>* Nodelist, int coding_index) const
+    /// Compatibility mode: find a node closer than same_node_threshold in the open list or in the close list.
+    /// The threshold is at most one voxel, so only the neighbouring voxels are checked.
+    Node* findInNodeIndex(const SearchContext &context, float x, float y, float z, float vx, float vy, float vz, bool in_open_list) const
     {
-        for(int i = 0; i < Nodelist->size(); i++)
-        {
-            if (Nodelist->at(i)->coding_index == coding_index){
-                return i;
+        /// This function is hard to tune!!!!
+        float same_node_threshold = Geometry::resolution * std::min((fabs(vx)+fabs(vy)+fabs(vz)+0.0001f)*time_step_node, 1.f);
+
+        int x_index, y_index, z_index;
+        getVoxelIndex(x, y, z, x_index, y_index, z_index);
+
+        for(int i=-1; i<=1; ++i){
+            for(int j=-1; j<=1; ++j){
+                for(int k=-1; k<=1; ++k){
+                    auto bucket = context.node_index.find(getVoxelCode(x_index+i, y_index+j, z_index+k));
+                    if(bucket == context.node_index.end()){
+                        continue;
+                    }
+
+                    for(Node *n = bucket->second; n != nullptr; n = n->next_in_voxel){
+                        if(NodeHeap::contains(n) == in_open_list &&
+                            fabs(n->x - x) < same_node_threshold &&
+                            fabs(n->y - y) < same_node_threshold &&
+                            fabs(n->z - z) < same_node_threshold)
+                        {
+                            return n;
+                        }
+                    }
+                }
             }
         }
-        return -1;
+        return nullptr;
     }
 
 
     static bool fourDIndexToOneDIndex(const int &x_index, const int &y_index, const int &z_index, const int time_index, int &index){
         /// Get Index
-        static const int z_change_storage_taken = MAP_WIDTH_VOXEL_NUM*MAP_LENGTH_VOXEL_NUM*RISK_MAP_NUMBER;
-        static const int y_change_storage_taken = MAP_LENGTH_VOXEL_NUM*RISK_MAP_NUMBER;
-        static const int x_change_storage_taken = RISK_MAP_NUMBER;
 
-        index = z_index * z_change_storage_taken + y_index * y_change_storage_taken + x_index*x_change_storage_taken + time_index;
+        index = Layout::index(x_index, y_index, z_index, time_index);
 
-        if(index < 0 || index >= VOXEL_NUM*RISK_MAP_NUMBER){
+        if(index < 0 || index >= Geometry::voxel_num*Geometry::risk_map_number){
             return false;
         }else{
             return true;
@@ -1190,11 +2565,6 @@ private:
     }
 
 
-    static bool compare(Node* n1,Node* n2){
-        return n1->f < n2->f;
-    }
-
-
     static bool nodeEqual(Node* n1, Node* n2, float threshold = 1.f){
         if(fabs(n1->x - n2->x) < threshold && fabs(n1->y - n2->y) < threshold && fabs(n1->z - n2->z) < threshold){
             return true;
@@ -1205,8 +2575,6 @@ private:
 
 
 public:
-    vector<Node*> result_path_reversed;
-
     float time_step_node;
     float time_step_trajectory;
 
@@ -1223,41 +2591,61 @@ public:
     float a_sample_step_z;
 
     float boundary_width;
+    int max_search_steps;
+    float max_search_time;
+
+    bool use_hashed_node_index;
+    bool use_velocity_direction_code;
 
     float risk_limitation_motion_primitive;
     float risk_limitation_corridor;
     float risk_limitation_single_voxel;
 
 private:
-    vector<Node*> open_list;
-    vector<Node*> close_list;
-    vector<Node*> result_path;
-    Node *start_node{};
-    Node *end_node{};
+    SearchContext default_context; // of search() and findCorridors()
+    vector<unique_ptr<SearchContext>> batch_contexts; // of the queries of plan() without a context
+
+    bool use_warm_start;
+    float warm_start_position_tolerance;
+    float warm_start_velocity_tolerance;
 
-    float start_time;
+    unique_ptr<ThreadPool> expansion_thread_pool;
+    unique_ptr<ThreadPool> query_thread_pool;
 
-    float map_length_half;
-    float map_width_half;
-    float map_height_half;
+    static constexpr float map_length_half = Geometry::length_half;
+    static constexpr float map_width_half = Geometry::width_half;
+    static constexpr float map_height_half = Geometry::height_half;
 
     float height_max_limit;
     float height_min_limit;
     bool use_height_limit;
     bool sample_z_acc;
 
-    float map_center_x;
-    float map_center_y;
-    float map_center_z;
-    float safety_distance;
-    float reference_direction_angle;
-
     vector<float> a_sample_vector_x;
     vector<float> a_sample_vector_y;
     vector<float> a_sample_vector_z;
 
-    vector<TrajPoint> searched_point_vector;
+    bool use_incremental_corridor;
+    bool use_galloping_corridor;
+    float corridor_max_expand_distance;
+
+    bool use_primitive_table;
+    bool primitive_table_dirty;
+    float primitive_table_velocity_resolution;
+    int primitive_table_velocity_half_num;
+    float primitive_table_safety_distance;
+    vector<PrimitiveShape> primitive_table;
+
+    bool record_searched_points;
 
  float *risk_map{};
+
+    /// Summed-volume tables of each layer of the risk map, padded with one zero voxel at the low side of each axis
+    vector<double> risk_sum_table;
+    vector<int> risk_exceed_table;
+    float risk_table_single_voxel_threshold;
+    bool risk_table_dirty;
+    uint64_t risk_table_frame_seq; // frame the tables were built from, 0 if unknown
 };
 
+typedef AstarT<> Astar;
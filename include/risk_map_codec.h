@@ -0,0 +1,337 @@
+//
+// Encoding of the future risk maps into rast_corridor_planning::RiskMap messages.
+//
+
+#ifndef RISK_MAP_CODEC_H
+#define RISK_MAP_CODEC_H
+
+#include "risk_map_layout.h"
+#include "rast_corridor_planning/RiskMap.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+/// Dense or sparse (nonzero voxels only) layers, or some bricks of the layers, with risk values as float32 or quantized
+/// to uint16/uint8.
+/// Quantized values are rounded up, so a decoded risk is never smaller than the mapped one and is larger by less than
+/// quantization_scale. Zero risk stays exactly zero.
+class RiskMapCodec{
+public:
+    /// src: risk maps in the order of the map (zyxt) with src_voxel_stride floats per voxel.
+    /// quantization_bits: 0 for float32, 16 or 8. The header and map center of msg are left to the caller.
+    static void encode(const float *src, int src_voxel_stride, bool sparse, int quantization_bits, rast_corridor_planning::RiskMap &msg)
+    {
+        encodeFrame(src, src_voxel_stride, sparse, quantization_bits, nullptr, msg);
+    }
+
+    /// Encode only the given RiskMapBricks bricks. msg.seq and msg.base_seq are left to the caller.
+    static void encodeBricks(const float *src, int src_voxel_stride, const std::vector<uint32_t> &bricks, int quantization_bits,
+                             rast_corridor_planning::RiskMap &msg)
+    {
+        encodeFrame(src, src_voxel_stride, true, quantization_bits, &bricks, msg);
+    }
+
+    /// Decode to dst in RiskMapLayout order. Returns false if the message does not fit the map size or is malformed.
+    /// A bricks message only writes its bricks, so dst must hold the frame msg.base_seq.
+    static bool decode(const rast_corridor_planning::RiskMap &msg, float *dst)
+    {
+        if(msg.length_voxel_num != MAP_LENGTH_VOXEL_NUM || msg.width_voxel_num != MAP_WIDTH_VOXEL_NUM
+           || msg.height_voxel_num != MAP_HEIGHT_VOXEL_NUM || msg.risk_map_number != RISK_MAP_NUMBER){
+            return false;
+        }
+
+        switch(msg.quantization){
+            case rast_corridor_planning::RiskMap::QUANTIZATION_NONE:
+                return decodeValues(msg, msg.values_float32, 1.f, dst);
+            case rast_corridor_planning::RiskMap::QUANTIZATION_UINT16:
+                return decodeValues(msg, msg.values_uint16, msg.quantization_scale, dst);
+            case rast_corridor_planning::RiskMap::QUANTIZATION_UINT8:
+                return decodeValues(msg, msg.values_uint8, msg.quantization_scale, dst);
+            default:
+                return false;
+        }
+    }
+
+private:
+    static void encodeFrame(const float *src, int src_voxel_stride, bool sparse, int quantization_bits, const std::vector<uint32_t> *bricks,
+                            rast_corridor_planning::RiskMap &msg)
+    {
+        msg.length_voxel_num = MAP_LENGTH_VOXEL_NUM;
+        msg.width_voxel_num = MAP_WIDTH_VOXEL_NUM;
+        msg.height_voxel_num = MAP_HEIGHT_VOXEL_NUM;
+        msg.risk_map_number = RISK_MAP_NUMBER;
+        msg.resolution = VOXEL_RESOLUTION;
+        if(bricks){
+            msg.encoding = rast_corridor_planning::RiskMap::ENCODING_BRICKS;
+        }else{
+            msg.encoding = sparse ? rast_corridor_planning::RiskMap::ENCODING_SPARSE : rast_corridor_planning::RiskMap::ENCODING_DENSE;
+        }
+
+        msg.layer_nonzero_num.clear();
+        msg.voxel_indexes.clear();
+        msg.values_float32.clear();
+        msg.values_uint16.clear();
+        msg.values_uint8.clear();
+        msg.brick_size = RISK_MAP_BRICK_SIZE;
+        msg.brick_indexes.clear();
+
+        if(quantization_bits == 16){
+            msg.quantization = rast_corridor_planning::RiskMap::QUANTIZATION_UINT16;
+            msg.quantization_scale = quantizationScale(src, src_voxel_stride, 65535.f);
+            encodeValues(src, src_voxel_stride, sparse, bricks, 1.f / msg.quantization_scale, msg, msg.values_uint16);
+        }else if(quantization_bits == 8){
+            msg.quantization = rast_corridor_planning::RiskMap::QUANTIZATION_UINT8;
+            msg.quantization_scale = quantizationScale(src, src_voxel_stride, 255.f);
+            encodeValues(src, src_voxel_stride, sparse, bricks, 1.f / msg.quantization_scale, msg, msg.values_uint8);
+        }else{
+            msg.quantization = rast_corridor_planning::RiskMap::QUANTIZATION_NONE;
+            msg.quantization_scale = 1.f;
+            encodeValues(src, src_voxel_stride, sparse, bricks, 1.f, msg, msg.values_float32);
+        }
+    }
+
+    static float quantizationScale(const float *src, int src_voxel_stride, float max_level)
+    {
+        float max_risk = 0.f;
+        for(int i=0; i<VOXEL_NUM; ++i){
+            for(int j=0; j<RISK_MAP_NUMBER; ++j){
+                max_risk = std::max(max_risk, src[i*src_voxel_stride + j]);
+            }
+        }
+        return max_risk > 0.f ? max_risk / max_level : 1.f;
+    }
+
+    template<typename T>
+    static T quantize(float risk, float scale_inv)
+    {
+        if constexpr(std::is_floating_point<T>::value){
+            return risk;
+        }else{
+            const float level = std::ceil(risk * scale_inv);
+            return level <= 0.f ? 0 : (T)std::min(level, (float)std::numeric_limits<T>::max());
+        }
+    }
+
+    template<typename T>
+    static void encodeValues(const float *src, int src_voxel_stride, bool sparse, const std::vector<uint32_t> *bricks, float scale_inv,
+                             rast_corridor_planning::RiskMap &msg, std::vector<T> &values)
+    {
+        if(bricks){
+            msg.brick_indexes = *bricks;
+            for(const auto b : *bricks){
+                int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+                RiskMapBricks::range((int)b, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+                for(int z=z_begin; z<z_end; ++z){
+                    for(int y=y_begin; y<y_end; ++y){
+                        for(int x=x_begin; x<x_end; ++x){
+                            values.push_back(quantize<T>(src[RiskMapLayoutT<RiskMapOrder::ZYXT>::spatialIndex(x, y, z)*src_voxel_stride + t], scale_inv));
+                        }
+                    }
+                }
+            }
+            return;
+        }
+
+        if(!sparse){
+            values.resize(VOXEL_NUM * RISK_MAP_NUMBER);
+            for(int t=0; t<RISK_MAP_NUMBER; ++t){
+                T *layer = &values[t * VOXEL_NUM];
+                for(int i=0; i<VOXEL_NUM; ++i){
+                    layer[i] = quantize<T>(src[i*src_voxel_stride + t], scale_inv);
+                }
+            }
+            return;
+        }
+
+        msg.layer_nonzero_num.resize(RISK_MAP_NUMBER);
+        for(int t=0; t<RISK_MAP_NUMBER; ++t){
+            const size_t layer_start = values.size();
+            for(int i=0; i<VOXEL_NUM; ++i){
+                const float risk = src[i*src_voxel_stride + t];
+                if(risk != 0.f){
+                    msg.voxel_indexes.push_back(i);
+                    values.push_back(quantize<T>(risk, scale_inv));
+                }
+            }
+            msg.layer_nonzero_num[t] = values.size() - layer_start;
+        }
+    }
+
+    template<typename T>
+    static bool decodeValues(const rast_corridor_planning::RiskMap &msg, const std::vector<T> &values, float scale, float *dst)
+    {
+        if(msg.encoding == rast_corridor_planning::RiskMap::ENCODING_DENSE){
+            if(values.size() != (size_t)VOXEL_NUM * RISK_MAP_NUMBER){
+                return false;
+            }
+            for(int t=0; t<RISK_MAP_NUMBER; ++t){
+                const T *layer = &values[t * VOXEL_NUM];
+                for(int i=0; i<VOXEL_NUM; ++i){
+                    dst[RiskMapLayout::index(i, t)] = (float)layer[i] * scale;
+                }
+            }
+            return true;
+        }
+
+        if(msg.encoding == rast_corridor_planning::RiskMap::ENCODING_BRICKS){
+            if(msg.brick_size != RISK_MAP_BRICK_SIZE){
+                return false;
+            }
+            size_t value_num = 0;
+            for(const auto b : msg.brick_indexes){
+                if(b >= (uint32_t)RiskMapBricks::num){
+                    return false;
+                }
+                int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+                RiskMapBricks::range((int)b, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+                value_num += (size_t)(x_end - x_begin) * (y_end - y_begin) * (z_end - z_begin);
+            }
+            if(value_num != values.size()){
+                return false;
+            }
+
+            size_t k = 0;
+            for(const auto b : msg.brick_indexes){
+                int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+                RiskMapBricks::range((int)b, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+                for(int z=z_begin; z<z_end; ++z){
+                    for(int y=y_begin; y<y_end; ++y){
+                        for(int x=x_begin; x<x_end; ++x, ++k){
+                            dst[RiskMapLayout::index(x, y, z, t)] = (float)values[k] * scale;
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+
+        if(msg.encoding != rast_corridor_planning::RiskMap::ENCODING_SPARSE || msg.layer_nonzero_num.size() != RISK_MAP_NUMBER
+           || msg.voxel_indexes.size() != values.size()){
+            return false;
+        }
+
+        size_t value_num = 0;
+        for(const auto n : msg.layer_nonzero_num){
+            value_num += n;
+        }
+        if(value_num != values.size()){
+            return false;
+        }
+        for(const auto i : msg.voxel_indexes){
+            if(i >= (uint32_t)VOXEL_NUM){
+                return false;
+            }
+        }
+
+        /// dst is only written after the checks
+        std::fill(dst, dst + RiskMapLayout::size, 0.f);
+        size_t k = 0;
+        for(int t=0; t<RISK_MAP_NUMBER; ++t){
+            const size_t layer_end = k + msg.layer_nonzero_num[t];
+            for(; k<layer_end; ++k){
+                dst[RiskMapLayout::index((int)msg.voxel_indexes[k], t)] = (float)values[k] * scale;
+            }
+        }
+        return true;
+    }
+};
+
+
+
+/// Encodes a complete frame every key_frame_interval frames and otherwise only the bricks in which a voxel changed by
+/// more than change_threshold since the brick was last sent, so the receiver's copy differs from the map by at most
+/// change_threshold, besides the quantization. A complete frame is also sent when most bricks changed. A receiver that misses a frame waits for
+/// the next complete one.
+class RiskMapDeltaEncoder{
+public:
+    RiskMapDeltaEncoder() : key_frame_interval(1), change_threshold(0.f), seq(0), frames_since_key_frame(0) {}
+
+    /// 1 sends complete frames only
+    void setKeyFrameInterval(int key_frame_interval_in)
+    {
+        key_frame_interval = key_frame_interval_in > 1 ? key_frame_interval_in : 1;
+    }
+
+    void setChangeThreshold(float change_threshold_in)
+    {
+        change_threshold = change_threshold_in > 0.f ? change_threshold_in : 0.f;
+    }
+
+    /// Same arguments as RiskMapCodec::encode(). Also sets msg.seq and msg.base_seq.
+    void encode(const float *src, int src_voxel_stride, bool sparse, int quantization_bits, rast_corridor_planning::RiskMap &msg)
+    {
+        ++ seq;
+
+        changed_bricks.clear();
+        const bool key_frame = sent.empty() || frames_since_key_frame + 1 >= key_frame_interval;
+        if(!key_frame){
+            for(int b=0; b<RiskMapBricks::num; ++b){
+                if(brickChanged(src, src_voxel_stride, b)){
+                    changed_bricks.push_back((uint32_t)b);
+                }
+            }
+        }
+
+        if(key_frame || changed_bricks.size() * 2 > (size_t)RiskMapBricks::num){
+            RiskMapCodec::encode(src, src_voxel_stride, sparse, quantization_bits, msg);
+            msg.seq = seq;
+            msg.base_seq = 0;
+
+            sent.resize(RiskMapLayout::size);
+            for(int i=0; i<VOXEL_NUM; ++i){
+                for(int t=0; t<RISK_MAP_NUMBER; ++t){
+                    sent[i*RISK_MAP_NUMBER + t] = src[i*src_voxel_stride + t];
+                }
+            }
+            frames_since_key_frame = 0;
+            return;
+        }
+
+        RiskMapCodec::encodeBricks(src, src_voxel_stride, changed_bricks, quantization_bits, msg);
+        msg.seq = seq;
+        msg.base_seq = seq - 1;
+
+        for(const auto b : changed_bricks){
+            int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+            RiskMapBricks::range((int)b, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+            for(int z=z_begin; z<z_end; ++z){
+                for(int y=y_begin; y<y_end; ++y){
+                    for(int x=x_begin; x<x_end; ++x){
+                        const int i = RiskMapLayoutT<RiskMapOrder::ZYXT>::spatialIndex(x, y, z);
+                        sent[i*RISK_MAP_NUMBER + t] = src[i*src_voxel_stride + t];
+                    }
+                }
+            }
+        }
+        ++ frames_since_key_frame;
+    }
+
+private:
+    bool brickChanged(const float *src, int src_voxel_stride, int brick) const
+    {
+        int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+        RiskMapBricks::range(brick, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+        for(int z=z_begin; z<z_end; ++z){
+            for(int y=y_begin; y<y_end; ++y){
+                for(int x=x_begin; x<x_end; ++x){
+                    const int i = RiskMapLayoutT<RiskMapOrder::ZYXT>::spatialIndex(x, y, z);
+                    if(std::fabs(src[i*src_voxel_stride + t] - sent[i*RISK_MAP_NUMBER + t]) > change_threshold){
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    int key_frame_interval;
+    float change_threshold;
+    uint32_t seq;
+    int frames_since_key_frame;
+    std::vector<float> sent; // risk maps as the receiver has them, zyxt
+    std::vector<uint32_t> changed_bricks;
+};
+
+#endif //RISK_MAP_CODEC_H
@@ -0,0 +1,139 @@
+//
+// Storage order of the future risk maps in the planner.
+//
+
+#ifndef RISK_MAP_LAYOUT_H
+#define RISK_MAP_LAYOUT_H
+
+#include "map_geometry.h"
+
+/// 1: one contiguous 3D volume per prediction step (tzyx). 0: the order of the map message, time innermost (zyxt).
+/// The planner only reads one time step per envelope, so the time-major order keeps the voxels of a row together.
+#ifndef RISK_MAP_TIME_MAJOR
+#define RISK_MAP_TIME_MAJOR 1
+#endif
+
+enum class RiskMapOrder { ZYXT, TZYX };
+
+template<RiskMapOrder ORDER, typename GEOMETRY>
+struct RiskMapStrides;
+
+template<typename GEOMETRY>
+struct RiskMapStrides<RiskMapOrder::ZYXT, GEOMETRY>
+{
+    static constexpr int x = GEOMETRY::risk_map_number;
+    static constexpr int y = GEOMETRY::length_voxel_num*GEOMETRY::risk_map_number;
+    static constexpr int z = GEOMETRY::width_voxel_num*GEOMETRY::length_voxel_num*GEOMETRY::risk_map_number;
+    static constexpr int t = 1;
+};
+
+template<typename GEOMETRY>
+struct RiskMapStrides<RiskMapOrder::TZYX, GEOMETRY>
+{
+    static constexpr int x = 1;
+    static constexpr int y = GEOMETRY::length_voxel_num;
+    static constexpr int z = GEOMETRY::width_voxel_num*GEOMETRY::length_voxel_num;
+    static constexpr int t = GEOMETRY::voxel_num;
+};
+
+/// Index of a voxel of a prediction step in a risk map of voxel_num*risk_map_number floats
+template<RiskMapOrder ORDER, typename GEOMETRY = DspMapGeometry>
+struct RiskMapLayoutT
+{
+    typedef GEOMETRY Geometry;
+    static constexpr RiskMapOrder order = ORDER;
+
+    static constexpr int length_voxel_num = GEOMETRY::length_voxel_num;
+    static constexpr int width_voxel_num = GEOMETRY::width_voxel_num;
+    static constexpr int height_voxel_num = GEOMETRY::height_voxel_num;
+    static constexpr int risk_map_number = GEOMETRY::risk_map_number;
+    static constexpr int voxel_num = GEOMETRY::voxel_num;
+
+    static constexpr int x_stride = RiskMapStrides<ORDER, GEOMETRY>::x;
+    static constexpr int y_stride = RiskMapStrides<ORDER, GEOMETRY>::y;
+    static constexpr int z_stride = RiskMapStrides<ORDER, GEOMETRY>::z;
+    static constexpr int t_stride = RiskMapStrides<ORDER, GEOMETRY>::t;
+
+    static constexpr int size = voxel_num*risk_map_number;
+
+    static constexpr int index(int x_index, int y_index, int z_index, int time_index)
+    {
+        return z_index*z_stride + y_index*y_stride + x_index*x_stride + time_index*t_stride;
+    }
+
+    /// spatial_index: z*width_voxel_num*length_voxel_num + y*length_voxel_num + x, as in the map message
+    static constexpr int index(int spatial_index, int time_index)
+    {
+        return ORDER == RiskMapOrder::ZYXT ? spatial_index*risk_map_number + time_index : time_index*voxel_num + spatial_index;
+    }
+
+    static constexpr int spatialIndex(int x_index, int y_index, int z_index)
+    {
+        return z_index*width_voxel_num*length_voxel_num + y_index*length_voxel_num + x_index;
+    }
+
+    /// Copy a map in the message order (zyxt, src_voxel_stride floats per voxel) to this order
+    static void fromZYXT(const float *src, int src_voxel_stride, float *dst)
+    {
+        for(int i=0; i<voxel_num; ++i){
+            for(int j=0; j<risk_map_number; ++j){
+                dst[index(i, j)] = src[i*src_voxel_stride + j];
+            }
+        }
+    }
+};
+
+/// Bricks of RISK_MAP_BRICK_SIZE^3 voxels of one time layer, the unit of incremental risk map updates. The last brick
+/// along an axis is smaller if the map size is not a multiple of the brick size.
+#ifndef RISK_MAP_BRICK_SIZE
+#define RISK_MAP_BRICK_SIZE 8
+#endif
+
+template<typename GEOMETRY = DspMapGeometry>
+struct RiskMapBricksT
+{
+    static constexpr int size = RISK_MAP_BRICK_SIZE;
+    static constexpr int x_num = (GEOMETRY::length_voxel_num + size - 1) / size;
+    static constexpr int y_num = (GEOMETRY::width_voxel_num + size - 1) / size;
+    static constexpr int z_num = (GEOMETRY::height_voxel_num + size - 1) / size;
+    static constexpr int layer_num = x_num * y_num * z_num; // bricks of one time layer
+    static constexpr int num = layer_num * GEOMETRY::risk_map_number;
+
+    static constexpr int index(int brick_x, int brick_y, int brick_z, int time_index)
+    {
+        return time_index*layer_num + (brick_z*y_num + brick_y)*x_num + brick_x;
+    }
+
+    /// Time layer and voxel ranges [begin, end) of a brick
+    static void range(int brick, int &time_index, int &x_begin, int &x_end, int &y_begin, int &y_end, int &z_begin, int &z_end)
+    {
+        time_index = brick / layer_num;
+        const int in_layer = brick % layer_num;
+        const int brick_x = in_layer % x_num;
+        const int brick_y = (in_layer / x_num) % y_num;
+        const int brick_z = in_layer / (x_num * y_num);
+
+        x_begin = brick_x * size;
+        y_begin = brick_y * size;
+        z_begin = brick_z * size;
+        x_end = x_begin + size < GEOMETRY::length_voxel_num ? x_begin + size : GEOMETRY::length_voxel_num;
+        y_end = y_begin + size < GEOMETRY::width_voxel_num ? y_begin + size : GEOMETRY::width_voxel_num;
+        z_end = z_begin + size < GEOMETRY::height_voxel_num ? z_begin + size : GEOMETRY::height_voxel_num;
+    }
+};
+
+typedef RiskMapBricksT<DspMapGeometry> RiskMapBricks;
+
+#if RISK_MAP_TIME_MAJOR
+#define RISK_MAP_ORDER RiskMapOrder::TZYX
+#else
+#define RISK_MAP_ORDER RiskMapOrder::ZYXT
+#endif
+
+/// Layout of the risk maps of a planner for a geometry
+template<typename GEOMETRY>
+using RiskMapLayoutOf = RiskMapLayoutT<RISK_MAP_ORDER, GEOMETRY>;
+
+typedef RiskMapLayoutOf<DspMapGeometry> RiskMapLayout;
+
+#endif //RISK_MAP_LAYOUT_H
@@ -0,0 +1,411 @@
+//
+// Ring of risk map frames shared between the mapping node and the planning node, or between threads of one node.
+//
+
+#ifndef RISK_MAP_SHARED_MEMORY_H
+#define RISK_MAP_SHARED_MEMORY_H
+
+#include "risk_map_layout.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RISK_MAP_SHM_MAGIC 0x4b534952u // "RISK"
+#define RISK_MAP_SHM_VERSION 2u
+#define RISK_MAP_SHM_SLOT_NUM 4
+
+/// Layout of the shared memory:
+///   RiskMapShmHeader | RISK_MAP_SHM_SLOT_NUM x risk map (RiskMapLayout order, 64-byte aligned)
+///
+/// There is one writer and any number of readers. "latest" holds (seq << 8 | slot) of the newest complete frame, 0 if
+/// there is none. A reader increases the reader number of that slot and then checks that "latest" has not changed;
+/// if it has, the slot may be rewritten, so the reader releases it and tries again. The writer only writes slots
+/// that are not the latest and have no readers, and drops the frame if there is none. All accesses to "latest" and
+/// the reader numbers are sequentially consistent, which makes the check of the reader safe.
+///
+/// brick_change_seq of a slot holds, for each RiskMapBricks brick, the seq of the last frame in which the brick changed,
+/// so a reader that built data from an older frame knows what to update even if it skipped frames.
+typedef struct RiskMapShmSlot
+{
+    std::atomic<uint32_t> reader_num;
+    uint32_t reserved;
+    uint64_t seq;
+    double stamp;
+    float map_center[3];
+    uint64_t brick_change_seq[RiskMapBricks::num];
+}RiskMapShmSlot;
+
+typedef struct RiskMapShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t length_voxel_num;
+    int32_t width_voxel_num;
+    int32_t height_voxel_num;
+    int32_t risk_map_number;
+    float resolution;
+    uint32_t time_major;
+    uint32_t slot_num;
+    uint32_t reserved;
+    uint64_t slot_bytes;
+    uint64_t data_offset;
+    std::atomic<uint64_t> latest;
+    RiskMapShmSlot slots[RISK_MAP_SHM_SLOT_NUM];
+}RiskMapShmHeader;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "Atomics in shared memory must be lock free");
+
+
+class RiskMapShmSegment{
+public:
+    static uint64_t slotBytes()
+    {
+        return ((uint64_t)RiskMapLayout::size * sizeof(float) + 63u) / 64u * 64u;
+    }
+
+    static uint64_t dataOffset()
+    {
+        return (sizeof(RiskMapShmHeader) + 63u) / 64u * 64u;
+    }
+
+    static uint64_t totalBytes()
+    {
+        return dataOffset() + slotBytes() * RISK_MAP_SHM_SLOT_NUM;
+    }
+
+    static float* slotData(RiskMapShmHeader *header, int slot)
+    {
+        return reinterpret_cast<float*>(reinterpret_cast<char*>(header) + header->data_offset + header->slot_bytes * slot);
+    }
+
+    /// Map an existing or a new segment. An empty name maps a new segment private to this process. Returns nullptr if
+    /// it fails.
+    static RiskMapShmHeader* map(const std::string &name, bool create)
+    {
+        if(name.empty()){
+            void *address = mmap(nullptr, totalBytes(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            return address == MAP_FAILED ? nullptr : static_cast<RiskMapShmHeader*>(address);
+        }
+
+        int fd = shm_open(name.c_str(), create ? (O_CREAT | O_RDWR) : O_RDWR, 0666);
+        if(fd < 0){
+            return nullptr;
+        }
+
+        if(create && ftruncate(fd, (off_t)totalBytes()) != 0){
+            std::cout << "Risk map shared memory: failed to resize " << name << std::endl;
+            close(fd);
+            return nullptr;
+        }
+
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) != 0 || (uint64_t)file_stat.st_size < totalBytes()){
+            close(fd);
+            return nullptr;
+        }
+
+        void *address = mmap(nullptr, totalBytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(address == MAP_FAILED){
+            std::cout << "Risk map shared memory: failed to map " << name << std::endl;
+            return nullptr;
+        }
+        return static_cast<RiskMapShmHeader*>(address);
+    }
+
+    static void unmap(RiskMapShmHeader *header)
+    {
+        if(header){
+            munmap(header, totalBytes());
+        }
+    }
+};
+
+
+/// A risk map frame held by a reader. The slot is not rewritten until the frame is released or destroyed.
+class RiskMapShmFrame{
+public:
+    RiskMapShmFrame() : header(nullptr), slot(-1) {}
+
+    RiskMapShmFrame(RiskMapShmHeader *header_in, int slot_in) : header(header_in), slot(slot_in) {}
+
+    RiskMapShmFrame(const RiskMapShmFrame &) = delete;
+    RiskMapShmFrame &operator=(const RiskMapShmFrame &) = delete;
+
+    RiskMapShmFrame(RiskMapShmFrame &&other) noexcept : header(other.header), slot(other.slot)
+    {
+        other.header = nullptr;
+        other.slot = -1;
+    }
+
+    RiskMapShmFrame &operator=(RiskMapShmFrame &&other) noexcept
+    {
+        if(this != &other){
+            release();
+            std::swap(header, other.header);
+            std::swap(slot, other.slot);
+        }
+        return *this;
+    }
+
+    ~RiskMapShmFrame()
+    {
+        release();
+    }
+
+    bool valid() const { return header != nullptr; }
+
+    /// Risk map in RiskMapLayout order
+    float* data() const { return RiskMapShmSegment::slotData(header, slot); }
+
+    uint64_t seq() const { return header->slots[slot].seq; }
+
+    double stamp() const { return header->slots[slot].stamp; }
+
+    const float* mapCenter() const { return header->slots[slot].map_center; }
+
+    /// RiskMapBricks::num entries, see RiskMapShmSlot
+    const uint64_t* brickChangeSeq() const { return header->slots[slot].brick_change_seq; }
+
+    void release()
+    {
+        if(header){
+            header->slots[slot].reader_num.fetch_sub(1);
+            header = nullptr;
+            slot = -1;
+        }
+    }
+
+private:
+    RiskMapShmHeader *header;
+    int slot;
+};
+
+
+class RiskMapShmWriter{
+public:
+    RiskMapShmWriter() : header(nullptr), writing_slot(-1), seq(0) {}
+
+    RiskMapShmWriter(const RiskMapShmWriter &) = delete;
+    RiskMapShmWriter &operator=(const RiskMapShmWriter &) = delete;
+
+    ~RiskMapShmWriter()
+    {
+        RiskMapShmSegment::unmap(header);
+        if(!segment_name.empty()){
+            shm_unlink(segment_name.c_str());
+        }
+    }
+
+    /// Create a new segment. An old segment with the same name is removed first, so readers have to be started after
+    /// the writer. An empty name creates a ring for readers in this process, see RiskMapShmReader::attach().
+    bool open(const std::string &name)
+    {
+        if(!name.empty()){
+            shm_unlink(name.c_str());
+        }
+        header = RiskMapShmSegment::map(name, true);
+        if(!header){
+            return false;
+        }
+        segment_name = name;
+
+        header->version = RISK_MAP_SHM_VERSION;
+        header->length_voxel_num = MAP_LENGTH_VOXEL_NUM;
+        header->width_voxel_num = MAP_WIDTH_VOXEL_NUM;
+        header->height_voxel_num = MAP_HEIGHT_VOXEL_NUM;
+        header->risk_map_number = RISK_MAP_NUMBER;
+        header->resolution = VOXEL_RESOLUTION;
+        header->time_major = RiskMapLayout::order == RiskMapOrder::TZYX ? 1 : 0;
+        header->slot_num = RISK_MAP_SHM_SLOT_NUM;
+        header->slot_bytes = RiskMapShmSegment::slotBytes();
+        header->data_offset = RiskMapShmSegment::dataOffset();
+        for(auto &s : header->slots){
+            s.reader_num.store(0);
+            s.seq = 0;
+        }
+        header->latest.store(0);
+
+        /// Readers check the magic number last
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        header->magic = RISK_MAP_SHM_MAGIC;
+        return true;
+    }
+
+    /// Get a slot to write the next frame into. Returns nullptr if every slot is the latest frame or is being read; the
+    /// frame should be dropped then.
+    float* beginFrame()
+    {
+        if(!header){
+            return nullptr;
+        }
+
+        const uint64_t latest = header->latest.load();
+        const int latest_slot = latest == 0 ? -1 : (int)(latest & 0xffu);
+
+        for(int i=1; i<=RISK_MAP_SHM_SLOT_NUM; ++i){
+            const int slot = (latest_slot + i + RISK_MAP_SHM_SLOT_NUM) % RISK_MAP_SHM_SLOT_NUM;
+            if(slot != latest_slot && header->slots[slot].reader_num.load() == 0){
+                writing_slot = slot;
+                return RiskMapShmSegment::slotData(header, slot);
+            }
+        }
+        return nullptr;
+    }
+
+    RiskMapShmHeader* segment() const { return header; }
+
+    /// Publish the frame written after beginFrame(). The bricks are compared with the previous frame to find the
+    /// changed ones.
+    void commitFrame(double stamp, float map_center_x, float map_center_y, float map_center_z)
+    {
+        if(!header || writing_slot < 0){
+            return;
+        }
+
+        ++ seq;
+        RiskMapShmSlot &s = header->slots[writing_slot];
+        const uint64_t latest = header->latest.load();
+        if(latest == 0){
+            std::fill(s.brick_change_seq, s.brick_change_seq + RiskMapBricks::num, seq);
+        }else{
+            /// The latest slot is not written while this one is, and readers never write
+            const int latest_slot = (int)(latest & 0xffu);
+            const float *previous = RiskMapShmSegment::slotData(header, latest_slot);
+            const float *current = RiskMapShmSegment::slotData(header, writing_slot);
+            for(int b=0; b<RiskMapBricks::num; ++b){
+                s.brick_change_seq[b] = brickChanged(previous, current, b) ? seq : header->slots[latest_slot].brick_change_seq[b];
+            }
+        }
+        s.seq = seq;
+        s.stamp = stamp;
+        s.map_center[0] = map_center_x;
+        s.map_center[1] = map_center_y;
+        s.map_center[2] = map_center_z;
+
+        header->latest.store((seq << 8u) | (uint64_t)writing_slot);
+        writing_slot = -1;
+    }
+
+private:
+    static bool brickChanged(const float *previous, const float *current, int brick)
+    {
+        int t, x_begin, x_end, y_begin, y_end, z_begin, z_end;
+        RiskMapBricks::range(brick, t, x_begin, x_end, y_begin, y_end, z_begin, z_end);
+        for(int z=z_begin; z<z_end; ++z){
+            for(int y=y_begin; y<y_end; ++y){
+                const int row = RiskMapLayout::index(x_begin, y, z, t);
+                if(RiskMapLayout::x_stride == 1){
+                    if(std::memcmp(previous + row, current + row, sizeof(float) * (x_end - x_begin)) != 0){
+                        return true;
+                    }
+                }else{
+                    for(int x=0; x<x_end-x_begin; ++x){
+                        if(std::memcmp(previous + row + x*RiskMapLayout::x_stride, current + row + x*RiskMapLayout::x_stride, sizeof(float)) != 0){
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    RiskMapShmHeader *header;
+    std::string segment_name;
+    int writing_slot;
+    uint64_t seq;
+};
+
+
+class RiskMapShmReader{
+public:
+    RiskMapShmReader() : header(nullptr), owns_header(false) {}
+
+    RiskMapShmReader(const RiskMapShmReader &) = delete;
+    RiskMapShmReader &operator=(const RiskMapShmReader &) = delete;
+
+    ~RiskMapShmReader()
+    {
+        if(owns_header){
+            RiskMapShmSegment::unmap(header);
+        }
+    }
+
+    /// Read the ring of a writer in this process. The writer has to outlive the reader.
+    void attach(const RiskMapShmWriter &writer)
+    {
+        if(owns_header){
+            RiskMapShmSegment::unmap(header);
+        }
+        header = writer.segment();
+        owns_header = false;
+    }
+
+    /// Map the segment created by the writer. Returns false if it does not exist yet or was made for another map size.
+    bool open(const std::string &name)
+    {
+        RiskMapShmHeader *header_mapped = RiskMapShmSegment::map(name, false);
+        if(!header_mapped){
+            return false;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool layout_matched = header_mapped->magic == RISK_MAP_SHM_MAGIC && header_mapped->version == RISK_MAP_SHM_VERSION
+                && header_mapped->length_voxel_num == MAP_LENGTH_VOXEL_NUM && header_mapped->width_voxel_num == MAP_WIDTH_VOXEL_NUM
+                && header_mapped->height_voxel_num == MAP_HEIGHT_VOXEL_NUM && header_mapped->risk_map_number == RISK_MAP_NUMBER
+                && header_mapped->time_major == (RiskMapLayout::order == RiskMapOrder::TZYX ? 1u : 0u)
+                && header_mapped->slot_num == RISK_MAP_SHM_SLOT_NUM;
+        if(!layout_matched){
+            std::cout << "Risk map shared memory: " << name << " is not ready or has a different map layout" << std::endl;
+            RiskMapShmSegment::unmap(header_mapped);
+            return false;
+        }
+
+        if(owns_header){
+            RiskMapShmSegment::unmap(header);
+        }
+        header = header_mapped;
+        owns_header = true;
+        return true;
+    }
+
+    bool isOpen() const { return header != nullptr; }
+
+    /// Hold the newest frame. The returned frame is not valid if there is no frame yet.
+    RiskMapShmFrame acquireLatest()
+    {
+        if(!header){
+            return RiskMapShmFrame();
+        }
+
+        while(true){
+            const uint64_t latest = header->latest.load();
+            if(latest == 0){
+                return RiskMapShmFrame();
+            }
+
+            const int slot = (int)(latest & 0xffu);
+            header->slots[slot].reader_num.fetch_add(1);
+            if(header->latest.load() == latest){
+                return RiskMapShmFrame(header, slot);
+            }
+            header->slots[slot].reader_num.fetch_sub(1);
+        }
+    }
+
+private:
+    RiskMapShmHeader *header;
+    bool owns_header;
+};
+
+#endif //RISK_MAP_SHARED_MEMORY_H
@@ -0,0 +1,328 @@
+//
+// Files that hold the inputs of one planning cycle, to replay a slow or failed search offline.
+//
+
+#ifndef RISK_MAP_SNAPSHOT_H
+#define RISK_MAP_SNAPSHOT_H
+
+#include "bounded_queue.h"
+#include "risk_map_layout.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RISK_MAP_SNAPSHOT_MAGIC 0x50414e53u // "SNAP"
+#define RISK_MAP_SNAPSHOT_VERSION 1u
+#define RISK_MAP_SNAPSHOT_PARAMETER_BYTES 4096
+
+enum class RiskMapSnapshotTrigger : uint32_t { REQUEST = 0, SLOW_CYCLE = 1 };
+
+/// Layout of a snapshot file:
+///   RiskMapSnapshotHeader | risk map (RiskMapLayout order, at data_offset, 64-byte aligned)
+///
+/// The start and the goal are in the frame of the map center, as given to Astar::search(). parameters holds the
+/// planner parameters as the "name: value" lines of cfg.yaml, so the benchmark can read them like a config file.
+/// warm_started is set when the recorded search was seeded with the path of the search before it, which the file does
+/// not hold, so a replay searches from scratch and can find another path.
+typedef struct RiskMapSnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t length_voxel_num;
+    int32_t width_voxel_num;
+    int32_t height_voxel_num;
+    int32_t risk_map_number;
+    float resolution;
+    uint32_t time_major;
+    uint64_t data_offset;
+    uint64_t data_bytes;
+
+    uint64_t risk_map_seq;
+    double stamp; // of the risk map
+    double cycle_time; // seconds the planning cycle took
+    RiskMapSnapshotTrigger trigger;
+    float start_time;
+    float reference_direction_angle;
+    uint32_t warm_started;
+    double map_center[3];
+    double start_position[3];
+    double start_velocity[3];
+    double start_acceleration[3];
+    double goal[3];
+
+    char parameters[RISK_MAP_SNAPSHOT_PARAMETER_BYTES]; // zero terminated
+}RiskMapSnapshotHeader;
+
+static_assert(std::is_trivially_copyable<RiskMapSnapshotHeader>::value, "Snapshot headers are written as bytes");
+
+
+class RiskMapSnapshotFormat{
+public:
+    static uint64_t dataOffset()
+    {
+        return (sizeof(RiskMapSnapshotHeader) + 63u) / 64u * 64u;
+    }
+
+    static uint64_t dataBytes()
+    {
+        return (uint64_t)RiskMapLayout::size * sizeof(float);
+    }
+
+    static uint64_t totalBytes()
+    {
+        return dataOffset() + dataBytes();
+    }
+
+    /// A header with the map layout of the planner filled in and everything else zero
+    static RiskMapSnapshotHeader emptyHeader()
+    {
+        RiskMapSnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = RISK_MAP_SNAPSHOT_MAGIC;
+        header.version = RISK_MAP_SNAPSHOT_VERSION;
+        header.length_voxel_num = RiskMapLayout::length_voxel_num;
+        header.width_voxel_num = RiskMapLayout::width_voxel_num;
+        header.height_voxel_num = RiskMapLayout::height_voxel_num;
+        header.risk_map_number = RiskMapLayout::risk_map_number;
+        header.resolution = (float)RiskMapLayout::Geometry::resolution;
+        header.time_major = RiskMapLayout::order == RiskMapOrder::TZYX ? 1 : 0;
+        header.data_offset = dataOffset();
+        header.data_bytes = dataBytes();
+        return header;
+    }
+
+    static bool matchesPlanner(const RiskMapSnapshotHeader &header)
+    {
+        return header.magic == RISK_MAP_SNAPSHOT_MAGIC && header.version == RISK_MAP_SNAPSHOT_VERSION
+               && header.length_voxel_num == RiskMapLayout::length_voxel_num && header.width_voxel_num == RiskMapLayout::width_voxel_num
+               && header.height_voxel_num == RiskMapLayout::height_voxel_num && header.risk_map_number == RiskMapLayout::risk_map_number
+               && header.resolution > (float)RiskMapLayout::Geometry::resolution * 0.999f
+               && header.resolution < (float)RiskMapLayout::Geometry::resolution * 1.001f
+               && header.time_major == (RiskMapLayout::order == RiskMapOrder::TZYX ? 1u : 0u)
+               && header.data_bytes == dataBytes() && header.data_offset % 64u == 0;
+    }
+};
+
+
+/// Writes snapshots on one thread with the idle scheduling policy. record() only copies the inputs into a buffer that
+/// was allocated by start(); when every buffer is still being written, the snapshot is dropped, so a slow disk never
+/// makes planning wait.
+class RiskMapSnapshotRecorder{
+public:
+    RiskMapSnapshotRecorder() : jobs(2), running(false), max_file_num(0), file_num(0) {}
+
+    RiskMapSnapshotRecorder(const RiskMapSnapshotRecorder &) = delete;
+    RiskMapSnapshotRecorder &operator=(const RiskMapSnapshotRecorder &) = delete;
+
+    ~RiskMapSnapshotRecorder()
+    {
+        stop();
+    }
+
+    /// max_file_num: files written at most, 0: no limit
+    void start(const std::string &directory_in, int max_file_num_in = 0, int buffer_num = 2)
+    {
+        if(running){
+            return;
+        }
+        directory = directory_in;
+        max_file_num = max_file_num_in;
+        file_num = 0;
+
+        buffer_num = buffer_num > 0 ? buffer_num : 1;
+        buffers.assign(buffer_num, std::vector<char>(RiskMapSnapshotFormat::totalBytes()));
+        free_buffers.clear();
+        for(int i=0; i<buffer_num; ++i){
+            free_buffers.push_back(i);
+        }
+        jobs.setCapacity(buffer_num);
+
+        running = true;
+        worker = std::thread(&RiskMapSnapshotRecorder::workerLoop, this);
+    }
+
+    /// Write the snapshots still in the queue and join the thread
+    void stop()
+    {
+        if(!running){
+            return;
+        }
+        jobs.close();
+        worker.join();
+        running = false;
+    }
+
+    bool isRunning() const { return running; }
+
+    /// header: from RiskMapSnapshotFormat::emptyHeader(). risk_map: RiskMapLayout::size floats. Returns false if the
+    /// snapshot was dropped.
+    bool record(const RiskMapSnapshotHeader &header, const float *risk_map)
+    {
+        if(!running){
+            return false;
+        }
+
+        int buffer;
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            if(free_buffers.empty() || (max_file_num > 0 && file_num >= max_file_num)){
+                return false;
+            }
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+            ++ file_num;
+        }
+
+        char *bytes = buffers[buffer].data();
+        std::memcpy(bytes, &header, sizeof(header));
+        std::memset(bytes + sizeof(header), 0, RiskMapSnapshotFormat::dataOffset() - sizeof(header));
+        std::memcpy(bytes + RiskMapSnapshotFormat::dataOffset(), risk_map, RiskMapSnapshotFormat::dataBytes());
+        jobs.push(buffer);
+        return true;
+    }
+
+private:
+    void workerLoop()
+    {
+        sched_param param{};
+        param.sched_priority = 0;
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+        int buffer;
+        int written_num = 0;
+        while(jobs.pop(buffer)){
+            const std::vector<char> &bytes = buffers[buffer];
+            RiskMapSnapshotHeader header;
+            std::memcpy(&header, bytes.data(), sizeof(header));
+
+            char name[64];
+            snprintf(name, sizeof(name), "/snapshot_%.3f_%d.rmsnap", header.stamp, written_num++);
+            const std::string path = directory + name;
+            if(!writeFile(path, bytes)){
+                std::cout << "Risk map snapshot: failed to write " << path << std::endl;
+            }
+
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            free_buffers.push_back(buffer);
+        }
+    }
+
+    static bool writeFile(const std::string &path, const std::vector<char> &bytes)
+    {
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if(fd < 0){
+            return false;
+        }
+        size_t written = 0;
+        while(written < bytes.size()){
+            const ssize_t n = write(fd, bytes.data() + written, bytes.size() - written);
+            if(n <= 0){
+                close(fd);
+                return false;
+            }
+            written += (size_t)n;
+        }
+        return close(fd) == 0;
+    }
+
+    BoundedQueue<int> jobs; // buffers to write
+    std::vector<std::vector<char>> buffers; // header and risk map, as in the file
+    std::vector<int> free_buffers;
+    std::mutex buffer_mutex;
+    std::thread worker;
+    std::string directory;
+    bool running;
+    int max_file_num;
+    int file_num;
+};
+
+
+/// A snapshot file mapped into memory. The risk map is read in place: the mapping is private, so the writable pointer
+/// that Astar takes never changes the file, and pages are only copied if they are written.
+class RiskMapSnapshotFile{
+public:
+    RiskMapSnapshotFile() : address(nullptr), bytes(0) {}
+
+    RiskMapSnapshotFile(const RiskMapSnapshotFile &) = delete;
+    RiskMapSnapshotFile &operator=(const RiskMapSnapshotFile &) = delete;
+
+    ~RiskMapSnapshotFile()
+    {
+        unmap();
+    }
+
+    /// Returns false if the file cannot be mapped or was recorded for another map layout
+    bool open(const std::string &path)
+    {
+        unmap();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            return false;
+        }
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) != 0 || (uint64_t)file_stat.st_size < sizeof(RiskMapSnapshotHeader)){
+            close(fd);
+            return false;
+        }
+
+        void *mapped = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapped == MAP_FAILED){
+            return false;
+        }
+
+        const RiskMapSnapshotHeader *header_mapped = static_cast<const RiskMapSnapshotHeader*>(mapped);
+        if(!RiskMapSnapshotFormat::matchesPlanner(*header_mapped)
+           || header_mapped->data_offset + header_mapped->data_bytes > (uint64_t)file_stat.st_size){
+            std::cout << "Risk map snapshot: " << path << " is not a snapshot of the planner map layout" << std::endl;
+            munmap(mapped, (size_t)file_stat.st_size);
+            return false;
+        }
+
+        address = mapped;
+        bytes = (size_t)file_stat.st_size;
+        return true;
+    }
+
+    bool isOpen() const { return address != nullptr; }
+
+    const RiskMapSnapshotHeader& header() const { return *static_cast<const RiskMapSnapshotHeader*>(address); }
+
+    /// Risk map in RiskMapLayout order
+    float* data() const { return reinterpret_cast<float*>(static_cast<char*>(address) + header().data_offset); }
+
+    /// The parameter lines, also if the writer did not terminate them
+    std::string parameters() const
+    {
+        const char *text = header().parameters;
+        return std::string(text, strnlen(text, RISK_MAP_SNAPSHOT_PARAMETER_BYTES));
+    }
+
+private:
+    void unmap()
+    {
+        if(address){
+            munmap(address, bytes);
+            address = nullptr;
+            bytes = 0;
+        }
+    }
+
+    void *address;
+    size_t bytes;
+};
+
+#endif //RISK_MAP_SNAPSHOT_H
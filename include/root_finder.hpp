@@ -36,6 +36,67 @@ namespace RootFinderParam
 constexpr size_t highestOrder = 64;
 }
 
+namespace RootFinder
+{
+
+// Coefficients of a polynomial up to the highest order, on the stack
+typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, RootFinderParam::highestOrder + 1, 1> CoeffVector;
+
+class RootSet
+// Distinct roots in increasing order, kept in a fixed array instead of the tree nodes of a std::set
+{
+public:
+    RootSet() : num(0) {}
+
+    void insert(double x)
+    {
+        int i = num;
+        while (i > 0 && values[i - 1] > x)
+        {
+            i--;
+        }
+        if ((i > 0 && values[i - 1] == x) || num == capacity)
+        {
+            return;
+        }
+        for (int j = num; j > i; j--)
+        {
+            values[j] = values[j - 1];
+        }
+        values[i] = x;
+        num++;
+    }
+
+    void clear() { num = 0; }
+
+    void keepInside(double lbound, double ubound)
+    // Remove the roots outside the open interval (lbound, ubound)
+    {
+        int kept = 0;
+        for (int i = 0; i < num; i++)
+        {
+            if (values[i] > lbound && values[i] < ubound)
+            {
+                values[kept++] = values[i];
+            }
+        }
+        num = kept;
+    }
+
+    int size() const { return num; }
+    bool empty() const { return num == 0; }
+    double operator[](int i) const { return values[i]; }
+    const double *begin() const { return values; }
+    const double *end() const { return values + num; }
+
+private:
+    static constexpr int capacity = RootFinderParam::highestOrder + 1;
+    double values[capacity];
+    int num;
+};
+
+} // namespace RootFinder
+
 namespace RootFinderPriv
 {
 
@@ -123,10 +184,10 @@ inline double polyEval(double *p, int len, double x)
     return retVal;
 }
 
-inline std::set<double> solveCub(double a, double b, double c, double d)
+inline RootFinder::RootSet solveCub(double a, double b, double c, double d)
 // Calculate all roots of a*x^3 + b*x^2 + c*x + d = 0
 {
-    std::set<double> roots;
+    RootFinder::RootSet roots;
 
     constexpr double cos120 = -0.50;
     constexpr double sin120 = 0.866025403784438646764;
@@ -286,11 +347,11 @@ inline int solveResolvent(double *x, double a, double b, double c)
     }
 }
 
-inline std::set<double> solveQuartMonic(double a, double b, double c, double d)
+inline RootFinder::RootSet solveQuartMonic(double a, double b, double c, double d)
 // Calculate all roots of the monic quartic equation:
 // x^4 + a*x^3 + b*x^2 + c*x +d = 0
 {
-    std::set<double> roots;
+    RootFinder::RootSet roots;
 
     double a3 = -b;
     double b3 = a * c - 4.0 * d;
@@ -374,7 +435,7 @@ inline std::set<double> solveQuartMonic(double a, double b, double c, double d)
     return roots;
 }
 
-inline std::set<double> solveQuart(double a, double b, double c, double d, double e)
+inline RootFinder::RootSet solveQuart(double a, double b, double c, double d, double e)
 // Calculate the quartic equation: a*x^4 + b*x^3 + c*x^2 + d*x + e = 0
 // All coefficients can be zero
 {
@@ -388,11 +449,11 @@ inline std::set<double> solveQuart(double a, double b, double c, double d, doubl
     }
 }
 
-inline std::set<double> eigenSolveRealRoots(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol)
+inline RootFinder::RootSet eigenSolveRealRoots(const RootFinder::CoeffVector &coeffs, double lbound, double ubound, double tol)
 // Calculate roots of coeffs(x) inside (lbound, rbound) by computing eigen values of its companion matrix
 // Complex roots with magnitude of imaginary part less than tol are considered real
 {
-    std::set<double> rts;
+    RootFinder::RootSet rts;
 
     int order = (int)coeffs.size() - 1;
     Eigen::VectorXd monicCoeffs(order + 1);
@@ -534,19 +595,17 @@ inline double shrinkInterval(double *coeffs, int numCoeffs, double lbound, doubl
 // Calculate a single zero of poly coeffs(x) inside [lbound, ubound]
 // Requirements: coeffs(lbound)*coeffs(ubound) < 0, lbound < ubound
 {
-    double *dcoeffs = new double[numCoeffs - 1];
+    double dcoeffs[RootFinderParam::highestOrder + 1];
     polyDeri(coeffs, dcoeffs, numCoeffs);
     auto func = [&coeffs, &numCoeffs](double x) { return polyEval(coeffs, numCoeffs, x); };
     auto dfunc = [&dcoeffs, &numCoeffs](double x) { return polyEval(dcoeffs, numCoeffs - 1, x); };
     constexpr int maxDblIts = 128;
-    double rts = safeNewton(func, dfunc, lbound, ubound, tol, maxDblIts);
-    delete[] dcoeffs;
-    return rts;
+    return safeNewton(func, dfunc, lbound, ubound, tol, maxDblIts);
 }
 
 inline void recurIsolate(double l, double r, double fl, double fr, int lnv, int rnv,
                          double tol, double **sturmSeqs, int *szSeq, int len,
-                         std::set<double> &rts)
+                         RootFinder::RootSet &rts)
 // Isolate all roots of sturmSeqs[0](x) inside interval (l, r) recursively and store them in rts
 // Requirements: fl := sturmSeqs[0](l) != 0, fr := sturmSeqs[0](r) != 0, l < r,
 //               lnv != rnv, lnv = numSignVar(l), rnv = numSignVar(r)
@@ -667,23 +726,23 @@ inline void recurIsolate(double l, double r, double fl, double fr, int lnv, int
     }
 };
 
-inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol)
+inline RootFinder::RootSet isolateRealRoots(const RootFinder::CoeffVector &coeffs, double lbound, double ubound, double tol)
 // Calculate roots of coeffs(x) inside (lbound, rbound) leveraging Sturm theory
 // Requirement: leading coefficient must be nonzero
 //              coeffs(lbound) != 0, coeffs(rbound) != 0, lbound < rbound
 {
-    std::set<double> rts;
+    RootFinder::RootSet rts;
 
     // Calculate monic coefficients
     int order = (int)coeffs.size() - 1;
-    Eigen::VectorXd monicCoeffs(order + 1);
+    RootFinder::CoeffVector monicCoeffs(order + 1);
     monicCoeffs << 1.0, coeffs.tail(order) / coeffs(0);
 
     // Calculate Cauchy’s bound for the roots of a polynomial
     double rho_c = 1 + monicCoeffs.tail(order).cwiseAbs().maxCoeff();
 
     // Calculate Kojima’s bound for the roots of a polynomial
-    Eigen::VectorXd nonzeroCoeffs(order + 1);
+    RootFinder::CoeffVector nonzeroCoeffs(order + 1);
     nonzeroCoeffs.setZero();
     int nonzeros = 0;
     double tempEle;
@@ -696,7 +755,7 @@ inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double l
         }
     }
     nonzeroCoeffs = nonzeroCoeffs.head(nonzeros).eval();
-    Eigen::VectorXd kojimaVec = nonzeroCoeffs.tail(nonzeros - 1).cwiseQuotient(nonzeroCoeffs.head(nonzeros - 1)).cwiseAbs();
+    RootFinder::CoeffVector kojimaVec = nonzeroCoeffs.tail(nonzeros - 1).cwiseQuotient(nonzeroCoeffs.head(nonzeros - 1)).cwiseAbs();
     kojimaVec.tail(1) /= 2.0;
     double rho_k = 2.0 * kojimaVec.maxCoeff();
 
@@ -1011,8 +1070,10 @@ inline int countRoots(const Eigen::VectorXd &coeffs, double l, double r)
     return nRoots;
 }
 
-inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol, bool isolation = true)
-// Calculate roots of coeffs(x) inside (lbound, rbound)
+inline void solvePolynomial(const Eigen::Ref<const Eigen::VectorXd> &coeffs, double lbound, double ubound, double tol,
+                            RootSet &rts, bool isolation = true)
+// Calculate roots of coeffs(x) inside (lbound, rbound) and store them in rts
+// Nothing is allocated for orders up to RootFinderParam::highestOrder, so one RootSet can be reused for many polynomials
 //
 // Closed-form solutions are employed for reduced_order < 5
 // isolation = true:
@@ -1024,7 +1085,7 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
 // Requirement: leading coefficient must be nonzero
 //              coeffs(lbound) != 0, coeffs(rbound) != 0, lbound < rbound
 {
-    std::set<double> rts;
+    rts.clear();
 
     int valid = coeffs.size();
     for (int i = 0; i < coeffs.size(); i++)
@@ -1068,7 +1129,7 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
     }
     else
     {
-        Eigen::VectorXd ncoeffs(std::max(5, nonzeros));
+        CoeffVector ncoeffs(std::max(5, nonzeros));
         ncoeffs.setZero();
         ncoeffs.tail(nonzeros) << coeffs.segment(coeffs.size() - valid, nonzeros);
 
@@ -1094,19 +1155,15 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
         }
     }
 
-    for (auto it = rts.begin(); it != rts.end();)
-    {
-        if (*it > lbound && *it < ubound)
-        {
-            it++;
-        }
-        else
-        {
-            it = rts.erase(it);
-        }
-    }
+    rts.keepInside(lbound, ubound);
+}
 
-    return rts;
+inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol, bool isolation = true)
+// Calculate roots of coeffs(x) inside (lbound, rbound)
+{
+    RootSet rts;
+    solvePolynomial(coeffs, lbound, ubound, tol, rts, isolation);
+    return std::set<double>(rts.begin(), rts.end());
 }
 
 } // namespace RootFinder
@@ -0,0 +1,134 @@
+//
+// Fixed-capacity single-producer/single-consumer ring buffer.
+//
+
+#ifndef SPSC_RING_BUFFER_H
+#define SPSC_RING_BUFFER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/// One thread (the producer) calls push(), clear() and back(). Another thread (the consumer) calls pop(). Both may call
+/// size(), empty() and snapshot(), which reads the items in place. No call blocks or allocates. The consumer should
+/// read items through a snapshot, since the producer may clear the buffer between an empty() check and a read.
+///
+/// The consumer is the only writer of head and the producer the only writer of tail and discard_until. clear() does
+/// not touch head: it moves discard_until to tail, and both sides treat every item before discard_until as removed.
+/// Discarded items still take space until the consumer passes them, so CAPACITY should be about twice the number of
+/// items kept.
+template<typename T, size_t CAPACITY>
+class SpscRingBuffer{
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+    /// Items from the first one to the last one at the time of the call, read without a copy. The producer does not
+    /// overwrite them before the consumer pops them, and the consumer never writes items. A snapshot should not be used
+    /// after the thread that took it has changed the buffer.
+    class Snapshot{
+    public:
+        class Iterator{
+        public:
+            Iterator(const SpscRingBuffer *buffer_in, uint64_t index_in) : buffer(buffer_in), index(index_in) {}
+
+            const T &operator*() const { return buffer->items[index & (CAPACITY - 1)]; }
+            const T *operator->() const { return &buffer->items[index & (CAPACITY - 1)]; }
+            Iterator &operator++() { ++ index; return *this; }
+            bool operator!=(const Iterator &other) const { return index != other.index; }
+            bool operator==(const Iterator &other) const { return index == other.index; }
+
+        private:
+            const SpscRingBuffer *buffer;
+            uint64_t index;
+        };
+
+        Snapshot(const SpscRingBuffer *buffer_in, uint64_t first_in, uint64_t last_in)
+            : buffer(buffer_in), first(first_in), last(last_in) {}
+
+        Iterator begin() const { return Iterator(buffer, first); }
+        Iterator end() const { return Iterator(buffer, last); }
+
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+
+        const T &operator[](size_t i) const { return buffer->items[(first + i) & (CAPACITY - 1)]; }
+        const T &front() const { return (*this)[0]; }
+        const T &back() const { return (*this)[size() - 1]; }
+
+    private:
+        const SpscRingBuffer *buffer;
+        uint64_t first;
+        uint64_t last;
+    };
+
+    SpscRingBuffer() : head(0), tail(0), discard_until(0) {}
+
+    SpscRingBuffer(const SpscRingBuffer &) = delete;
+    SpscRingBuffer &operator=(const SpscRingBuffer &) = delete;
+
+    static constexpr size_t capacity() { return CAPACITY; }
+
+    Snapshot snapshot() const
+    {
+        /// The first index is read before the tail, so it never passes the tail
+        const uint64_t first = firstIndex();
+        return Snapshot(this, first, tail.load(std::memory_order_acquire));
+    }
+
+    size_t size() const { return snapshot().size(); }
+
+    bool empty() const { return snapshot().empty(); }
+
+    /// Producer. Returns false if the buffer is full.
+    bool push(const T &item)
+    {
+        const uint64_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) >= CAPACITY){
+            return false;
+        }
+        items[t & (CAPACITY - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Producer. Remove all items.
+    void clear()
+    {
+        discard_until.store(tail.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+
+    /// Producer. The buffer should not be empty.
+    const T &back() const
+    {
+        return items[(tail.load(std::memory_order_relaxed) - 1) & (CAPACITY - 1)];
+    }
+
+    /// Consumer. Returns false if the buffer is empty.
+    bool pop()
+    {
+        const uint64_t h = firstIndex();
+        if(h == tail.load(std::memory_order_acquire)){
+            head.store(h, std::memory_order_release);
+            return false;
+        }
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    uint64_t firstIndex() const
+    {
+        return std::max(head.load(std::memory_order_acquire), discard_until.load(std::memory_order_acquire));
+    }
+
+    std::array<T, CAPACITY> items;
+
+    /// On separate cache lines, since they are written by different threads
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> discard_until;
+};
+
+#endif //SPSC_RING_BUFFER_H
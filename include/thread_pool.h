@@ -0,0 +1,129 @@
+//
+// Persistent worker threads for short parallel loops in the planner.
+//
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed group of worker threads that run the iterations of parallelFor(). The threads are created once and sleep
+/// between loops, so a loop costs a wake up instead of a thread creation. The calling thread works on the loop too.
+class ThreadPool{
+public:
+    /// worker_num: number of threads besides the calling thread. 0 runs every loop in the calling thread.
+    explicit ThreadPool(int worker_num = 0)
+        : current_job(nullptr), job_num(0), next_index(0), active_worker_num(0), generation(0), stopping(false)
+    {
+        for(int i=0; i<worker_num; ++i){
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for(auto &w : workers){
+            w.join();
+        }
+    }
+
+    /// Number of threads that run a loop, including the calling thread
+    int threadNum() const { return (int)workers.size() + 1; }
+
+    /// Run job(0) ... job(num-1) on all threads and return when all of them are done. The order of the iterations is
+    /// not defined, so each iteration should only write its own result. Calls from different threads are serialized.
+    void parallelFor(int num, const std::function<void(int)> &job)
+    {
+        if(num <= 0){
+            return;
+        }
+        if(workers.empty() || num == 1){
+            for(int i=0; i<num; ++i){
+                job(i);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> call_lock(call_mutex);
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            current_job = &job;
+            job_num = num;
+            next_index.store(0);
+            active_worker_num = (int)workers.size();
+            ++ generation;
+        }
+        start_cv.notify_all();
+
+        runIterations(job, num);
+
+        std::unique_lock<std::mutex> lock(state_mutex);
+        done_cv.wait(lock, [this]{ return active_worker_num == 0; });
+        current_job = nullptr;
+    }
+
+private:
+    void runIterations(const std::function<void(int)> &job, int num)
+    {
+        int i;
+        while((i = next_index.fetch_add(1)) < num){
+            job(i);
+        }
+    }
+
+    void workerLoop()
+    {
+        unsigned long last_generation = 0;
+        while(true){
+            const std::function<void(int)> *job;
+            int num;
+            {
+                std::unique_lock<std::mutex> lock(state_mutex);
+                start_cv.wait(lock, [&]{ return stopping || generation != last_generation; });
+                if(stopping){
+                    return;
+                }
+                last_generation = generation;
+                job = current_job;
+                num = job_num;
+            }
+
+            runIterations(*job, num);
+
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                -- active_worker_num;
+            }
+            done_cv.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex call_mutex;
+    std::mutex state_mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+
+    const std::function<void(int)> *current_job;
+    int job_num;
+    std::atomic<int> next_index;
+    int active_worker_num;
+    unsigned long generation;
+    bool stopping;
+};
+
+#endif //THREAD_POOL_H
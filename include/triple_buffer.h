@@ -0,0 +1,55 @@
+//
+// Latest value handed from one thread to another without a lock.
+//
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/// One thread (the writer) calls write(). Another thread (the reader) calls read(), which returns the last value written
+/// before the call, or a default constructed value before the first write. Neither call blocks, loops or allocates.
+///
+/// There are three items. The writer owns one and the reader owns another. The third one is the newest value written,
+/// or an item the reader has given back. write() fills the item of the writer and swaps it with the third one. read()
+/// swaps its item with the third one only when the third one is newer. The swaps are one atomic exchange each, so an
+/// item is never written while the other side uses it.
+template<typename T>
+class TripleBuffer{
+public:
+    TripleBuffer() : write_index(0), read_index(1), middle(2) {}
+
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+    /// Writer
+    void write(const T &value)
+    {
+        items[write_index] = value;
+        write_index = middle.exchange(write_index | NEW_VALUE, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    /// Reader. The reference is valid until the next call.
+    const T &read()
+    {
+        if(middle.load(std::memory_order_relaxed) & NEW_VALUE){
+            read_index = middle.exchange(read_index, std::memory_order_acq_rel) & INDEX_MASK;
+        }
+        return items[read_index];
+    }
+
+private:
+    static constexpr uint8_t INDEX_MASK = 3;
+    static constexpr uint8_t NEW_VALUE = 4;
+
+    std::array<T, 3> items;
+
+    /// On separate cache lines, since they are written by different threads
+    alignas(64) uint8_t write_index;
+    alignas(64) uint8_t read_index;
+    alignas(64) std::atomic<uint8_t> middle;
+};
+
+#endif //TRIPLE_BUFFER_H
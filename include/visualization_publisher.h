@@ -0,0 +1,78 @@
+//
+// Background thread that builds and publishes visualization messages.
+//
+
+#ifndef VISUALIZATION_PUBLISHER_H
+#define VISUALIZATION_PUBLISHER_H
+
+#include "bounded_queue.h"
+#include <functional>
+#include <thread>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
+
+/// Jobs posted by the planning threads run in order on one thread with the idle scheduling policy, so building the
+/// markers never takes CPU time from planning. When the thread falls behind, the oldest jobs are dropped. Without
+/// start(), post() runs the job in the calling thread.
+class VisualizationPublisher{
+public:
+    VisualizationPublisher() : jobs(16), running(false) {}
+
+    VisualizationPublisher(const VisualizationPublisher &) = delete;
+    VisualizationPublisher &operator=(const VisualizationPublisher &) = delete;
+
+    ~VisualizationPublisher()
+    {
+        stop();
+    }
+
+    void start(size_t queue_size = 16)
+    {
+        if(running){
+            return;
+        }
+        jobs.setCapacity(queue_size);
+        running = true;
+        worker = std::thread(&VisualizationPublisher::workerLoop, this);
+    }
+
+    /// Publish the jobs still in the queue and join the thread
+    void stop()
+    {
+        if(!running){
+            return;
+        }
+        jobs.close();
+        worker.join();
+        running = false;
+    }
+
+    void post(std::function<void()> job)
+    {
+        if(running){
+            jobs.push(std::move(job));
+        }else{
+            job();
+        }
+    }
+
+private:
+    void workerLoop()
+    {
+        sched_param param{};
+        param.sched_priority = 0;
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+        std::function<void()> job;
+        while(jobs.pop(job)){
+            job();
+        }
+    }
+
+    BoundedQueue<std::function<void()>> jobs;
+    std::thread worker;
+    bool running;
+};
+
+#endif //VISUALIZATION_PUBLISHER_H
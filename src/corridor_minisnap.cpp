@@ -11,66 +11,52 @@
 
 #include <CorridorMiniSnap/corridor_minisnap.h>
 
-#include <CorridorMiniSnap/root_finder.hpp>
+#include <root_finder.hpp>
 
 using namespace traj_opt;
 
+double divided_factorial(int i, int d);
+
 /********************************/
 /********** Poly Piece **********/
 /********************************/
 
-void PolyPiece::setup(const double t) { _duration = t; }
-void PolyPiece::setup(const Eigen::MatrixXd coeffs) { _coeffs = coeffs; }
+void PolyPiece::setup(const double t) {
+  _duration = t;
+  updateDerivatives();
+}
+void PolyPiece::setup(const Eigen::MatrixXd coeffs) {
+  _coeffs = coeffs;
+  updateDerivatives();
+}
 void PolyPiece::setup(const double t, const Eigen::MatrixXd coeffs) {
-  setup(t);
-  setup(coeffs);
+  _duration = t;
+  _coeffs   = coeffs;
+  updateDerivatives();
 }
 
 /**
- * @brief get position
- * @param t relative time stamp
- * @return Eigen::Vector3d
+ * @brief scale the derivatives from relative time to absolute time once, so
+ * they are evaluated without divisions
  */
-Eigen::Vector3d PolyPiece::getPos(double t) const {
-  Eigen::Vector3d pos = Eigen::Vector3d::Zero();
-  Eigen::VectorXd T(N_ORDER + 1);
-  T(0) = 1;
-  for (int i = 1; i <= N_ORDER; i++) {
-    T(i) = pow(t, i);
-  }
-  pos = _coeffs * T;
-  return pos;
+void PolyPiece::updateDerivatives() {
+  double T_inv = 1.0 / _duration;
+  _vel_coeffs  = derivative(_coeffs) * T_inv;
+  _acc_coeffs  = derivative(_vel_coeffs) * T_inv;
+  _jrk_coeffs  = derivative(_acc_coeffs) * T_inv;
 }
 
-Eigen::Vector3d PolyPiece::getVel(double t) const {
-  Eigen::VectorXd T(N_ORDER);
-  T(0) = 1;
-  for (int i = 1; i <= N_ORDER - 1; i++) {
-    T(i) = pow(t, i) * (i + 1);
-  }
-  Eigen::Vector3d vel = _coeffs.block<3, 7>(0, 1) * T / _duration;
-
-  return vel;
-}
-
-Eigen::Vector3d PolyPiece::getAcc(double t) const {
-  Eigen::VectorXd T(N_ORDER - 1);
-  T(0) = 2;
-  for (int i = 1; i <= N_ORDER - 2; i++) {
-    T(i) = pow(t, i) * (i + 1) * (i + 2);
-  }
-  Eigen::Vector3d acc = _coeffs.block<3, 6>(0, 2) * T / pow(_duration, 2);
-  return acc;
-}
-
-Eigen::Vector3d PolyPiece::getJrk(double t) const {
-  Eigen::VectorXd T(N_ORDER - 2);
-  T(0) = 6;
-  for (int i = 1; i <= N_ORDER - 3; i++) {
-    T(i) = pow(t, i) * (i + 1) * (i + 2) * (i + 3);
-  }
-  Eigen::Vector3d jrk = _coeffs.block<3, 5>(0, 3) * T;
-  return jrk;
+/**
+ * @brief get position, velocity, acceleration and jerk
+ * @param t relative time stamp
+ */
+PolyState PolyPiece::getState(double t) const {
+  PolyState state;
+  state.pos = evaluatePolynomial(_coeffs, t);
+  state.vel = evaluatePolynomial(_vel_coeffs, t);
+  state.acc = evaluatePolynomial(_acc_coeffs, t);
+  state.jrk = evaluatePolynomial(_jrk_coeffs, t);
+  return state;
 }
 
 Eigen::Matrix3Xd Trajectory::getPositions() const {
@@ -170,6 +156,13 @@ Eigen::Vector3d Trajectory::getJrk(double t) const {
   return _pieces[index].getJrk(relative_time);
 }
 
+PolyState Trajectory::getState(double t) const {
+  double relative_time;
+  int    index;
+  locatePiece(t, relative_time, index);
+  return _pieces[index].getState(relative_time);
+}
+
 double Trajectory::getDuration() const {
   double T = 0;
   for (size_t i = 0; i < N; i++) {
@@ -178,34 +171,85 @@ double Trajectory::getDuration() const {
   return T;
 }
 
+/**
+ * @brief sample at t0, t0 + dt, ..., t0 + (count - 1) * dt. The piece of each
+ * sample is found from the piece of the last one, so dt should not be negative.
+ * Time stamps after the end give the end state, like getPos().
+ * @param samples buffer of the caller, resized to count
+ */
+void Trajectory::sample(double t0, double dt, int count, TrajectorySamples &samples) const {
+  samples.resize(count);
+  int    idx         = 0;
+  double piece_start = 0;  // absolute start time of piece idx
+  for (int k = 0; k < count; k++) {
+    double t = t0 + dt * k;
+    while (idx < N - 1 && t - piece_start > _pieces[idx].getDuration()) {
+      piece_start += _pieces[idx].getDuration();
+      idx++;
+    }
+    double relative_time = (t - piece_start) / _pieces[idx].getDuration();
+    if (relative_time > 1) {
+      relative_time = 1;
+    }
+
+    PolyState state    = _pieces[idx].getState(relative_time);
+    samples.t[k]       = t;
+    samples.pos.col(k) = state.pos;
+    samples.vel.col(k) = state.vel;
+    samples.acc.col(k) = state.acc;
+    samples.jrk.col(k) = state.jrk;
+  }
+}
+
 double Trajectory::getMaxVelRate() const {
-  double T = 0;
+  TrajectorySamples samples;
+  sample(0, 0.1, (int)std::ceil(getDuration() / 0.1), samples);
   double V = 0;
-  for (double t = 0; t < getDuration(); t += 0.1) {
-    Eigen::Vector3d v;
-    v             = this->getVel(t);
-    double v_rate = v.norm();
-    if (v_rate > V) {
-      V = v_rate;
-    }
+  for (int k = 0; k < samples.size(); k++) {
+    V = std::max(V, samples.vel.col(k).norm());
   }
   return V;
 }
 
 double Trajectory::getMaxAccRate() const {
-  double T = 0;
+  TrajectorySamples samples;
+  sample(0, 0.1, (int)std::ceil(getDuration() / 0.1), samples);
   double A = 0;
-  for (double t = 0; t < getDuration(); t += 0.1) {
-    Eigen::Vector3d a;
-    a             = this->getAcc(t);
-    double a_rate = a.norm();
-    if (a_rate > A) {
-      A = a_rate;
-    }
+  for (int k = 0; k < samples.size(); k++) {
+    A = std::max(A, samples.acc.col(k).norm());
   }
   return A;
 }
 
+/**
+ * @brief sum over the pieces of factors[d] times the integral of the squared
+ * d-th derivative, in the time of the trajectory. Unlike
+ * CorridorMiniSnap::getMinimumCost(), which is in the relative time of each
+ * piece, it compares trajectories with different time allocations.
+ */
+double Trajectory::getCost(const std::vector<double> &factors) const {
+  double cost = 0;
+  for (int i = 0; i < N; i++) {
+    double                                  T     = _pieces[i].getDuration();
+    Eigen::Matrix<double, DIM, N_ORDER + 1> coeff = _pieces[i].getCoefficient();
+    for (int d = 0; d <= D_ORDER && d < (int)factors.size(); d++) {
+      if (factors[d] == 0) {
+        continue;
+      }
+      /* integral of the squared derivative over the relative time [0, 1] */
+      double integral = 0;
+      for (int j = d; j <= N_ORDER; j++) {
+        for (int k = d; k <= N_ORDER; k++) {
+          integral += divided_factorial(j, d) * divided_factorial(k, d) / (j + k - 2 * d + 1) *
+                      coeff.col(j).dot(coeff.col(k));
+        }
+      }
+      cost += factors[d] * integral / pow(T, 2 * d - 1);
+    }
+  }
+  return cost;
+}
+
 int Trajectory::getPieceNum() const { return N; }
 
 /**********************************/
@@ -215,12 +259,12 @@ int Trajectory::getPieceNum() const { return N; }
 void MiniSnap::reset(const Eigen::Matrix3d &head, const Eigen::Matrix3d &tail,
                      const std::vector<Eigen::Vector3d> &waypoints,
                      const std::vector<double> &         timeAlloc) {
-  ROS_INFO_STREAM("[TrajOpt] head state:\n" << head);
-  ROS_INFO_STREAM("[TrajOpt] tail state:\n" << tail);
+  ROS_DEBUG_STREAM("[TrajOpt] head state:\n" << head);
+  ROS_DEBUG_STREAM("[TrajOpt] tail state:\n" << tail);
   _headPVA = head;
   _tailPVA = tail;
-  ROS_INFO_STREAM("[TrajOpt] waypoints:" << waypoints.size());
-  ROS_INFO_STREAM("[TrajOpt] timeAlloc:" << timeAlloc.size());
+  ROS_DEBUG_STREAM("[TrajOpt] waypoints:" << waypoints.size());
+  ROS_DEBUG_STREAM("[TrajOpt] timeAlloc:" << timeAlloc.size());
   _waypoints = waypoints;
   _timeAlloc = timeAlloc;
   N          = timeAlloc.size();
@@ -352,7 +396,7 @@ void MiniSnap::getContinuityConstraint() {
 
 bool MiniSnap::solveQP() {
   IOSQP solver;
-  ROS_INFO("[TrajOpt] start solving");
+  ROS_DEBUG("[TrajOpt] start solving");
   Eigen::VectorXd q;
   q.resize(N * (N_ORDER + 1) * DIM);
   q.setZero();
@@ -372,12 +416,12 @@ bool MiniSnap::solveQP() {
  */
 bool MiniSnap::optimize() {
   getCostFunc();
-  ROS_INFO("[TrajOpt] Generated Cost Func");
+  ROS_DEBUG("[TrajOpt] Generated Cost Func");
   getHeadTailConstraint();
   getWaypointsConstraint();
-  ROS_INFO("[TrajOpt] Generated WaypointsConstraint");
+  ROS_DEBUG("[TrajOpt] Generated WaypointsConstraint");
   getContinuityConstraint();
-  ROS_INFO("[TrajOpt] Generated ContinuityConstraint");
+  ROS_DEBUG("[TrajOpt] Generated ContinuityConstraint");
   _lb            = _ub;
   bool isSuccess = solveQP();
   return isSuccess;
@@ -402,18 +446,17 @@ double MiniSnap::getMinimumCost() const { return _x.transpose() * _Q * _x; }
 void CorridorMiniSnap::reset(const Eigen::Matrix3d &head, const Eigen::Matrix3d &tail,
                              const std::vector<double> &                      timeAlloc,
                              const std::vector<Eigen::Matrix<double, 6, -1>> &corridors) {
-  ROS_INFO_STREAM("[TrajOpt] head state:\n" << head);
-  ROS_INFO_STREAM("[TrajOpt] tail state:\n" << tail);
+  ROS_DEBUG_STREAM("[TrajOpt] head state:\n" << head);
+  ROS_DEBUG_STREAM("[TrajOpt] tail state:\n" << tail);
   _headPVA = head;
   _tailPVA = tail;
-  ROS_INFO_STREAM("[TrajOpt] timeAlloc:" << timeAlloc.size());
+  ROS_DEBUG_STREAM("[TrajOpt] timeAlloc:" << timeAlloc.size());
   _timeAlloc = timeAlloc;
   _Polygons  = corridors;
   N          = timeAlloc.size();
   int S      = N * (N_ORDER + 1) * DIM;  // number of variables
   _x.resize(S);
   _Q.resize(S, S);
-  _Q.setZero();
 
   n_hyperplanes = 0;
   for (int i = 0; i < corridors.size() - 1; i++) {
@@ -428,14 +471,98 @@ void CorridorMiniSnap::reset(const Eigen::Matrix3d &head, const Eigen::Matrix3d
    */
   // int M = DIM * 4 * 2 + 2 * N_POLYHEDRA * (N - 1) + DIM * 4 * (N - 1);
   int M = DIM * 4 * 2 + DIM * 4 * (N - 1) + n_hyperplanes;
-  _A.resize(M, S);
-  _A.setZero();
-  _ub.resize(M);  // inherited b as upper bound
+
+  /**
+   * @brief rows reserved for the constraints of isCorridorSatisfied(), with
+   * the pattern of all coefficients of their piece. Inactive until used.
+   */
+  int N_PIECE          = DIM * (N_ORDER + 1);
+  _slack_rows_reserved = _persistent_solver ? _slack_rows_per_piece : 0;
+  _slack_row_begin     = M;
+  _slack_rows_used.assign(N, 0);
+  int slack_rows = _slack_rows_reserved * N;
+
+  _A_triplets.clear();
+  _A_triplets.reserve(DIM * 4 * 2 * (N_ORDER + 1) + n_hyperplanes * N_PIECE +
+                      DIM * 4 * (N - 1) * (N_ORDER + 2) + slack_rows * N_PIECE);
+  for (int r = 0; r < slack_rows; r++) {
+    int piece = r / _slack_rows_reserved;
+    for (int k = 0; k < N_PIECE; k++) {
+      _A_triplets.emplace_back(M + r, piece * N_PIECE + k, 0.0);
+    }
+  }
+  _ub.resize(M + slack_rows);  // inherited b as upper bound
   _ub.setZero();
-  _lb.resize(M);  // lower bound
+  _lb.resize(M + slack_rows);  // lower bound
   _lb.setZero();
+  _ub.tail(slack_rows).setConstant(OSQP_INFTY);
+  _lb.tail(slack_rows).setConstant(-OSQP_INFTY);
+}
+
+void CorridorMiniSnap::setPersistentSolver(bool enable, int slack_rows) {
+  _persistent_solver    = enable;
+  _slack_rows_per_piece = std::max(slack_rows, 0);
+}
+
+/**
+ * @brief add a nonzero of the constraint matrix. Zeros are skipped, so the
+ * matrix has the nonzeros the dense matrix had after sparseView(). A persistent
+ * solver keeps them, so the pattern does not depend on the corridor normals.
+ */
+inline void CorridorMiniSnap::addConstraintCoeff(int row, int col, double value) {
+  if (value != 0 || _persistent_solver) {
+    _A_triplets.emplace_back(row, col, value);
+  }
+}
+
+/**
+ * @brief add the coefficients of one dimension of one piece to a constraint row
+ */
+inline void CorridorMiniSnap::addConstraintCoeffs(int row, int col,
+                                                  const Eigen::Matrix<double, 1, N_ORDER + 1> &coeffs) {
+  for (int k = 0; k <= N_ORDER; k++) {
+    addConstraintCoeff(row, col + k, coeffs(k));
+  }
+}
+
+/**
+ * @brief add a constraint of isCorridorSatisfied() on the coefficients of a
+ * piece. It takes a reserved row of the piece if one is left, otherwise it is
+ * appended as a new row.
+ */
+inline void CorridorMiniSnap::addRefinementConstraint(
+    int piece, const Eigen::Matrix<double, 1, DIM * (N_ORDER + 1)> &coeffs, double ub, int &row,
+    std::vector<double> &constraint_ub) {
+  int C       = N_ORDER + 1;
+  int N_PIECE = DIM * C;
+  if (_slack_rows_used[piece] < _slack_rows_reserved) {
+    int slack_row = piece * _slack_rows_reserved + _slack_rows_used[piece]++;
+    for (int k = 0; k < N_PIECE; k++) {
+      _A_triplets[slack_row * N_PIECE + k] =
+          Triplet(_slack_row_begin + slack_row, piece * N_PIECE + k, coeffs(k));
+    }
+    _ub(_slack_row_begin + slack_row) = ub;
+    _lb(_slack_row_begin + slack_row) = -OSQP_INFTY;
+    return;
+  }
+
+  for (int i = 0; i < DIM; i++) {
+    addConstraintCoeffs(row, piece * N_PIECE + i * C, coeffs.segment<N_ORDER + 1>(i * C));
+  }
+  constraint_ub.push_back(ub);
+  row++;
 }
 
+/**
+ * @brief coefficients of a piece with d on one dimension
+ */
+static Eigen::Matrix<double, 1, DIM * (N_ORDER + 1)> singleDimensionCoeffs(
+    int dim, const Eigen::Matrix<double, 1, N_ORDER + 1> &d) {
+  Eigen::Matrix<double, 1, DIM * (N_ORDER + 1)> coeffs;
+  coeffs.setZero();
+  coeffs.segment<N_ORDER + 1>(dim * (N_ORDER + 1)) = d;
+  return coeffs;
+}
 
 /**
  * @brief
@@ -455,9 +582,9 @@ void CorridorMiniSnap::getTransitionConstraint(double delta) {
     for (int i = 0; i < this_corridor.cols(); i++) {
       Eigen::VectorXd v = this_corridor.col(i);
       // int row_index = SR + i + 2 * N_POLYHEDRA * j;
-      _A.block(row_index, j * N_PIECE + 0, 1, C)     = pos_1d * v(0);
-      _A.block(row_index, j * N_PIECE + C, 1, C)     = pos_1d * v(1);
-      _A.block(row_index, j * N_PIECE + C * 2, 1, C) = pos_1d * v(2);
+      addConstraintCoeffs(row_index, j * N_PIECE + 0, pos_1d * v(0));
+      addConstraintCoeffs(row_index, j * N_PIECE + C, pos_1d * v(1));
+      addConstraintCoeffs(row_index, j * N_PIECE + C * 2, pos_1d * v(2));
 
       Eigen::Vector3d n_vec(v(0), v(1), v(2)), p(v(3), v(4), v(5));
       p[1] = p[1] - delta * n_vec[1];
@@ -471,9 +598,9 @@ void CorridorMiniSnap::getTransitionConstraint(double delta) {
     for (int i = 0; i < next_corridor.cols(); i++) {
       Eigen::VectorXd v = next_corridor.col(i);
       // int row_index = SR + i + 2 * N_POLYHEDRA * j + N_POLYHEDRA;
-      _A.block(row_index, j * N_PIECE + 0, 1, C)     = pos_1d * v(0);
-      _A.block(row_index, j * N_PIECE + C, 1, C)     = pos_1d * v(1);
-      _A.block(row_index, j * N_PIECE + C * 2, 1, C) = pos_1d * v(2);
+      addConstraintCoeffs(row_index, j * N_PIECE + 0, pos_1d * v(0));
+      addConstraintCoeffs(row_index, j * N_PIECE + C, pos_1d * v(1));
+      addConstraintCoeffs(row_index, j * N_PIECE + C * 2, pos_1d * v(2));
       Eigen::Vector3d n_vec(v(0), v(1), v(2)), p(v(3), v(4), v(5));
       p[1] = p[1] - delta * n_vec[1];
       p[2] = p[2] - 0.5 * delta * n_vec[1];
@@ -501,28 +628,25 @@ void CorridorMiniSnap::getContinuityConstraint() {
 
   for (int j = 0; j < N - 1; j++) {
     for (int i = 0; i < DIM; i++) {
-      _A.block(SR + 0 + 4 * i + 12 * j, i * M + j * K, 1, N_ORDER + 1) = pos_1d;
-      _A.block(SR + 1 + 4 * i + 12 * j, i * M + j * K, 1, N_ORDER + 1) = vel_1d;
-      _A.block(SR + 2 + 4 * i + 12 * j, i * M + j * K, 1, N_ORDER + 1) = acc_1d;
-      _A.block(SR + 3 + 4 * i + 12 * j, i * M + j * K, 1, N_ORDER + 1) = jer_1d;
-      _A(SR + 0 + 4 * i + 12 * j, 0 + K * (j + 1) + i * M)             = -1;
-      _A(SR + 1 + 4 * i + 12 * j, 1 + K * (j + 1) + i * M)             = -1;
-      _A(SR + 2 + 4 * i + 12 * j, 2 + K * (j + 1) + i * M)             = -2;
-      _A(SR + 3 + 4 * i + 12 * j, 3 + K * (j + 1) + i * M)             = -6;
+      addConstraintCoeffs(SR + 0 + 4 * i + 12 * j, i * M + j * K, pos_1d);
+      addConstraintCoeffs(SR + 1 + 4 * i + 12 * j, i * M + j * K, vel_1d);
+      addConstraintCoeffs(SR + 2 + 4 * i + 12 * j, i * M + j * K, acc_1d);
+      addConstraintCoeffs(SR + 3 + 4 * i + 12 * j, i * M + j * K, jer_1d);
+      addConstraintCoeff(SR + 0 + 4 * i + 12 * j, 0 + K * (j + 1) + i * M, -1);
+      addConstraintCoeff(SR + 1 + 4 * i + 12 * j, 1 + K * (j + 1) + i * M, -1);
+      addConstraintCoeff(SR + 2 + 4 * i + 12 * j, 2 + K * (j + 1) + i * M, -2);
+      addConstraintCoeff(SR + 3 + 4 * i + 12 * j, 3 + K * (j + 1) + i * M, -6);
     }
   }
-  // std::cout << _ub << std::endl;
-  // std::cout << _A.block(0, 0, 24, 360) << std::endl;
-  // std::cout << _A.block(15 * N - 15, 3*8*N - 48, 24, 48) << std::endl;
 }
 
 void CorridorMiniSnap::getHeadTailConstraint() {
   /* constraints for starting states*/
   for (int i = 0; i < DIM; i++) {
-    _A(0 + 4 * i, 0 + 8 * i) = 1;
-    _A(1 + 4 * i, 1 + 8 * i) = 1;
-    _A(2 + 4 * i, 2 + 8 * i) = 2;
-    _A(3 + 4 * i, 3 + 8 * i) = 6;
+    addConstraintCoeff(0 + 4 * i, 0 + 8 * i, 1);
+    addConstraintCoeff(1 + 4 * i, 1 + 8 * i, 1);
+    addConstraintCoeff(2 + 4 * i, 2 + 8 * i, 2);
+    addConstraintCoeff(3 + 4 * i, 3 + 8 * i, 6);
     _ub(0 + 4 * i)           = _headPVA(i, 0);
     _ub(1 + 4 * i)           = _headPVA(i, 1) * _timeAlloc[0];
     _ub(2 + 4 * i)           = _headPVA(i, 2) * _timeAlloc[0] * _timeAlloc[0];
@@ -545,12 +669,10 @@ void CorridorMiniSnap::getHeadTailConstraint() {
   jer_1d << 0, 0, 0, 6, 24, 60, 120, 210;
   double T = _timeAlloc[N - 1];
   for (int i = 0; i < DIM; i++) {
-    // std::cout << _A.rows() << ' ' << _A.cols() << ' ' << M + 8 * i <<
-    // std::endl;
-    _A.block(12 + 0 + 4 * i, M + 8 * i, 1, N_ORDER + 1) = pos_1d;
-    _A.block(12 + 1 + 4 * i, M + 8 * i, 1, N_ORDER + 1) = vel_1d;
-    _A.block(12 + 2 + 4 * i, M + 8 * i, 1, N_ORDER + 1) = acc_1d;
-    _A.block(12 + 3 + 4 * i, M + 8 * i, 1, N_ORDER + 1) = jer_1d;
+    addConstraintCoeffs(12 + 0 + 4 * i, M + 8 * i, pos_1d);
+    addConstraintCoeffs(12 + 1 + 4 * i, M + 8 * i, vel_1d);
+    addConstraintCoeffs(12 + 2 + 4 * i, M + 8 * i, acc_1d);
+    addConstraintCoeffs(12 + 3 + 4 * i, M + 8 * i, jer_1d);
     _ub(12 + 0 + 4 * i)                                 = _tailPVA(i, 0);
     _ub(12 + 1 + 4 * i)                                 = _tailPVA(i, 1) * T;
     _ub(12 + 2 + 4 * i)                                 = _tailPVA(i, 2) * T * T;
@@ -563,21 +685,26 @@ void CorridorMiniSnap::getHeadTailConstraint() {
 }
 
 bool CorridorMiniSnap::primarySolveQP() {
-  IOSQP solver;
-  ROS_INFO("[TrajOpt] start solving");
+  IOSQP  local_solver;
+  IOSQP &solver = _persistent_solver ? _solver : local_solver;
+  ROS_DEBUG("[TrajOpt] start solving");
   Eigen::VectorXd q;
   q.resize(N * (N_ORDER + 1) * DIM);
   q.setZero();
-  SparMat Q = _Q.sparseView();
-  SparMat A = _A.sparseView();
+  _A.resize(_ub.rows(), N * (N_ORDER + 1) * DIM);
+  _A.setFromTriplets(_A_triplets.begin(), _A_triplets.end());
+  solver.setTimeLimit(_time_limit);
 //  std::cout << "setMats" << std::endl;
-  c_int flag = solver.setMats(Q, q, A, _lb, _ub, 1e-3, 1e-3);
+  c_int flag = _persistent_solver ? solver.updateMats(_Q, q, _A, _lb, _ub, 1e-3, 1e-3)
+                                  : solver.setMats(_Q, q, _A, _lb, _ub, 1e-3, 1e-3);
 //  std::cout << "FLAG: " << flag << std::endl;
+  _qp_iterations = 0;
   if (flag != 0) {
     std::cout << "Problem non-convex. " << std::endl;
     return false;
   }
   solver.solve();
+  _qp_iterations = solver.getIter();
   c_int status = solver.getStatus();
 //  std::cout << "STATUS: " << status << std::endl;
   _x = solver.getPrimalSol();
@@ -590,13 +717,13 @@ bool CorridorMiniSnap::primarySolveQP() {
 
 bool CorridorMiniSnap::optimize(const std::vector<double> &factors, double delta) {
   getCostFunc(factors);
-  ROS_INFO("[TrajOpt] Generated Cost Func");
+  ROS_DEBUG("[TrajOpt] Generated Cost Func");
   getHeadTailConstraint();
-  ROS_INFO("[TrajOpt] Generated Head Tail Constraint");
+  ROS_DEBUG("[TrajOpt] Generated Head Tail Constraint");
   getTransitionConstraint(delta);
-  ROS_INFO("[TrajOpt] Generated Transitional Constraint");
+  ROS_DEBUG("[TrajOpt] Generated Transitional Constraint");
   getContinuityConstraint();
-  ROS_INFO("[TrajOpt] Generated Continuity Constraint");
+  ROS_DEBUG("[TrajOpt] Generated Continuity Constraint");
   // getCorridorConstraint();
   // std::cout << "Generated Corridor Constraint" << std::endl;
   bool isSuccess = primarySolveQP();
@@ -604,7 +731,7 @@ bool CorridorMiniSnap::optimize(const std::vector<double> &factors, double delta
 }
 
 bool CorridorMiniSnap::reOptimize() {
-  ROS_INFO("[TrajOpt] Solve new QP problem");
+  ROS_DEBUG("[TrajOpt] Solve new QP problem");
   bool isSuccess = primarySolveQP();
   return isSuccess;
 }
@@ -641,52 +768,27 @@ void CorridorMiniSnap::getCostFunc(const std::vector<double> &factors) {
     }
   }
   // std::cout << Q;
-  /* iterate all dimensions and all pieces */
-  for (int i = 0; i < N * DIM; i++) {
-    _Q.block(i * D, i * D, D, D) = Q;
+  /* iterate all dimensions and all pieces, upper triangle only */
+  std::vector<Triplet> triplets;
+  triplets.reserve(N * DIM * D * (D + 1) / 2);
+  for (int k = 0; k < N * DIM; k++) {
+    for (int j = 0; j < D; j++) {
+      for (int i = 0; i <= j; i++) {
+        if (Q(i, j) != 0) {
+          triplets.emplace_back(k * D + i, k * D + j, Q(i, j));
+        }
+      }
+    }
   }
+  _Q.setFromTriplets(triplets.begin(), triplets.end());
 }
 
 typedef Eigen::Matrix<double, DIM, N_ORDER + 1> CoeffMatrix;
 
 /**
- * @brief derivative calculate
- *
- * @param coeff
- * @return Eigen::Matrix<double, DIM, N_ORDER + 1>
- */
-
-Eigen::Matrix<double, DIM, N_ORDER> derivative(CoeffMatrix coeff) {
-  Eigen::Matrix<double, DIM, N_ORDER> der;
-  for (int i = 0; i < DIM; i++) {
-    for (int j = 0; j < N_ORDER; j++) {
-      der(i, j) = coeff(i, j + 1) * (j + 1);
-    }
-  }
-  return der;
-}
-/** TODO: Templates **/
-Eigen::Matrix<double, DIM, N_ORDER - 1> derivative(Eigen::Matrix<double, DIM, N_ORDER> coeff) {
-  Eigen::Matrix<double, DIM, N_ORDER - 1> der;
-  for (int i = 0; i < DIM; i++) {
-    for (int j = 0; j < N_ORDER - 1; j++) {
-      der(i, j) = coeff(i, j + 1) * (j + 1);
-    }
-  }
-  return der;
-}
-Eigen::Matrix<double, DIM, N_ORDER - 2> derivative(Eigen::Matrix<double, DIM, N_ORDER - 1> coeff) {
-  Eigen::Matrix<double, DIM, N_ORDER - 2> der;
-  for (int i = 0; i < DIM; i++) {
-    for (int j = 0; j < N_ORDER - 2; j++) {
-      der(i, j) = coeff(i, j + 1) * (j + 1);
-    }
-  }
-  return der;
-}
-
-/**
- * @brief tangent curve based constraint refinement
+ * @brief tangent curve based constraint refinement. A piece whose Bernstein
+ * coefficients are within a bound cannot violate it, so the roots are only
+ * searched for the bounds that the coefficients do not prove.
  *
  * @param traj
  * @return true
@@ -695,32 +797,34 @@ Eigen::Matrix<double, DIM, N_ORDER - 2> derivative(Eigen::Matrix<double, DIM, N_
  */
 bool CorridorMiniSnap::isCorridorSatisfied(Trajectory &traj, double max_vel, double max_acc,
                                            double delta) {
-  bool                         isSatisfied = true;
-  std::vector<Eigen::VectorXd> constraints;
-  int                          C        = N_ORDER + 1;
-  int                          N_PIECES = DIM * C;
-  int                          S        = N * (N_ORDER + 1) * DIM;
+  bool                isSatisfied = true;
+  std::vector<double> constraint_ub;  // of the rows appended below the current constraints
+  int                 row         = _ub.rows();
+  RootFinder::RootSet roots;          // reused by every root search below
+  _root_searches = 0;
 
   /* add position constraints */
   for (int idx = 0; idx < N; idx++) { /* for each piece */
-    Eigen::MatrixXd                     polyhedra = _Polygons[idx];
+    const Eigen::Matrix<double, 6, -1> &polyhedra = _Polygons[idx];
     CoeffMatrix                         coeff     = traj[idx].getCoefficient();
     Eigen::Matrix<double, DIM, N_ORDER> coeff_dot = derivative(coeff);
 
+    /* upper bound of n^T * pos(t) on the piece, for all hyperplanes at once */
+    Eigen::VectorXd max_projection =
+        (polyhedra.topRows<3>().transpose() * bernsteinCoefficients(coeff)).rowwise().maxCoeff();
+
     for (int i = 0; i < polyhedra.cols(); i++) { /* for each hyperplane */
       Eigen::Vector3d n_vec = polyhedra.block<3, 1>(0, i);
       Eigen::Vector3d p     = polyhedra.block<3, 1>(3, i);
-      Eigen::VectorXd coeff_solver_reverse(7), coeff_solver(7);
-      coeff_solver_reverse = n_vec.transpose() * coeff_dot;
-      for (int j = 0; j < 7; j++) {
-        coeff_solver(j) = coeff_solver_reverse(6 - j);
+      if (max_projection(i) <= n_vec.dot(p)) {
+        continue; /* the piece cannot cross this hyperplane */
       }
 
-      std::set<double> allRoots = RootFinder::solvePolynomial(coeff_solver, 0, 1, 0.0000001);
-
-      for (auto itr = allRoots.begin(); itr != allRoots.end(); itr++) {
-        double t = *itr;
+      Eigen::Matrix<double, N_ORDER, 1> coeff_solver = (coeff_dot.transpose() * n_vec).reverse();
+      RootFinder::solvePolynomial(coeff_solver, 0, 1, 0.0000001, roots);
+      ++_root_searches;
 
+      for (double t : roots) {
         Eigen::Vector3d pos = traj[idx].getPos(t);
 
         if (n_vec.dot(p - pos) < 0) {
@@ -734,118 +838,60 @@ bool CorridorMiniSnap::isCorridorSatisfied(Trajectory &traj, double max_vel, dou
           p[1] = p[1] - delta * n_vec[1];
           p[2] = p[2] - 0.5 * delta * n_vec[1];
 
-          Eigen::VectorXd Ab(S + 1);
-          Ab.setZero();
-          Ab.segment(idx * N_PIECES, N_PIECES) = d3;
-          Ab(S) = n_vec(0) * p(0) + n_vec(1) * p(1) + n_vec(2) * p(2);
-          constraints.push_back(Ab);
+          addRefinementConstraint(idx, d3, n_vec(0) * p(0) + n_vec(1) * p(1) + n_vec(2) * p(2), row,
+                                  constraint_ub);
         }
       }
     }
 
-    std::set<double> root_x, root_y, root_z;
-    /* add velocity constraints */
-    Eigen::Matrix<double, DIM, N_ORDER - 1> coeff_dot2 = derivative(coeff_dot);
-    Eigen::VectorXd                         a_coeff_x  = coeff_dot2.row(0);
-    Eigen::VectorXd                         a_coeff_y  = coeff_dot2.row(1);
-    Eigen::VectorXd                         a_coeff_z  = coeff_dot2.row(2);
-    root_x = RootFinder::solvePolynomial(a_coeff_x.reverse(), 0, 1, 0.0001);
-    root_y = RootFinder::solvePolynomial(a_coeff_y.reverse(), 0, 1, 0.0001);
-    root_z = RootFinder::solvePolynomial(a_coeff_z.reverse(), 0, 1, 0.0001);
-    std::set<double> vx_roots(root_x.begin(), root_x.end());
-    std::set<double> vy_roots(root_y.begin(), root_y.end());
-    std::set<double> vz_roots(root_z.begin(), root_z.end());
-
-    int idxt = 0;
-    for (auto itr = vx_roots.begin(); itr != vx_roots.end(); itr++) {
-      double          t   = *itr;
-      Eigen::Vector3d vel = traj[idx].getVel(t);
-//      std::cout << idxt << "\033[1;32m t:" << t << "\tvel_x\t\033[0m" << vel(0) << std::endl;
-      idxt++;
-      if (vel(0) > max_vel) {
-        isSatisfied = false;
-        Eigen::Matrix<double, 1, N_ORDER + 1> d;
-        d << 0, 1, 2 * pow(t, 1), 3 * pow(t, 2), 4 * pow(t, 3), 5 * pow(t, 4), 6 * pow(t, 5),
-            7 * pow(t, 6);
-        Eigen::VectorXd Ab(S + 1);
-        Ab.setZero();
-        Ab.segment(idx * N_PIECES, C) = d;
-//        std::cout << "T " << _timeAlloc[idx] << std::endl;
-        Ab(S) = max_vel * _timeAlloc[idx];
-        constraints.push_back(Ab);
+    /* add velocity constraints, vel = coeff_dot / T */
+    Eigen::Matrix<double, DIM, N_ORDER - 1> coeff_dot2    = derivative(coeff_dot);
+    Eigen::Vector3d                         max_vel_coeff = bernsteinCoefficients(coeff_dot).rowwise().maxCoeff();
+    for (int dim = 0; dim < DIM; dim++) {
+      if (max_vel_coeff(dim) <= max_vel * _timeAlloc[idx]) {
+        continue;
       }
-    }
-    for (auto itr = vy_roots.begin(); itr != vy_roots.end(); itr++) {
-      double          t   = *itr;
-      Eigen::Vector3d vel = traj[idx].getVel(t);
-//      std::cout << "\033[1;32m t:" << t << "\tvel_y\t\033[0m" << vel(1) << std::endl;
-      if (vel(1) > max_vel) {
-        isSatisfied = false;
-//        std::cout << t << "\tvel_y\t" << vel(1) << std::endl;
-        Eigen::Matrix<double, 1, N_ORDER + 1> d;
-        d << 0, 1, 2 * pow(t, 1), 3 * pow(t, 2), 4 * pow(t, 3), 5 * pow(t, 4), 6 * pow(t, 5),
-            7 * pow(t, 6);
-        Eigen::VectorXd Ab(S + 1);
-        Ab.setZero();
-        Ab.segment(idx * N_PIECES + C, C) = d;
-        Ab(S)                             = max_vel * _timeAlloc[idx];
-        constraints.push_back(Ab);
-      }
-    }
-    for (auto itr = vz_roots.begin(); itr != vz_roots.end(); itr++) {
-      double          t   = *itr;
-      Eigen::Vector3d vel = traj[idx].getVel(t);
-//      std::cout << "\033[1;32m t:" << t << "\tvel_z\t\033[0m" << vel(2) << std::endl;
-
-      if (vel(2) > max_vel) {
-        isSatisfied = false;
-//        std::cout << t << "\tvel_z\t" << vel(2) << std::endl;
-        Eigen::Matrix<double, 1, N_ORDER + 1> d;
-        d << 0, 1, 2 * pow(t, 1), 3 * pow(t, 2), 4 * pow(t, 3), 5 * pow(t, 4), 6 * pow(t, 5),
-            7 * pow(t, 6);
-        Eigen::VectorXd Ab(S + 1);
-        Ab.setZero();
-        Ab.segment(idx * N_PIECES + 2 * C, C) = d;
-        Ab(S)                                 = max_vel * _timeAlloc[idx];
-        constraints.push_back(Ab);
+
+      Eigen::Matrix<double, N_ORDER - 1, 1> a_coeff = coeff_dot2.row(dim).transpose().reverse();
+      RootFinder::solvePolynomial(a_coeff, 0, 1, 0.0001, roots);
+      ++_root_searches;
+
+      for (double t : roots) {
+        Eigen::Vector3d vel = traj[idx].getVel(t);
+        if (vel(dim) > max_vel) {
+          isSatisfied = false;
+          Eigen::Matrix<double, 1, N_ORDER + 1> d;
+          d << 0, 1, 2 * pow(t, 1), 3 * pow(t, 2), 4 * pow(t, 3), 5 * pow(t, 4), 6 * pow(t, 5),
+              7 * pow(t, 6);
+          addRefinementConstraint(idx, singleDimensionCoeffs(dim, d), max_vel * _timeAlloc[idx], row,
+                                  constraint_ub);
+        }
       }
     }
 
-    /* add acceleration constraints */
-    Eigen::Matrix<double, DIM, N_ORDER - 2> coeff_dot3 = derivative(coeff_dot2);
-    Eigen::VectorXd                         j_coeff_x  = coeff_dot3.row(0);
-    Eigen::VectorXd                         j_coeff_y  = coeff_dot3.row(1);
-    Eigen::VectorXd                         j_coeff_z  = coeff_dot3.row(2);
-    root_x = RootFinder::solvePolynomial(j_coeff_x.reverse(), 0, 1, 0.0001);
-    // root_y = RootFinder::solvePolynomial(j_coeff_y.reverse(), 0, 1, 0.0001);
-    // root_z = RootFinder::solvePolynomial(j_coeff_z.reverse(), 0, 1, 0.0001);
-    std::set<double> ax_roots(root_x.begin(), root_x.end());
-    // std::set<double> ay_roots(root_y.begin(), root_y.end());
-    // std::set<double> az_roots(root_z.begin(), root_z.end());
-
-    for (auto itr = ax_roots.begin(); itr != ax_roots.end(); itr++) {
-      double          t   = *itr;
-      Eigen::Vector3d acc = traj[idx].getAcc(t);
-//      std::cout << "\033[1;32m t:" << t << "\tacc_x\t\033[0m" << acc(0) << std::endl;
-      if (acc(0) > max_acc) {
-        isSatisfied = false;
-        Eigen::Matrix<double, 1, N_ORDER + 1> d;
-        d << 0, 0, 2, 6 * pow(t, 1), 12 * pow(t, 2), 20 * pow(t, 3), 30 * pow(t, 4), 42 * pow(t, 5);
-        Eigen::VectorXd Ab(S + 1);
-        Ab.setZero();
-        Ab.segment(idx * N_PIECES, C) = d;
-        Ab(S)                         = max_acc * pow(_timeAlloc[idx], 2);
-        constraints.push_back(Ab);
-      }
-      if (acc(0) < -max_acc) {
-        isSatisfied = false;
-        Eigen::Matrix<double, 1, N_ORDER + 1> d;
-        d << 0, 0, 2, 6 * pow(t, 1), 12 * pow(t, 2), 20 * pow(t, 3), 30 * pow(t, 4), 42 * pow(t, 5);
-        Eigen::VectorXd Ab(S + 1);
-        Ab.setZero();
-        Ab.segment(idx * N_PIECES, C) = -d;
-        Ab(S)                         = max_acc * pow(_timeAlloc[idx], 2);
-        constraints.push_back(Ab);
+    /* add acceleration constraints, acc = coeff_dot2 / T^2 */
+    Eigen::Matrix<double, DIM, N_ORDER - 1> acc_bernstein = bernsteinCoefficients(coeff_dot2);
+    double                                  acc_bound     = max_acc * pow(_timeAlloc[idx], 2);
+    if (acc_bernstein.row(0).maxCoeff() > acc_bound || acc_bernstein.row(0).minCoeff() < -acc_bound) {
+      Eigen::Matrix<double, DIM, N_ORDER - 2> coeff_dot3 = derivative(coeff_dot2);
+      Eigen::Matrix<double, N_ORDER - 2, 1>   j_coeff_x  = coeff_dot3.row(0).transpose().reverse();
+      RootFinder::solvePolynomial(j_coeff_x, 0, 1, 0.0001, roots);
+      ++_root_searches;
+
+      for (double t : roots) {
+        Eigen::Vector3d acc = traj[idx].getAcc(t);
+        if (acc(0) > max_acc) {
+          isSatisfied = false;
+          Eigen::Matrix<double, 1, N_ORDER + 1> d;
+          d << 0, 0, 2, 6 * pow(t, 1), 12 * pow(t, 2), 20 * pow(t, 3), 30 * pow(t, 4), 42 * pow(t, 5);
+          addRefinementConstraint(idx, singleDimensionCoeffs(0, d), acc_bound, row, constraint_ub);
+        }
+        if (acc(0) < -max_acc) {
+          isSatisfied = false;
+          Eigen::Matrix<double, 1, N_ORDER + 1> d;
+          d << 0, 0, 2, 6 * pow(t, 1), 12 * pow(t, 2), 20 * pow(t, 3), 30 * pow(t, 4), 42 * pow(t, 5);
+          addRefinementConstraint(idx, singleDimensionCoeffs(0, -d), acc_bound, row, constraint_ub);
+        }
       }
     }
   //   for (auto itr = ay_roots.begin(); itr != ay_roots.end(); itr++) {
@@ -900,16 +946,14 @@ bool CorridorMiniSnap::isCorridorSatisfied(Trajectory &traj, double max_vel, dou
   //   }
   }
 
-  /* load constraints to A matrix */
-  int n   = constraints.size();
-  int ROW = _A.rows();
-  _A.conservativeResize(ROW + n, Eigen::NoChange);
+  /* append the bounds of the new rows. Their coefficients are already in _A_triplets */
+  int n   = constraint_ub.size();
+  int ROW = _ub.rows();
   _ub.conservativeResize(ROW + n);
   _lb.conservativeResize(ROW + n);
   for (int i = 0; i < n; i++) {
-    _A.row(ROW + i) = constraints[i].head(S);
-    _ub(ROW + i)    = constraints[i](S);
-    _lb(ROW + i)    = -OSQP_INFTY;
+    _ub(ROW + i) = constraint_ub[i];
+    _lb(ROW + i) = -OSQP_INFTY;
   }
 
 //  std::cout << "\033[42m"
@@ -926,7 +970,9 @@ void CorridorMiniSnap::getTrajectory(Trajectory *traj) {
 //  std::cout << (*traj)[3].getCoefficient().row(0) << std::endl;
 }
 
-double CorridorMiniSnap::getMinimumCost() const { return _x.transpose() * _Q * _x; }
+double CorridorMiniSnap::getMinimumCost() const {
+  return _x.dot(_Q.selfadjointView<Eigen::Upper>() * _x);
+}
 
 // /***************************************/
 // /***** Corridor MiniSnap Original ******/
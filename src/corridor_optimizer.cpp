@@ -0,0 +1,240 @@
+/**
+ * @file corridor_optimizer.cpp
+ * @brief minimum snap in the corridors of a path, refined until the
+ * constraints hold, for the allocation of the corridors or several candidate
+ * time allocations.
+ *
+ */
+
+#include <CorridorMiniSnap/corridor_optimizer.h>
+
+#include <algorithm>
+
+using namespace traj_opt;
+using namespace std::chrono;
+
+/**
+ * @brief seconds left for a QP solve before the deadline. 0: no deadline
+ */
+static double qpTimeLimit(steady_clock::time_point deadline) {
+  if (deadline == steady_clock::time_point::max()) {
+    return 0.0;
+  }
+  return std::max(duration<double>(deadline - steady_clock::now()).count(), 1e-6);
+}
+
+void CorridorOptimizer::setConfig(const CorridorOptimizerConfig &config) {
+  _config = config;
+  _solver.setPersistentSolver(_config.persistent_solver, _config.slack_rows_per_piece);
+
+  _candidate_solvers.clear();
+  _candidate_thread_pool.reset();
+  if (_config.candidate_threads > 0) {
+    const int candidate_num =
+        1 + (int)_config.time_scales.size() + (_config.heuristic_velocity_ratio > 0.0 ? 1 : 0);
+    for (int i = 0; i < candidate_num; i++) {
+      _candidate_solvers.emplace_back(new CorridorMiniSnap());
+      _candidate_solvers.back()->setPersistentSolver(_config.persistent_solver,
+                                                     _config.slack_rows_per_piece);
+    }
+    _candidate_thread_pool.reset(new ThreadPool(_config.candidate_threads - 1));
+  }
+}
+
+bool CorridorOptimizer::solve(const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state,
+                              const std::vector<double>                     &time_alloc,
+                              const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+                              const std::vector<TimeWindow> &corridor_time_windows,
+                              Trajectory &traj, bool &corridor_satisfied) {
+  _stats = CorridorOptimizationStats();
+  if (_candidate_solvers.empty()) {
+    const bool is_solved = solveInCorridors(_solver, init_state, finl_state, time_alloc, corridors, traj,
+                                            corridor_satisfied, _stats, steady_clock::time_point::max());
+    _stats.candidate = is_solved ? 0 : -1;
+    return is_solved;
+  }
+  return solveTimeAllocationCandidates(init_state, finl_state, time_alloc, corridors,
+                                       corridor_time_windows, traj, corridor_satisfied);
+}
+
+/**
+ * @brief minimum snap in the corridors, refined until the corridor, velocity
+ * and acceleration constraints hold or the refinements run out
+ * @param deadline gives up when it has passed, also in the middle of a QP solve
+ */
+bool CorridorOptimizer::solveInCorridors(CorridorMiniSnap &solver, const Eigen::Matrix3d &init_state,
+                                         const Eigen::Matrix3d &finl_state,
+                                         const std::vector<double> &time_alloc,
+                                         const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+                                         Trajectory &traj, bool &corridor_satisfied,
+                                         CorridorOptimizationStats &stats,
+                                         steady_clock::time_point   deadline) const {
+  corridor_satisfied = false;
+  if (steady_clock::now() > deadline) {
+    return false;
+  }
+
+  solver.reset(init_state, finl_state, time_alloc, corridors);
+  solver.setTimeLimit(qpTimeLimit(deadline));
+
+  bool is_solved = false;
+  try {
+    is_solved = solver.optimize(_config.factors, _config.delta_corridor);
+  } catch (int e) {
+    ROS_ERROR("Optimizer crashed!");
+    return false;
+  }
+  stats.qp_solves++;
+  stats.qp_iterations += solver.getIterations();
+
+  if (!is_solved) {
+    return false;
+  }
+
+  solver.getTrajectory(&traj);
+  int i = 0;
+  while (!(corridor_satisfied = solver.isCorridorSatisfied(traj, _config.max_vel, _config.max_acc,
+                                                           _config.delta_corridor)) &&
+         i++ < _config.max_refinements) {
+    stats.root_finder_calls += solver.getRootSearches();
+    if (steady_clock::now() > deadline) {
+      return false;
+    }
+    solver.setTimeLimit(qpTimeLimit(deadline));
+    try {
+      is_solved = solver.reOptimize();
+    } catch (int e) {
+      ROS_ERROR("Optimizer crashed!");
+      return false;
+    }
+    stats.qp_solves++;
+    stats.qp_iterations += solver.getIterations();
+
+    if (is_solved) {
+      solver.getTrajectory(&traj);
+    } else {
+      return false;
+    }
+  }
+  stats.root_finder_calls += solver.getRootSearches();
+
+  return true;
+}
+
+std::vector<std::vector<double>> CorridorOptimizer::timeAllocationCandidates(
+    const std::vector<double> &time_alloc, const std::vector<Eigen::Matrix<double, 6, -1>> &corridors,
+    const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state) const {
+  std::vector<std::vector<double>> candidates;
+  candidates.push_back(time_alloc);
+
+  for (const double scale : _config.time_scales) {
+    std::vector<double> scaled = time_alloc;
+    for (auto &t : scaled) {
+      t *= scale;
+    }
+    candidates.push_back(scaled);
+  }
+
+  if (_config.heuristic_velocity_ratio > 0.0) {
+    /* The path goes from the start through the middles between the centers of
+     * neighboring corridors to the end. Durations stay within half and twice
+     * the ones of the corridors. */
+    const double velocity = _config.heuristic_velocity_ratio * _config.max_vel;
+    std::vector<Eigen::Vector3d> centers;
+    for (const auto &c : corridors) {
+      centers.emplace_back(c.bottomRows<3>().rowwise().mean());
+    }
+
+    std::vector<double> heuristic(time_alloc.size());
+    Eigen::Vector3d     last = init_state.col(0);
+    for (size_t i = 0; i < time_alloc.size(); i++) {
+      Eigen::Vector3d next = i + 1 < centers.size() ? Eigen::Vector3d(0.5 * (centers[i] + centers[i + 1]))
+                                                    : Eigen::Vector3d(finl_state.col(0));
+      heuristic[i] = std::min(std::max((next - last).norm() / velocity, 0.5 * time_alloc[i]), 2.0 * time_alloc[i]);
+      last         = next;
+    }
+    candidates.push_back(heuristic);
+  }
+
+  return candidates;
+}
+
+bool CorridorOptimizer::timeAllocationInSafeWindows(const std::vector<double>     &time_alloc,
+                                                    const std::vector<TimeWindow> &corridor_time_windows) {
+  if (corridor_time_windows.size() != time_alloc.size()) {
+    return false;
+  }
+  const double tolerance = 1e-6;
+  double       t         = 0.0;
+  for (size_t i = 0; i < time_alloc.size(); i++) {
+    if (t < corridor_time_windows[i].first - tolerance ||
+        t + time_alloc[i] > corridor_time_windows[i].second + tolerance) {
+      return false;
+    }
+    t += time_alloc[i];
+  }
+  return true;
+}
+
+/**
+ * @brief solve the candidate time allocations at once and keep the trajectory
+ * with the lowest cost plus time_weight times its duration. A trajectory that
+ * meets the constraints wins over one that does not. The allocation of the
+ * corridors is solved to the end like without candidates, so there is always
+ * the result a single solver would give. The corridors were only checked for
+ * the risk of the times of their A* intervals, so another candidate is only
+ * solved when each of its pieces stays in the time window of its corridor. The
+ * other candidates give up at the deadline, also in the middle of a QP solve.
+ * With fewer threads than candidates they are solved one after another, so the
+ * optimization can take up to the deadline longer than with a single solver.
+ */
+bool CorridorOptimizer::solveTimeAllocationCandidates(
+    const Eigen::Matrix3d &init_state, const Eigen::Matrix3d &finl_state, const std::vector<double> &time_alloc,
+    const std::vector<Eigen::Matrix<double, 6, -1>> &corridors, const std::vector<TimeWindow> &corridor_time_windows,
+    Trajectory &traj, bool &corridor_satisfied) {
+  const auto candidates    = timeAllocationCandidates(time_alloc, corridors, init_state, finl_state);
+  const int  candidate_num = std::min((int)candidates.size(), (int)_candidate_solvers.size());
+  const steady_clock::time_point deadline =
+      steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(_config.deadline));
+
+  std::vector<Trajectory>                results(candidate_num);
+  std::vector<char>                      solved(candidate_num, 0);
+  std::vector<char>                      satisfied(candidate_num, 0);
+  std::vector<CorridorOptimizationStats> stats(candidate_num);
+  _candidate_thread_pool->parallelFor(candidate_num, [&](int i) {
+    if (i > 0 && !timeAllocationInSafeWindows(candidates[i], corridor_time_windows)) {
+      return;
+    }
+    bool candidate_satisfied = false;
+    solved[i]    = solveInCorridors(*_candidate_solvers[i], init_state, finl_state, candidates[i], corridors,
+                                    results[i], candidate_satisfied, stats[i],
+                                    i == 0 ? steady_clock::time_point::max() : deadline);
+    satisfied[i] = candidate_satisfied;
+  });
+
+  int    best      = -1;
+  double best_cost = 0.0;
+  for (int i = 0; i < candidate_num; i++) {
+    _stats.qp_solves += stats[i].qp_solves;
+    _stats.qp_iterations += stats[i].qp_iterations;
+    _stats.root_finder_calls += stats[i].root_finder_calls;
+    if (!solved[i] || (i > 0 && !satisfied[i])) {
+      continue;
+    }
+    const double cost = results[i].getCost(_config.factors) + _config.time_weight * results[i].getDuration();
+    if (best < 0 || (satisfied[i] && !satisfied[best]) || (satisfied[i] == satisfied[best] && cost < best_cost)) {
+      best      = i;
+      best_cost = cost;
+    }
+  }
+
+  _stats.candidate = best;
+  if (best < 0) {
+    corridor_satisfied = false;
+    return false;
+  }
+  ROS_DEBUG("Time allocation candidate %d of %d chosen, cost = %lf", best, candidate_num, best_cost);
+  traj               = results[best];
+  corridor_satisfied = satisfied[best];
+  return true;
+}
@@ -15,7 +15,9 @@
 #include "gazebo_msgs/ModelStates.h"
 #include "geometry_msgs/PoseStamped.h"
 #include <queue>
-#include "std_msgs/Float32MultiArray.h"
+#include "risk_map_codec.h"
+#include "risk_map_shared_memory.h"
+#include "point_cloud_voxel_filter.h"
 
 using namespace std;
 
@@ -36,7 +38,7 @@ float z_min = -MAP_HEIGHT_VOXEL_NUM * VOXEL_RESOLUTION / 2;
 float z_max = MAP_HEIGHT_VOXEL_NUM * VOXEL_RESOLUTION / 2;
 
 ros::Publisher cloud_pub, map_center_pub, gazebo_model_states_pub;
-ros::Publisher future_risk_pub, future_risk_full_array_pub, current_marker_pub, fov_pub, cluster_status_pub;
+ros::Publisher future_risk_pub, future_risk_map_pub, current_marker_pub, fov_pub, cluster_status_pub;
 gazebo_msgs::ModelStates ground_truth_model_states;
 
 Eigen::Vector3d uav_position_global;
@@ -50,6 +52,20 @@ bool rviz_map_center_locked = false;
 
 bool position_received = false;
 
+bool use_shared_memory_risk_map = false;
+string risk_map_shared_memory_name = "/rast_risk_map";
+RiskMapShmWriter risk_map_shm_writer;
+
+bool use_fused_point_cloud_filter = true;
+int point_cloud_filter_threads = 1;
+PointCloudVoxelFilter point_cloud_voxel_filter;
+
+bool risk_map_sparse_encoding = true;
+int risk_map_quantization_bits = 0; // 0: float32, 16 or 8
+int risk_map_key_frame_interval = 1; // 1: complete risk maps only. Otherwise changed bricks between complete ones.
+float risk_map_brick_change_threshold = 0.f;
+RiskMapDeltaEncoder risk_map_encoder;
+
 
 void actorPublish(const vector<Eigen::Vector3d> &actors)
 {
@@ -228,6 +244,31 @@ void colorAssign(int &r, int &g, int &b, float v, float value_min=0.f, float val
 }
 
 
+/// Byte offsets of float32 x, y and z in a point. False if the cloud has no such fields or is big endian.
+bool getFloatXYZOffsets(const sensor_msgs::PointCloud2 &cloud, int &x_offset, int &y_offset, int &z_offset)
+{
+    if(cloud.is_bigendian){
+        return false;
+    }
+
+    x_offset = y_offset = z_offset = -1;
+    for(const auto &field : cloud.fields){
+        if(field.datatype != sensor_msgs::PointField::FLOAT32 || field.offset + sizeof(float) > cloud.point_step){
+            continue;
+        }
+        if(field.name == "x"){
+            x_offset = (int)field.offset;
+        }else if(field.name == "y"){
+            y_offset = (int)field.offset;
+        }else if(field.name == "z"){
+            z_offset = (int)field.offset;
+        }
+    }
+    return x_offset >= 0 && y_offset >= 0 && z_offset >= 0 && cloud.data.size() >= (size_t)cloud.row_step * cloud.height
+           && cloud.row_step >= cloud.width * cloud.point_step;
+}
+
+
 pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_filtered(new pcl::PointCloud<pcl::PointXYZ>());
 geometry_msgs::PoseStamped map_pose_global;
 void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud)
@@ -285,31 +326,39 @@ void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud)
     /// Point cloud process
     double this_time = cloud->header.stamp.toSec();
 
-    // convert cloud to pcl form
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_in(new pcl::PointCloud<pcl::PointXYZ>());
-    pcl::fromROSMsg(*cloud, *cloud_in);
-
-    // down-sample for all
-    pcl::VoxelGrid<pcl::PointXYZ> sor;
-    sor.setInputCloud(cloud_in);
-    sor.setLeafSize(res, res, res);
-    sor.filter(*cloud_filtered);
-
+    int x_offset, y_offset, z_offset;
     int useful_point_num = 0;
-    for(int i=0; i<cloud_filtered->width; i++){
-        float x = cloud_filtered->points.at(i).z;
-        float y = -cloud_filtered->points.at(i).x;
-        float z = -cloud_filtered->points.at(i).y;
-
-        if(inRange(x_min, x_max, x) && inRange(y_min, y_max, y) && inRange(z_min, z_max, z))
-        {
-            point_clouds[useful_point_num*3] = x;
-            point_clouds[useful_point_num*3+1] = y;
-            point_clouds[useful_point_num*3+2] = z;
-            ++ useful_point_num;
-
-            if(useful_point_num >= MAX_POINT_NUM){
-                break;
+    if(use_fused_point_cloud_filter && getFloatXYZOffsets(*cloud, x_offset, y_offset, z_offset)){
+        // down-sample, transform and crop in one pass over the message buffer
+        useful_point_num = point_cloud_voxel_filter.filter(cloud->data.data(), (int)cloud->width, (int)cloud->height,
+                                                           (int)cloud->row_step, (int)cloud->point_step,
+                                                           x_offset, y_offset, z_offset, point_clouds, MAX_POINT_NUM);
+    }else{
+        // convert cloud to pcl form
+        pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_in(new pcl::PointCloud<pcl::PointXYZ>());
+        pcl::fromROSMsg(*cloud, *cloud_in);
+
+        // down-sample for all
+        pcl::VoxelGrid<pcl::PointXYZ> sor;
+        sor.setInputCloud(cloud_in);
+        sor.setLeafSize(res, res, res);
+        sor.filter(*cloud_filtered);
+
+        for(int i=0; i<cloud_filtered->width; i++){
+            float x = cloud_filtered->points.at(i).z;
+            float y = -cloud_filtered->points.at(i).x;
+            float z = -cloud_filtered->points.at(i).y;
+
+            if(inRange(x_min, x_max, x) && inRange(y_min, y_max, y) && inRange(z_min, z_max, z))
+            {
+                point_clouds[useful_point_num*3] = x;
+                point_clouds[useful_point_num*3+1] = y;
+                point_clouds[useful_point_num*3+2] = z;
+                ++ useful_point_num;
+
+                if(useful_point_num >= MAX_POINT_NUM){
+                    break;
+                }
             }
         }
     }
@@ -347,7 +396,18 @@ void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud)
     sensor_msgs::PointCloud2 cloud_to_pub_transformed;
     static float risk_maps[VOXEL_NUM][RISK_MAP_NUMBER];
 
-    my_map.getOccupancyMapWithRiskMaps(occupied_num, cloud_to_publish, &risk_maps[0][0], 0.2); //0.25
+    /// In the shared memory mode, the map writes into a free slot directly if the planner uses the same order.
+    /// Otherwise the frame is dropped when the planner still holds every other slot.
+    float *risk_map_slot = nullptr;
+    if(use_shared_memory_risk_map){
+        risk_map_slot = risk_map_shm_writer.beginFrame();
+        if(!risk_map_slot){
+            ROS_WARN("No free risk map slot in the shared memory. Frame dropped.");
+        }
+    }
+    const bool write_risk_map_to_slot = risk_map_slot && RiskMapLayout::order == RiskMapOrder::ZYXT;
+
+    my_map.getOccupancyMapWithRiskMaps(occupied_num, cloud_to_publish, write_risk_map_to_slot ? risk_map_slot : &risk_maps[0][0], 0.2); //0.25
 
     if(!rviz_map_center_locked){
         for(auto &p : cloud_to_publish){
@@ -358,27 +418,27 @@ void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud)
     }
 
 
-    /// Publish future status with multi-array
-    std_msgs::Float32MultiArray future_risk_array_msg;
-    std_msgs::MultiArrayDimension future_risk_array_dimension;
-    future_risk_array_dimension.size = VOXEL_NUM;
-    future_risk_array_dimension.stride = RISK_MAP_NUMBER;
-    future_risk_array_msg.layout.dim.push_back(future_risk_array_dimension);
-
-
-    future_risk_array_msg.data.reserve(VOXEL_NUM*RISK_MAP_NUMBER + 3);
-    for(int i=0; i<VOXEL_NUM; ++i){
-        for(int j=0; j<RISK_MAP_NUMBER; ++j){
-            future_risk_array_msg.data.push_back(risk_maps[i][j]);
+    if(use_shared_memory_risk_map){
+        /// Publish future status to the shared memory
+        if(risk_map_slot){
+            if(!write_risk_map_to_slot){
+                RiskMapLayout::fromZYXT(&risk_maps[0][0], RISK_MAP_NUMBER, risk_map_slot);
+            }
+            risk_map_shm_writer.commitFrame(cloud->header.stamp.toSec(), uav_position.x(), uav_position.y(), uav_position.z());
         }
+    }else{
+        /// Publish future status with the risk map message
+        static rast_corridor_planning::RiskMap future_risk_map_msg;
+        future_risk_map_msg.header.stamp = cloud->header.stamp;
+        future_risk_map_msg.header.frame_id = "map";
+        future_risk_map_msg.map_center.x = uav_position.x();
+        future_risk_map_msg.map_center.y = uav_position.y();
+        future_risk_map_msg.map_center.z = uav_position.z();
+        risk_map_encoder.encode(&risk_maps[0][0], RISK_MAP_NUMBER, risk_map_sparse_encoding, risk_map_quantization_bits, future_risk_map_msg);
+
+        future_risk_map_pub.publish(future_risk_map_msg);
     }
 
-    future_risk_array_msg.data.push_back(uav_position.x());
-    future_risk_array_msg.data.push_back(uav_position.y());
-    future_risk_array_msg.data.push_back(uav_position.z());
-
-    future_risk_full_array_pub.publish(future_risk_array_msg);
-
 
     finish2 = clock();
     double duration2 = (double)(finish2 - start2) / CLOCKS_PER_SEC;
@@ -519,6 +579,14 @@ void getParameterList(const ros::NodeHandle& nh) {
     nh.getParam("/map_sim_example/rviz_map_center_locked", rviz_map_center_locked);
     nh.getParam("/map_sim_example/localization_stddev", localization_stddev);
     nh.getParam("/map_sim_example/observation_stddev", observation_stddev);
+    nh.getParam("/map_sim_example/use_shared_memory_risk_map", use_shared_memory_risk_map);
+    nh.getParam("/map_sim_example/risk_map_shared_memory_name", risk_map_shared_memory_name);
+    nh.getParam("/map_sim_example/risk_map_sparse_encoding", risk_map_sparse_encoding);
+    nh.getParam("/map_sim_example/use_fused_point_cloud_filter", use_fused_point_cloud_filter);
+    nh.getParam("/map_sim_example/point_cloud_filter_threads", point_cloud_filter_threads);
+    nh.getParam("/map_sim_example/risk_map_quantization_bits", risk_map_quantization_bits);
+    nh.getParam("/map_sim_example/risk_map_key_frame_interval", risk_map_key_frame_interval);
+    nh.getParam("/map_sim_example/risk_map_brick_change_threshold", risk_map_brick_change_threshold);
 }
 
 
@@ -528,6 +596,13 @@ int main(int argc, char **argv)
     ros::NodeHandle n;
 
     getParameterList(n);
+
+    if(use_shared_memory_risk_map && !risk_map_shm_writer.open(risk_map_shared_memory_name)){
+        ROS_ERROR("Failed to create the risk map shared memory %s. Publishing the risk map topic instead.", risk_map_shared_memory_name.c_str());
+        use_shared_memory_risk_map = false;
+    }
+    risk_map_encoder.setKeyFrameInterval(risk_map_key_frame_interval);
+    risk_map_encoder.setChangeThreshold(risk_map_brick_change_threshold);
     
     /// Initialize map
     my_map.setPredictionVariance(0.05, 0.05);  //0.1, 0.1
@@ -538,6 +613,9 @@ int main(int argc, char **argv)
     my_map.setNewBornParticleWeight(0.0001); //0.01
     DSPMap::setOriginalVoxelFilterResolution(res);
 
+    point_cloud_voxel_filter.setGrid(res, x_min, x_max, y_min, y_max, z_min, z_max);
+    point_cloud_voxel_filter.setThreadNum(point_cloud_filter_threads);
+
     ros::Subscriber object_states_sub = n.subscribe("/gazebo/model_states", 1, simObjectStateCallback);
 
     ros::Subscriber point_cloud_sub = n.subscribe("/camera_front/depth/points", 1, cloudCallback);
@@ -548,7 +626,7 @@ int main(int argc, char **argv)
     gazebo_model_states_pub = n.advertise<gazebo_msgs::ModelStates>("/my_map/model_states", 1, true);
 
     future_risk_pub = n.advertise<sensor_msgs::PointCloud2>("/my_map/future_risk", 1, true);
-    future_risk_full_array_pub = n.advertise<std_msgs::Float32MultiArray>("/my_map/future_risk_full_array", 1, true);
+    future_risk_map_pub = n.advertise<rast_corridor_planning::RiskMap>("/my_map/future_risk_map", 1, true);
 
     cluster_status_pub = n.advertise<sensor_msgs::PointCloud2>("/my_map/cluster_status", 1, true);
 
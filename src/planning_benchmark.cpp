@@ -0,0 +1,706 @@
+//
+// Offline benchmark of the planning stages on recorded risk maps.
+//
+// Usage: rosrun rast_corridor_planning planning_benchmark <risk_maps.bag | snapshot.rmsnap ...> [--config cfg.yaml]
+//        [--cases cases.txt] [--output benchmark.json] [--repeat N] [--topic /my_map/future_risk_map] [name=value ...]
+//
+// The bag holds the rast_corridor_planning::RiskMap messages of the mapping node, for example recorded with
+// "rosbag record /my_map/future_risk_map" while quick_test.launch runs. Each complete frame is a case planned from the
+// map center at rest to the goal p_goal_x, p_goal_y, p_goal_z. A cases file gives one case per line instead:
+//     frame_index start_x start_y start_z start_vx start_vy start_vz goal_x goal_y goal_z
+// in the global frame. The cases run in the order of their frames. A name=value argument overrides a parameter of the config file, e.g. a_star_expansion_threads=4.
+//
+// Snapshot files of planning_node (see snapshot_directory in cfg.yaml) are frames with their own case: the start,
+// goal and reference direction of the recorded cycle. Without --config, the parameters recorded in the first snapshot
+// are used. The risk maps of snapshots are mapped, not copied. The bag is decoded one frame at a time while the cases
+// run, so the length of the recording does not matter.
+//
+// The stages run like in trajectoryCallback() and optimizationInCorridors() of planning_node, with the same parameter
+// defaults and the same CorridorOptimizer, without ROS timers, and the result is written as JSON with sorted keys, so
+// two runs can be compared with diff.
+//
+
+#include "risk_aware_kinodynamic_a_star.h"
+#include "risk_map_codec.h"
+#include "risk_map_snapshot.h"
+#include <CorridorMiniSnap/corridor_optimizer.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace traj_opt;
+using namespace std;
+using namespace std::chrono;
+
+typedef struct BenchmarkCase
+{
+    int frame_index;
+    Eigen::Vector3d start_position; // global frame
+    Eigen::Vector3d start_velocity;
+    Eigen::Vector3d start_acceleration = Eigen::Vector3d::Zero();
+    Eigen::Vector3d goal; // global frame
+    float start_time = 0.f;
+    bool has_reference_direction = false; // false: the direction of the last path found
+    float reference_direction_angle = 100.f;
+}BenchmarkCase;
+
+typedef struct RecordedFrame
+{
+    float *risk_map = nullptr; // RiskMapLayout order, in the decoding buffer of the bag. Unused for a snapshot
+    std::shared_ptr<RiskMapSnapshotFile> snapshot;
+    Eigen::Vector3d map_center;
+
+    float* data() { return snapshot ? snapshot->data() : risk_map; }
+}RecordedFrame;
+
+/// Values of a flat "name: value  # comment" yaml file. Lists are kept as their text.
+class BenchmarkParameters{
+public:
+    bool loadFile(const std::string &path)
+    {
+        std::ifstream file(path);
+        if(!file){
+            return false;
+        }
+        load(file);
+        return true;
+    }
+
+    void loadText(const std::string &text)
+    {
+        std::istringstream stream(text);
+        load(stream);
+    }
+
+    /// name=value
+    bool set(const std::string &assignment)
+    {
+        const size_t equal = assignment.find('=');
+        if(equal == std::string::npos){
+            return false;
+        }
+        values[trim(assignment.substr(0, equal))] = trim(assignment.substr(equal + 1));
+        return true;
+    }
+
+    /// Keep value if the parameter is not set
+    template<typename T>
+    void get(const std::string &name, T &value)
+    {
+        auto it = values.find(name);
+        if(it != values.end()){
+            std::istringstream stream(it->second);
+            T parsed;
+            if(stream >> parsed){
+                value = parsed;
+            }
+        }
+        used[name] = toString(value);
+    }
+
+    void get(const std::string &name, bool &value)
+    {
+        auto it = values.find(name);
+        if(it != values.end()){
+            value = it->second == "true" || it->second == "True" || it->second == "1";
+        }
+        used[name] = value ? "true" : "false";
+    }
+
+    /// [a, b, c]
+    void get(const std::string &name, std::vector<double> &value)
+    {
+        auto it = values.find(name);
+        if(it != values.end()){
+            std::string text = it->second;
+            std::replace(text.begin(), text.end(), ',', ' ');
+            const size_t begin = text.find('[');
+            const size_t end = text.rfind(']');
+            if(begin != std::string::npos && end != std::string::npos && begin < end){
+                std::istringstream stream(text.substr(begin + 1, end - begin - 1));
+                std::vector<double> parsed;
+                double v;
+                while(stream >> v){
+                    parsed.push_back(v);
+                }
+                if(stream.eof()){
+                    value = parsed;
+                }
+            }
+        }
+        std::ostringstream stream;
+        stream << "[";
+        for(size_t i=0; i<value.size(); ++i){
+            stream << (i > 0 ? ", " : "") << value[i];
+        }
+        stream << "]";
+        used[name] = stream.str();
+    }
+
+    /// Parameters read by the benchmark with the values used
+    const std::map<std::string, std::string> &usedValues() const { return used; }
+
+private:
+    void load(std::istream &lines)
+    {
+        std::string line;
+        while(std::getline(lines, line)){
+            const size_t comment = line.find('#');
+            if(comment != std::string::npos){
+                line.erase(comment);
+            }
+            const size_t colon = line.find(':');
+            if(colon == std::string::npos){
+                continue;
+            }
+            const std::string name = trim(line.substr(0, colon));
+            const std::string value = trim(line.substr(colon + 1));
+            if(!name.empty() && !value.empty()){
+                values[name] = value;
+            }
+        }
+    }
+
+    static std::string trim(const std::string &s)
+    {
+        const size_t begin = s.find_first_not_of(" \t\r\"'");
+        const size_t end = s.find_last_not_of(" \t\r\"'");
+        return begin == std::string::npos ? std::string() : s.substr(begin, end - begin + 1);
+    }
+
+    template<typename T>
+    static std::string toString(const T &value)
+    {
+        std::ostringstream stream;
+        stream << value;
+        return stream.str();
+    }
+
+    std::map<std::string, std::string> values;
+    std::map<std::string, std::string> used;
+};
+
+/// Latencies or counts of one quantity over all runs
+class BenchmarkSeries{
+public:
+    void add(double value) { values.push_back(value); }
+
+    size_t size() const { return values.size(); }
+
+    /// Nearest rank
+    double percentile(double p) const
+    {
+        if(values.empty()){
+            return 0.0;
+        }
+        std::vector<double> sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        const int rank = (int)std::ceil(p / 100.0 * (double)sorted.size());
+        return sorted[std::min(std::max(rank, 1), (int)sorted.size()) - 1];
+    }
+
+    double mean() const
+    {
+        double sum = 0.0;
+        for(const double v : values){
+            sum += v;
+        }
+        return values.empty() ? 0.0 : sum / (double)values.size();
+    }
+
+    double max() const
+    {
+        return values.empty() ? 0.0 : *std::max_element(values.begin(), values.end());
+    }
+
+    void writeJson(FILE *file) const
+    {
+        fprintf(file, "{\"max\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"samples\": %zu}",
+                max(), mean(), percentile(50.0), percentile(95.0), percentile(99.0), size());
+    }
+
+private:
+    std::vector<double> values;
+};
+
+static double millisecondsSince(steady_clock::time_point start)
+{
+    return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+/// Decode the messages of the topic in order and call process_frame(frame) for each frame. The risk map of a frame is
+/// only valid during the call. A bricks message is patched into the frame before it and dropped when that frame is not
+/// the base of the message, like in mapFutureStatusCallback(). Returns the number of dropped messages.
+template<typename F>
+static int streamRecordedFrames(const std::string &bag_path, const std::string &topic, F process_frame)
+{
+    rosbag::Bag bag;
+    bag.open(bag_path, rosbag::bagmode::Read);
+    rosbag::View view(bag, rosbag::TopicQuery(topic));
+
+    std::vector<float> resident(RiskMapLayout::size, 0.f);
+    bool resident_valid = false;
+    uint32_t resident_seq = 0;
+    int dropped_num = 0;
+
+    for(const rosbag::MessageInstance &instance : view){
+        rast_corridor_planning::RiskMap::ConstPtr msg = instance.instantiate<rast_corridor_planning::RiskMap>();
+        if(!msg){
+            continue;
+        }
+        const bool bricks_message = msg->encoding == rast_corridor_planning::RiskMap::ENCODING_BRICKS;
+        if(bricks_message && (!resident_valid || msg->base_seq != resident_seq)){
+            ++ dropped_num;
+            continue;
+        }
+        if(!RiskMapCodec::decode(*msg, resident.data())){
+            resident_valid = false;
+            ++ dropped_num;
+            continue;
+        }
+        resident_valid = true;
+        resident_seq = msg->seq;
+
+        RecordedFrame frame;
+        frame.risk_map = resident.data();
+        frame.map_center << msg->map_center.x, msg->map_center.y, msg->map_center.z;
+        process_frame(frame);
+    }
+    bag.close();
+    return dropped_num;
+}
+
+static bool readCases(const std::string &path, std::vector<BenchmarkCase> &cases)
+{
+    std::ifstream file(path);
+    if(!file){
+        return false;
+    }
+    std::string line;
+    while(std::getline(file, line)){
+        if(line.empty() || line[0] == '#'){
+            continue;
+        }
+        std::istringstream stream(line);
+        BenchmarkCase c;
+        if(stream >> c.frame_index >> c.start_position.x() >> c.start_position.y() >> c.start_position.z()
+                  >> c.start_velocity.x() >> c.start_velocity.y() >> c.start_velocity.z() >> c.goal.x() >> c.goal.y() >> c.goal.z()){
+            cases.push_back(c);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s <risk_maps.bag | snapshot.rmsnap ...> [--config cfg.yaml] [--cases cases.txt] "
+                        "[--output benchmark.json] [--repeat N] [--topic name] [name=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    std::string bag_path;
+    std::vector<std::string> snapshot_paths;
+    std::string config_path, cases_path, output_path = "benchmark.json", topic = "/my_map/future_risk_map";
+    int repeat = 1;
+    std::vector<std::string> assignments;
+    const std::string snapshot_extension = ".rmsnap";
+    for(int i=1; i<argc; ++i){
+        const std::string arg = argv[i];
+        if(arg == "--config" && i + 1 < argc){
+            config_path = argv[++i];
+        }else if(arg == "--cases" && i + 1 < argc){
+            cases_path = argv[++i];
+        }else if(arg == "--output" && i + 1 < argc){
+            output_path = argv[++i];
+        }else if(arg == "--repeat" && i + 1 < argc){
+            repeat = std::max(1, atoi(argv[++i]));
+        }else if(arg == "--topic" && i + 1 < argc){
+            topic = argv[++i];
+        }else if(arg.find('=') != std::string::npos){
+            assignments.push_back(arg);
+        }else if(arg.size() > snapshot_extension.size()
+                 && arg.compare(arg.size() - snapshot_extension.size(), snapshot_extension.size(), snapshot_extension) == 0){
+            snapshot_paths.push_back(arg);
+        }else if(bag_path.empty() && arg.compare(0, 2, "--") != 0){
+            bag_path = arg;
+        }else{
+            fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    /// Each snapshot is a frame with its own case. Its risk map stays in the mapped file.
+    std::vector<RecordedFrame> snapshot_frames;
+    std::vector<BenchmarkCase> snapshot_cases;
+    for(const auto &path : snapshot_paths){
+        std::shared_ptr<RiskMapSnapshotFile> snapshot = std::make_shared<RiskMapSnapshotFile>();
+        if(!snapshot->open(path)){
+            fprintf(stderr, "Failed to read the snapshot %s\n", path.c_str());
+            return 1;
+        }
+        const RiskMapSnapshotHeader &header = snapshot->header();
+        if(header.warm_started){
+            fprintf(stderr, "Warning: the search of %s was warm started from the path of the search before it, which is not "
+                            "recorded. The replay can find another path.\n", path.c_str());
+        }
+        RecordedFrame frame;
+        frame.snapshot = snapshot;
+        frame.map_center << header.map_center[0], header.map_center[1], header.map_center[2];
+
+        BenchmarkCase c;
+        c.frame_index = (int)snapshot_frames.size();
+        for(int i=0; i<3; ++i){
+            c.start_position(i) = header.start_position[i] + header.map_center[i];
+            c.start_velocity(i) = header.start_velocity[i];
+            c.start_acceleration(i) = header.start_acceleration[i];
+            c.goal(i) = header.goal[i] + header.map_center[i];
+        }
+        c.start_time = header.start_time;
+        c.has_reference_direction = true;
+        c.reference_direction_angle = header.reference_direction_angle;
+        snapshot_frames.push_back(std::move(frame));
+        snapshot_cases.push_back(c);
+    }
+    const int snapshot_frame_num = (int)snapshot_frames.size();
+
+    BenchmarkParameters parameters;
+    if(!config_path.empty() && !parameters.loadFile(config_path)){
+        fprintf(stderr, "Failed to read %s\n", config_path.c_str());
+        return 1;
+    }
+    if(config_path.empty() && snapshot_frame_num > 0){
+        parameters.loadText(snapshot_frames.front().snapshot->parameters());
+    }
+    for(const auto &assignment : assignments){
+        parameters.set(assignment);
+    }
+
+    /// Defaults of planning_node
+    double goal_x = 60.0, goal_y = 0.0, goal_z = 1.5;
+    double max_vel = 3.0, max_acc = 4.0, max_vel_optimization = 3.0, max_acc_optimization = 4.0;
+    bool use_height_limit = true, sample_z_acc = true;
+    float height_limit_max = 2.2f, height_limit_min = 0.f, expand_safety_distance = 0.2f;
+    double planning_time_step = 0.05, delta_corridor = 0.3;
+    float a_star_acc_sample_step = 2.f, a_star_search_time_step = 0.4f;
+    bool a_star_hashed_node_index = true, a_star_velocity_direction_code = false, a_star_use_primitive_table = true;
+    float a_star_primitive_velocity_resolution = 0.1f;
+    int a_star_expansion_threads = 1, a_star_max_search_steps = 300;
+    float a_star_max_search_time = 0.f;
+    bool a_star_warm_start = false;
+    float a_star_warm_start_position_tolerance = 0.3f, a_star_warm_start_velocity_tolerance = 0.5f;
+    bool a_star_record_searched_points = false;
+    bool corridor_incremental_expansion = true, corridor_galloping_expansion = false;
+    float corridor_max_expand_distance = 2.f;
+    float risk_threshold_motion_primitive = 0.15f, risk_threshold_single_voxel = 0.15f, risk_threshold_corridor = 2.5f;
+    bool optimization_persistent_solver = false;
+    int optimization_slack_rows_per_piece = 8;
+    int optimization_candidate_threads = 0;
+    std::vector<double> optimization_time_scales = {0.8, 1.25, 1.6};
+    double optimization_heuristic_velocity_ratio = 0.7, optimization_time_weight = 1.0, optimization_deadline = 0.05;
+    std::vector<double> factors = {0, 0.5, 0.5, 0, 0};
+
+    parameters.get("p_goal_x", goal_x);
+    parameters.get("p_goal_y", goal_y);
+    parameters.get("p_goal_z", goal_z);
+    parameters.get("max_vel", max_vel);
+    parameters.get("max_acc", max_acc);
+    parameters.get("max_vel_optimization", max_vel_optimization);
+    parameters.get("max_acc_optimization", max_acc_optimization);
+    parameters.get("use_height_limit", use_height_limit);
+    parameters.get("height_limit_max", height_limit_max);
+    parameters.get("height_limit_min", height_limit_min);
+    parameters.get("sample_z_acc", sample_z_acc);
+    parameters.get("expand_safety_distance", expand_safety_distance);
+    parameters.get("pos_factor", factors[0]);
+    parameters.get("vel_factor", factors[1]);
+    parameters.get("acc_factor", factors[2]);
+    parameters.get("jerk_factor", factors[3]);
+    parameters.get("snap_factor", factors[4]);
+    parameters.get("delta_corridor", delta_corridor);
+    parameters.get("optimization_persistent_solver", optimization_persistent_solver);
+    parameters.get("optimization_slack_rows_per_piece", optimization_slack_rows_per_piece);
+    parameters.get("optimization_candidate_threads", optimization_candidate_threads);
+    parameters.get("optimization_time_scales", optimization_time_scales);
+    parameters.get("optimization_heuristic_velocity_ratio", optimization_heuristic_velocity_ratio);
+    parameters.get("optimization_time_weight", optimization_time_weight);
+    parameters.get("optimization_deadline", optimization_deadline);
+    parameters.get("planning_time_step", planning_time_step);
+    parameters.get("a_star_acc_sample_step", a_star_acc_sample_step);
+    parameters.get("a_star_search_time_step", a_star_search_time_step);
+    parameters.get("a_star_hashed_node_index", a_star_hashed_node_index);
+    parameters.get("a_star_velocity_direction_code", a_star_velocity_direction_code);
+    parameters.get("a_star_use_primitive_table", a_star_use_primitive_table);
+    parameters.get("a_star_primitive_velocity_resolution", a_star_primitive_velocity_resolution);
+    parameters.get("a_star_expansion_threads", a_star_expansion_threads);
+    parameters.get("a_star_max_search_steps", a_star_max_search_steps);
+    parameters.get("a_star_max_search_time", a_star_max_search_time);
+    parameters.get("a_star_warm_start", a_star_warm_start);
+    parameters.get("a_star_warm_start_position_tolerance", a_star_warm_start_position_tolerance);
+    parameters.get("a_star_warm_start_velocity_tolerance", a_star_warm_start_velocity_tolerance);
+    parameters.get("a_star_record_searched_points", a_star_record_searched_points);
+    parameters.get("corridor_incremental_expansion", corridor_incremental_expansion);
+    parameters.get("corridor_galloping_expansion", corridor_galloping_expansion);
+    parameters.get("corridor_max_expand_distance", corridor_max_expand_distance);
+    parameters.get("risk_threshold_motion_primitive", risk_threshold_motion_primitive);
+    parameters.get("risk_threshold_single_voxel", risk_threshold_single_voxel);
+    parameters.get("risk_threshold_corridor", risk_threshold_corridor);
+
+    /// Same setup as the main() of planning_node
+    Astar astar_planner;
+    astar_planner.setTimeParameters(a_star_search_time_step, (float)planning_time_step);
+    astar_planner.setHeightLimit(use_height_limit, height_limit_max, height_limit_min);
+    astar_planner.setIfSampleZDirection(sample_z_acc);
+    astar_planner.setMaximumVelAccAndStep(static_cast<float>(max_vel), static_cast<float>(max_vel), static_cast<float>(max_acc), static_cast<float>(max_acc/2.0), a_star_acc_sample_step);
+    astar_planner.setRiskThreshold(risk_threshold_motion_primitive, risk_threshold_single_voxel, risk_threshold_corridor);
+    astar_planner.setNodeIndexMode(a_star_hashed_node_index, a_star_velocity_direction_code);
+    astar_planner.setPrimitiveTable(a_star_use_primitive_table, a_star_primitive_velocity_resolution);
+    astar_planner.setExpansionThreads(a_star_expansion_threads);
+    astar_planner.setMaximumSearchSteps(a_star_max_search_steps);
+    astar_planner.setMaximumSearchTime(a_star_max_search_time);
+    astar_planner.setWarmStart(a_star_warm_start, a_star_warm_start_position_tolerance, a_star_warm_start_velocity_tolerance);
+    astar_planner.setRecordSearchedPoints(a_star_record_searched_points);
+    astar_planner.setCorridorExpansion(corridor_incremental_expansion, corridor_galloping_expansion, corridor_max_expand_distance);
+
+    CorridorOptimizerConfig optimizer_config;
+    optimizer_config.factors = factors;
+    optimizer_config.delta_corridor = delta_corridor;
+    optimizer_config.max_vel = max_vel_optimization;
+    optimizer_config.max_acc = max_acc_optimization;
+    optimizer_config.persistent_solver = optimization_persistent_solver;
+    optimizer_config.slack_rows_per_piece = optimization_slack_rows_per_piece;
+    optimizer_config.candidate_threads = optimization_candidate_threads;
+    optimizer_config.time_scales = optimization_time_scales;
+    optimizer_config.heuristic_velocity_ratio = optimization_heuristic_velocity_ratio;
+    optimizer_config.time_weight = optimization_time_weight;
+    optimizer_config.deadline = optimization_deadline;
+    CorridorOptimizer corridor_optimizer;
+    corridor_optimizer.setConfig(optimizer_config);
+
+    std::vector<BenchmarkCase> cases;
+    if(!cases_path.empty() && !readCases(cases_path, cases)){
+        fprintf(stderr, "Failed to read %s\n", cases_path.c_str());
+        return 1;
+    }
+
+    BenchmarkSeries risk_table_ms, search_ms, corridors_ms, optimization_ms, total_ms;
+    BenchmarkSeries search_nodes, qp_iterations, qp_solves;
+    std::map<std::string, int> stop_reasons;
+    int run_num = 0, path_num = 0, optimized_num = 0, skipped_case_num = 0;
+    float reference_direction_angle = 100.f;
+
+    auto run_case = [&](const BenchmarkCase &c, RecordedFrame &frame){
+        ++ run_num;
+        const steady_clock::time_point run_start = steady_clock::now();
+
+        /// The whole table is built, since the bricks changed between the recorded frames are not known
+        steady_clock::time_point stage_start = steady_clock::now();
+        astar_planner.updateRiskMap(frame.data());
+        risk_table_ms.add(millisecondsSince(stage_start));
+
+        const Eigen::Vector3d start_p = c.start_position - frame.map_center;
+        Eigen::Vector3d start_v = c.start_velocity;
+        for(int i=0; i<2; ++i){
+            if(fabs(start_v(i)) > astar_planner.v_max_xy){
+                start_v(i) = astar_planner.v_max_xy * start_v(i) / fabs(start_v(i));
+            }
+        }
+        if(fabs(start_v.z()) > astar_planner.v_max_z){
+            start_v.z() = astar_planner.v_max_z * start_v.z() / fabs(start_v.z());
+        }
+        Node start_node(0, start_p.x(), start_p.y(), start_p.z(), start_v.x(), start_v.y(), start_v.z());
+        Node end_node(0, c.goal.x() - frame.map_center.x(), c.goal.y() - frame.map_center.y(), c.goal.z() - frame.map_center.z(), 0, 0, 0);
+        vector<Node*> result;
+
+        stage_start = steady_clock::now();
+        astar_planner.updateMapCenterPosition(frame.map_center.x(), frame.map_center.y(), frame.map_center.z());
+        if(c.has_reference_direction){
+            reference_direction_angle = c.reference_direction_angle;
+        }
+        SearchStopReason stop_reason = astar_planner.search(&start_node, &end_node, c.start_time, expand_safety_distance, reference_direction_angle,
+                                                            frame.data(), result);
+        search_ms.add(millisecondsSince(stage_start));
+        search_nodes.add(astar_planner.getLastSearchSteps());
+        ++ stop_reasons[searchStopReasonName(stop_reason)];
+
+        if(result.size() <= 1 || result.size() >= 10){ // same limits as planning_node
+            total_ms.add(millisecondsSince(run_start));
+            return;
+        }
+        ++ path_num;
+        reference_direction_angle = atan2(result[1]->y - result[0]->y, result[1]->x - result[0]->x);
+
+        stage_start = steady_clock::now();
+        vector<Corridor*> corridors;
+        astar_planner.findCorridors(corridors, 2);
+        vector<TimeWindow> corridor_time_windows;
+        if(corridor_optimizer.usesCandidates()){
+            for(const auto &corridor : corridors){
+                float window_start, window_end;
+                astar_planner.getCorridorSafeTimeWindow(*corridor, window_start, window_end);
+                corridor_time_windows.emplace_back(window_start, window_end);
+            }
+        }
+        corridors_ms.add(millisecondsSince(stage_start));
+
+        /// Same problem as the corridor message of planning_node
+        stage_start = steady_clock::now();
+        std::vector<Eigen::Matrix<double, 6, -1>> polyhedra;
+        std::vector<double> time_alloc;
+        for(const auto &corridor : corridors){
+            Eigen::Matrix<double, 6, -1> polygon(6, corridor->envelope.surfaces.size());
+            for(size_t i=0; i<corridor->envelope.surfaces.size(); ++i){
+                const Plane3D &surface = corridor->envelope.surfaces[i];
+                polygon.col(i) << surface.normal.x, surface.normal.y, surface.normal.z, surface.point.x, surface.point.y, surface.point.z;
+            }
+            polyhedra.push_back(polygon);
+            time_alloc.push_back(a_star_search_time_step);
+        }
+        Eigen::Matrix3d init_state = Eigen::Matrix3d::Zero();
+        Eigen::Matrix3d finl_state = Eigen::Matrix3d::Zero();
+        init_state.col(0) << result.front()->x, result.front()->y, result.front()->z;
+        init_state.col(1) << result.front()->vx, result.front()->vy, result.front()->vz;
+        init_state.col(2) = c.start_acceleration;
+        finl_state.col(0) << result.back()->x, result.back()->y, result.back()->z;
+        finl_state.col(1) << result.back()->vx, result.back()->vy, result.back()->vz;
+
+        Trajectory traj;
+        bool satisfied = false;
+        const bool is_solved = corridor_optimizer.solve(init_state, finl_state, time_alloc, polyhedra, corridor_time_windows, traj, satisfied);
+        optimization_ms.add(millisecondsSince(stage_start));
+        qp_iterations.add(corridor_optimizer.getLastStats().qp_iterations);
+        qp_solves.add(corridor_optimizer.getLastStats().qp_solves);
+        if(is_solved && satisfied){
+            ++ optimized_num;
+        }
+        total_ms.add(millisecondsSince(run_start));
+    };
+
+    /// The cases of a frame, in the order of the cases file. Without a file, a snapshot has its own case and a frame
+    /// of the bag is planned from its map center to the goal.
+    std::map<int, std::vector<BenchmarkCase>> frame_cases;
+    for(const auto &c : cases){
+        frame_cases[c.frame_index].push_back(c);
+    }
+    auto run_frame = [&](int frame_index, RecordedFrame &frame){
+        if(!cases_path.empty()){
+            auto it = frame_cases.find(frame_index);
+            if(it != frame_cases.end()){
+                for(const auto &c : it->second){
+                    run_case(c, frame);
+                }
+            }
+        }else if(frame_index < snapshot_frame_num){
+            run_case(snapshot_cases[frame_index], frame);
+        }else{
+            BenchmarkCase c;
+            c.frame_index = frame_index;
+            c.start_position = frame.map_center;
+            c.start_velocity = Eigen::Vector3d::Zero();
+            c.goal << goal_x, goal_y, goal_z;
+            run_case(c, frame);
+        }
+    };
+
+    /// The bag is read again for each repetition instead of keeping its frames
+    int frame_num = snapshot_frame_num;
+    int dropped_num = 0;
+    for(int r=0; r<repeat; ++r){
+        for(int i=0; i<snapshot_frame_num; ++i){
+            run_frame(i, snapshot_frames[i]);
+        }
+        if(bag_path.empty()){
+            continue;
+        }
+
+        int bag_frame_num = 0;
+        try{
+            const int dropped_num_this = streamRecordedFrames(bag_path, topic, [&](RecordedFrame &frame){
+                run_frame(snapshot_frame_num + bag_frame_num, frame);
+                ++ bag_frame_num;
+            });
+            if(r == 0){
+                dropped_num = dropped_num_this;
+                frame_num += bag_frame_num;
+            }
+        }catch(const rosbag::BagException &e){
+            fprintf(stderr, "Failed to read %s: %s\n", bag_path.c_str(), e.what());
+            return 1;
+        }
+    }
+    if(frame_num == 0){
+        fprintf(stderr, "No snapshot and no risk map of the planner size on topic %s\n", topic.c_str());
+        return 1;
+    }
+
+    int case_num = (int)cases.size();
+    if(cases_path.empty()){
+        case_num = frame_num;
+    }else{
+        for(const auto &c : cases){
+            if(c.frame_index < 0 || c.frame_index >= frame_num){
+                skipped_case_num += repeat;
+            }
+        }
+    }
+
+    FILE *file = output_path == "-" ? stdout : fopen(output_path.c_str(), "w");
+    if(!file){
+        fprintf(stderr, "Failed to write %s\n", output_path.c_str());
+        return 1;
+    }
+
+    const double run_num_inv = run_num > 0 ? 1.0 / (double)run_num : 0.0;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"cases\": %d,\n", case_num);
+    fprintf(file, "  \"frames\": %d,\n", frame_num);
+    fprintf(file, "  \"frames_dropped\": %d,\n", dropped_num);
+    fprintf(file, "  \"geometry\": \"%s\",\n", Astar::Geometry::name());
+    fprintf(file, "  \"latency_ms\": {\n");
+    const std::pair<const char*, const BenchmarkSeries*> stages[] = {{"corridors", &corridors_ms}, {"optimization", &optimization_ms},
+                                                                     {"risk_table", &risk_table_ms}, {"search", &search_ms}, {"total", &total_ms}};
+    for(size_t i=0; i<sizeof(stages) / sizeof(stages[0]); ++i){
+        fprintf(file, "    \"%s\": ", stages[i].first);
+        stages[i].second->writeJson(file);
+        fprintf(file, i + 1 < sizeof(stages) / sizeof(stages[0]) ? ",\n" : "\n");
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"parameters\": {\n");
+    size_t parameter_seq = 0;
+    for(const auto &p : parameters.usedValues()){
+        fprintf(file, "    \"%s\": \"%s\"%s\n", p.first.c_str(), p.second.c_str(), ++ parameter_seq < parameters.usedValues().size() ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"qp_iterations\": ");
+    qp_iterations.writeJson(file);
+    fprintf(file, ",\n  \"qp_solves\": ");
+    qp_solves.writeJson(file);
+    fprintf(file, ",\n  \"repeat\": %d,\n", repeat);
+    fprintf(file, "  \"runs\": %d,\n", run_num);
+    fprintf(file, "  \"search_nodes\": ");
+    search_nodes.writeJson(file);
+    fprintf(file, ",\n  \"skipped_cases\": %d,\n", skipped_case_num);
+    fprintf(file, "  \"stop_reasons\": {");
+    size_t reason_seq = 0;
+    for(const auto &reason : stop_reasons){
+        fprintf(file, "\"%s\": %d%s", reason.first.c_str(), reason.second, ++ reason_seq < stop_reasons.size() ? ", " : "");
+    }
+    fprintf(file, "},\n");
+    fprintf(file, "  \"success_rate\": {\"optimization\": %.4f, \"overall\": %.4f, \"search\": %.4f}\n",
+            path_num > 0 ? (double)optimized_num / (double)path_num : 0.0, (double)optimized_num * run_num_inv, (double)path_num * run_num_inv);
+    fprintf(file, "}\n");
+
+    if(file != stdout){
+        fclose(file);
+    }
+    return 0;
+}
@@ -13,27 +13,42 @@
 #include "nav_msgs/Odometry.h"
 #include "std_msgs/Float64.h"
 #include "risk_aware_kinodynamic_a_star.h"
+#include "risk_map_shared_memory.h"
+#include "risk_map_snapshot.h"
 #include "decomp_ros_msgs/DynPolyhedronArray.h"
 #include "decomp_ros_msgs/Polyhedron.h"
-#include <CorridorMiniSnap/corridor_minisnap.h>
+#include <CorridorMiniSnap/corridor_optimizer.h>
 #include "nav_msgs/Path.h"
 #include "trajectory_msgs/JointTrajectoryPoint.h"
 #include "trajectory_msgs/MultiDOFJointTrajectory.h"
-#include "std_msgs/Float32MultiArray.h"
+#include "risk_map_codec.h"
+#include "spsc_ring_buffer.h"
+#include "triple_buffer.h"
+#include "bounded_queue.h"
+#include "visualization_publisher.h"
+#include "planning_instrumentation.h"
+#include "diagnostic_msgs/DiagnosticArray.h"
 #include "mav_msgs/default_topics.h"
 #include "trajectory_msgs/MultiDOFJointTrajectory.h"
 #include <ctime>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include "std_msgs/UInt8.h"
+#include "std_msgs/Empty.h"
 
 
 using namespace traj_opt;
 using namespace std;
 using namespace std::chrono;
 
+/// The risk map topic and the shared memory frames carry the map of the mapping node
+static_assert(std::is_same<Astar::Geometry, DspMapGeometry>::value, "The planner geometry must be the one of the risk map frames");
 Astar astar_planner;
 
-CorridorMiniSnap mini_snap_;
+CorridorOptimizer corridor_optimizer;
 Trajectory traj_;
 
 queue<double> pose_att_time_queue;
@@ -51,9 +66,21 @@ Eigen::Quaternionf uav_att_global;
 bool state_locked = false;
 double max_differentiated_current_a = 4.0;
 
-float future_risk_global[VOXEL_NUM][RISK_MAP_NUMBER];
-bool future_risk_updated = false;
-bool future_risk_locked = false;
+/// Risk map frames (in RiskMapLayout order, with the map center and stamp) are read from the ring of the mapper in the
+/// shared memory mode, or from a ring in this process filled by mapFutureStatusCallback
+bool use_shared_memory_risk_map = false;
+string risk_map_shared_memory_name = "/rast_risk_map";
+RiskMapShmWriter risk_map_topic_writer;
+RiskMapShmReader risk_map_reader;
+
+/// Inputs of planning cycles written to files for planning_benchmark, when a message is received on
+/// /planning_node/record_snapshot or when a cycle is slow
+string snapshot_directory = ""; /// Empty: no snapshots
+double snapshot_slow_cycle_time = 0.0; /// Seconds. Cycles that take longer are recorded. 0: only on request
+int snapshot_max_number = 100; /// Files written at most. 0: no limit
+string snapshot_parameters; /// Planner parameters as cfg.yaml lines, stored in every snapshot
+RiskMapSnapshotRecorder snapshot_recorder;
+std::atomic<bool> snapshot_requested(false);
 
 bool rviz_map_center_locked = false;
 
@@ -61,9 +88,6 @@ bool position_received = false;
 bool trajectory_initialized = false;
 double goal_x = 60.0, goal_y = 0.0, goal_z = 1.5;
 
-bool in_safety_mode = false;
-Eigen::Vector3d p_store_for_em, v_store_for_em, a_store_for_em;
-float yaw_store_for_em = 0.f;
 float reference_direction_angle = 100.f;
 
 typedef struct PVAYPoint
@@ -72,10 +96,28 @@ typedef struct PVAYPoint
     Eigen::Vector3d velocity;
     Eigen::Vector3d acceleration;
     double yaw = 0.0;
+    uint64_t seq = 0; // index along the committed trajectory. 0: not committed
 }PVAYPoint;
 
-queue<PVAYPoint> trajectory_piece;
-queue<PVAYPoint> trajectory_to_nmpc;
+/// Last setpoint and safety mode flag of setpointCallback, read by P1 of trajectoryCallback
+typedef struct SetpointState
+{
+    PVAYPoint setpoint;
+    bool in_safety_mode = false;
+}SetpointState;
+
+TripleBuffer<SetpointState> setpoint_state_slot;
+
+/// Committed trajectory and NMPC look-ahead. Filled by trajectoryCallback and popped by setpointCallback.
+SpscRingBuffer<PVAYPoint, 512> trajectory_piece;
+SpscRingBuffer<PVAYPoint, 512> trajectory_to_nmpc;
+
+/// trajectoryCallback and the optimization stage both add to the rings above, so they take this mutex. The version is
+/// increased by every change, so a result planned from an older trajectory can be found. Every point pushed to
+/// trajectory_piece gets the next seq, so the point a search started from can still be found after a change.
+std::mutex trajectory_producer_mutex;
+std::atomic<unsigned long> trajectory_version(0);
+uint64_t trajectory_point_seq = 0;
 
 int trajectory_piece_max_size = 12;
 int nmpc_receive_points_num = 20;
@@ -86,6 +128,13 @@ double max_acc = 4.0;
 double max_vel_optimization = 3.0;
 double max_acc_optimization = 4.0;
 double delta_corridor = 0.3;
+bool optimization_persistent_solver = false;
+int optimization_slack_rows_per_piece = 8;
+int optimization_candidate_threads = 0; /// Threads that solve candidate time allocations, including the calling thread. 0: only the allocation of the corridors
+std::vector<double> optimization_time_scales = {0.8, 1.25, 1.6}; /// Candidates scaled from the allocation of the corridors
+double optimization_heuristic_velocity_ratio = 0.7; /// Candidate from the path length at this fraction of max_vel_optimization. 0: none
+double optimization_time_weight = 1.0; /// Cost of one second of flight, added to the cost of a candidate trajectory
+double optimization_deadline = 0.05; /// Seconds. Candidates other than the allocation of the corridors give up after it, also in the middle of a QP solve
 
 bool use_height_limit = true;
 float height_limit_max = 2.2f;
@@ -95,6 +144,24 @@ bool sample_z_acc = true;
 float a_star_acc_sample_step = 2.f;
 float a_star_search_time_step = 0.4f; /// Should be tuned to reach one voxel at least when using maximum acceleration.
 float expand_safety_distance = 0.2f;
+bool a_star_hashed_node_index = true;
+bool a_star_velocity_direction_code = false;
+bool a_star_use_primitive_table = true;
+float a_star_primitive_velocity_resolution = 0.1f;
+int a_star_expansion_threads = 1;
+int a_star_max_search_steps = 300;
+float a_star_max_search_time = 0.f; /// Seconds. 0: no time limit
+bool a_star_warm_start = false; /// Continue the last path when the new start is on it
+float a_star_warm_start_position_tolerance = 0.3f;
+float a_star_warm_start_velocity_tolerance = 0.5f;
+bool corridor_incremental_expansion = true;
+bool corridor_galloping_expansion = false;
+float corridor_max_expand_distance = 2.f;
+bool pipelined_planning = false; /// Run the optimization on its own thread, so the next search does not wait for it
+int pipeline_queue_size = 1;
+bool visualization_enabled = true; /// Markers are only built for topics with subscribers
+bool visualization_thread = true; /// Build and publish the markers on a low priority thread
+bool a_star_record_searched_points = false;
 
 float risk_threshold_motion_primitive = 0.15;
 float risk_threshold_single_voxel = 0.15;
@@ -104,116 +171,172 @@ std::vector<double> factors(5);
 
 geometry_msgs::PoseStamped map_pose_global;
 
-bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, const Eigen::Vector3d planning_start_map_center);
+/// Corridors handed from the search stage (trajectoryCallback) to the optimization stage
+typedef struct OptimizationJob
+{
+    decomp_ros_msgs::DynPolyhedronArray corridor_msg;
+    Eigen::Vector3d planning_start_map_center;
+    uint64_t risk_map_seq = 0;
+    double risk_map_stamp = 0.0;
+    unsigned long base_trajectory_version = 0; // version of the committed trajectory the search started from
+    uint64_t start_point_seq = 0; // committed point the search started from. 0: not from a committed point
+    std::vector<std::pair<double, double>> corridor_time_windows; // in which each corridor is safe. Only for candidate time allocations
+    double search_start_time = 0.0;
+    double queued_time = 0.0;
+}OptimizationJob;
+
+BoundedQueue<OptimizationJob> optimization_queue;
+
+/// Latencies and work of the planning stages, published on /diagnostics every diagnostics_period
+enum PlanningStage {STAGE_MAP_INGEST, STAGE_START_STATE, STAGE_SEARCH, STAGE_CORRIDORS, STAGE_OPTIMIZATION, STAGE_PUBLISHING,
+                    STAGE_CYCLE, STAGE_PIPELINE_QUEUE, STAGE_MAP_AGE, STAGE_COMMIT_INTERVAL, STAGE_NUM};
+const char *const planning_stage_names[STAGE_NUM] = {"map_ingest", "p1_start_state", "p2_search", "p3_corridors", "p4_optimization",
+                                                     "publishing", "cycle", "pipeline_queue", "map_age", "commit_interval"};
+LatencyHistogram stage_latency[STAGE_NUM];
+
+enum PlanningCounter {COUNTER_CYCLES, COUNTER_PLANNING_SKIPPED, COUNTER_PATHS, COUNTER_EXPANDED_NODES, COUNTER_ENVELOPE_CHECKS,
+                      COUNTER_ENVELOPE_VOXEL_CHECKS, COUNTER_CORRIDOR_EXPANSION_STEPS, COUNTER_QP_SOLVES, COUNTER_QP_ITERATIONS,
+                      COUNTER_ROOT_FINDER_CALLS, COUNTER_OPTIMIZATION_FAILURES, COUNTER_NUM};
+const char *const planning_counter_names[COUNTER_NUM] = {"cycles", "planning_skipped", "paths", "expanded_nodes", "envelope_checks",
+                                                         "envelope_voxel_checks", "corridor_expansion_steps", "qp_solves",
+                                                         "qp_iterations", "root_finder_calls", "optimization_failures"};
+InstrumentationCounter planning_counters[COUNTER_NUM];
+
+double diagnostics_period = 1.0; /// Seconds. 0: no timing and no diagnostics
+ros::Publisher diagnostics_pub;
+
+VisualizationPublisher visualization_publisher;
+
+bool visualizationWanted(const ros::Publisher &publisher)
+{
+    return visualization_enabled && publisher.getNumSubscribers() > 0;
+}
+
+bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray &msg, const Eigen::Vector3d planning_start_map_center,
+                             unsigned long base_trajectory_version, uint64_t start_point_seq,
+                             const std::vector<std::pair<double, double>> &corridor_time_windows);
+void runOptimizationStage(const OptimizationJob &job);
 
 void corridorsPublish(vector<Corridor*> &corridors, geometry_msgs::PoseStamped &map_pose, bool clear_corridors = false)
 {
-    ROS_INFO("corridors num = %ld", corridors.size());
+    ROS_DEBUG("corridors num = %ld", corridors.size());
+
+    if(!visualizationWanted(current_marker_pub)){
+        return;
+    }
 
+    /// The corridors are reused by the next search, so the envelopes are copied for the publisher thread
+    vector<RectangleEnvelope> envelopes;
     if(clear_corridors){
-        corridors.clear();
-        auto* empty_corridor = new Corridor();
-        for(int i=0; i<10; ++i){
-            for(int j=0; j<8; ++j)
-            {
-                Point3D p;
-                p.x = p.y = p.z = 1000.f;
-                empty_corridor->envelope.vertexes.push_back(p);
-            }
-            corridors.push_back(empty_corridor);
+        RectangleEnvelope empty_envelope;
+        for(auto &p : empty_envelope.vertexes){
+            p.x = p.y = p.z = 1000.f;
         }
+        envelopes.assign(10, empty_envelope);
     }else{
         if(corridors.empty()) {
-            ROS_INFO("Empty corridors !");
+            ROS_DEBUG("Empty corridors !");
             return;
         }
+        envelopes.reserve(corridors.size());
+        for(const auto &c : corridors){
+            envelopes.push_back(c->envelope);
+        }
     }
 
-    visualization_msgs::MarkerArray marker_array;
-    visualization_msgs::Marker marker;
+    const ros::Time stamp = ros::Time::now();
+    const geometry_msgs::Point map_position = map_pose.pose.position;
 
-    marker.header.frame_id = "map";
-    marker.header.stamp = ros::Time::now();
-    marker.type = visualization_msgs::Marker::CUBE;
-    marker.action = visualization_msgs::Marker::ADD;
-    marker.ns = "cubes";
+    visualization_publisher.post([envelopes = std::move(envelopes), stamp, map_position]{
+        visualization_msgs::MarkerArray marker_array;
+        visualization_msgs::Marker marker;
 
-    marker.color.a = 0.2;
-    marker.color.g = 1.0;
+        marker.header.frame_id = "map";
+        marker.header.stamp = stamp;
+        marker.type = visualization_msgs::Marker::CUBE;
+        marker.action = visualization_msgs::Marker::ADD;
+        marker.ns = "cubes";
 
-    int id=0;
-    for(const auto& c : corridors){
-        marker.id = id;
-        ++id;
+        marker.color.a = 0.2;
+        marker.color.g = 1.0;
 
-        marker.pose.position.x = 0.0;
-        marker.pose.position.y = 0.0;
-        marker.pose.position.z = 0.0;
+        int id=0;
+        for(const auto& envelope : envelopes){
+            marker.id = id;
+            ++id;
 
-        for(int i=0; i<8; ++i)
-        {
-            marker.pose.position.x += c->envelope.vertexes[i].x;
-            marker.pose.position.y += c->envelope.vertexes[i].y;
-            marker.pose.position.z += c->envelope.vertexes[i].z;
-        }
-        marker.pose.position.x /= 8.0;
-        marker.pose.position.y /= 8.0;
-        marker.pose.position.z /= 8.0;
-
-        if(!rviz_map_center_locked){
-            marker.pose.position.x += map_pose.pose.position.x;
-            marker.pose.position.y += map_pose.pose.position.y;
-            marker.pose.position.z += map_pose.pose.position.z;
-        }
+            marker.pose.position.x = 0.0;
+            marker.pose.position.y = 0.0;
+            marker.pose.position.z = 0.0;
 
-        // Orientation
-        Eigen::Quaternionf ori;
-        ori.x() = ori.y() = ori.z() = 0.f;
-        ori.w() = 1.f;
-
-        float angle = atan2(c->envelope.vertexes[4].y - c->envelope.vertexes[2].y, c->envelope.vertexes[4].x - c->envelope.vertexes[2].x);
-        Eigen::Quaternionf axis; //= quad * q1 * quad.inverse();
-        axis.w() = cos(angle/2.f);
-        axis.x() = 0.0;
-        axis.y() = 0.0;
-        axis.z() = sin(angle/2.f);
-        Eigen::Quaternionf rotated_att = ori * axis;
-
-        marker.pose.orientation.x = rotated_att.x();
-        marker.pose.orientation.y = rotated_att.y();
-        marker.pose.orientation.z = rotated_att.z();
-        marker.pose.orientation.w = rotated_att.w();
-
-        // Width, length, height
-        marker.scale.x = sqrt((c->envelope.vertexes[2].x - c->envelope.vertexes[4].x)*(c->envelope.vertexes[2].x - c->envelope.vertexes[4].x)
-                              + (c->envelope.vertexes[2].y - c->envelope.vertexes[4].y)*(c->envelope.vertexes[2].y - c->envelope.vertexes[4].y));
-        marker.scale.y = sqrt((c->envelope.vertexes[2].x - c->envelope.vertexes[1].x)*(c->envelope.vertexes[2].x - c->envelope.vertexes[1].x)
-                              + (c->envelope.vertexes[2].y - c->envelope.vertexes[1].y)*(c->envelope.vertexes[2].y - c->envelope.vertexes[1].y));
-
-        marker.scale.z = c->envelope.vertexes[1].z - c->envelope.vertexes[0].z;
-        marker_array.markers.push_back(marker);
-    }
+            for(int i=0; i<8; ++i)
+            {
+                marker.pose.position.x += envelope.vertexes[i].x;
+                marker.pose.position.y += envelope.vertexes[i].y;
+                marker.pose.position.z += envelope.vertexes[i].z;
+            }
+            marker.pose.position.x /= 8.0;
+            marker.pose.position.y /= 8.0;
+            marker.pose.position.z /= 8.0;
+
+            if(!rviz_map_center_locked){
+                marker.pose.position.x += map_position.x;
+                marker.pose.position.y += map_position.y;
+                marker.pose.position.z += map_position.z;
+            }
 
-    // Add some useless cubics to remove old one.
-    for(int extra_id = id; extra_id<50; ++extra_id){
-        marker.id = id;
-        ++id;
-
-        marker.pose.position.x = -1000;
-        marker.pose.position.y = -1000;
-        marker.pose.position.z = 1000;
-        marker.scale.x = 0;
-        marker.scale.y = 0;
-        marker.scale.z = 0;
-        marker_array.markers.push_back(marker);
-    }
+            // Orientation
+            Eigen::Quaternionf ori;
+            ori.x() = ori.y() = ori.z() = 0.f;
+            ori.w() = 1.f;
+
+            float angle = atan2(envelope.vertexes[4].y - envelope.vertexes[2].y, envelope.vertexes[4].x - envelope.vertexes[2].x);
+            Eigen::Quaternionf axis; //= quad * q1 * quad.inverse();
+            axis.w() = cos(angle/2.f);
+            axis.x() = 0.0;
+            axis.y() = 0.0;
+            axis.z() = sin(angle/2.f);
+            Eigen::Quaternionf rotated_att = ori * axis;
+
+            marker.pose.orientation.x = rotated_att.x();
+            marker.pose.orientation.y = rotated_att.y();
+            marker.pose.orientation.z = rotated_att.z();
+            marker.pose.orientation.w = rotated_att.w();
+
+            // Width, length, height
+            marker.scale.x = sqrt((envelope.vertexes[2].x - envelope.vertexes[4].x)*(envelope.vertexes[2].x - envelope.vertexes[4].x)
+                                  + (envelope.vertexes[2].y - envelope.vertexes[4].y)*(envelope.vertexes[2].y - envelope.vertexes[4].y));
+            marker.scale.y = sqrt((envelope.vertexes[2].x - envelope.vertexes[1].x)*(envelope.vertexes[2].x - envelope.vertexes[1].x)
+                                  + (envelope.vertexes[2].y - envelope.vertexes[1].y)*(envelope.vertexes[2].y - envelope.vertexes[1].y));
+
+            marker.scale.z = envelope.vertexes[1].z - envelope.vertexes[0].z;
+            marker_array.markers.push_back(marker);
+        }
+
+        // Add some useless cubics to remove old one.
+        for(int extra_id = id; extra_id<50; ++extra_id){
+            marker.id = id;
+            ++id;
+
+            marker.pose.position.x = -1000;
+            marker.pose.position.y = -1000;
+            marker.pose.position.z = 1000;
+            marker.scale.x = 0;
+            marker.scale.y = 0;
+            marker.scale.z = 0;
+            marker_array.markers.push_back(marker);
+        }
 
-    current_marker_pub.publish(marker_array);
+        current_marker_pub.publish(marker_array);
+    });
 }
 
 
 void linesPublish(vector<Eigen::Vector3d> &points, int id, float r, float g, float b, float a, float width, int type=visualization_msgs::Marker::POINTS, bool clear_path = false)
 {
+    if(!visualizationWanted(astar_result_pub)){
+        return;
+    }
 
     if(clear_path){
         points.clear();
@@ -224,78 +347,104 @@ void linesPublish(vector<Eigen::Vector3d> &points, int id, float r, float g, flo
         }
     }else{
         if(points.empty()) {
-            ROS_INFO("Empty path !");
+            ROS_DEBUG("Empty path !");
             return;
         }
     }
 
-    visualization_msgs::Marker marker;
+    const ros::Time stamp = ros::Time::now();
 
-    marker.header.frame_id = "map";
-    marker.header.stamp = ros::Time::now();
-    marker.type = type;
-    marker.action = visualization_msgs::Marker::ADD;
-    marker.ns = "points_and_lines";
-    marker.id = id;
+    visualization_publisher.post([points, id, r, g, b, a, width, type, stamp]{
+        visualization_msgs::Marker marker;
 
-    marker.scale.x = width;
-    marker.scale.y = width;
-    marker.scale.z = width;
+        marker.header.frame_id = "map";
+        marker.header.stamp = stamp;
+        marker.type = type;
+        marker.action = visualization_msgs::Marker::ADD;
+        marker.ns = "points_and_lines";
+        marker.id = id;
 
-    marker.color.a = a;
-    marker.color.r = r;
-    marker.color.g = g;
-    marker.color.b = b;
-    marker.pose.orientation.w  = 1.0;
+        marker.scale.x = width;
+        marker.scale.y = width;
+        marker.scale.z = width;
 
+        marker.color.a = a;
+        marker.color.r = r;
+        marker.color.g = g;
+        marker.color.b = b;
+        marker.pose.orientation.w  = 1.0;
 
-    for(const auto & point : points)
-    {
-        geometry_msgs::Point p;
-        p.x = point.x();
-        p.y = point.y();
-        p.z = point.z();
-        marker.points.push_back(p);
-    }
+        marker.points.reserve(points.size());
+        for(const auto & point : points)
+        {
+            geometry_msgs::Point p;
+            p.x = point.x();
+            p.y = point.y();
+            p.z = point.z();
+            marker.points.push_back(p);
+        }
 
-    astar_result_pub.publish(marker);
+        astar_result_pub.publish(marker);
+    });
 }
 
 
 
-void mapFutureStatusCallback(const std_msgs::Float32MultiArrayConstPtr &future_risk)
+void mapFutureStatusCallback(const rast_corridor_planning::RiskMapConstPtr &future_risk)
 {
-    future_risk_locked = true;
-    for(int i=0; i<VOXEL_NUM; ++i){
-        for(int j=0; j<RISK_MAP_NUMBER; ++j){
-            future_risk_global[i][j] = future_risk->data[i*future_risk->layout.dim[0].stride + j];
+    /// Seq of the message in the latest frame. A bricks message only applies on top of the message before it.
+    static bool resident_risk_map_valid = false;
+    static uint32_t resident_risk_map_seq = 0;
+    PLANNING_SCOPED_TIMER(stage_latency[STAGE_MAP_INGEST]);
+
+    const bool bricks_message = future_risk->encoding == rast_corridor_planning::RiskMap::ENCODING_BRICKS;
+    if(bricks_message && (!resident_risk_map_valid || future_risk->base_seq != resident_risk_map_seq)){
+        ROS_WARN_THROTTLE(1.0, "Risk map bricks do not apply to the latest risk map. Waiting for a complete risk map.");
+        return;
+    }
+
+    /// Decoded straight into a free frame. The planner keeps using its frame meanwhile.
+    float *risk_map_slot = risk_map_topic_writer.beginFrame();
+    if(!risk_map_slot){
+        ROS_WARN("No free risk map frame. Message dropped.");
+        resident_risk_map_valid = false;
+        return;
+    }
+
+    /// The bricks are patched into a copy of the latest frame
+    if(bricks_message){
+        RiskMapShmFrame base_frame = risk_map_reader.acquireLatest();
+        if(!base_frame.valid()){
+            resident_risk_map_valid = false;
+            return;
         }
+        std::memcpy(risk_map_slot, base_frame.data(), sizeof(float) * RiskMapLayout::size);
     }
-    future_risk_locked = false;
 
-    map_pose_global.pose.position.x = future_risk->data[VOXEL_NUM*RISK_MAP_NUMBER];
-    map_pose_global.pose.position.y = future_risk->data[VOXEL_NUM*RISK_MAP_NUMBER + 1];
-    map_pose_global.pose.position.z = future_risk->data[VOXEL_NUM*RISK_MAP_NUMBER + 2];
+    if(!RiskMapCodec::decode(*future_risk, risk_map_slot)){
+        const std::string geometry_name = findMapGeometryName(PrebuiltMapGeometries(), future_risk->length_voxel_num, future_risk->width_voxel_num,
+                                                              future_risk->height_voxel_num, future_risk->risk_map_number, future_risk->resolution);
+        ROS_ERROR("Risk map message does not fit the map size of the planner (%s, received %s). Ignored.", Astar::Geometry::name(),
+                  geometry_name.empty() ? "an unknown size" : geometry_name.c_str());
+        resident_risk_map_valid = false;
+        return;
+    }
+    resident_risk_map_valid = true;
+    resident_risk_map_seq = future_risk->seq;
 
-    future_risk_updated = true;
+    risk_map_topic_writer.commitFrame(future_risk->header.stamp.toSec(), future_risk->map_center.x, future_risk->map_center.y, future_risk->map_center.z);
 }
 
 
 int getPointSpatialIndexInMap(const PVAYPoint &p, const Eigen::Vector3d &map_center){
-    static const int z_change_storage_taken = MAP_WIDTH_VOXEL_NUM*MAP_LENGTH_VOXEL_NUM;  //Order: zyxt
-    static const int y_change_storage_taken = MAP_LENGTH_VOXEL_NUM;
-    static const int x_change_storage_taken = 1;
-    static const int max_size = MAP_HEIGHT_VOXEL_NUM*MAP_WIDTH_VOXEL_NUM*MAP_LENGTH_VOXEL_NUM;
-
-    static const float map_length_half = MAP_LENGTH_VOXEL_NUM * VOXEL_RESOLUTION / 2.f;
-    static const float map_width_half  = MAP_WIDTH_VOXEL_NUM  * VOXEL_RESOLUTION / 2.f;
-    static const float map_height_half = MAP_HEIGHT_VOXEL_NUM * VOXEL_RESOLUTION / 2.f;
+    typedef Astar::Geometry Geometry;
+    static constexpr int max_size = Geometry::voxel_num;
 
-    auto x_index = (int)((p.position.x()-map_center.x() + map_length_half) / VOXEL_RESOLUTION);
-    auto y_index = (int)((p.position.y()-map_center.y() + map_width_half) / VOXEL_RESOLUTION);
-    auto z_index = (int)((p.position.z()-map_center.z() + map_height_half) / VOXEL_RESOLUTION);
+    auto x_index = (int)((p.position.x()-map_center.x() + Geometry::length_half) / Geometry::resolution);
+    auto y_index = (int)((p.position.y()-map_center.y() + Geometry::width_half) / Geometry::resolution);
+    auto z_index = (int)((p.position.z()-map_center.z() + Geometry::height_half) / Geometry::resolution);
 
-    int index = z_index*z_change_storage_taken + y_index*y_change_storage_taken + x_index*x_change_storage_taken;
+    int index = Astar::Layout::spatialIndex(x_index, y_index, z_index);
     if(index >= 0 && index < max_size){
         return index;
     }else{
@@ -304,28 +453,121 @@ int getPointSpatialIndexInMap(const PVAYPoint &p, const Eigen::Vector3d &map_cen
 }
 
 
-void trajectoryCallback(const ros::TimerEvent& e)
+/// Percentiles of the stage latencies and the counts of the period since the last message
+void diagnosticsCallback(const ros::TimerEvent& e)
 {
-    static double last_end_time = ros::Time::now().toSec();
+    static double last_publish_time = ros::Time::now().toSec();
+    const double now = ros::Time::now().toSec();
+
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    auto add_value = [](diagnostic_msgs::DiagnosticStatus &status, const string &key, const string &value){
+        diagnostic_msgs::KeyValue key_value;
+        key_value.key = key;
+        key_value.value = value;
+        status.values.push_back(key_value);
+    };
+    auto milliseconds = [](double seconds){
+        char text[32];
+        snprintf(text, sizeof(text), "%.3f", seconds * 1e3);
+        return string(text);
+    };
+
+    diagnostic_msgs::DiagnosticStatus latency;
+    latency.name = "planning_node: latency";
+    latency.hardware_id = "planning_node";
+    latency.level = diagnostic_msgs::DiagnosticStatus::OK;
+    latency.message = "milliseconds";
+    add_value(latency, "period", milliseconds(now - last_publish_time));
+    for(int i=0; i<STAGE_NUM; ++i){
+        const LatencyHistogram::Snapshot stage = stage_latency[i].takeSnapshot();
+        const string name = planning_stage_names[i];
+        add_value(latency, name + ".count", to_string(stage.count));
+        add_value(latency, name + ".mean", milliseconds(stage.mean()));
+        add_value(latency, name + ".p50", milliseconds(stage.quantile(0.5)));
+        add_value(latency, name + ".p95", milliseconds(stage.quantile(0.95)));
+        add_value(latency, name + ".p99", milliseconds(stage.quantile(0.99)));
+        add_value(latency, name + ".max", milliseconds(stage.max));
+        if(i == STAGE_CYCLE && stage.quantile(0.95) > planning_time_step){
+            latency.level = diagnostic_msgs::DiagnosticStatus::WARN;
+            latency.message = "milliseconds. 5% of the cycles take longer than planning_time_step";
+        }
+    }
+    msg.status.push_back(latency);
+
+    diagnostic_msgs::DiagnosticStatus counters;
+    counters.name = "planning_node: counters";
+    counters.hardware_id = "planning_node";
+    counters.level = diagnostic_msgs::DiagnosticStatus::OK;
+    counters.message = "counts of the period";
+    for(int i=0; i<COUNTER_NUM; ++i){
+        add_value(counters, planning_counter_names[i], to_string(planning_counters[i].take()));
+    }
+    msg.status.push_back(counters);
 
-    ROS_WARN("Time interval between two plannings = %lf", ros::Time::now().toSec() - last_end_time);
+    diagnostics_pub.publish(msg);
+    last_publish_time = now;
+}
 
-    if(!future_risk_updated) return;
+void snapshotRequestCallback(const std_msgs::Empty &msg)
+{
+    snapshot_requested = true;
+}
 
-    double trajectory_planning_start_time = ros::Time::now().toSec();
+/// The start, the goal and the reference direction are the ones given to the search, in the frame of the map center
+void recordPlanningSnapshot(RiskMapSnapshotTrigger trigger, double cycle_time, const RiskMapShmFrame &risk_map_frame,
+                            const Eigen::Vector3d &map_center, const Eigen::Vector3d &start_p, const Eigen::Vector3d &start_v,
+                            const Eigen::Vector3d &start_a, const Eigen::Vector3d &goal, float start_time, float searched_reference_direction_angle)
+{
+    RiskMapSnapshotHeader snapshot = RiskMapSnapshotFormat::emptyHeader();
+    snapshot.risk_map_seq = risk_map_frame.seq();
+    snapshot.stamp = risk_map_frame.stamp();
+    snapshot.cycle_time = cycle_time;
+    snapshot.trigger = trigger;
+    snapshot.start_time = start_time;
+    snapshot.reference_direction_angle = searched_reference_direction_angle;
+    snapshot.warm_started = astar_planner.getLastSearchWarmStarted() ? 1u : 0u;
+    for(int i=0; i<3; ++i){
+        snapshot.map_center[i] = map_center(i);
+        snapshot.start_position[i] = start_p(i);
+        snapshot.start_velocity[i] = start_v(i);
+        snapshot.start_acceleration[i] = start_a(i);
+        snapshot.goal[i] = goal(i);
+    }
+    strncpy(snapshot.parameters, snapshot_parameters.c_str(), RISK_MAP_SNAPSHOT_PARAMETER_BYTES - 1);
 
-    /// Copy future status
-    static float future_risk_planning[VOXEL_NUM][RISK_MAP_NUMBER];
-    while(future_risk_locked){
-        ros::Duration(0.0001).sleep();
+    if(!snapshot_recorder.record(snapshot, risk_map_frame.data())){
+        ROS_WARN("Snapshot of the planning cycle dropped. The recorder is busy or wrote snapshot_max_number files.");
     }
-    future_risk_locked = true;
-    for(int i=0; i<VOXEL_NUM; ++i){
-        for(int j=0; j<RISK_MAP_NUMBER; ++j){
-            future_risk_planning[i][j] = future_risk_global[i][j];
-        }
+}
+
+void trajectoryCallback(const ros::TimerEvent& e)
+{
+    /// The newest frame is held until the callback returns, so it is not rewritten while planning. No copy, no waiting.
+    if(use_shared_memory_risk_map && !risk_map_reader.isOpen() && !risk_map_reader.open(risk_map_shared_memory_name)) return;
+    RiskMapShmFrame risk_map_frame = risk_map_reader.acquireLatest();
+    if(!risk_map_frame.valid()) return;
+
+    double trajectory_planning_start_time = ros::Time::now().toSec();
+    PLANNING_TIMER(cycle_timer, stage_latency[STAGE_CYCLE]);
+    PLANNING_COUNT(planning_counters[COUNTER_CYCLES], 1);
+
+    static unsigned long risk_map_planning_seq = 0;
+    float *risk_map_planning = risk_map_frame.data();
+    const bool new_risk_map = risk_map_planning_seq != risk_map_frame.seq();
+    risk_map_planning_seq = risk_map_frame.seq();
+
+    /// The map center comes with the frame
+    const float *map_center = risk_map_frame.mapCenter();
+    map_pose_global.pose.position.x = map_center[0];
+    map_pose_global.pose.position.y = map_center[1];
+    map_pose_global.pose.position.z = map_center[2];
+
+    /// Summed-volume risk tables are updated once per received map, only where its bricks changed
+    if(new_risk_map){
+        PLANNING_SCOPED_TIMER(stage_latency[STAGE_MAP_INGEST]);
+        astar_planner.updateRiskMap(risk_map_planning, risk_map_frame.brickChangeSeq(), risk_map_frame.seq());
     }
-    future_risk_locked = false;
 
 
     /***** P1: Check the risk of the planned short trajectory and set a start position ****/
@@ -336,12 +578,17 @@ void trajectoryCallback(const ros::TimerEvent& e)
     Eigen::Vector3d planning_start_map_center;
     planning_start_map_center << map_pose_global.pose.position.x, map_pose_global.pose.position.y, map_pose_global.pose.position.z;
 
+    PLANNING_TIMER(start_state_timer, stage_latency[STAGE_START_STATE]);
+    const SetpointState setpoint_state = setpoint_state_slot.read();
+    uint64_t start_point_seq = 0;
+    std::unique_lock<std::mutex> trajectory_lock(trajectory_producer_mutex);
+
     geometry_msgs::PointStamped tracking_error_signal; // 0: normal 1: tracking error too large 2: safety mode
     tracking_error_signal.header.stamp = ros::Time::now();
     tracking_error_signal.point.x = 0.0;
 
-    if(in_safety_mode){
-        planning_start_p = p_store_for_em - planning_start_map_center;
+    if(setpoint_state.in_safety_mode){
+        planning_start_p = setpoint_state.setpoint.position - planning_start_map_center;
 
         planning_start_v = Eigen::Vector3d::Zero();
         tracking_error_signal.point.x = 2.0;
@@ -349,68 +596,70 @@ void trajectoryCallback(const ros::TimerEvent& e)
     }else{
         /// Calculated risk of planned trajectory
         float risk = 0.f;
-        std::queue<PVAYPoint> current_queue_copy(trajectory_piece);
-        while (!current_queue_copy.empty())
+        for(const auto &p : trajectory_piece.snapshot())
         {
-            auto p = current_queue_copy.front();
-
             int spatial_index = getPointSpatialIndexInMap(p, planning_start_map_center);
             if(spatial_index >= 0){
-                risk += future_risk_global[spatial_index][0];
+                risk += risk_map_planning[Astar::Layout::index(spatial_index, 0)];
             }
-
-            current_queue_copy.pop();
         }
 
         /// Set planning initial state
         if(risk > risk_threshold_motion_primitive){
-            planning_start_p = p_store_for_em - planning_start_map_center;
+            planning_start_p = setpoint_state.setpoint.position - planning_start_map_center;
             // Empty the queue so it will enter safety mode
-            std::queue<PVAYPoint> empty;
-            std::swap( trajectory_piece, empty);
-            ROS_WARN("Current planned trajecotry not safe!");
+            trajectory_piece.clear();
+            ++ trajectory_version;
+            ROS_WARN_THROTTLE(1.0, "Current planned trajectory not safe!");
         }
-        else if(!trajectory_piece.empty() && (p_store_for_em - uav_position_global).norm() > 1.0){
+        else if(!trajectory_piece.empty() && (setpoint_state.setpoint.position - uav_position_global).norm() > 1.0){
             // Tracking error too large
             PVAYPoint temp_p;
-            temp_p.position = 0.5*p_store_for_em + 0.5*uav_position_global;
+            temp_p.position = 0.5*setpoint_state.setpoint.position + 0.5*uav_position_global;
             temp_p.velocity = Eigen::Vector3d::Zero();
             temp_p.acceleration = Eigen::Vector3d::Zero();
             temp_p.yaw = 0.0;
+            temp_p.seq = ++ trajectory_point_seq;
 
             // Empty the queue and add the temp point
-            std::queue<PVAYPoint> empty;
-            std::swap( trajectory_piece, empty);
+            trajectory_piece.clear();
             trajectory_piece.push(temp_p);
+            ++ trajectory_version;
+            start_point_seq = temp_p.seq;
 
             planning_start_p = temp_p.position - planning_start_map_center;
 
-            ROS_WARN("Tracking error too large. Set a new start point.");
+            ROS_WARN_THROTTLE(1.0, "Tracking error too large. Set a new start point.");
             tracking_error_signal.point.x = 1.0;
         }
         else{
             if(trajectory_piece.size() > trajectory_piece_max_size * 0.8)
             {
                 /// Planning is not necessary
-                ROS_WARN("Planning is not necessary!");
-                last_end_time = ros::Time::now().toSec();
+                PLANNING_COUNT(planning_counters[COUNTER_PLANNING_SKIPPED], 1);
                 return;
             }
             else if(!trajectory_piece.empty()){
-                planning_start_p = trajectory_piece.back().position - planning_start_map_center;
-                planning_start_v = trajectory_piece.back().velocity;
-                planning_start_a = trajectory_piece.back().acceleration;
+                const PVAYPoint &last_point = trajectory_piece.back();
+                planning_start_p = last_point.position - planning_start_map_center;
+                planning_start_v = last_point.velocity;
+                planning_start_a = last_point.acceleration;
                 if(planning_start_a.norm() > max_differentiated_current_a){
                     planning_start_a = planning_start_a / planning_start_a.norm() * max_differentiated_current_a;
                 }
+                start_point_seq = last_point.seq;
             }
         }
     }
+    const float start_time = trajectory_piece.size() * planning_time_step; //start time
+    const unsigned long base_trajectory_version = trajectory_version;
+    trajectory_lock.unlock();
+    PLANNING_TIMER_STOP(start_state_timer);
     tracking_error_too_large_state_pub.publish(tracking_error_signal);
 
 
     /***** P2: Risk-aware Kino-dynamic A*  ****/
-    double astar_start_time = ros::Time::now().toSec();
+    PLANNING_TIMER(search_timer, stage_latency[STAGE_SEARCH]);
 
     if(fabs(planning_start_v.x()) > astar_planner.v_max_xy){//} || fabs(planning_start_v.y()) > astar_planner.v_max_xy || fabs(planning_start_v.z()) > astar_planner.v_max_z){
         planning_start_v.x() = astar_planner.v_max_xy * planning_start_v.x() / fabs(planning_start_v.x());
@@ -422,19 +671,30 @@ void trajectoryCallback(const ros::TimerEvent& e)
         planning_start_v.z() = astar_planner.v_max_z * planning_start_v.z() / fabs(planning_start_v.z());
     }
 
-    Node *start_node = new Node(0, planning_start_p.x(), planning_start_p.y(), planning_start_p.z(),
-                                planning_start_v.x(), planning_start_v.y(), planning_start_v.z());
-    Node *end_node = new Node(0, goal_x-planning_start_map_center(0),goal_y-planning_start_map_center(1),goal_z-planning_start_map_center(2), 0, 0, 0);
+    Node start_node(0, planning_start_p.x(), planning_start_p.y(), planning_start_p.z(),
+                    planning_start_v.x(), planning_start_v.y(), planning_start_v.z());
+    Node end_node(0, goal_x-planning_start_map_center(0),goal_y-planning_start_map_center(1),goal_z-planning_start_map_center(2), 0, 0, 0);
     vector<Node*> result;
 
-    float start_time = trajectory_piece.size() * planning_time_step; //start time
+    const float searched_reference_direction_angle = reference_direction_angle;
 
 
     astar_planner.updateMapCenterPosition(planning_start_map_center(0), planning_start_map_center(1), planning_start_map_center(2));
-    astar_planner.search(start_node, end_node, start_time, expand_safety_distance, reference_direction_angle, &future_risk_planning[0][0], result); //distance = 0.25
+    SearchStopReason search_stop_reason = astar_planner.search(&start_node, &end_node, start_time, expand_safety_distance, reference_direction_angle, risk_map_planning, result); //distance = 0.25
+    PLANNING_TIMER_STOP(search_timer);
+    ROS_DEBUG("A* stopped by: %s%s", searchStopReasonName(search_stop_reason), astar_planner.getLastSearchWarmStarted() ? " (warm start)" : "");
+    if(search_stop_reason == SearchStopReason::INVALID_START){
+        ROS_WARN_THROTTLE(1.0, "Invalid A* start point (%f, %f, %f) in the map frame.", start_node.x, start_node.y, start_node.z);
+    }
+    PLANNING_COUNT(planning_counters[COUNTER_EXPANDED_NODES], astar_planner.getLastSearchSteps());
+    PLANNING_COUNT(planning_counters[COUNTER_ENVELOPE_CHECKS], astar_planner.getLastEnvelopeChecks());
+    PLANNING_COUNT(planning_counters[COUNTER_ENVELOPE_VOXEL_CHECKS], astar_planner.getLastEnvelopeVoxelChecks());
 
+    /// Only recorded by the search when a_star_record_searched_points is set
     vector<TrajPoint> searched_points;
-    astar_planner.getSearchedPoints(searched_points);
+    if(a_star_record_searched_points){
+        astar_planner.getSearchedPoints(searched_points);
+    }
 
 
     /// Visualize searched points
@@ -452,104 +712,84 @@ void trajectoryCallback(const ros::TimerEvent& e)
 //    linesPublish(searched_points_to_show, 89, 1.0, 0.1, 0.1, 1.0, 0.05);
 
 
-    /// To record max and avg search time
-    static double a_star_total_time = 0.0;
-    static double a_star_max_time = 0.0;
-    static int a_star_counter = 0;
-    double a_star_time = ros::Time::now().toSec() - astar_start_time;
-    a_star_total_time += a_star_time;
-    a_star_counter += 1;
-
-    if(a_star_time > a_star_max_time){
-        a_star_max_time = a_star_time;
-    }
-
-    ROS_INFO("A* time = %lf", a_star_time);
-    ROS_INFO("A* AVG time = %lf", a_star_total_time / (double)a_star_counter );
-    ROS_INFO("A* MAX time = %lf", a_star_max_time);
-
-
     if(result.size() > 1 && result.size() < 10){ //at least two nodes to build a corridor
+        PLANNING_COUNT(planning_counters[COUNTER_PATHS], 1);
+
+        // Set reference_direction_angle
+        reference_direction_angle = atan2(result[1]->y - result[0]->y, result[1]->x - result[0]->x);
 
         // Publish nodes
-        vector<Eigen::Vector3d> points;
-        for(auto &p : result){
-            Eigen::Vector3d p_this;
-            if(rviz_map_center_locked) {
-                p_this.x() = p->x;
-                p_this.y() = p->y;
-                p_this.z() = p->z;
-            }else{
-                p_this.x() = p->x + map_pose_global.pose.position.x;
-                p_this.y() = p->y + map_pose_global.pose.position.y;
-                p_this.z() = p->z + map_pose_global.pose.position.z;
-            }
+        if(visualizationWanted(astar_result_pub)){
+            PLANNING_SCOPED_TIMER(stage_latency[STAGE_PUBLISHING]);
+            vector<Eigen::Vector3d> points;
+            for(auto &p : result){
+                Eigen::Vector3d p_this;
+                if(rviz_map_center_locked) {
+                    p_this.x() = p->x;
+                    p_this.y() = p->y;
+                    p_this.z() = p->z;
+                }else{
+                    p_this.x() = p->x + map_pose_global.pose.position.x;
+                    p_this.y() = p->y + map_pose_global.pose.position.y;
+                    p_this.z() = p->z + map_pose_global.pose.position.z;
+                }
 
-            points.push_back(p_this);
-        }
-        linesPublish(points, 0, 0.8, 0.3, 0.4, 1.0, 0.2);
+                points.push_back(p_this);
+            }
+            linesPublish(points, 0, 0.8, 0.3, 0.4, 1.0, 0.2);
 
-        // Set reference_direction_angle
-        reference_direction_angle = atan2(points[1].y()-points[0].y(), points[1].x()-points[0].x());
+            // Restore trajectories and publish
+            vector<Eigen::Vector3d> a_star_traj_points_to_show;
 
-        // Restore trajectories and publish
-        vector<Eigen::Vector3d> a_star_traj_points_to_show;
+            for(int i=0; i<result.size()-1; ++i){
+                auto node1 = result[i];
+                auto node2 = result[i+1];
 
-        queue<PVAYPoint> trajectory_piece_temp;
+                float ax = (node2->vx - node1->vx) / astar_planner.time_step_node;
+                float ay = (node2->vy - node1->vy) / astar_planner.time_step_node;
+                float az = (node2->vz - node1->vz) / astar_planner.time_step_node;
+                auto point_num_one_piece = (int)(astar_planner.time_step_node / astar_planner.time_step_trajectory);
 
-        for(int i=0; i<result.size()-1; ++i){
-            auto node1 = result[i];
-            auto node2 = result[i+1];
+                for(int j=1; j<point_num_one_piece; ++j){ //Skip the first point. Which is the same as the last point on the last piece.
+                    Eigen::Vector3d p;
+                    float t = (float)j*astar_planner.time_step_trajectory;
+                    p.x() = node1->x + node1->vx*t + 0.5*ax*t*t;
+                    p.y() = node1->y + node1->vy*t + 0.5*ay*t*t;
+                    p.z() = node1->z + node1->vz*t + 0.5*az*t*t;
 
-            float ax = (node2->vx - node1->vx) / astar_planner.time_step_node;
-            float ay = (node2->vy - node1->vy) / astar_planner.time_step_node;
-            float az = (node2->vz - node1->vz) / astar_planner.time_step_node;
-            auto point_num_one_piece = (int)(astar_planner.time_step_node / astar_planner.time_step_trajectory);
+                    if(!rviz_map_center_locked){
+                        p.x() += map_pose_global.pose.position.x;
+                        p.y() += map_pose_global.pose.position.y;
+                        p.z() += map_pose_global.pose.position.z;
+                    }
 
-            for(int j=1; j<point_num_one_piece; ++j){ //Skip the first point. Which is the same as the last point on the last piece.
-                Eigen::Vector3d p;
-                float t = (float)j*astar_planner.time_step_trajectory;
-                p.x() = node1->x + node1->vx*t + 0.5*ax*t*t;
-                p.y() = node1->y + node1->vy*t + 0.5*ay*t*t;
-                p.z() = node1->z + node1->vz*t + 0.5*az*t*t;
+                    a_star_traj_points_to_show.push_back(p);
 
-                if(!rviz_map_center_locked){
-                    p.x() += map_pose_global.pose.position.x;
-                    p.y() += map_pose_global.pose.position.y;
-                    p.z() += map_pose_global.pose.position.z;
                 }
 
-                a_star_traj_points_to_show.push_back(p);
-
             }
-
+            linesPublish(a_star_traj_points_to_show, 1, 0.1, 0.9, 0.2, 1.0, 0.1, visualization_msgs::Marker::LINE_STRIP);
         }
-        linesPublish(a_star_traj_points_to_show, 1, 0.1, 0.9, 0.2, 1.0, 0.1, visualization_msgs::Marker::LINE_STRIP);
 
 
         /***** P3: Risk-constrained corridor ****/
-        double corridor_start_time = ros::Time::now().toSec();
+        PLANNING_TIMER(corridors_timer, stage_latency[STAGE_CORRIDORS]);
         vector<Corridor*> corridors;
 
         astar_planner.findCorridors(corridors, 2);
-
-
-        /// To record max and avg corridors calculation time
-        static double corridor_total_time = 0.0;
-        static double corridor_max_time = 0.0;
-        static int corridor_counter = 0;
-        double corridor_time = ros::Time::now().toSec() - corridor_start_time;
-        corridor_total_time += corridor_time;
-        corridor_counter += 1;
-
-        if(corridor_time > corridor_max_time){
-            corridor_max_time = corridor_time;
+        PLANNING_COUNT(planning_counters[COUNTER_CORRIDOR_EXPANSION_STEPS], astar_planner.getLastCorridorExpansionSteps());
+
+        /// Candidate time allocations of P4 fly the corridors at other times, so the times they are safe are found here,
+        /// on the risk map they were built on
+        vector<std::pair<double, double>> corridor_time_windows;
+        if(corridor_optimizer.usesCandidates()){
+            for(const auto &corridor : corridors){
+                float window_start, window_end;
+                astar_planner.getCorridorSafeTimeWindow(*corridor, window_start, window_end);
+                corridor_time_windows.emplace_back(window_start, window_end);
+            }
         }
 
-        ROS_INFO("corridors time this = %lf",corridor_time);
-        ROS_INFO("corridors AVG time = %lf", corridor_total_time / (double)corridor_counter );
-        ROS_INFO("corridors MAX time = %lf", corridor_max_time);
-
         /// Publish corridors to optimization planner
         decomp_ros_msgs::DynPolyhedronArray corridor_msg;
         corridor_msg.header.stamp = ros::Time::now();
@@ -595,20 +835,39 @@ void trajectoryCallback(const ros::TimerEvent& e)
 
             corridor_msg.dyn_polyhedrons.push_back(corridor_this);
         }
-        corridor_pub.publish(corridor_msg);
-        /// Publish corridors to RVIZ
-        corridorsPublish(corridors, map_pose_global);
+        PLANNING_TIMER_STOP(corridors_timer);
+
+        {
+            PLANNING_SCOPED_TIMER(stage_latency[STAGE_PUBLISHING]);
+            corridor_pub.publish(corridor_msg);
+            /// Publish corridors to RVIZ
+            corridorsPublish(corridors, map_pose_global);
+        }
 
 
         /***** P4: Trajectory Optimization *****/
-        double optimization_start_t = ros::Time::now().toSec();
-        bool trajectory_optimized = optimizationInCorridors(corridor_msg, planning_start_map_center);
-        ROS_INFO("optimization time = %lf", ros::Time::now().toSec() - optimization_start_t);
-        if(!trajectory_optimized){
-            ROS_WARN("No optimization result!!");
+        OptimizationJob job;
+        job.corridor_msg = std::move(corridor_msg);
+        job.planning_start_map_center = planning_start_map_center;
+        job.risk_map_seq = risk_map_frame.seq();
+        job.risk_map_stamp = risk_map_frame.stamp();
+        job.base_trajectory_version = base_trajectory_version;
+        job.start_point_seq = start_point_seq;
+        job.corridor_time_windows = std::move(corridor_time_windows);
+        job.search_start_time = trajectory_planning_start_time;
+        job.queued_time = ros::Time::now().toSec();
+
+        if(pipelined_planning){
+            if(optimization_queue.push(std::move(job)) > 0){
+                ROS_WARN_THROTTLE(1.0, "Optimization stage is busy. Older corridors dropped.");
+            }
+        }else{
+            runOptimizationStage(job);
         }
 
     }else{ // A* no result
+        PLANNING_SCOPED_TIMER(stage_latency[STAGE_PUBLISHING]);
+
         /// Eliminate the left points in RVIZ
         vector<Eigen::Vector3d> points;
         linesPublish(points, 0, 0.8, 0.3, 0.4, 1.0, 0.2, visualization_msgs::Marker::POINTS, true);
@@ -622,8 +881,18 @@ void trajectoryCallback(const ros::TimerEvent& e)
 //        std::swap( trajectory_piece, empty);
     }
 
-    ROS_INFO("Planning thread total time = %lf", ros::Time::now().toSec() - trajectory_planning_start_time);
-    last_end_time = ros::Time::now().toSec();
+    PLANNING_TIMER_STOP(cycle_timer);
+    const double cycle_time = ros::Time::now().toSec() - trajectory_planning_start_time;
+
+    if(snapshot_recorder.isRunning()){
+        const bool slow_cycle = snapshot_slow_cycle_time > 0.0 && cycle_time > snapshot_slow_cycle_time;
+        if(snapshot_requested.exchange(false) || slow_cycle){
+            Eigen::Vector3d goal(end_node.x, end_node.y, end_node.z);
+            recordPlanningSnapshot(slow_cycle ? RiskMapSnapshotTrigger::SLOW_CYCLE : RiskMapSnapshotTrigger::REQUEST, cycle_time,
+                                   risk_map_frame, planning_start_map_center, planning_start_p, planning_start_v, planning_start_a, goal,
+                                   start_time, searched_reference_direction_angle);
+        }
+    }
 }
 
 
@@ -664,44 +933,53 @@ inline Eigen::Vector3d jetColor(double a) {
  * @param maxV
  */
 void visualizeTraj(const Trajectory& appliedTraj, const Eigen::Vector3d &planning_start_map_center, double maxV) {
-    visualization_msgs::Marker traj_marker;
-    traj_marker.header.frame_id = "map";
-    traj_marker.header.stamp = ros::Time::now();
-    traj_marker.type = visualization_msgs::Marker::LINE_LIST;
-    traj_marker.pose.orientation.w = 1.00;
-    traj_marker.action = visualization_msgs::Marker::ADD;
-    traj_marker.id = 0;
-    traj_marker.ns = "trajectory";
-    traj_marker.color.r = 0.00;
-    traj_marker.color.g = 0.50;
-    traj_marker.color.b = 1.00;
-    traj_marker.scale.x = 0.10;
-
-    double T = 0.05;
-    Eigen::Vector3d lastX = appliedTraj.getPos(0.0) + planning_start_map_center;
-    for (double t = T; t < appliedTraj.getDuration(); t += T) {
-        std_msgs::ColorRGBA c;
-        Eigen::Vector3d jets = jetColor(appliedTraj.getVel(t).norm() / maxV);
-        c.r = jets[0];
-        c.g = jets[1];
-        c.b = jets[2];
-        c.a = 0.8;
-
-        geometry_msgs::Point point;
-        Eigen::Vector3d X = appliedTraj.getPos(t) + planning_start_map_center;
-        point.x = lastX(0);
-        point.y = lastX(1);
-        point.z = lastX(2);
-        traj_marker.points.push_back(point);
-        traj_marker.colors.push_back(c);
-        point.x = X(0);
-        point.y = X(1);
-        point.z = X(2);
-        traj_marker.points.push_back(point);
-        traj_marker.colors.push_back(c);
-        lastX = X;
+    if(!visualizationWanted(color_vel_pub)){
+        return;
     }
-    color_vel_pub.publish(traj_marker);
+
+    const ros::Time stamp = ros::Time::now();
+    visualization_publisher.post([appliedTraj, planning_start_map_center, maxV, stamp]{
+        visualization_msgs::Marker traj_marker;
+        traj_marker.header.frame_id = "map";
+        traj_marker.header.stamp = stamp;
+        traj_marker.type = visualization_msgs::Marker::LINE_LIST;
+        traj_marker.pose.orientation.w = 1.00;
+        traj_marker.action = visualization_msgs::Marker::ADD;
+        traj_marker.id = 0;
+        traj_marker.ns = "trajectory";
+        traj_marker.color.r = 0.00;
+        traj_marker.color.g = 0.50;
+        traj_marker.color.b = 1.00;
+        traj_marker.scale.x = 0.10;
+
+        double T = 0.05;
+        TrajectorySamples samples;
+        appliedTraj.sample(0.0, T, (int)std::ceil(appliedTraj.getDuration() / T), samples);
+        Eigen::Vector3d lastX = appliedTraj.getPos(0.0) + planning_start_map_center;
+        for (int k = 1; k < samples.size(); ++k) {
+            std_msgs::ColorRGBA c;
+            Eigen::Vector3d jets = jetColor(samples.vel.col(k).norm() / maxV);
+            c.r = jets[0];
+            c.g = jets[1];
+            c.b = jets[2];
+            c.a = 0.8;
+
+            geometry_msgs::Point point;
+            Eigen::Vector3d X = samples.pos.col(k) + planning_start_map_center;
+            point.x = lastX(0);
+            point.y = lastX(1);
+            point.z = lastX(2);
+            traj_marker.points.push_back(point);
+            traj_marker.colors.push_back(c);
+            point.x = X(0);
+            point.y = X(1);
+            point.z = X(2);
+            traj_marker.points.push_back(point);
+            traj_marker.colors.push_back(c);
+            lastX = X;
+        }
+        color_vel_pub.publish(traj_marker);
+    });
 }
 
 
@@ -774,9 +1052,33 @@ Eigen::Matrix3d dynPolyArrayToEndPos(
 
 
 
+/**
+ * @brief number of committed points a result planned from base_trajectory_version and start_point_seq continues. All
+ * of them if the trajectory has not changed since the search. Otherwise the points up to the start point of the
+ * search if it is still committed, so a search that overlapped the commit of the previous result replaces the points
+ * after its start. The caller holds trajectory_producer_mutex.
+ * @return -1 if the result does not continue the committed trajectory
+ */
+int committedPointsBeforeResult(unsigned long base_trajectory_version, uint64_t start_point_seq) {
+    const auto committed_points = trajectory_piece.snapshot();
+    if (trajectory_version == base_trajectory_version) {
+        return (int)committed_points.size();
+    }
+    if (start_point_seq > 0) {
+        for (size_t i = 0; i < committed_points.size(); ++i) {
+            if (committed_points[i].seq == start_point_seq) {
+                return (int)i + 1;
+            }
+        }
+    }
+    return -1;
+}
+
 ros::Time traj_start_;
 ros::Time traj_end_;
-bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, const Eigen::Vector3d planning_start_map_center) {
+bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray &msg, const Eigen::Vector3d planning_start_map_center,
+                             unsigned long base_trajectory_version, uint64_t start_point_seq,
+                             const std::vector<std::pair<double, double>> &corridor_time_windows) {
     auto corridors = dynPolyArrayToVector(msg);
     auto time_alloc = dynPolyArrayToTimeAlloc(msg);
 
@@ -787,8 +1089,6 @@ bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, cons
     Eigen::Vector3d zero(0.0, 0.0, 0.0);
     Eigen::Matrix3d init_state = dynPolyArrayToInitPos(msg);
     Eigen::Matrix3d finl_state = dynPolyArrayToEndPos(msg);
-    std::cout << "init\t" << init_state << std::endl;
-    std::cout << "final\t" << finl_state << std::endl;
 
 
     /* clean buffer */
@@ -797,17 +1097,15 @@ bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, cons
     for (auto it = time_alloc.begin(); it != time_alloc.end(); ++it) {
         T += (*it);
     }
-    std::cout << "Time Size: " << time_alloc.size() << std::endl;
-    std::cout << "Time: " << T << std::endl;
-
-    mini_snap_.reset(init_state, finl_state, time_alloc, corridors);
 
-    bool is_solved = false;
-    try{
-        is_solved = mini_snap_.optimize(factors, delta_corridor);
-    }catch(int e) {
-        ROS_ERROR("Optimizer crashed!");
-        return false;
+    bool corridor_satisfied;
+    bool is_solved = corridor_optimizer.solve(init_state, finl_state, time_alloc, corridors, corridor_time_windows, traj_, corridor_satisfied);
+    const CorridorOptimizationStats &optimization_stats = corridor_optimizer.getLastStats();
+    PLANNING_COUNT(planning_counters[COUNTER_QP_SOLVES], optimization_stats.qp_solves);
+    PLANNING_COUNT(planning_counters[COUNTER_QP_ITERATIONS], optimization_stats.qp_iterations);
+    PLANNING_COUNT(planning_counters[COUNTER_ROOT_FINDER_CALLS], optimization_stats.root_finder_calls);
+    if (is_solved) {
+        T = traj_.getDuration();
     }
 
     if (!is_solved) {
@@ -815,40 +1113,44 @@ bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, cons
         return false;
     }
 
-    mini_snap_.getTrajectory(&traj_);
-    int I = 10;  // max iterations
-    int i = 0;
-    while (!mini_snap_.isCorridorSatisfied(traj_, max_vel_optimization, max_acc_optimization, delta_corridor) && i++ < I) {
-//        std::cout << "out of corridor:\t" << i << std::endl;
-        try{
-            is_solved = mini_snap_.reOptimize();
-        }catch(int e) {
-            ROS_ERROR("Optimizer crashed!");
-            return false;
-        }
 
-        if(is_solved){
-            mini_snap_.getTrajectory(&traj_);
-        }else{
-            ROS_ERROR("No solution found for these corridors!");
-            return false;
-        }
-    }  // apply minimum snap optimization
 
+    /// Add to queue. A result planned from a trajectory that has changed since the search continues it at its start point.
+    std::unique_lock<std::mutex> trajectory_lock(trajectory_producer_mutex);
+    const int kept_point_num = committedPointsBeforeResult(base_trajectory_version, start_point_seq);
+    if(kept_point_num < 0){
+        ROS_WARN_THROTTLE(1.0, "Trajectory changed during the optimization. Result dropped.");
+        return false;
+    }
 
+    const auto committed_points = trajectory_piece.snapshot();
+    if(kept_point_num < (int)committed_points.size()){
+        std::vector<PVAYPoint> kept_points;
+        for(int i=0; i<kept_point_num; ++i){
+            kept_points.push_back(committed_points[i]);
+        }
+        trajectory_piece.clear();
+        for(const auto &p : kept_points){
+            trajectory_piece.push(p);
+        }
+    }
 
-    /// Add to queue
-    float time = 0.f;
-    trajectory_to_nmpc = trajectory_piece;
+    trajectory_to_nmpc.clear();
+    for(const auto &p : trajectory_piece.snapshot()){
+        trajectory_to_nmpc.push(p);
+    }
 
+    /// One point every planning_time_step after the start, until the end of the trajectory or a full buffer
     static int buffer_size = nmpc_receive_points_num*2;
-    while(trajectory_to_nmpc.size() <= buffer_size && time < T)
+    static TrajectorySamples trajectory_samples;
+    const int sample_num = std::min(buffer_size + 1 - (int)trajectory_to_nmpc.size(), (int)std::ceil(T / planning_time_step));
+    traj_.sample(planning_time_step, planning_time_step, std::max(sample_num, 0), trajectory_samples);
+    for(int k=0; k<trajectory_samples.size(); ++k)
     {
-        time += planning_time_step;
         PVAYPoint p;
-        p.position = traj_.getPos(time) + planning_start_map_center; // map frame to global frame
-        p.velocity = traj_.getVel(time);
-        p.acceleration = traj_.getAcc(time);
+        p.position = trajectory_samples.pos.col(k) + planning_start_map_center; // map frame to global frame
+        p.velocity = trajectory_samples.vel.col(k);
+        p.acceleration = trajectory_samples.acc.col(k);
 
         /** Yaw direction planning: velocity direction **/
         double yaw_sp = atan2(p.velocity.y(), p.velocity.x());
@@ -866,38 +1168,43 @@ bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, cons
 
         yaw_sp_last = yaw_sp;
         p.yaw = yaw_sp;
+        p.seq = ++ trajectory_point_seq;
         trajectory_to_nmpc.push(p);
 
         if(trajectory_piece.size() < trajectory_piece_max_size){
             trajectory_piece.push(p);
         }
     }
+    ++ trajectory_version;
     trajectory_initialized = true;
 
 
     static double time_last_planned = ros::Time::now().toSec();
     double time_from_last_valid_planning =  ros::Time::now().toSec()-time_last_planned;
-    if(time_from_last_valid_planning < 0.15){
-        ROS_INFO("Time from last valid planning is = %lf s", time_from_last_valid_planning);
-    }else{
-        ROS_ERROR("Time from last valid planning is = %lf s", time_from_last_valid_planning);
+    PLANNING_RECORD(stage_latency[STAGE_COMMIT_INTERVAL], time_from_last_valid_planning);
+    if(time_from_last_valid_planning >= 0.15){
+        ROS_WARN_THROTTLE(1.0, "Time from last valid planning is = %lf s", time_from_last_valid_planning);
     }
     time_last_planned = ros::Time::now().toSec();
 
-    queue<PVAYPoint> current_queue = trajectory_piece;
     vector<Eigen::Vector3d> queue_points_to_show;
-    while(!current_queue.empty()){
-        PVAYPoint p = current_queue.front();
-        current_queue.pop();
-        Eigen::Vector3d position_this;
-        position_this << p.position.x(), p.position.y(), p.position.z();
+    const bool show_queue_points = visualizationWanted(astar_result_pub);
+    if(show_queue_points){
+        for(const auto &p : trajectory_piece.snapshot()){
+            Eigen::Vector3d position_this;
+            position_this << p.position.x(), p.position.y(), p.position.z();
 
-        if(rviz_map_center_locked){position_this -= planning_start_map_center;}
+            if(rviz_map_center_locked){position_this -= planning_start_map_center;}
 
-        queue_points_to_show.push_back(position_this);
+            queue_points_to_show.push_back(position_this);
+        }
     }
+    trajectory_lock.unlock();
 
-    linesPublish(queue_points_to_show, 45, 0.5, 0.2, 0.8, 1.0, 0.1);
+    PLANNING_TIMER(publishing_timer, stage_latency[STAGE_PUBLISHING]);
+    if(show_queue_points){
+        linesPublish(queue_points_to_show, 45, 0.5, 0.2, 0.8, 1.0, 0.1);
+    }
 
 
     /// Print and visualization
@@ -950,16 +1257,54 @@ bool optimizationInCorridors(const decomp_ros_msgs::DynPolyhedronArray msg, cons
     return  true;
 }
 
+/// P4 of the pipeline. Corridors that no longer fit the committed trajectory or come from an older map than the last
+/// committed result are dropped.
+void runOptimizationStage(const OptimizationJob &job)
+{
+    static uint64_t last_committed_risk_map_seq = 0;
+    double optimization_start_t = ros::Time::now().toSec();
+
+    bool trajectory_continued;
+    {
+        std::lock_guard<std::mutex> trajectory_lock(trajectory_producer_mutex);
+        trajectory_continued = committedPointsBeforeResult(job.base_trajectory_version, job.start_point_seq) >= 0;
+    }
+    if(job.risk_map_seq < last_committed_risk_map_seq || !trajectory_continued){
+        ROS_WARN_THROTTLE(1.0, "Corridors planned on map %lu are stale. Dropped.", (unsigned long)job.risk_map_seq);
+        return;
+    }
+
+    bool trajectory_optimized = optimizationInCorridors(job.corridor_msg, job.planning_start_map_center, job.base_trajectory_version,
+                                                        job.start_point_seq, job.corridor_time_windows);
+    double optimization_end_t = ros::Time::now().toSec();
+    if(trajectory_optimized){
+        last_committed_risk_map_seq = job.risk_map_seq;
+    }else{
+        PLANNING_COUNT(planning_counters[COUNTER_OPTIMIZATION_FAILURES], 1);
+    }
+
+    /// P4 includes the publishing at the end of optimizationInCorridors(), which is also timed as publishing
+    PLANNING_RECORD(stage_latency[STAGE_OPTIMIZATION], optimization_end_t - optimization_start_t);
+    PLANNING_RECORD(stage_latency[STAGE_PIPELINE_QUEUE], optimization_start_t - job.queued_time);
+    PLANNING_RECORD(stage_latency[STAGE_MAP_AGE], optimization_end_t - job.risk_map_stamp);
+}
+
+
 void setpointCallback(const ros::TimerEvent& e)
 {
     if(!position_received || !trajectory_initialized){
         return;
     }
 
-    static bool p_store_for_em_initialized = false;
-    if(!p_store_for_em_initialized){
-        p_store_for_em = uav_position_global;
-        p_store_for_em_initialized = true;
+    /// Only this callback writes the state. P1 reads the copy published to setpoint_state_slot at the end.
+    static SetpointState setpoint_state;
+    PVAYPoint &setpoint = setpoint_state.setpoint;
+    bool &safety_mode = setpoint_state.in_safety_mode;
+
+    static bool setpoint_initialized = false;
+    if(!setpoint_initialized){
+        setpoint.position = uav_position_global;
+        setpoint_initialized = true;
     }
 
     static double flight_start_time = 0.0;
@@ -987,17 +1332,21 @@ void setpointCallback(const ros::TimerEvent& e)
     point.velocities.push_back(vel);
     traj_msg.points.push_back(point);
 
-    if(!trajectory_piece.empty())  // Trajectory available
+    /// A result spliced into the committed trajectory pushes its first points again. A point popped while they were
+    /// copied comes back with the seq it had, and is popped again without being used.
+    static uint64_t last_setpoint_seq = 0;
+    auto committed_points = trajectory_piece.snapshot();
+    while(!committed_points.empty() && committed_points.front().seq <= last_setpoint_seq){
+        trajectory_piece.pop();
+        committed_points = trajectory_piece.snapshot();
+    }
+    if(!committed_points.empty())  // Trajectory available
     {
-        in_safety_mode = false;
-
-        auto trajectory_to_nmpc_copy = trajectory_to_nmpc;
-        trajectory_to_nmpc.pop();
+        safety_mode = false;
 
-        while(traj_msg.points.size() < 20 && !trajectory_to_nmpc_copy.empty())
+        for(const auto &p : trajectory_to_nmpc.snapshot())
         {
-            auto p = trajectory_to_nmpc_copy.front();
-            trajectory_to_nmpc_copy.pop();
+            if(traj_msg.points.size() >= 20) break;
 
             trajectory_msgs::MultiDOFJointTrajectoryPoint point;
             geometry_msgs::Transform tr;
@@ -1017,12 +1366,11 @@ void setpointCallback(const ros::TimerEvent& e)
             point.velocities.push_back(vel);
             traj_msg.points.push_back(point);
         }
+        trajectory_to_nmpc.pop();
 
-        p_store_for_em << trajectory_piece.front().position.x(), trajectory_piece.front().position.y(), trajectory_piece.front().position.z();
-        v_store_for_em << trajectory_piece.front().velocity.x(), trajectory_piece.front().velocity.y(), trajectory_piece.front().velocity.z();
-        a_store_for_em << trajectory_piece.front().acceleration.x(), trajectory_piece.front().acceleration.y(), trajectory_piece.front().acceleration.z();
-
-        yaw_store_for_em = trajectory_piece.front().yaw;
+        const PVAYPoint &current_point = committed_points.front();
+        setpoint = current_point;
+        last_setpoint_seq = current_point.seq;
 
         trajectory_piece.pop();
 
@@ -1031,19 +1379,19 @@ void setpointCallback(const ros::TimerEvent& e)
 
     }else{
         /// Safety mode
-        in_safety_mode = true;
+        safety_mode = true;
 
         /// TEST code: let hover height in safety mode be 1.0
-        p_store_for_em.z() = 1.1;
+        setpoint.position.z() = 1.1;
 
-        ROS_WARN("No available trajectory point. Safety mode!");
+        ROS_WARN_THROTTLE(1.0, "No available trajectory point. Safety mode!");
         while(traj_msg.points.size() < 20)
         {
             trajectory_msgs::MultiDOFJointTrajectoryPoint point;
             geometry_msgs::Transform tr;
-            tr.translation.x = p_store_for_em.x();
-            tr.translation.y = p_store_for_em.y();
-            tr.translation.z = p_store_for_em.z();
+            tr.translation.x = setpoint.position.x();
+            tr.translation.y = setpoint.position.y();
+            tr.translation.z = setpoint.position.z();
             tr.rotation.w = 1.0; ///Yaw zero for the moment
             tr.rotation.x = 0;
             tr.rotation.y = 0;
@@ -1057,11 +1405,13 @@ void setpointCallback(const ros::TimerEvent& e)
             point.velocities.push_back(vel);
             traj_msg.points.push_back(point);
 
-            v_store_for_em << 0, 0, 0;
-            a_store_for_em << 0, 0, 0;
+            setpoint.velocity << 0, 0, 0;
+            setpoint.acceleration << 0, 0, 0;
         }
     }
 
+    setpoint_state_slot.write(setpoint_state);
+
     /// Add predicted points if no enough points for mpc
     geometry_msgs::Transform tr_last = traj_msg.points[traj_msg.points.size()-1].transforms[0];
     geometry_msgs::Twist vel_last = traj_msg.points[traj_msg.points.size()-1].velocities[0];
@@ -1088,41 +1438,41 @@ void setpointCallback(const ros::TimerEvent& e)
     /// Publish the first control points to show tracking error
     geometry_msgs::TwistStamped velocity_sp_msg;
     velocity_sp_msg.header.stamp = ros::Time::now();
-    velocity_sp_msg.twist.linear.x = v_store_for_em(0);
-    velocity_sp_msg.twist.linear.y = v_store_for_em(1);
-    velocity_sp_msg.twist.linear.z = v_store_for_em(2);
+    velocity_sp_msg.twist.linear.x = setpoint.velocity(0);
+    velocity_sp_msg.twist.linear.y = setpoint.velocity(1);
+    velocity_sp_msg.twist.linear.z = setpoint.velocity(2);
     velocity_setpoint_pub.publish(velocity_sp_msg);
 
 
     geometry_msgs::PoseStamped pose_sp_msg;
     pose_sp_msg.header.stamp = ros::Time::now();
-    pose_sp_msg.pose.position.x = p_store_for_em(0) - uav_position_global.x();
-    pose_sp_msg.pose.position.y = p_store_for_em(1) - uav_position_global.y();
-    pose_sp_msg.pose.position.z = p_store_for_em(2) - uav_position_global.z();
+    pose_sp_msg.pose.position.x = setpoint.position(0) - uav_position_global.x();
+    pose_sp_msg.pose.position.y = setpoint.position(1) - uav_position_global.y();
+    pose_sp_msg.pose.position.z = setpoint.position(2) - uav_position_global.z();
     position_tracking_pub.publish(pose_sp_msg);
 
 
     /// Publish the pva setpoint.
     trajectory_msgs::JointTrajectoryPoint pva_setpoint;
-    pva_setpoint.positions.push_back(p_store_for_em.x()); //x
-    pva_setpoint.positions.push_back(p_store_for_em.y()); //y
-    pva_setpoint.positions.push_back(p_store_for_em.z()); //z
-    pva_setpoint.positions.push_back(yaw_store_for_em);  //yaw
+    pva_setpoint.positions.push_back(setpoint.position.x()); //x
+    pva_setpoint.positions.push_back(setpoint.position.y()); //y
+    pva_setpoint.positions.push_back(setpoint.position.z()); //z
+    pva_setpoint.positions.push_back(setpoint.yaw);  //yaw
 
-    pva_setpoint.velocities.push_back(v_store_for_em.x());
-    pva_setpoint.velocities.push_back(v_store_for_em.y());
-    pva_setpoint.velocities.push_back(v_store_for_em.z());
+    pva_setpoint.velocities.push_back(setpoint.velocity.x());
+    pva_setpoint.velocities.push_back(setpoint.velocity.y());
+    pva_setpoint.velocities.push_back(setpoint.velocity.z());
 
-    pva_setpoint.accelerations.push_back(a_store_for_em.x());
-    pva_setpoint.accelerations.push_back(a_store_for_em.y());
-    pva_setpoint.accelerations.push_back(a_store_for_em.z());
+    pva_setpoint.accelerations.push_back(setpoint.acceleration.x());
+    pva_setpoint.accelerations.push_back(setpoint.acceleration.y());
+    pva_setpoint.accelerations.push_back(setpoint.acceleration.z());
 
     pva_pub.publish(pva_setpoint);
 
 
     /// Publish mode
     std_msgs::UInt8 planning_mode;
-    if(in_safety_mode){
+    if(safety_mode){
         planning_mode.data = 0;
     }else{
         planning_mode.data = 1;
@@ -1252,12 +1602,44 @@ void getParameterList(const ros::NodeHandle& nh) {
     nh.getParam("/planning_node/jerk_factor", factors[3]);
     nh.getParam("/planning_node/snap_factor", factors[4]);
     nh.getParam("/planning_node/delta_corridor", delta_corridor);
+    nh.getParam("/planning_node/optimization_persistent_solver", optimization_persistent_solver);
+    nh.getParam("/planning_node/optimization_slack_rows_per_piece", optimization_slack_rows_per_piece);
+    nh.getParam("/planning_node/optimization_candidate_threads", optimization_candidate_threads);
+    nh.getParam("/planning_node/optimization_time_scales", optimization_time_scales);
+    nh.getParam("/planning_node/optimization_heuristic_velocity_ratio", optimization_heuristic_velocity_ratio);
+    nh.getParam("/planning_node/optimization_time_weight", optimization_time_weight);
+    nh.getParam("/planning_node/optimization_deadline", optimization_deadline);
 
     nh.getParam("/planning_node/planning_time_step", planning_time_step);
     nh.getParam("/planning_node/a_star_acc_sample_step", a_star_acc_sample_step);
     nh.getParam("/planning_node/a_star_search_time_step", a_star_search_time_step);
+    nh.getParam("/planning_node/a_star_hashed_node_index", a_star_hashed_node_index);
+    nh.getParam("/planning_node/a_star_velocity_direction_code", a_star_velocity_direction_code);
+    nh.getParam("/planning_node/a_star_use_primitive_table", a_star_use_primitive_table);
+    nh.getParam("/planning_node/a_star_primitive_velocity_resolution", a_star_primitive_velocity_resolution);
+    nh.getParam("/planning_node/a_star_expansion_threads", a_star_expansion_threads);
+    nh.getParam("/planning_node/a_star_max_search_steps", a_star_max_search_steps);
+    nh.getParam("/planning_node/a_star_max_search_time", a_star_max_search_time);
+    nh.getParam("/planning_node/a_star_warm_start", a_star_warm_start);
+    nh.getParam("/planning_node/a_star_warm_start_position_tolerance", a_star_warm_start_position_tolerance);
+    nh.getParam("/planning_node/a_star_warm_start_velocity_tolerance", a_star_warm_start_velocity_tolerance);
+    nh.getParam("/planning_node/corridor_incremental_expansion", corridor_incremental_expansion);
+    nh.getParam("/planning_node/corridor_galloping_expansion", corridor_galloping_expansion);
+    nh.getParam("/planning_node/corridor_max_expand_distance", corridor_max_expand_distance);
+    nh.getParam("/planning_node/pipelined_planning", pipelined_planning);
+    nh.getParam("/planning_node/pipeline_queue_size", pipeline_queue_size);
+    nh.getParam("/planning_node/visualization_enabled", visualization_enabled);
+    nh.getParam("/planning_node/visualization_thread", visualization_thread);
+    nh.getParam("/planning_node/a_star_record_searched_points", a_star_record_searched_points);
+
+    nh.getParam("/planning_node/diagnostics_period", diagnostics_period);
+    nh.getParam("/planning_node/snapshot_directory", snapshot_directory);
+    nh.getParam("/planning_node/snapshot_slow_cycle_time", snapshot_slow_cycle_time);
+    nh.getParam("/planning_node/snapshot_max_number", snapshot_max_number);
 
     nh.getParam("/planning_node/rviz_map_center_locked", rviz_map_center_locked);
+    nh.getParam("/planning_node/use_shared_memory_risk_map", use_shared_memory_risk_map);
+    nh.getParam("/planning_node/risk_map_shared_memory_name", risk_map_shared_memory_name);
 
     nh.getParam("/planning_node/risk_threshold_motion_primitive", risk_threshold_motion_primitive);
     nh.getParam("/planning_node/risk_threshold_single_voxel", risk_threshold_single_voxel);
@@ -1267,6 +1649,53 @@ void getParameterList(const ros::NodeHandle& nh) {
 }
 
 
+/// The parameters planning_benchmark reads, in the format of cfg.yaml
+string plannerParameterLines()
+{
+    ostringstream lines;
+    lines << boolalpha;
+    lines << "p_goal_x: " << goal_x << "\n" << "p_goal_y: " << goal_y << "\n" << "p_goal_z: " << goal_z << "\n";
+    lines << "max_vel: " << max_vel << "\n" << "max_acc: " << max_acc << "\n";
+    lines << "max_vel_optimization: " << max_vel_optimization << "\n" << "max_acc_optimization: " << max_acc_optimization << "\n";
+    lines << "use_height_limit: " << use_height_limit << "\n" << "height_limit_max: " << height_limit_max << "\n"
+          << "height_limit_min: " << height_limit_min << "\n" << "sample_z_acc: " << sample_z_acc << "\n";
+    lines << "expand_safety_distance: " << expand_safety_distance << "\n";
+    lines << "pos_factor: " << factors[0] << "\n" << "vel_factor: " << factors[1] << "\n" << "acc_factor: " << factors[2] << "\n"
+          << "jerk_factor: " << factors[3] << "\n" << "snap_factor: " << factors[4] << "\n";
+    lines << "delta_corridor: " << delta_corridor << "\n";
+    lines << "optimization_persistent_solver: " << optimization_persistent_solver << "\n"
+          << "optimization_slack_rows_per_piece: " << optimization_slack_rows_per_piece << "\n";
+    lines << "optimization_candidate_threads: " << optimization_candidate_threads << "\n"
+          << "optimization_time_scales: [";
+    for(size_t i=0; i<optimization_time_scales.size(); ++i){
+        lines << (i > 0 ? ", " : "") << optimization_time_scales[i];
+    }
+    lines << "]\n"
+          << "optimization_heuristic_velocity_ratio: " << optimization_heuristic_velocity_ratio << "\n"
+          << "optimization_time_weight: " << optimization_time_weight << "\n"
+          << "optimization_deadline: " << optimization_deadline << "\n";
+    lines << "planning_time_step: " << planning_time_step << "\n";
+    lines << "a_star_acc_sample_step: " << a_star_acc_sample_step << "\n" << "a_star_search_time_step: " << a_star_search_time_step << "\n";
+    lines << "a_star_hashed_node_index: " << a_star_hashed_node_index << "\n"
+          << "a_star_velocity_direction_code: " << a_star_velocity_direction_code << "\n";
+    lines << "a_star_use_primitive_table: " << a_star_use_primitive_table << "\n"
+          << "a_star_primitive_velocity_resolution: " << a_star_primitive_velocity_resolution << "\n";
+    lines << "a_star_expansion_threads: " << a_star_expansion_threads << "\n" << "a_star_max_search_steps: " << a_star_max_search_steps << "\n"
+          << "a_star_max_search_time: " << a_star_max_search_time << "\n";
+    lines << "a_star_warm_start: " << a_star_warm_start << "\n"
+          << "a_star_warm_start_position_tolerance: " << a_star_warm_start_position_tolerance << "\n"
+          << "a_star_warm_start_velocity_tolerance: " << a_star_warm_start_velocity_tolerance << "\n";
+    lines << "a_star_record_searched_points: " << a_star_record_searched_points << "\n";
+    lines << "corridor_incremental_expansion: " << corridor_incremental_expansion << "\n"
+          << "corridor_galloping_expansion: " << corridor_galloping_expansion << "\n"
+          << "corridor_max_expand_distance: " << corridor_max_expand_distance << "\n";
+    lines << "risk_threshold_motion_primitive: " << risk_threshold_motion_primitive << "\n"
+          << "risk_threshold_single_voxel: " << risk_threshold_single_voxel << "\n"
+          << "risk_threshold_corridor: " << risk_threshold_corridor << "\n";
+    return lines.str();
+}
+
+
 int main(int argc, char **argv)
 {
     ros::init(argc, argv, "planning_node");
@@ -1281,8 +1710,46 @@ int main(int argc, char **argv)
     astar_planner.setIfSampleZDirection(sample_z_acc);
     astar_planner.setMaximumVelAccAndStep(static_cast<float>(max_vel), static_cast<float>(max_vel), static_cast<float>(max_acc), static_cast<float>(max_acc/2.0), a_star_acc_sample_step);
     astar_planner.setRiskThreshold(risk_threshold_motion_primitive, risk_threshold_single_voxel, risk_threshold_corridor);
+    astar_planner.setNodeIndexMode(a_star_hashed_node_index, a_star_velocity_direction_code);
+    astar_planner.setPrimitiveTable(a_star_use_primitive_table, a_star_primitive_velocity_resolution);
+    astar_planner.setExpansionThreads(a_star_expansion_threads);
+    astar_planner.setMaximumSearchSteps(a_star_max_search_steps);
+    astar_planner.setMaximumSearchTime(a_star_max_search_time);
+    astar_planner.setWarmStart(a_star_warm_start, a_star_warm_start_position_tolerance, a_star_warm_start_velocity_tolerance);
+    astar_planner.setRecordSearchedPoints(a_star_record_searched_points);
+    astar_planner.setCorridorExpansion(corridor_incremental_expansion, corridor_galloping_expansion, corridor_max_expand_distance);
+    CorridorOptimizerConfig optimizer_config;
+    optimizer_config.factors = factors;
+    optimizer_config.delta_corridor = delta_corridor;
+    optimizer_config.max_vel = max_vel_optimization;
+    optimizer_config.max_acc = max_acc_optimization;
+    optimizer_config.persistent_solver = optimization_persistent_solver;
+    optimizer_config.slack_rows_per_piece = optimization_slack_rows_per_piece;
+    optimizer_config.candidate_threads = optimization_candidate_threads;
+    optimizer_config.time_scales = optimization_time_scales;
+    optimizer_config.heuristic_velocity_ratio = optimization_heuristic_velocity_ratio;
+    optimizer_config.time_weight = optimization_time_weight;
+    optimizer_config.deadline = optimization_deadline;
+    corridor_optimizer.setConfig(optimizer_config);
+    planningInstrumentationEnabled().store(diagnostics_period > 0.0);
+
+    ros::Subscriber snapshot_sub;
+    if(!snapshot_directory.empty()){
+        snapshot_parameters = plannerParameterLines();
+        snapshot_recorder.start(snapshot_directory, snapshot_max_number);
+        snapshot_sub = n.subscribe("/planning_node/record_snapshot", 1, snapshotRequestCallback);
+    }
 
-    ros::Subscriber future_risk_sub = n.subscribe("/my_map/future_risk_full_array", 1, mapFutureStatusCallback);
+    ros::Subscriber future_risk_sub;
+    if(!use_shared_memory_risk_map){
+        if(!risk_map_topic_writer.open("")){
+            ROS_ERROR("Failed to allocate the risk map frames.");
+            return 1;
+        }
+        risk_map_reader.attach(risk_map_topic_writer);
+        /// Bricks messages have to be applied in order, so they are not dropped in the queue
+        future_risk_sub = n.subscribe("/my_map/future_risk_map", 10, mapFutureStatusCallback);
+    }
     ros::Subscriber pose_sub = n.subscribe("/mavros/local_position/pose", 1, simPoseCallback);
     ros::Subscriber vel_sub = n.subscribe("/mavros/local_position/velocity_local", 1, simVelocityCallback);
 
@@ -1306,17 +1773,45 @@ int main(int argc, char **argv)
     mode_pub = n.advertise<std_msgs::UInt8>("/traj_opt/mode", 1);
     tracking_error_too_large_state_pub = n.advertise<geometry_msgs::PointStamped>("/traj_opt/tracking_error_too_large_signal", 1);
     pva_pub = n.advertise<trajectory_msgs::JointTrajectoryPoint>("/pva_setpoint", 1, true);
+    diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
 
 
     ros::Duration(2).sleep();
 
     ros::Timer timer2 = n.createTimer(ros::Duration(planning_time_step), trajectoryCallback);
     ros::Timer timer3 = n.createTimer(ros::Duration(planning_time_step), setpointCallback);
+    ros::Timer diagnostics_timer;
+    if(diagnostics_period > 0.0){
+        diagnostics_timer = n.createTimer(ros::Duration(diagnostics_period), diagnosticsCallback);
+    }
+
+
+    if(visualization_thread){
+        visualization_publisher.start();
+    }
 
+    /// Optimization stage of the pipeline
+    optimization_queue.setCapacity(pipeline_queue_size);
+    std::thread optimization_thread;
+    if(pipelined_planning){
+        optimization_thread = std::thread([]{
+            OptimizationJob job;
+            while(optimization_queue.pop(job)){
+                runOptimizationStage(job);
+            }
+        });
+    }
 
     ros::AsyncSpinner spinner(3); // Use 3 threads
     spinner.start();
     ros::waitForShutdown();
 
+    optimization_queue.close();
+    if(optimization_thread.joinable()){
+        optimization_thread.join();
+    }
+    visualization_publisher.stop();
+    snapshot_recorder.stop();
+
     return 0;
 }